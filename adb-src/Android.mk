@@ -49,9 +49,16 @@ LIBADB_SRC_FILES := \
     adb.cpp \
     adb_io.cpp \
     adb_listeners.cpp \
+    adb_stats.cpp \
     adb_trace.cpp \
     adb_utils.cpp \
+    buffered_reader.cpp \
+    byte_ring.cpp \
     fdevent.cpp \
+    packet_memory.cpp \
+    packet_scheduler.cpp \
+    packet_trace.cpp \
+    service_pool.cpp \
     sockets.cpp \
     socket_spec.cpp \
     sysdeps/errno.cpp \
@@ -62,8 +69,17 @@ LIBADB_SRC_FILES := \
 LIBADB_TEST_SRCS := \
     adb_io_test.cpp \
     adb_listeners_test.cpp \
+    adb_stats_test.cpp \
+    adb_trace_test.cpp \
     adb_utils_test.cpp \
+    buffered_reader_test.cpp \
+    byte_ring_test.cpp \
     fdevent_test.cpp \
+    packet_memory_test.cpp \
+    packet_scheduler_test.cpp \
+    packet_trace_test.cpp \
+    service_pool_test.cpp \
+    service_table_test.cpp \
     socket_spec_test.cpp \
     socket_test.cpp \
     sysdeps_test.cpp \
@@ -88,6 +104,7 @@ LIBADB_darwin_SRC_FILES := \
     sysdeps/posix/network.cpp \
     client/usb_dispatch.cpp \
     client/usb_libusb.cpp \
+    client/usb_mock.cpp \
     client/usb_osx.cpp \
 
 LIBADB_linux_SRC_FILES := \
@@ -95,6 +112,7 @@ LIBADB_linux_SRC_FILES := \
     sysdeps/posix/network.cpp \
     client/usb_dispatch.cpp \
     client/usb_libusb.cpp \
+    client/usb_mock.cpp \
     client/usb_linux.cpp \
 
 LIBADB_windows_SRC_FILES := \
@@ -174,6 +192,7 @@ LOCAL_CFLAGS := -DADB_HOST=0 $(LIBADB_CFLAGS)
 LOCAL_SRC_FILES := \
     $(LIBADB_TEST_SRCS) \
     $(LIBADB_TEST_linux_SRCS) \
+    file_sync_service_test.cpp \
     shell_service.cpp \
     shell_service_protocol.cpp \
     shell_service_protocol_test.cpp \
@@ -216,9 +235,11 @@ LOCAL_SRC_FILES := \
     services.cpp \
     shell_service_protocol.cpp \
     shell_service_protocol_test.cpp \
+    sync_progress.cpp \
+    sync_progress_test.cpp \
 
-LOCAL_SRC_FILES_linux := $(LIBADB_TEST_linux_SRCS)
-LOCAL_SRC_FILES_darwin := $(LIBADB_TEST_darwin_SRCS)
+LOCAL_SRC_FILES_linux := $(LIBADB_TEST_linux_SRCS) client/usb_mock_test.cpp
+LOCAL_SRC_FILES_darwin := $(LIBADB_TEST_darwin_SRCS) client/usb_mock_test.cpp
 LOCAL_SRC_FILES_windows := $(LIBADB_TEST_windows_SRCS)
 LOCAL_SANITIZE := $(adb_host_sanitize)
 LOCAL_STATIC_LIBRARIES := \
@@ -269,6 +290,7 @@ LOCAL_SRC_FILES := \
     line_printer.cpp \
     services.cpp \
     shell_service_protocol.cpp \
+    sync_progress.cpp \
 
 LOCAL_CFLAGS += \
     $(ADB_COMMON_CFLAGS) \
@@ -321,6 +343,74 @@ ifdef HOST_CROSS_OS
 $(call dist-for-goals,win_sdk,$(ALL_MODULES.host_cross_adb.BUILT))
 endif
 
+# adb_packet_trace: decodes `adb packet-trace` dumps
+# =========================================================
+include $(CLEAR_VARS)
+
+LOCAL_MODULE := adb_packet_trace
+LOCAL_MODULE_HOST_OS := darwin linux windows
+LOCAL_SRC_FILES := packet_trace_decode.cpp
+LOCAL_CFLAGS := $(ADB_COMMON_CFLAGS)
+LOCAL_SANITIZE := $(adb_host_sanitize)
+LOCAL_CXX_STL := libc++_static
+
+include $(BUILD_HOST_EXECUTABLE)
+
+# adb_benchmark: loopback throughput and latency of the server's data path
+# =========================================================
+include $(CLEAR_VARS)
+
+LOCAL_MODULE := adb_benchmark
+LOCAL_MODULE_HOST_OS := darwin linux windows
+LOCAL_CFLAGS := -DADB_HOST=1 $(LIBADB_CFLAGS)
+LOCAL_CFLAGS_windows := $(LIBADB_windows_CFLAGS)
+LOCAL_CFLAGS_linux := $(LIBADB_linux_CFLAGS)
+LOCAL_CFLAGS_darwin := $(LIBADB_darwin_CFLAGS)
+LOCAL_SRC_FILES := \
+    adb_benchmark.cpp \
+    adb_client.cpp \
+    services.cpp \
+    shell_service_protocol.cpp \
+
+LOCAL_SANITIZE := $(adb_host_sanitize)
+LOCAL_STATIC_LIBRARIES := \
+    libadb \
+    libbase \
+    libcrypto_utils \
+    libcrypto \
+    libcutils \
+    libdiagnose_usb \
+    libmdnssd \
+
+LOCAL_STATIC_LIBRARIES_linux := libusb
+LOCAL_STATIC_LIBRARIES_darwin := libusb
+LOCAL_STATIC_LIBRARIES_windows := AdbWinApi
+
+# Set entrypoint to wmain from sysdeps_win32.cpp instead of main
+LOCAL_LDFLAGS_windows := -municode
+LOCAL_LDLIBS_linux := -lrt -ldl -lpthread
+LOCAL_LDLIBS_darwin := -framework CoreFoundation -framework IOKit -lobjc
+LOCAL_LDLIBS_windows := -lws2_32 -luserenv
+LOCAL_CXX_STL := libc++_static
+LOCAL_MULTILIB := first
+
+include $(BUILD_HOST_EXECUTABLE)
+
+# adb_device_simulator: fake adbds over TCP, for scale testing the server
+# =========================================================
+include $(CLEAR_VARS)
+
+LOCAL_MODULE := adb_device_simulator
+LOCAL_MODULE_HOST_OS := linux
+LOCAL_SRC_FILES := device_simulator.cpp
+LOCAL_CFLAGS := -DADB_HOST=1 $(ADB_COMMON_CFLAGS)
+LOCAL_SANITIZE := $(adb_host_sanitize)
+LOCAL_STATIC_LIBRARIES := libbase
+LOCAL_LDLIBS_linux := -lpthread
+LOCAL_CXX_STL := libc++_static
+
+include $(BUILD_HOST_EXECUTABLE)
+
 # adbd device daemon
 # =========================================================
 
@@ -21,6 +21,7 @@
 
 #include <ctype.h>
 #include <errno.h>
+#include <inttypes.h>
 #include <stdarg.h>
 #include <stddef.h>
 #include <stdint.h>
@@ -36,12 +37,19 @@
 #include <thread>
 #include <vector>
 
+#include <android-base/parseint.h>
+
 #include "adb_auth.h"
 #include "sysdeps.h"
 #include "adb_io.h"
 #include "adb_listeners.h"
+#include "adb_stats.h"
 #include "adb_unique_fd.h"
 #include "adb_utils.h"
+#include "fdevent.h"
+#include "packet_memory.h"
+#include "service_pool.h"
+#include "service_table.h"
 #include "sysdeps/chrono.h"
 #include "transport.h"
 
@@ -130,13 +138,21 @@ void handle_offline(atransport* t)
 	t->RunDisconnects();
 }
 
-static void send_ready(unsigned local, unsigned remote, atransport* t)
+// |window| is only for answering an OPEN on a windowed stream.
+// |priority| should be the stream's, so the READY isn't overtaken by the stream's own packets.
+static void send_ready(unsigned local, unsigned remote, atransport* t, uint32_t window,
+	PacketPriority priority)
 {
 	D("Calling send_ready");
 	apacket* p = get_apacket();
+	p->priority = priority;
 	p->msg.command = A_OKAY;
 	p->msg.arg0 = local;
 	p->msg.arg1 = remote;
+	if (window != 0) {
+		memcpy(p->data, &window, sizeof(window));
+		p->msg.data_length = sizeof(window);
+	}
 	send_packet(p, t);
 }
 
@@ -286,6 +302,9 @@ void handle_packet(apacket* p, atransport* t)
 		((char*)(&(p->msg.command)))[2],
 		((char*)(&(p->msg.command)))[3]);
 	print_packet("recv", p);
+	if (p->timestamp_ns != 0) {
+		t->stats.read_latency.Record(p->timestamp_ns, stats_now_ns());
+	}
 
 	switch (p->msg.command) {
 	case A_SYNC:
@@ -323,8 +342,16 @@ void handle_packet(apacket* p, atransport* t)
 		}
 		break;
 
-	case A_OPEN: /* OPEN(local-id, 0, "destination") */
-		if (t->online && p->msg.arg0 != 0 && p->msg.arg1 == 0) {
+	case A_OPEN: /* OPEN(local-id, window, "destination") */
+		if (t->online && p->msg.arg0 != 0) {
+			if (p->msg.arg1 != 0 && stream_window(t) == 0) {
+				// A window we didn't advertise: refuse the stream rather than leave the opener
+				// waiting for an answer.
+				D("Invalid A_OPEN(%u, %u) on transport %s without stream windows",
+					p->msg.arg0, p->msg.arg1, t->serial);
+				send_close(0, p->msg.arg0, t);
+				break;
+			}
 			char* name = (char*)p->data;
 			name[p->msg.data_length > 0 ? p->msg.data_length - 1 : 0] = 0;
 			asocket* s = create_local_service_socket(name, t);
@@ -334,7 +361,11 @@ void handle_packet(apacket* p, atransport* t)
 			else {
 				s->peer = create_remote_socket(p->msg.arg0, t);
 				s->peer->peer = s;
-				send_ready(s->id, s->peer->id, t);
+				track_local_socket(s, t);
+				// The stream is windowed if the opener offered a window, and we answer with ours.
+				uint32_t window = p->msg.arg1 != 0 ? stream_window(t) : 0;
+				s->peer->send_window = p->msg.arg1;
+				send_ready(s->id, s->peer->id, t, window, s->priority);
 				s->ready(s);
 			}
 		}
@@ -348,11 +379,20 @@ void handle_packet(apacket* p, atransport* t)
 					/* On first READY message, create the connection. */
 					s->peer = create_remote_socket(p->msg.arg0, t);
 					s->peer->peer = s;
+					track_local_socket(s, t);
+					// A window in the payload accepts the one offered in our OPEN.
+					uint32_t window = 0;
+					if (p->msg.data_length == sizeof(window) && stream_window(t) != 0) {
+						memcpy(&window, p->data, sizeof(window));
+					}
+					s->peer->send_window = window;
 					s->ready(s);
 				}
 				else if (s->peer->id == p->msg.arg0) {
 					/* Other READY messages must use the same local-id */
-					s->ready(s);
+					if (remote_socket_acked(s->peer, p)) {
+						s->ready(s);
+					}
 				}
 				else {
 					D("Invalid A_OKAY(%d,%d), expected A_OKAY(%d,%d) on transport %s",
@@ -397,12 +437,27 @@ void handle_packet(apacket* p, atransport* t)
 		if (t->online && p->msg.arg0 != 0 && p->msg.arg1 != 0) {
 			asocket* s = find_local_socket(p->msg.arg1, p->msg.arg0);
 			if (s) {
-				unsigned rid = p->msg.arg0;
 				p->len = p->msg.data_length;
 
+				// On a windowed stream, acknowledgements are batched: they're sent once half the
+				// window is waiting, or when a backed-up local socket drains (see
+				// remote_socket_ready). Either way they go through rs->ready(), which holds them
+				// back while over the packet memory budget. |s| and its peer may be gone after
+				// enqueue() returns 1.
+				asocket* rs = s->peer;
+				bool windowed = rs->send_window != 0;
+				if (windowed) {
+					rs->recv_unacked += p->len;
+				}
+
 				if (s->enqueue(s, p) == 0) {
 					D("Enqueue the socket");
-					send_ready(s->id, rid, t);
+					if (!windowed) {
+						rs->ready(rs);
+					}
+					else if (rs->recv_unacked >= kStreamWindowBytes / 2) {
+						rs->ready(rs);
+					}
 				}
 				return;
 			}
@@ -945,186 +1000,271 @@ static int SendOkay(int fd, const std::string& s) {
 	return 0;
 }
 
-int handle_host_request(const char* service, TransportType type,
-	const char* serial, int reply_fd, asocket* s) {
-	if (strcmp(service, "kill") == 0) {
-		fprintf(stderr, "adb server killed by remote request\n");
-		fflush(stdout);
-
-		// Send a reply even though we don't read it anymore, so that old versions
-		// of adb that do read it don't spew error messages.
-		SendOkay(reply_fd);
+// A host service request, as handed to its handler in host_services.
+struct HostRequest {
+	const char* service;
+	// What follows the service name; see ServiceArgument.
+	const char* argument;
+	TransportType type;
+	const char* serial;
+	int reply_fd;
+	asocket* s;
+};
+
+// Host service handlers return 0 if they've dealt with the request (and sent the OKAY or FAIL
+// themselves), 1 if the smart socket should carry on (after switching transports), or -1 if
+// the request isn't one they understand.
+typedef int (*HostServiceHandler)(const HostRequest& request);
+
+static int host_kill(const HostRequest& request) {
+	fprintf(stderr, "adb server killed by remote request\n");
+	fflush(stdout);
+
+	// Send a reply even though we don't read it anymore, so that old versions
+	// of adb that do read it don't spew error messages.
+	SendOkay(request.reply_fd);
+
+	// Rely on process exit to close the socket for us.
+	android::base::quick_exit(0);
+}
 
-		// Rely on process exit to close the socket for us.
-		android::base::quick_exit(0);
+// "transport:" is used for switching transport with a specified serial number
+// "transport-usb" is used for switching transport to the only USB transport
+// "transport-local" is used for switching transport to the only local transport
+// "transport-any" is used for switching transport to the only transport
+static int switch_transport(const HostRequest& request, TransportType type, const char* serial) {
+	std::string error;
+	atransport* t = acquire_one_transport(type, serial, nullptr, &error);
+	if (t != nullptr) {
+		request.s->transport = t;
+		SendOkay(request.reply_fd);
 	}
+	else {
+		SendFail(request.reply_fd, error);
+	}
+	return 1;
+}
 
-	// "transport:" is used for switching transport with a specified serial number
-	// "transport-usb:" is used for switching transport to the only USB transport
-	// "transport-local:" is used for switching transport to the only local transport
-	// "transport-any:" is used for switching transport to the only transport
-	if (!strncmp(service, "transport", strlen("transport"))) {
-		TransportType type = kTransportAny;
+static int host_transport(const HostRequest& request) {
+	return switch_transport(request, kTransportAny, request.argument);
+}
 
-		if (!strncmp(service, "transport-usb", strlen("transport-usb"))) {
-			type = kTransportUsb;
-		}
-		else if (!strncmp(service, "transport-local", strlen("transport-local"))) {
-			type = kTransportLocal;
-		}
-		else if (!strncmp(service, "transport-any", strlen("transport-any"))) {
-			type = kTransportAny;
-		}
-		else if (!strncmp(service, "transport:", strlen("transport:"))) {
-			service += strlen("transport:");
-			serial = service;
-		}
+static int host_transport_any(const HostRequest& request) {
+	return switch_transport(request, kTransportAny, request.serial);
+}
 
-		std::string error;
-		atransport* t = acquire_one_transport(type, serial, nullptr, &error);
-		if (t != nullptr) {
-			s->transport = t;
-			SendOkay(reply_fd);
-		}
-		else {
-			SendFail(reply_fd, error);
+static int host_transport_local(const HostRequest& request) {
+	return switch_transport(request, kTransportLocal, request.serial);
+}
+
+static int host_transport_usb(const HostRequest& request) {
+	return switch_transport(request, kTransportUsb, request.serial);
+}
+
+// return a list of all connected devices
+static int host_devices(const HostRequest& request) {
+	bool long_listing = request.service[7] == '-';
+	D("Getting device list...");
+	std::string device_list = list_transports(long_listing);
+	D("Sending device list...");
+	return SendOkay(request.reply_fd, device_list);
+}
+
+static int host_reconnect_offline(const HostRequest& request) {
+	std::string response;
+	close_usb_devices([&response](const atransport* transport) {
+		switch (transport->GetConnectionState()) {
+		case kCsOffline:
+		case kCsUnauthorized:
+			response += "reconnecting " + transport->serial_name() + "\n";
+			return true;
+		default:
+			return false;
 		}
-		return 1;
+		});
+	if (!response.empty()) {
+		response.resize(response.size() - 1);
 	}
+	SendOkay(request.reply_fd, response);
+	return 0;
+}
 
-	// return a list of all connected devices
-	if (!strncmp(service, "devices", 7)) {
-		bool long_listing = (strcmp(service + 7, "-l") == 0);
-		if (long_listing || service[7] == 0) {
-			D("Getting device list...");
-			std::string device_list = list_transports(long_listing);
-			D("Sending device list...");
-			return SendOkay(reply_fd, device_list);
-		}
-		return 1;
+static int host_features(const HostRequest& request) {
+	std::string error;
+	atransport* t = acquire_one_transport(request.type, request.serial, nullptr, &error);
+	if (t != nullptr) {
+		SendOkay(request.reply_fd, FeatureSetToString(t->features()));
+	}
+	else {
+		SendFail(request.reply_fd, error);
 	}
+	return 0;
+}
 
-	if (!strcmp(service, "reconnect-offline")) {
-		std::string response;
-		close_usb_devices([&response](const atransport* transport) {
-			switch (transport->GetConnectionState()) {
-			case kCsOffline:
-			case kCsUnauthorized:
-				response += "reconnecting " + transport->serial_name() + "\n";
-				return true;
-			default:
-				return false;
-			}
-			});
-		if (!response.empty()) {
-			response.resize(response.size() - 1);
-		}
-		SendOkay(reply_fd, response);
-		return 0;
+static int host_host_features(const HostRequest& request) {
+	FeatureSet features = supported_features();
+	// Abuse features to report libusb status.
+	if (should_use_libusb()) {
+		features.insert(kFeatureLibusb);
 	}
+	features.insert(kFeaturePushSync);
+	SendOkay(request.reply_fd, FeatureSetToString(features));
+	return 0;
+}
 
-	if (!strcmp(service, "features")) {
-		std::string error;
-		atransport* t = acquire_one_transport(type, serial, nullptr, &error);
-		if (t != nullptr) {
-			SendOkay(reply_fd, FeatureSetToString(t->features()));
-		}
-		else {
-			SendFail(reply_fd, error);
-		}
-		return 0;
+// remove TCP transport
+static int host_disconnect(const HostRequest& request) {
+	const std::string address(request.argument);
+	if (address.empty()) {
+		kick_all_tcp_devices();
+		return SendOkay(request.reply_fd, "disconnected everything");
 	}
 
-	if (!strcmp(service, "host-features")) {
-		FeatureSet features = supported_features();
-		// Abuse features to report libusb status.
-		if (should_use_libusb()) {
-			features.insert(kFeatureLibusb);
-		}
-		features.insert(kFeaturePushSync);
-		SendOkay(reply_fd, FeatureSetToString(features));
-		return 0;
+	std::string serial;
+	std::string host;
+	int port = DEFAULT_ADB_LOCAL_TRANSPORT_PORT;
+	std::string error;
+	if (!android::base::ParseNetAddress(address, &host, &port, &serial, &error)) {
+		return SendFail(request.reply_fd, StringPrintf("couldn't parse '%s': %s",
+			address.c_str(), error.c_str()));
+	}
+	atransport* t = find_transport(serial.c_str());
+	if (t == nullptr) {
+		return SendFail(request.reply_fd, StringPrintf("no such device '%s'",
+			serial.c_str()));
 	}
+	kick_transport(t);
+	return SendOkay(request.reply_fd, StringPrintf("disconnected %s", address.c_str()));
+}
 
-	// remove TCP transport
-	if (!strncmp(service, "disconnect:", 11)) {
-		const std::string address(service + 11);
-		if (address.empty()) {
-			kick_all_tcp_devices();
-			return SendOkay(reply_fd, "disconnected everything");
-		}
+// Returns our value for ADB_SERVER_VERSION.
+static int host_version(const HostRequest& request) {
+	return SendOkay(request.reply_fd, StringPrintf("%04x", ADB_SERVER_VERSION));
+}
 
-		std::string serial;
-		std::string host;
-		int port = DEFAULT_ADB_LOCAL_TRANSPORT_PORT;
-		std::string error;
-		if (!android::base::ParseNetAddress(address, &host, &port, &serial, &error)) {
-			return SendFail(reply_fd, StringPrintf("couldn't parse '%s': %s",
-				address.c_str(), error.c_str()));
-		}
-		atransport* t = find_transport(serial.c_str());
-		if (t == nullptr) {
-			return SendFail(reply_fd, StringPrintf("no such device '%s'",
-				serial.c_str()));
+// Reports the traffic counters of every transport and local socket.
+static int host_stats(const HostRequest& request) {
+	return SendOkay(request.reply_fd, format_stats());
+}
+
+// Reports how much memory queued packets hold, against the budgets.
+static int host_packet_memory(const HostRequest& request) {
+	return SendOkay(request.reply_fd, format_packet_memory());
+}
+
+// Reports how busy the threads running services are.
+static int host_service_pool(const HostRequest& request) {
+	return SendOkay(request.reply_fd, format_service_pool());
+}
+
+// Reports on ("fdevent-profile"), starts ("fdevent-profile:start[:<ms>]") or stops
+// ("fdevent-profile:stop") profiling of the main loop.
+static int host_fdevent_profile(const HostRequest& request) {
+	const char* argument = request.argument;
+	if (argument == nullptr) {
+		return SendOkay(request.reply_fd, fdevent_profile_summary());
+	}
+	if (!strcmp(argument, "start") || !strncmp(argument, "start:", 6)) {
+		int64_t slow_threshold_ms = 50;
+		if (argument[5] == ':' &&
+			!android::base::ParseInt(argument + 6, &slow_threshold_ms, int64_t(0))) {
+			return SendFail(request.reply_fd,
+				StringPrintf("invalid threshold '%s'", argument + 6));
 		}
-		kick_transport(t);
-		return SendOkay(reply_fd, StringPrintf("disconnected %s", address.c_str()));
+		fdevent_profile_start(slow_threshold_ms);
+		return SendOkay(request.reply_fd, StringPrintf("profiling, slow threshold %" PRId64 "ms\n",
+			slow_threshold_ms));
+	}
+	if (!strcmp(argument, "stop")) {
+		fdevent_profile_stop();
+		return SendOkay(request.reply_fd, fdevent_profile_summary());
 	}
+	return -1;
+}
 
-	// Returns our value for ADB_SERVER_VERSION.
-	if (!strcmp(service, "version")) {
-		return SendOkay(reply_fd, StringPrintf("%04x", ADB_SERVER_VERSION));
+// These always report "unknown" rather than the actual error, for scripts.
+static int host_get_serialno(const HostRequest& request) {
+	std::string error;
+	atransport* t = acquire_one_transport(request.type, request.serial, nullptr, &error);
+	if (t) {
+		return SendOkay(request.reply_fd, t->serial ? t->serial : "unknown");
+	}
+	else {
+		return SendFail(request.reply_fd, error);
 	}
+}
 
-	// These always report "unknown" rather than the actual error, for scripts.
-	if (!strcmp(service, "get-serialno")) {
-		std::string error;
-		atransport* t = acquire_one_transport(type, serial, nullptr, &error);
-		if (t) {
-			return SendOkay(reply_fd, t->serial ? t->serial : "unknown");
-		}
-		else {
-			return SendFail(reply_fd, error);
-		}
+static int host_get_devpath(const HostRequest& request) {
+	std::string error;
+	atransport* t = acquire_one_transport(request.type, request.serial, nullptr, &error);
+	if (t) {
+		return SendOkay(request.reply_fd, t->devpath ? t->devpath : "unknown");
 	}
-	if (!strcmp(service, "get-devpath")) {
-		std::string error;
-		atransport* t = acquire_one_transport(type, serial, nullptr, &error);
-		if (t) {
-			return SendOkay(reply_fd, t->devpath ? t->devpath : "unknown");
-		}
-		else {
-			return SendFail(reply_fd, error);
-		}
+	else {
+		return SendFail(request.reply_fd, error);
 	}
-	if (!strcmp(service, "get-state")) {
-		std::string error;
-		atransport* t = acquire_one_transport(type, serial, nullptr, &error);
-		if (t) {
-			return SendOkay(reply_fd, t->connection_state_name());
-		}
-		else {
-			return SendFail(reply_fd, error);
-		}
+}
+
+static int host_get_state(const HostRequest& request) {
+	std::string error;
+	atransport* t = acquire_one_transport(request.type, request.serial, nullptr, &error);
+	if (t) {
+		return SendOkay(request.reply_fd, t->connection_state_name());
 	}
+	else {
+		return SendFail(request.reply_fd, error);
+	}
+}
+
+// Indicates a new emulator instance has started.
+static int host_emulator(const HostRequest& request) {
+	int port = atoi(request.argument);
+	local_connect(port);
+	/* we don't even need to send a reply */
+	return 0;
+}
 
-	// Indicates a new emulator instance has started.
-	if (!strncmp(service, "emulator:", 9)) {
-		int  port = atoi(service + 9);
-		local_connect(port);
-		/* we don't even need to send a reply */
-		return 0;
+static int host_reconnect(const HostRequest& request) {
+	std::string response;
+	atransport* t = acquire_one_transport(request.type, request.serial, nullptr, &response, true);
+	if (t != nullptr) {
+		kick_transport(t);
+		response =
+			"reconnecting " + t->serial_name() + " [" + t->connection_state_name() + "]\n";
 	}
+	return SendOkay(request.reply_fd, response);
+}
 
-	if (!strcmp(service, "reconnect")) {
-		std::string response;
-		atransport* t = acquire_one_transport(type, serial, nullptr, &response, true);
-		if (t != nullptr) {
-			kick_transport(t);
-			response =
-				"reconnecting " + t->serial_name() + " [" + t->connection_state_name() + "]\n";
-		}
-		return SendOkay(reply_fd, response);
+static const auto& host_services = *new ServiceTable<HostServiceHandler>({
+	{ "devices", ServiceArgument::kNone, host_devices },
+	{ "devices-l", ServiceArgument::kNone, host_devices },
+	{ "disconnect", ServiceArgument::kRequired, host_disconnect },
+	{ "emulator", ServiceArgument::kRequired, host_emulator },
+	{ "fdevent-profile", ServiceArgument::kOptional, host_fdevent_profile },
+	{ "features", ServiceArgument::kNone, host_features },
+	{ "get-devpath", ServiceArgument::kNone, host_get_devpath },
+	{ "get-serialno", ServiceArgument::kNone, host_get_serialno },
+	{ "get-state", ServiceArgument::kNone, host_get_state },
+	{ "host-features", ServiceArgument::kNone, host_host_features },
+	{ "kill", ServiceArgument::kNone, host_kill },
+	{ "packet-memory", ServiceArgument::kNone, host_packet_memory },
+	{ "reconnect", ServiceArgument::kNone, host_reconnect },
+	{ "reconnect-offline", ServiceArgument::kNone, host_reconnect_offline },
+	{ "service-pool", ServiceArgument::kNone, host_service_pool },
+	{ "stats", ServiceArgument::kNone, host_stats },
+	{ "transport", ServiceArgument::kRequired, host_transport },
+	{ "transport-any", ServiceArgument::kNone, host_transport_any },
+	{ "transport-local", ServiceArgument::kNone, host_transport_local },
+	{ "transport-usb", ServiceArgument::kNone, host_transport_usb },
+	{ "version", ServiceArgument::kNone, host_version },
+});
+
+int handle_host_request(const char* service, TransportType type,
+	const char* serial, int reply_fd, asocket* s) {
+	HostRequest request = { service, nullptr, type, serial, reply_fd, s };
+	const auto* entry = host_services.Find(service, &request.argument);
+	if (entry != nullptr) {
+		return entry->handler(request);
 	}
 
 	int ret = handle_forward_request(service, type, serial, reply_fd);
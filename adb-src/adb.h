@@ -51,7 +51,7 @@ constexpr size_t LINUX_MAX_SOCKET_SIZE = 4194304;
 std::string adb_version();
 
 // Increment this when we want to force users to start a new adb server.
-#define ADB_SERVER_VERSION 39
+#define ADB_SERVER_VERSION 43
 
 class atransport;
 
@@ -71,6 +71,11 @@ struct apacket
 	size_t len;
 	char* ptr;
 
+	// When the packet was handed to another thread or queued, for TrafficStats latencies.
+	uint64_t timestamp_ns;
+
+	PacketPriority priority;
+
 	amessage msg;
 	char data[MAX_PAYLOAD];
 };
@@ -0,0 +1,620 @@
+/*
+ * Copyright (C) 2017 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// adb_benchmark: measures the server's data path end to end. Each benchmark registers a
+// socket transport whose other end is a fake device thread speaking the adb protocol, and
+// pushes data through the real fdevent loop, transport threads, and local and remote sockets.
+// With --usb, the transport is a usb one instead, over the mock backend (client/usb_mock.h).
+//
+// Output is one line per benchmark, in a format that is kept stable so results can be compared
+// between releases:
+//
+//     adb_benchmark format=1 transport=socket|usb
+//     <name> mb_per_sec=X rtt_p50_us=N rtt_p99_us=N write_p50_us=N write_p99_us=N
+//         read_p50_us=N read_p99_us=N [ops_per_sec=X]
+//
+// rtt_* are round trips seen by the client (0 for benchmarks that don't measure them); write_*
+// and read_* are the transport's per-packet latencies (see TrafficStats), as histogram bucket
+// upper bounds. ops_per_sec is only there for benchmarks that count requests rather than bytes.
+
+#define TRACE_TAG ADB
+
+#include "sysdeps.h"
+
+#include <inttypes.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include <android-base/logging.h>
+#include <android-base/parseint.h>
+#include <android-base/stringprintf.h>
+#include <android-base/strings.h>
+
+#include "adb.h"
+#include "adb_io.h"
+#include "adb_stats.h"
+#include "fdevent.h"
+#include "socket.h"
+#include "transport.h"
+
+#if !defined(_WIN32)
+#include "client/usb_mock.h"
+#endif
+
+using namespace std::chrono_literals;
+
+// How a FakeDevice exchanges packets with the host.
+class DeviceLink {
+public:
+	virtual ~DeviceLink() {}
+
+	virtual bool ReadPacket(apacket* p) = 0;
+	virtual bool WritePacket(apacket* p) = 0;
+
+	// Makes pending and later reads and writes fail.
+	virtual void Shutdown() = 0;
+};
+
+class SocketLink : public DeviceLink {
+public:
+	explicit SocketLink(int fd) : fd_(fd) {}
+
+	~SocketLink() override {
+		adb_close(fd_);
+	}
+
+	bool ReadPacket(apacket* p) override {
+		if (!ReadFdExactly(fd_, &p->msg, sizeof(p->msg))) return false;
+		return ReadFdExactly(fd_, p->data, p->msg.data_length);
+	}
+
+	bool WritePacket(apacket* p) override {
+		return WriteFdExactly(fd_, &p->msg, sizeof(p->msg) + p->msg.data_length);
+	}
+
+	void Shutdown() override {
+		adb_shutdown(fd_);
+	}
+
+private:
+	const int fd_;
+};
+
+#if !defined(_WIN32)
+class UsbLink : public DeviceLink {
+public:
+	explicit UsbLink(mock::usb_handle* h) : h_(h) {}
+
+	~UsbLink() override {
+		mock::device_release(h_);
+	}
+
+	// Like adbd, the header and the payload are separate transfers.
+	bool ReadPacket(apacket* p) override {
+		if (!Read(&p->msg, sizeof(p->msg))) return false;
+		return Read(p->data, p->msg.data_length);
+	}
+
+	bool WritePacket(apacket* p) override {
+		if (mock::device_write(h_, &p->msg, sizeof(p->msg)) != 0) return false;
+		return p->msg.data_length == 0 ||
+			mock::device_write(h_, p->data, p->msg.data_length) == 0;
+	}
+
+	void Shutdown() override {
+		mock::disconnect(h_);
+	}
+
+private:
+	bool Read(void* data, size_t length) {
+		char* p = static_cast<char*>(data);
+		while (length > 0) {
+			int rc = mock::device_read(h_, p, length);
+			if (rc <= 0) return false;
+			p += rc;
+			length -= rc;
+		}
+		return true;
+	}
+
+	mock::usb_handle* const h_;
+};
+#endif
+
+// The device end of a transport. It implements just enough of adbd to be connected to,
+// and a few services for the benchmarks to open:
+//
+//     sink:<bytes>    Swallows <bytes>, then replies with a single byte.
+//     source:<bytes>  Sends <bytes> as fast as the host acknowledges them.
+//     echo:           Sends back everything it receives.
+//
+// An "exec:" prefix is ignored; it makes the host treat the stream as bulk (see
+// service_priority()). Streams are windowed (kFeatureStreamWindow), acknowledging every WRITE.
+class FakeDevice {
+public:
+	explicit FakeDevice(DeviceLink* link) : link_(link), thread_(&FakeDevice::Run, this) {}
+
+	~FakeDevice() {
+		link_->Shutdown();
+		thread_.join();
+	}
+
+private:
+	struct Stream {
+		uint32_t host_id;
+		std::string service;
+		uint64_t remaining;
+		uint32_t window;  // The host's, or 0 for a legacy stream.
+		uint64_t unacked;
+	};
+
+	void Run() {
+		adb_thread_setname("fake device");
+		apacket* p = get_apacket();
+		while (link_->ReadPacket(p)) {
+			HandlePacket(p);
+		}
+		put_apacket(p);
+	}
+
+	bool SendPacket(uint32_t command, uint32_t arg0, uint32_t arg1, const void* data,
+		size_t length) {
+		apacket* p = get_apacket();
+		p->msg.command = command;
+		p->msg.arg0 = arg0;
+		p->msg.arg1 = arg1;
+		p->msg.data_length = length;
+		p->msg.magic = command ^ 0xffffffff;
+		if (length > 0) memcpy(p->data, data, length);
+		p->msg.data_check = calculate_apacket_checksum(p);
+		bool result = link_->WritePacket(p);
+		put_apacket(p);
+		return result;
+	}
+
+	// Sends one WRITE on a legacy stream, or fills the window on a windowed one.
+	void SendSourceData(uint32_t id, Stream& stream) {
+		do {
+			size_t length = std::min<uint64_t>(stream.remaining, MAX_PAYLOAD);
+			stream.remaining -= length;
+			stream.unacked += length;
+			SendPacket(A_WRTE, id, stream.host_id, source_data_, length);
+		} while (stream.window != 0 && stream.remaining > 0 && stream.unacked < stream.window);
+	}
+
+	// Acknowledges a WRITE of |length| bytes.
+	void SendReady(uint32_t id, const Stream& stream, uint32_t length) {
+		if (stream.window != 0) {
+			SendPacket(A_OKAY, id, stream.host_id, &length, sizeof(length));
+		}
+		else {
+			SendPacket(A_OKAY, id, stream.host_id, nullptr, 0);
+		}
+	}
+
+	void HandlePacket(apacket* p) {
+		switch (p->msg.command) {
+		case A_CNXN: {
+			static const char banner[] = "device::features=stream_window";
+			SendPacket(A_CNXN, A_VERSION, MAX_PAYLOAD, banner, sizeof(banner) - 1);
+			break;
+		}
+
+		case A_OPEN: {
+			uint32_t id = next_id_++;
+			Stream stream;
+			stream.host_id = p->msg.arg0;
+			std::string name(p->data, strnlen(p->data, p->msg.data_length));
+			if (android::base::StartsWith(name, "exec:")) name.erase(0, strlen("exec:"));
+			std::vector<std::string> pieces = android::base::Split(name, ":");
+			stream.service = pieces[0];
+			stream.remaining = 0;
+			if (pieces.size() > 1) android::base::ParseUint(pieces[1], &stream.remaining);
+			stream.window = p->msg.arg1;
+			stream.unacked = 0;
+			if (stream.window != 0) {
+				SendPacket(A_OKAY, id, stream.host_id, &kStreamWindowBytes, sizeof(kStreamWindowBytes));
+			}
+			else {
+				SendPacket(A_OKAY, id, stream.host_id, nullptr, 0);
+			}
+			if (stream.service == "source" && stream.remaining > 0) {
+				SendSourceData(id, stream);
+			}
+			streams_[id] = stream;
+			break;
+		}
+
+		case A_OKAY: {
+			auto it = streams_.find(p->msg.arg1);
+			if (it == streams_.end()) break;
+			Stream& stream = it->second;
+			uint32_t acked = 0;
+			if (stream.window != 0 && p->msg.data_length == sizeof(acked)) {
+				memcpy(&acked, p->data, sizeof(acked));
+			}
+			stream.unacked -= std::min<uint64_t>(acked, stream.unacked);
+			if (stream.service == "source" && stream.remaining > 0 &&
+				(stream.window == 0 || stream.unacked < stream.window)) {
+				SendSourceData(it->first, stream);
+			}
+			break;
+		}
+
+		case A_WRTE: {
+			auto it = streams_.find(p->msg.arg1);
+			if (it == streams_.end()) break;
+			uint32_t id = it->first;
+			Stream& stream = it->second;
+			SendReady(id, stream, p->msg.data_length);
+			if (stream.service == "echo") {
+				SendPacket(A_WRTE, id, stream.host_id, p->data, p->msg.data_length);
+			}
+			else if (stream.service == "sink" && stream.remaining > 0) {
+				stream.remaining -= std::min<uint64_t>(stream.remaining, p->msg.data_length);
+				if (stream.remaining == 0) {
+					SendPacket(A_WRTE, id, stream.host_id, "k", 1);
+				}
+			}
+			break;
+		}
+
+		case A_CLSE:
+			streams_.erase(p->msg.arg1);
+			break;
+		}
+	}
+
+	std::unique_ptr<DeviceLink> link_;
+	uint32_t next_id_ = 1;
+	std::unordered_map<uint32_t, Stream> streams_;
+	char source_data_[MAX_PAYLOAD] = {};
+	std::thread thread_;
+};
+
+// A connected transport to a FakeDevice.
+class BenchmarkDevice {
+public:
+	BenchmarkDevice(const std::string& serial, bool usb) : serial_(serial) {
+#if !defined(_WIN32)
+		if (usb) {
+			mock::usb_handle* h = mock::attach(serial_, MockUsbOptions());
+			device_.reset(new FakeDevice(new UsbLink(h)));
+		}
+		else
+#endif
+		{
+			int fds[2];
+			if (adb_socketpair(fds) != 0) {
+				PLOG(FATAL) << "failed to create socketpair";
+			}
+			device_.reset(new FakeDevice(new SocketLink(fds[1])));
+			if (register_socket_transport(fds[0], serial_.c_str(), 0, 0) != 0) {
+				LOG(FATAL) << "failed to register transport " << serial_;
+			}
+		}
+
+		auto deadline = std::chrono::steady_clock::now() + 10s;
+		while ((transport_ = find_transport(serial_.c_str())) == nullptr ||
+			transport_->GetConnectionState() != kCsDevice) {
+			if (std::chrono::steady_clock::now() > deadline) {
+				LOG(FATAL) << "transport " << serial_ << " never came online";
+			}
+			std::this_thread::sleep_for(1ms);
+		}
+	}
+
+	// Opens |service| on the fake device, returning the client end of the stream.
+	int Open(const std::string& service) {
+		int fds[2];
+		if (adb_socketpair(fds) != 0) {
+			PLOG(FATAL) << "failed to create socketpair";
+		}
+		atransport* t = transport_;
+		int fd = fds[1];
+		fdevent_run_on_main_thread([t, fd, service]() {
+			asocket* s = create_local_socket(fd);
+			s->transport = t;
+			connect_to_remote(s, service.c_str());
+		});
+		return fds[0];
+	}
+
+	// Sends |request| to the server's smart socket, as a client connecting to the server would,
+	// returning the client end.
+	int OpenHost(const std::string& request) {
+		int fds[2];
+		if (adb_socketpair(fds) != 0) {
+			PLOG(FATAL) << "failed to create socketpair";
+		}
+		int fd = fds[1];
+		fdevent_run_on_main_thread([fd]() {
+			connect_to_smartsocket(create_local_socket(fd));
+		});
+		if (!SendProtocolString(fds[0], request)) {
+			PLOG(FATAL) << "failed to send " << request;
+		}
+		return fds[0];
+	}
+
+	const std::string& serial() const {
+		return serial_;
+	}
+
+	const TrafficStats& stats() const {
+		return transport_->stats;
+	}
+
+private:
+	std::string serial_;
+	// Destroying the device disconnects the transport.
+	std::unique_ptr<FakeDevice> device_;
+	atransport* transport_ = nullptr;
+};
+
+struct Result {
+	uint64_t bytes = 0;
+	std::chrono::steady_clock::duration elapsed{};
+	std::vector<uint64_t> rtt_us;
+	uint64_t operations = 0;
+};
+
+static void SendBytes(int fd, uint64_t bytes) {
+	std::vector<char> buf(64 * 1024, 'x');
+	while (bytes > 0) {
+		size_t length = std::min<uint64_t>(bytes, buf.size());
+		if (!WriteFdExactly(fd, buf.data(), length)) {
+			PLOG(FATAL) << "write failed";
+		}
+		bytes -= length;
+	}
+}
+
+static void ReceiveBytes(int fd, uint64_t bytes) {
+	std::vector<char> buf(64 * 1024);
+	while (bytes > 0) {
+		int rc = adb_read(fd, buf.data(), std::min<uint64_t>(bytes, buf.size()));
+		if (rc <= 0) {
+			PLOG(FATAL) << "read failed";
+		}
+		bytes -= rc;
+	}
+}
+
+// Sends |bytes| to a sink and waits for it to have received them all.
+static void Upload(BenchmarkDevice* device, uint64_t bytes) {
+	int fd = device->Open(android::base::StringPrintf("exec:sink:%" PRIu64, bytes));
+	SendBytes(fd, bytes);
+	ReceiveBytes(fd, 1);
+	adb_close(fd);
+}
+
+static Result BulkUpload(BenchmarkDevice* device) {
+	constexpr uint64_t kBytes = 64 * 1024 * 1024;
+	Result result;
+	auto start = std::chrono::steady_clock::now();
+	Upload(device, kBytes);
+	result.elapsed = std::chrono::steady_clock::now() - start;
+	result.bytes = kBytes;
+	return result;
+}
+
+static Result BulkDownload(BenchmarkDevice* device) {
+	constexpr uint64_t kBytes = 64 * 1024 * 1024;
+	Result result;
+	auto start = std::chrono::steady_clock::now();
+	int fd = device->Open(android::base::StringPrintf("exec:source:%" PRIu64, kBytes));
+	ReceiveBytes(fd, kBytes);
+	result.elapsed = std::chrono::steady_clock::now() - start;
+	adb_close(fd);
+	result.bytes = kBytes;
+	return result;
+}
+
+// Keystroke-sized writes, each waiting for its echo, like an interactive shell.
+static Result Echo(BenchmarkDevice* device, size_t round_trips) {
+	constexpr size_t kMessageSize = 64;
+	Result result;
+	int fd = device->Open("echo:");
+	char message[kMessageSize] = {};
+	auto start = std::chrono::steady_clock::now();
+	for (size_t i = 0; i < round_trips; ++i) {
+		auto sent = std::chrono::steady_clock::now();
+		SendBytes(fd, sizeof(message));
+		if (!ReadFdExactly(fd, message, sizeof(message))) {
+			PLOG(FATAL) << "read failed";
+		}
+		result.rtt_us.push_back(std::chrono::duration_cast<std::chrono::microseconds>(
+			std::chrono::steady_clock::now() - sent).count());
+	}
+	result.elapsed = std::chrono::steady_clock::now() - start;
+	adb_close(fd);
+	result.bytes = 2 * kMessageSize * round_trips;
+	return result;
+}
+
+static Result Interactive(BenchmarkDevice* device) {
+	return Echo(device, 2000);
+}
+
+// Echo round trips while a push saturates the transport. The throughput is the push's.
+static Result InteractiveUnderUpload(BenchmarkDevice* device) {
+	constexpr uint64_t kBytes = 256 * 1024 * 1024;
+	Result result;
+	auto start = std::chrono::steady_clock::now();
+	std::thread upload(Upload, device, kBytes);
+	// Give the push time to build up a backlog.
+	std::this_thread::sleep_for(100ms);
+	result.rtt_us = Echo(device, 200).rtt_us;
+	upload.join();
+	result.elapsed = std::chrono::steady_clock::now() - start;
+	result.bytes = kBytes;
+	return result;
+}
+
+static Result ConcurrentUpload(BenchmarkDevice* device) {
+	constexpr size_t kStreams = 16;
+	constexpr uint64_t kBytesPerStream = 4 * 1024 * 1024;
+	Result result;
+	std::vector<std::thread> threads;
+	auto start = std::chrono::steady_clock::now();
+	for (size_t i = 0; i < kStreams; ++i) {
+		threads.emplace_back(Upload, device, kBytesPerStream);
+	}
+	for (auto& thread : threads) {
+		thread.join();
+	}
+	result.elapsed = std::chrono::steady_clock::now() - start;
+	result.bytes = kStreams * kBytesPerStream;
+	return result;
+}
+
+// Short host requests, one per connection, like a script polling "adb devices". This is dominated
+// by parsing and dispatching the request on the server's main thread.
+static Result HostCommands(BenchmarkDevice* device) {
+	constexpr size_t kRequests = 20000;
+	const std::vector<std::string> requests = {
+		"host:version",
+		"host-serial:" + device->serial() + ":get-state",
+		"host:devices",
+	};
+	Result result;
+	auto start = std::chrono::steady_clock::now();
+	for (size_t i = 0; i < kRequests; ++i) {
+		auto sent = std::chrono::steady_clock::now();
+		const std::string& request = requests[i % requests.size()];
+		int fd = device->OpenHost(request);
+		char status[4];
+		std::string reply;
+		std::string error;
+		if (!ReadFdExactly(fd, status, sizeof(status)) || memcmp(status, "OKAY", 4) != 0 ||
+			!ReadProtocolString(fd, &reply, &error)) {
+			LOG(FATAL) << "request " << request << " failed";
+		}
+		adb_close(fd);
+		result.rtt_us.push_back(std::chrono::duration_cast<std::chrono::microseconds>(
+			std::chrono::steady_clock::now() - sent).count());
+	}
+	result.elapsed = std::chrono::steady_clock::now() - start;
+	result.operations = kRequests;
+	return result;
+}
+
+// Returns the upper bound of the histogram bucket containing the |percentile|th latency.
+static uint64_t HistogramPercentile(const LatencyHistogram& histogram, double percentile) {
+	uint64_t total = 0;
+	for (const auto& bucket : histogram.buckets) {
+		total += bucket.load(std::memory_order_relaxed);
+	}
+	if (total == 0) return 0;
+
+	uint64_t rank = std::max<uint64_t>(1, total * percentile / 100);
+	uint64_t seen = 0;
+	for (size_t i = 0; i < LatencyHistogram::kBuckets; ++i) {
+		seen += histogram.buckets[i].load(std::memory_order_relaxed);
+		if (seen >= rank) return UINT64_C(1) << i;
+	}
+	return UINT64_C(1) << (LatencyHistogram::kBuckets - 1);
+}
+
+static uint64_t Percentile(std::vector<uint64_t> values, double percentile) {
+	if (values.empty()) return 0;
+	std::sort(values.begin(), values.end());
+	size_t index = std::min(values.size() - 1, static_cast<size_t>(values.size() * percentile / 100));
+	return values[index];
+}
+
+struct Benchmark {
+	const char* name;
+	Result (*fn)(BenchmarkDevice* device);
+};
+
+static const Benchmark kBenchmarks[] = {
+	{ "bulk_upload", BulkUpload },
+	{ "bulk_download", BulkDownload },
+	{ "interactive", Interactive },
+	{ "interactive_under_upload", InteractiveUnderUpload },
+	{ "concurrent_upload", ConcurrentUpload },
+	{ "host_commands", HostCommands },
+};
+
+int main(int argc, char** argv) {
+	android::base::InitLogging(argv);
+	bool usb = false;
+	int arg = 1;
+#if !defined(_WIN32)
+	if (arg < argc && strcmp(argv[arg], "--usb") == 0) {
+		usb = true;
+		++arg;
+	}
+#endif
+	if (argc - arg > 1) {
+#if defined(_WIN32)
+		fprintf(stderr, "usage: adb_benchmark [FILTER]\n");
+#else
+		fprintf(stderr, "usage: adb_benchmark [--usb] [FILTER]\n");
+#endif
+		return 2;
+	}
+	const char* filter = arg < argc ? argv[arg] : "";
+
+#if !defined(_WIN32)
+	// Must be set before anything asks which usb backend to use.
+	if (usb) setenv("ADB_USB_MOCK", "1", 1);
+	signal(SIGPIPE, SIG_IGN);
+#endif
+	init_transport_registration();
+	std::thread(fdevent_loop).detach();
+
+	printf("adb_benchmark format=1 transport=%s\n", usb ? "usb" : "socket");
+	for (const Benchmark& benchmark : kBenchmarks) {
+		if (!strstr(benchmark.name, filter)) continue;
+
+		BenchmarkDevice device(std::string("benchmark-") + benchmark.name, usb);
+		Result result = benchmark.fn(&device);
+
+		double seconds = std::chrono::duration<double>(result.elapsed).count();
+		const TrafficStats& stats = device.stats();
+		printf("%s mb_per_sec=%.2f rtt_p50_us=%" PRIu64 " rtt_p99_us=%" PRIu64
+			" write_p50_us=%" PRIu64 " write_p99_us=%" PRIu64 " read_p50_us=%" PRIu64
+			" read_p99_us=%" PRIu64,
+			benchmark.name, result.bytes / (1024.0 * 1024.0) / seconds,
+			Percentile(result.rtt_us, 50), Percentile(result.rtt_us, 99),
+			HistogramPercentile(stats.write_latency, 50),
+			HistogramPercentile(stats.write_latency, 99),
+			HistogramPercentile(stats.read_latency, 50),
+			HistogramPercentile(stats.read_latency, 99));
+		if (result.operations != 0) {
+			printf(" ops_per_sec=%.0f", result.operations / seconds);
+		}
+		printf("\n");
+		fflush(stdout);
+	}
+
+	// The fdevent loop never returns.
+	exit(0);
+}
@@ -18,9 +18,10 @@
 
 #include "adb_io.h"
 
+#include <limits.h>
 #include <unistd.h>
 
-#include <thread>
+#include <algorithm>
 
 #include <android-base/stringprintf.h>
 
@@ -67,19 +68,63 @@ bool SendFail(int fd, const std::string& reason) {
 	return WriteFdExactly(fd, "FAIL", 4) && SendProtocolString(fd, reason);
 }
 
-bool ReadFdExactly(int fd, void* buf, size_t len) {
-	char* p = reinterpret_cast<char*>(buf);
+// Waits for fd to be ready for |events|, until |deadline|.
+static bool WaitForFd(int fd, short events, std::chrono::steady_clock::time_point deadline) {
+	int timeout = -1;
+	if (deadline != std::chrono::steady_clock::time_point::max()) {
+		auto remaining = std::chrono::duration_cast<std::chrono::milliseconds>(
+			deadline - std::chrono::steady_clock::now());
+		// Round up, so that a wait that's due in under a millisecond doesn't spin.
+		timeout = static_cast<int>(
+			std::min<int64_t>(INT_MAX, std::max<int64_t>(0, remaining.count() + 1)));
+	}
 
-	size_t len0 = len;
+	adb_pollfd pfd = { fd, events, 0 };
+	int rc = adb_poll(&pfd, 1, timeout);
+	if (rc == -1) {
+		D("poll: fd=%d error %d: %s", fd, errno, strerror(errno));
+		return false;
+	}
+	else if (rc == 0) {
+		D("poll: fd=%d timed out", fd);
+		errno = ETIMEDOUT;
+		return false;
+	}
+	// Errors and hangups are left for the next read or write to report.
+	return true;
+}
 
-	D("readx: fd=%d wanted=%zu", fd, len);
-	while (len > 0) {
-		int r = adb_read(fd, p, len);
+// Drops the first |len| bytes from the front of the iovecs, along with any that are left empty.
+static void ConsumeIovecs(adb_iovec** iov, int* iovcnt, size_t len) {
+	while (*iovcnt > 0 && len >= (*iov)->iov_len) {
+		len -= (*iov)->iov_len;
+		++*iov;
+		--*iovcnt;
+	}
+	if (len > 0) {
+		(*iov)->iov_base = reinterpret_cast<char*>((*iov)->iov_base) + len;
+		(*iov)->iov_len -= len;
+	}
+}
+
+bool ReadFdExactlyV(int fd, adb_iovec* iov, int iovcnt,
+	std::chrono::steady_clock::time_point deadline) {
+	bool has_deadline = deadline != std::chrono::steady_clock::time_point::max();
+
+	ConsumeIovecs(&iov, &iovcnt, 0);
+	while (iovcnt > 0) {
+		// A blocking read could outlast the deadline, so wait for data first.
+		if (has_deadline && !WaitForFd(fd, POLLIN, deadline)) return false;
+
+		int r = adb_readv(fd, iov, iovcnt);
 		if (r > 0) {
-			len -= r;
-			p += r;
+			ConsumeIovecs(&iov, &iovcnt, r);
 		}
 		else if (r == -1) {
+			if (errno == EAGAIN) {
+				if (!WaitForFd(fd, POLLIN, deadline)) return false;
+				continue;
+			}
 			D("readx: fd=%d error %d: %s", fd, errno, strerror(errno));
 			return false;
 		}
@@ -89,45 +134,62 @@ bool ReadFdExactly(int fd, void* buf, size_t len) {
 			return false;
 		}
 	}
-
-	VLOG(RWX) << "readx: fd=" << fd << " wanted=" << len0 << " got=" << (len0 - len)
-		<< " " << dump_hex(reinterpret_cast<const unsigned char*>(buf), len0);
-
 	return true;
 }
 
-bool WriteFdExactly(int fd, const void* buf, size_t len) {
-	const char* p = reinterpret_cast<const char*>(buf);
-	int r;
+bool WriteFdExactlyV(int fd, adb_iovec* iov, int iovcnt,
+	std::chrono::steady_clock::time_point deadline) {
+	bool has_deadline = deadline != std::chrono::steady_clock::time_point::max();
 
-	VLOG(RWX) << "writex: fd=" << fd << " len=" << len
-		<< " " << dump_hex(reinterpret_cast<const unsigned char*>(buf), len);
+	ConsumeIovecs(&iov, &iovcnt, 0);
+	while (iovcnt > 0) {
+		if (has_deadline && !WaitForFd(fd, POLLOUT, deadline)) return false;
 
-	while (len > 0) {
-		r = adb_write(fd, p, len);
-		if (r == -1) {
-			D("writex: fd=%d error %d: %s", fd, errno, strerror(errno));
-			if (errno == EAGAIN) {
-				std::this_thread::yield();
-				continue;
-			}
-			else if (errno == EPIPE) {
-				D("writex: fd=%d disconnected", fd);
-				errno = 0;
-				return false;
-			}
-			else {
-				return false;
-			}
+		int r = adb_writev(fd, iov, iovcnt);
+		if (r >= 0) {
+			ConsumeIovecs(&iov, &iovcnt, r);
+		}
+		else if (errno == EAGAIN) {
+			if (!WaitForFd(fd, POLLOUT, deadline)) return false;
+		}
+		else if (errno == EPIPE) {
+			D("writex: fd=%d disconnected", fd);
+			errno = 0;
+			return false;
 		}
 		else {
-			len -= r;
-			p += r;
+			D("writex: fd=%d error %d: %s", fd, errno, strerror(errno));
+			return false;
 		}
 	}
 	return true;
 }
 
+bool ReadFdExactly(int fd, void* buf, size_t len) {
+	D("readx: fd=%d wanted=%zu", fd, len);
+	adb_iovec iov;
+	iov.iov_base = buf;
+	iov.iov_len = len;
+	if (!ReadFdExactlyV(fd, &iov, 1)) {
+		return false;
+	}
+
+	VLOG(RWX) << "readx: fd=" << fd << " wanted=" << len << " got=" << len
+		<< " " << dump_hex(reinterpret_cast<const unsigned char*>(buf), len);
+
+	return true;
+}
+
+bool WriteFdExactly(int fd, const void* buf, size_t len) {
+	VLOG(RWX) << "writex: fd=" << fd << " len=" << len
+		<< " " << dump_hex(reinterpret_cast<const unsigned char*>(buf), len);
+
+	adb_iovec iov;
+	iov.iov_base = const_cast<void*>(buf);
+	iov.iov_len = len;
+	return WriteFdExactlyV(fd, &iov, 1);
+}
+
 bool WriteFdExactly(int fd, const char* str) {
 	return WriteFdExactly(fd, str, strlen(str));
 }
@@ -19,8 +19,17 @@
 
 #include <sys/types.h>
 
+#include <chrono>
 #include <string>
 
+// From sysdeps.h, which this header doesn't pull in.
+#if defined(_WIN32)
+struct adb_iovec;
+#else
+struct iovec;
+typedef struct iovec adb_iovec;
+#endif
+
  // Sends the protocol "OKAY" message.
 bool SendOkay(int fd);
 
@@ -41,6 +50,16 @@ bool ReadProtocolString(int fd, std::string* s, std::string* error);
 // If this function fails, the contents of buf are undefined.
 bool ReadFdExactly(int fd, void* buf, size_t len);
 
+// Reads exactly the bytes described by iov from fd, with as few readv() calls as the data
+// arriving allows.
+//
+// If fd is non-blocking, this waits for it with poll() rather than failing. If the deadline
+// passes first, it fails with errno set to ETIMEDOUT. Otherwise, it fails like ReadFdExactly.
+//
+// The iovecs are updated as data is read, so their contents are undefined afterward.
+bool ReadFdExactlyV(int fd, adb_iovec* iov, int iovcnt,
+	std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::time_point::max());
+
 // Given a client socket, wait for orderly/graceful shutdown. Call this:
 //
 // * Before closing a client socket.
@@ -66,6 +85,13 @@ bool ReadOrderlyShutdown(int fd);
 // is closed, errno will be set to 0.
 bool WriteFdExactly(int fd, const void* buf, size_t len);
 
+// Writes exactly the bytes described by iov to fd. A header and payload passed together go out
+// in a single writev() unless the fd can't take them all at once.
+//
+// Waiting and failure are as for ReadFdExactlyV and WriteFdExactly.
+bool WriteFdExactlyV(int fd, adb_iovec* iov, int iovcnt,
+	std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::time_point::max());
+
 // Same as above, but for strings.
 bool WriteFdExactly(int fd, const char* s);
 bool WriteFdExactly(int fd, const std::string& s);
@@ -25,11 +25,16 @@
 #include <sys/types.h>
 #include <unistd.h>
 
+#include <chrono>
 #include <string>
+#include <thread>
 
 #include <android-base/file.h>
 #include <android-base/test_utils.h>
 
+#include "adb_utils.h"
+#include "sysdeps.h"
+
  // All of these tests fail on Windows because they use the C Runtime open(),
  // but the adb_io APIs expect file descriptors from adb_open(). This could
  // theoretically be fixed by making adb_read()/adb_write() fallback to using
@@ -49,7 +54,7 @@ POSIX_TEST(io, ReadFdExactly_whole) {
 	ASSERT_NE(-1, tf.fd);
 
 	ASSERT_TRUE(android::base::WriteStringToFd(expected, tf.fd)) << strerror(errno);
-	ASSERT_EQ(0, lseek(tf.fd, 0, SEEK_SET));
+	ASSERT_EQ(0, adb_lseek(tf.fd, 0, SEEK_SET));
 
 	// Test reading the whole file.
 	char buf[sizeof(expected)] = {};
@@ -63,7 +68,7 @@ POSIX_TEST(io, ReadFdExactly_eof) {
 	ASSERT_NE(-1, tf.fd);
 
 	ASSERT_TRUE(android::base::WriteStringToFd(expected, tf.fd)) << strerror(errno);
-	ASSERT_EQ(0, lseek(tf.fd, 0, SEEK_SET));
+	ASSERT_EQ(0, adb_lseek(tf.fd, 0, SEEK_SET));
 
 	// Test that not having enough data will fail.
 	char buf[sizeof(expected) + 1] = {};
@@ -77,7 +82,7 @@ POSIX_TEST(io, ReadFdExactly_partial) {
 	ASSERT_NE(-1, tf.fd);
 
 	ASSERT_TRUE(android::base::WriteStringToFd(input, tf.fd)) << strerror(errno);
-	ASSERT_EQ(0, lseek(tf.fd, 0, SEEK_SET));
+	ASSERT_EQ(0, adb_lseek(tf.fd, 0, SEEK_SET));
 
 	// Test reading a partial file.
 	char buf[sizeof(input) - 1] = {};
@@ -96,7 +101,7 @@ POSIX_TEST(io, WriteFdExactly_whole) {
 	// Test writing the whole string to the file.
 	ASSERT_TRUE(WriteFdExactly(tf.fd, expected, sizeof(expected)))
 		<< strerror(errno);
-	ASSERT_EQ(0, lseek(tf.fd, 0, SEEK_SET));
+	ASSERT_EQ(0, adb_lseek(tf.fd, 0, SEEK_SET));
 
 	std::string s;
 	ASSERT_TRUE(android::base::ReadFdToString(tf.fd, &s));
@@ -110,7 +115,7 @@ POSIX_TEST(io, WriteFdExactly_partial) {
 
 	// Test writing a partial string to the file.
 	ASSERT_TRUE(WriteFdExactly(tf.fd, buf, sizeof(buf) - 2)) << strerror(errno);
-	ASSERT_EQ(0, lseek(tf.fd, 0, SEEK_SET));
+	ASSERT_EQ(0, adb_lseek(tf.fd, 0, SEEK_SET));
 
 	std::string expected(buf);
 	expected.pop_back();
@@ -121,7 +126,7 @@ POSIX_TEST(io, WriteFdExactly_partial) {
 }
 
 POSIX_TEST(io, WriteFdExactly_ENOSPC) {
-	int fd = open("/dev/full", O_WRONLY);
+	int fd = adb_open("/dev/full", O_WRONLY);
 	ASSERT_NE(-1, fd);
 
 	char buf[] = "foo";
@@ -136,7 +141,7 @@ POSIX_TEST(io, WriteFdExactly_string) {
 
 	// Test writing a partial string to the file.
 	ASSERT_TRUE(WriteFdExactly(tf.fd, str)) << strerror(errno);
-	ASSERT_EQ(0, lseek(tf.fd, 0, SEEK_SET));
+	ASSERT_EQ(0, adb_lseek(tf.fd, 0, SEEK_SET));
 
 	std::string s;
 	ASSERT_TRUE(android::base::ReadFdToString(tf.fd, &s));
@@ -149,9 +154,95 @@ POSIX_TEST(io, WriteFdFmt) {
 
 	// Test writing a partial string to the file.
 	ASSERT_TRUE(WriteFdFmt(tf.fd, "Foo%s%d", "bar", 123)) << strerror(errno);
-	ASSERT_EQ(0, lseek(tf.fd, 0, SEEK_SET));
+	ASSERT_EQ(0, adb_lseek(tf.fd, 0, SEEK_SET));
 
 	std::string s;
 	ASSERT_TRUE(android::base::ReadFdToString(tf.fd, &s));
 	EXPECT_STREQ("Foobar123", s.c_str());
-}
\ No newline at end of file
+}
+
+POSIX_TEST(io, WriteFdExactlyV) {
+	TemporaryFile tf;
+	ASSERT_NE(-1, tf.fd);
+
+	// Empty iovecs are skipped.
+	char header[] = "Foo";
+	char payload[] = "bar";
+	adb_iovec iov[] = {
+		{ header, 3 },
+		{ nullptr, 0 },
+		{ payload, 3 },
+	};
+	ASSERT_TRUE(WriteFdExactlyV(tf.fd, iov, 3)) << strerror(errno);
+	ASSERT_EQ(0, adb_lseek(tf.fd, 0, SEEK_SET));
+
+	std::string s;
+	ASSERT_TRUE(android::base::ReadFdToString(tf.fd, &s));
+	EXPECT_EQ("Foobar", s);
+}
+
+POSIX_TEST(io, ReadFdExactlyV) {
+	TemporaryFile tf;
+	ASSERT_NE(-1, tf.fd);
+	ASSERT_TRUE(android::base::WriteStringToFd("Foobar", tf.fd)) << strerror(errno);
+	ASSERT_EQ(0, adb_lseek(tf.fd, 0, SEEK_SET));
+
+	char header[4] = {};
+	char payload[5] = {};
+	adb_iovec iov[] = {
+		{ header, 2 },
+		{ payload, 4 },
+	};
+	ASSERT_TRUE(ReadFdExactlyV(tf.fd, iov, 2)) << strerror(errno);
+	EXPECT_STREQ("Fo", header);
+	EXPECT_STREQ("obar", payload);
+
+	// Running out of data fails the same way ReadFdExactly does.
+	ASSERT_EQ(0, adb_lseek(tf.fd, 0, SEEK_SET));
+	char buf[8];
+	adb_iovec whole = { buf, sizeof(buf) };
+	ASSERT_FALSE(ReadFdExactlyV(tf.fd, &whole, 1));
+	EXPECT_EQ(0, errno);
+}
+
+POSIX_TEST(io, ReadFdExactlyV_deadline) {
+	int fds[2];
+	ASSERT_EQ(0, adb_socketpair(fds));
+
+	char buf[4];
+	adb_iovec iov = { buf, sizeof(buf) };
+	auto start = std::chrono::steady_clock::now();
+	ASSERT_FALSE(ReadFdExactlyV(fds[0], &iov, 1, start + std::chrono::milliseconds(50)));
+	EXPECT_EQ(ETIMEDOUT, errno);
+	EXPECT_GE(std::chrono::steady_clock::now() - start, std::chrono::milliseconds(50));
+
+	adb_close(fds[0]);
+	adb_close(fds[1]);
+}
+
+// A non-blocking fd that fills up makes the write wait, rather than fail or spin.
+POSIX_TEST(io, WriteFdExactlyV_nonblocking) {
+	int fds[2];
+	ASSERT_EQ(0, adb_socketpair(fds));
+	ASSERT_TRUE(set_file_block_mode(fds[0], false));
+
+	std::string data(4 * 1024 * 1024, 'x');
+	std::string received;
+	std::thread reader([&]() {
+		std::this_thread::sleep_for(std::chrono::milliseconds(50));
+		char buf[64 * 1024];
+		while (received.size() < data.size()) {
+			int rc = adb_read(fds[1], buf, sizeof(buf));
+			if (rc <= 0) break;
+			received.append(buf, rc);
+		}
+	});
+
+	adb_iovec iov = { &data[0], data.size() };
+	EXPECT_TRUE(WriteFdExactlyV(fds[0], &iov, 1)) << strerror(errno);
+	reader.join();
+	EXPECT_EQ(data, received);
+
+	adb_close(fds[0]);
+	adb_close(fds[1]);
+}
@@ -0,0 +1,94 @@
+/*
+ * Copyright (C) 2017 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define TRACE_TAG ADB
+
+#include "adb_stats.h"
+
+#include <inttypes.h>
+
+#include <android-base/stringprintf.h>
+
+#include "adb.h"
+#include "transport.h"
+
+void LatencyHistogram::Record(uint64_t start_ns, uint64_t end_ns) {
+	uint64_t us = end_ns > start_ns ? (end_ns - start_ns) / 1000 : 0;
+	size_t bucket = 0;
+	while (us != 0 && bucket < kBuckets - 1) {
+		us >>= 1;
+		++bucket;
+	}
+	buckets[bucket].fetch_add(1, std::memory_order_relaxed);
+}
+
+std::string LatencyHistogram::ToString() const {
+	std::string result;
+	for (size_t i = 0; i < kBuckets; ++i) {
+		uint64_t count = buckets[i].load(std::memory_order_relaxed);
+		if (count == 0) continue;
+		if (!result.empty()) result += ',';
+		if (i == kBuckets - 1) {
+			android::base::StringAppendF(&result, "inf:%" PRIu64, count);
+		}
+		else {
+			android::base::StringAppendF(&result, "%" PRIu64 ":%" PRIu64, UINT64_C(1) << i, count);
+		}
+	}
+	return result.empty() ? "-" : result;
+}
+
+void TrafficStats::AppendTo(std::string* result) const {
+	android::base::StringAppendF(result,
+		" packets_in=%" PRIu64 " bytes_in=%" PRIu64 " packets_out=%" PRIu64
+		" bytes_out=%" PRIu64 " queued_packets=%" PRIu64 " queued_bytes=%" PRIu64
+		" backpressure=%" PRIu64,
+		packets_in.load(std::memory_order_relaxed), bytes_in.load(std::memory_order_relaxed),
+		packets_out.load(std::memory_order_relaxed), bytes_out.load(std::memory_order_relaxed),
+		queued_packets.load(std::memory_order_relaxed),
+		queued_bytes.load(std::memory_order_relaxed),
+		backpressure.load(std::memory_order_relaxed));
+	uint64_t capacity = payload_capacity_out.load(std::memory_order_relaxed);
+	if (capacity != 0) {
+		android::base::StringAppendF(result, " fill_percent=%" PRIu64,
+			bytes_out.load(std::memory_order_relaxed) * 100 / capacity);
+	}
+	*result += " read_latency_us=" + read_latency.ToString();
+	*result += " write_latency_us=" + write_latency.ToString();
+}
+
+static const char* name_or_dash(const char* name) {
+	return (name && *name) ? name : "-";
+}
+
+std::string format_stats() {
+	std::string result;
+	iterate_transports([&result](const atransport* t) {
+		android::base::StringAppendF(&result, "transport %s state=%s", name_or_dash(t->serial),
+			t->connection_state_name().c_str());
+		t->stats.AppendTo(&result);
+		result += '\n';
+		return true;
+	});
+	iterate_local_sockets([&result](const asocket* s) {
+		const atransport* t = s->transport ? s->transport : (s->peer ? s->peer->transport : nullptr);
+		android::base::StringAppendF(&result, "socket %u transport=%s peer=%u", s->id,
+			name_or_dash(t ? t->serial : nullptr), s->peer ? s->peer->id : 0);
+		s->stats.AppendTo(&result);
+		result += '\n';
+	});
+	return result;
+}
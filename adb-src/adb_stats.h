@@ -0,0 +1,107 @@
+/*
+ * Copyright (C) 2017 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __ADB_STATS_H
+#define __ADB_STATS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+#include <chrono>
+#include <string>
+
+// Traffic counters kept on each transport and socket, reported by the host:stats service.
+// They're only ever updated with relaxed atomic operations, so the packet path doesn't take
+// any locks for them. Everything here is trivially constructible, because asockets are
+// calloc()ed.
+
+static inline uint64_t stats_now_ns() {
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(
+		std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Counts latencies in power-of-two microsecond buckets: bucket 0 is under 1us, bucket i covers
+// [2^(i-1), 2^i)us, and the last bucket also takes everything longer.
+struct LatencyHistogram {
+	static constexpr size_t kBuckets = 24;
+
+	std::atomic<uint64_t> buckets[kBuckets];
+
+	void Record(uint64_t start_ns, uint64_t end_ns);
+
+	// Formats the non-empty buckets as "<upper bound in us>:<count>,...", with "inf" as the
+	// bound of the last bucket, or "-" if there are none.
+	std::string ToString() const;
+};
+
+struct TrafficStats {
+	std::atomic<uint64_t> packets_in;
+	std::atomic<uint64_t> bytes_in;
+	std::atomic<uint64_t> packets_out;
+	std::atomic<uint64_t> bytes_out;
+	// For a socket, the payload room of the packets it sent, so that bytes_out over this is how
+	// full they were on average.
+	std::atomic<uint64_t> payload_capacity_out;
+
+	// Packets waiting to be written: for a transport, those its write thread hasn't picked up
+	// yet; for a socket, those that didn't fit into its fd, until the backlog has drained.
+	std::atomic<uint64_t> queued_packets;
+	std::atomic<uint64_t> queued_bytes;
+
+	// Times a socket had to tell its peer to stop sending until its queue drains.
+	std::atomic<uint64_t> backpressure;
+
+	// For transports, how long a packet read from the device waits to be handled by the main
+	// thread. Sockets don't queue what they read, so they leave this empty.
+	LatencyHistogram read_latency;
+	// How long a packet takes from being queued to having been written out. A socket's backlog
+	// drains as a whole, so only its oldest packet is timed.
+	LatencyHistogram write_latency;
+
+	void RecordIn(size_t bytes) {
+		packets_in.fetch_add(1, std::memory_order_relaxed);
+		bytes_in.fetch_add(bytes, std::memory_order_relaxed);
+	}
+
+	void RecordOut(size_t bytes, size_t payload_capacity = 0) {
+		packets_out.fetch_add(1, std::memory_order_relaxed);
+		bytes_out.fetch_add(bytes, std::memory_order_relaxed);
+		payload_capacity_out.fetch_add(payload_capacity, std::memory_order_relaxed);
+	}
+
+	void RecordQueued(size_t bytes) {
+		queued_packets.fetch_add(1, std::memory_order_relaxed);
+		queued_bytes.fetch_add(bytes, std::memory_order_relaxed);
+	}
+
+	void RecordDequeued(size_t bytes, size_t packets = 1) {
+		queued_packets.fetch_sub(packets, std::memory_order_relaxed);
+		queued_bytes.fetch_sub(bytes, std::memory_order_relaxed);
+	}
+
+	void RecordBackpressure() {
+		backpressure.fetch_add(1, std::memory_order_relaxed);
+	}
+
+	// Appends " key=value" for each counter.
+	void AppendTo(std::string* result) const;
+};
+
+// The host:stats report: a line per transport, then one per local socket.
+std::string format_stats();
+
+#endif  // __ADB_STATS_H
@@ -0,0 +1,63 @@
+/*
+ * Copyright (C) 2017 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "adb_stats.h"
+
+#include <gtest/gtest.h>
+
+#include <string>
+
+TEST(adb_stats, histogram_empty) {
+	LatencyHistogram histogram{};
+	ASSERT_EQ("-", histogram.ToString());
+}
+
+TEST(adb_stats, histogram_buckets) {
+	LatencyHistogram histogram{};
+	histogram.Record(1000, 1500);        // 0us
+	histogram.Record(0, 1000);           // 1us
+	histogram.Record(0, 3000);           // 3us
+	histogram.Record(0, 3999);           // 3us
+	histogram.Record(5000, 1000);        // Clock went backwards: 0us.
+	histogram.Record(0, UINT64_MAX);     // Forever.
+	ASSERT_EQ("1:2,2:1,4:2,inf:1", histogram.ToString());
+}
+
+TEST(adb_stats, traffic) {
+	TrafficStats stats{};
+	stats.RecordIn(10);
+	stats.RecordIn(20);
+	stats.RecordOut(5);
+	stats.RecordQueued(100);
+	stats.RecordQueued(50);
+	stats.RecordDequeued(100);
+	stats.RecordBackpressure();
+
+	std::string result;
+	stats.AppendTo(&result);
+	ASSERT_EQ(" packets_in=2 bytes_in=30 packets_out=1 bytes_out=5 queued_packets=1"
+		" queued_bytes=50 backpressure=1 read_latency_us=- write_latency_us=-", result);
+}
+
+TEST(adb_stats, payload_fill) {
+	TrafficStats stats{};
+	stats.RecordOut(1024, 4096);
+	stats.RecordOut(3072, 4096);
+
+	std::string result;
+	stats.AppendTo(&result);
+	ASSERT_NE(std::string::npos, result.find(" fill_percent=50 ")) << result;
+}
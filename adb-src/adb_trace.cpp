@@ -14,10 +14,15 @@
  * limitations under the License.
  */
 
+#include <stdarg.h>
 #include <vector>
 #include <unordered_map>
 #include <iostream>
 #include <string>
+
+#include <android-base/logging.h>
+#include <android-base/stringprintf.h>
+
 #include "sysdeps.h"
 #include "adb_trace.h"
 #include "adb.h"
@@ -132,4 +137,15 @@ void adb_trace_init(char** argv) {
 
 void adb_trace_enable(AdbTrace trace_tag) {
 	adb_trace_mask |= (1 << trace_tag);
-}
\ No newline at end of file
+}
+
+void adb_trace_printf(const char* fmt, ...) {
+	std::string message;
+
+	va_list ap;
+	va_start(ap, fmt);
+	android::base::StringAppendV(&message, fmt, ap);
+	va_end(ap);
+
+	LOG(INFO) << message;
+}
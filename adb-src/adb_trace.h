@@ -17,6 +17,8 @@
 #ifndef __ADB_TRACE_H
 #define __ADB_TRACE_H
 
+#include "sysdeps/format.h"
+
  /* IMPORTANT: if you change the following list, don't
   * forget to update the corresponding 'tags' table in
   * the adb_trace_init() function implemented in adb_trace.cpp.
@@ -46,23 +48,23 @@ enum AdbTrace {
     else                  \
         LOG(INFO)
 
-// You must define TRACE_TAG before using this macro.
-//#define D(...) \
-//    VLOG(TRACE_TAG) << android::base::StringPrintf(__VA_ARGS__)
-template <typename T, typename... V>
-void D(T arg, V... args) {
-	std::cout << arg;
-	D(args...);
-}
-template<typename T>
-void D(T arg) {
-	std::cout << arg;
-}
+// You must define TRACE_TAG before using this macro. If TRACE_TAG isn't enabled, D() costs
+// a single test of adb_trace_mask: the arguments aren't evaluated and nothing is formatted.
+#define D(...)                                  \
+    do {                                        \
+        if (UNLIKELY(VLOG_IS_ON(TRACE_TAG))) {  \
+            adb_trace_printf(__VA_ARGS__);      \
+        }                                       \
+    } while (0)
 
 extern int adb_trace_mask;
 void adb_trace_init(char**);
 void adb_trace_enable(AdbTrace trace_tag);
 
+// Logs a printf-style trace message. Kept out of line so that D() call sites stay small.
+void adb_trace_printf(const char* fmt, ...)
+	__attribute__((__format__(ADB_FORMAT_ARCHETYPE, 1, 2)));
+
 // Include <atomic> before stdatomic.h (introduced in cutils/trace.h) to avoid compile error.
 #include <atomic>
 
@@ -0,0 +1,53 @@
+/*
+ * Copyright (C) 2017 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define TRACE_TAG SOCKETS
+
+#include "adb_trace.h"
+
+#include <gtest/gtest.h>
+
+class TraceTest : public ::testing::Test {
+protected:
+	void SetUp() override {
+		saved_mask_ = adb_trace_mask;
+	}
+
+	void TearDown() override {
+		adb_trace_mask = saved_mask_;
+	}
+
+	int saved_mask_;
+};
+
+static int count_evaluation(int* evaluations) {
+	return ++*evaluations;
+}
+
+TEST_F(TraceTest, disabled_tag_skips_arguments) {
+	adb_trace_mask = ~(1 << SOCKETS);
+	int evaluations = 0;
+	D("evaluated %d", count_evaluation(&evaluations));
+	EXPECT_EQ(0, evaluations);
+}
+
+TEST_F(TraceTest, enabled_tag_evaluates_arguments) {
+	adb_trace_mask = 0;
+	adb_trace_enable(SOCKETS);
+	int evaluations = 0;
+	D("evaluated %d", count_evaluation(&evaluations));
+	EXPECT_EQ(1, evaluations);
+}
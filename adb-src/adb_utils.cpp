@@ -32,6 +32,7 @@
 #include <android-base/parseint.h>
 #include <android-base/stringprintf.h>
 #include <android-base/strings.h>
+#include <openssl/sha.h>
 
 #include "adb.h"
 #include "adb_trace.h"
@@ -204,6 +205,56 @@ bool set_file_block_mode(int fd, bool block) {
 }
 #endif
 
+bool find_data_extent(int fd, int64_t offset, int64_t* data_start, int64_t* data_end) {
+#if defined(SEEK_HOLE) && !defined(_WIN32)
+    int64_t start = adb_lseek64(fd, offset, SEEK_DATA);
+    if (start == -1) {
+        if (errno != ENXIO) return false;
+
+        // There's no data at or after |offset|, so the rest of the file is one hole.
+        struct stat st;
+        if (fstat(fd, &st) == -1) return false;
+        *data_start = *data_end = std::max<int64_t>(offset, st.st_size);
+        return true;
+    }
+
+    int64_t end = adb_lseek64(fd, start, SEEK_HOLE);
+    if (end == -1 || adb_lseek64(fd, start, SEEK_SET) == -1) {
+        int saved_errno = errno;
+        adb_lseek64(fd, offset, SEEK_SET);
+        errno = saved_errno;
+        return false;
+    }
+    *data_start = start;
+    *data_end = end;
+    return true;
+#else
+    errno = ENOTSUP;
+    return false;
+#endif
+}
+
+bool hash_file_prefix(int fd, uint64_t length, std::string* digest, uint64_t* hashed_length) {
+    SHA256_CTX ctx;
+    SHA256_Init(&ctx);
+
+    std::vector<char> buf(64 * 1024);
+    uint64_t total = 0;
+    while (total < length) {
+        size_t count = std::min<uint64_t>(length - total, buf.size());
+        int rc = adb_read(fd, buf.data(), count);
+        if (rc == -1) return false;
+        if (rc == 0) break;
+        SHA256_Update(&ctx, buf.data(), rc);
+        total += rc;
+    }
+
+    digest->resize(SHA256_DIGEST_LENGTH);
+    SHA256_Final(reinterpret_cast<uint8_t*>(&(*digest)[0]), &ctx);
+    *hashed_length = total;
+    return true;
+}
+
 bool forward_targets_are_valid(const std::string& source, const std::string& dest,
                                std::string* error) {
     if (android::base::StartsWith(source, "tcp:")) {
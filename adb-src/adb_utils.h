@@ -17,6 +17,8 @@
 #ifndef _ADB_UTILS_H_
 #define _ADB_UTILS_H_
 
+#include <stdint.h>
+
 #include <condition_variable>
 #include <mutex>
 #include <string>
@@ -49,6 +51,17 @@ bool set_file_block_mode(int fd, bool block);
 
 extern int adb_close(int fd);
 
+// Finds the first extent of real data at or after |offset| (the current file offset) in |fd|, and
+// moves the file offset to its start. [*data_start, *data_end) is the extent; if the rest of the
+// file is a hole, both are set to the end of the file. Returns false, leaving the file offset at
+// |offset|, if the platform or filesystem can't report holes; the caller should then treat the
+// rest of the file as data.
+bool find_data_extent(int fd, int64_t offset, int64_t* data_start, int64_t* data_end);
+
+// Computes the SHA-256 digest of the next |length| bytes of |fd|, stopping early at EOF.
+// On success, |digest| holds the raw 32-byte digest and |hashed_length| the number of bytes read.
+bool hash_file_prefix(int fd, uint64_t length, std::string* digest, uint64_t* hashed_length);
+
 // Given forward/reverse targets, returns true if they look sane. If an error is found, fills
 // |error| and returns false.
 // Currently this only checks "tcp:" targets. Additional checking could be added for other targets
@@ -30,6 +30,7 @@
 
 #include "sysdeps.h"
 
+#include <android-base/file.h>
 #include <android-base/macros.h>
 #include <android-base/test_utils.h>
 
@@ -153,6 +154,79 @@ TEST(adb_utils, set_file_block_mode) {
 }
 #endif
 
+#if !defined(_WIN32)
+TEST(adb_utils, find_data_extent) {
+	constexpr int64_t kChunk = 64 * 1024;
+	constexpr int64_t kHole = 1024 * 1024;
+	constexpr int64_t kFileSize = kChunk + kHole + kChunk + kHole;
+
+	// Data, hole, data, trailing hole.
+	TemporaryFile tf;
+	ASSERT_NE(-1, tf.fd);
+	std::string data(kChunk, 'x');
+	ASSERT_EQ(kChunk, adb_write(tf.fd, data.data(), data.size()));
+	ASSERT_EQ(kChunk + kHole, adb_lseek64(tf.fd, kHole, SEEK_CUR));
+	ASSERT_EQ(kChunk, adb_write(tf.fd, data.data(), data.size()));
+	ASSERT_EQ(0, ftruncate(tf.fd, kFileSize));
+
+	int64_t start;
+	int64_t end;
+	ASSERT_TRUE(find_data_extent(tf.fd, 0, &start, &end));
+	EXPECT_EQ(0, start);
+	EXPECT_GE(end, kChunk);
+	EXPECT_EQ(start, adb_lseek64(tf.fd, 0, SEEK_CUR));
+
+	// Filesystems without hole support report everything as data, so only check that the
+	// extents cover all of the data and finish at the end of the file.
+	int64_t data_bytes = end - start;
+	while (start != end) {
+		ASSERT_TRUE(find_data_extent(tf.fd, end, &start, &end));
+		ASSERT_LE(start, end);
+		data_bytes += end - start;
+	}
+	EXPECT_EQ(kFileSize, start);
+	EXPECT_GE(data_bytes, 2 * kChunk);
+
+	// Asking from inside the trailing hole (or past the end) finds nothing.
+	ASSERT_TRUE(find_data_extent(tf.fd, kFileSize + 1, &start, &end));
+	EXPECT_EQ(start, end);
+}
+#endif
+
+#if !defined(_WIN32)
+TEST(adb_utils, hash_file_prefix) {
+	TemporaryFile whole;
+	ASSERT_NE(-1, whole.fd);
+	ASSERT_TRUE(android::base::WriteStringToFd("hello, world", whole.fd));
+	TemporaryFile prefix;
+	ASSERT_NE(-1, prefix.fd);
+	ASSERT_TRUE(android::base::WriteStringToFd("hello", prefix.fd));
+
+	std::string whole_digest;
+	std::string prefix_digest;
+	uint64_t hashed;
+	ASSERT_EQ(0, adb_lseek(whole.fd, 0, SEEK_SET));
+	ASSERT_TRUE(hash_file_prefix(whole.fd, 5, &whole_digest, &hashed));
+	EXPECT_EQ(5U, hashed);
+	EXPECT_EQ(32U, whole_digest.size());
+
+	ASSERT_EQ(0, adb_lseek(prefix.fd, 0, SEEK_SET));
+	ASSERT_TRUE(hash_file_prefix(prefix.fd, 5, &prefix_digest, &hashed));
+	EXPECT_EQ(whole_digest, prefix_digest);
+
+	// Asking for more than there is hashes what's there.
+	ASSERT_EQ(0, adb_lseek(prefix.fd, 0, SEEK_SET));
+	ASSERT_TRUE(hash_file_prefix(prefix.fd, 1024, &prefix_digest, &hashed));
+	EXPECT_EQ(5U, hashed);
+	EXPECT_EQ(whole_digest, prefix_digest);
+
+	ASSERT_EQ(0, adb_lseek(whole.fd, 0, SEEK_SET));
+	ASSERT_TRUE(hash_file_prefix(whole.fd, 1024, &whole_digest, &hashed));
+	EXPECT_EQ(12U, hashed);
+	EXPECT_NE(whole_digest, prefix_digest);
+}
+#endif
+
 TEST(adb_utils, test_forward_targets_are_valid) {
 	std::string error;
 
@@ -0,0 +1,77 @@
+/*
+ * Copyright (C) 2017 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define TRACE_TAG RWX
+
+#include "sysdeps.h"
+#include "buffered_reader.h"
+
+#include <string.h>
+
+#include <algorithm>
+
+#include "adb_trace.h"
+
+BufferedReader::BufferedReader(size_t capacity)
+	: capacity_(capacity), buffer_(new char[capacity]) {
+}
+
+bool BufferedReader::ReadExactly(int fd, void* data, size_t len) {
+	char* p = static_cast<char*>(data);
+
+	size_t copied = std::min(len, buffered());
+	if (copied > 0) {
+		memcpy(p, &buffer_[start_], copied);
+		start_ += copied;
+		p += copied;
+		len -= copied;
+	}
+	if (start_ == end_) {
+		start_ = end_ = 0;
+	}
+
+	// If there's anything left to read, the buffer is empty, so it can take a whole read's
+	// worth of whatever comes after.
+	while (len > 0) {
+		adb_iovec iov[2];
+		iov[0].iov_base = p;
+		iov[0].iov_len = len;
+		iov[1].iov_base = &buffer_[0];
+		iov[1].iov_len = capacity_;
+
+		int r = adb_readv(fd, iov, 2);
+		if (r == -1) {
+			D("buffered read: fd=%d error %d: %s", fd, errno, strerror(errno));
+			return false;
+		}
+		else if (r == 0) {
+			D("buffered read: fd=%d disconnected", fd);
+			errno = 0;
+			return false;
+		}
+
+		size_t n = r;
+		if (n < len) {
+			p += n;
+			len -= n;
+		}
+		else {
+			end_ = n - len;
+			len = 0;
+		}
+	}
+	return true;
+}
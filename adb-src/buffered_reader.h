@@ -0,0 +1,53 @@
+/*
+ * Copyright (C) 2017 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __BUFFERED_READER_H
+#define __BUFFERED_READER_H
+
+#include <stddef.h>
+
+#include <memory>
+
+// Reads a stream of packets from an fd with as few system calls as possible. Every read asks
+// for whatever the caller still needs, plus as much again as fits in an internal buffer, so
+// that a run of small packets (shell keystrokes, logcat lines, JDWP) comes in with a single
+// readv(), and later reads are served from memory. The caller's part of each readv() goes
+// straight into its own buffer, so large payloads aren't copied twice.
+//
+// Only one thread may use a BufferedReader at a time.
+class BufferedReader {
+public:
+	static constexpr size_t kDefaultCapacity = 64 * 1024;
+
+	explicit BufferedReader(size_t capacity = kDefaultCapacity);
+
+	// Reads exactly |len| bytes from |fd| into |data|, failing like ReadFdExactly. |fd| is passed
+	// on every call (rather than to the constructor) so that the owner can close it under us.
+	bool ReadExactly(int fd, void* data, size_t len);
+
+	// Bytes that have been read from the fd but not yet handed out.
+	size_t buffered() const {
+		return end_ - start_;
+	}
+
+private:
+	const size_t capacity_;
+	std::unique_ptr<char[]> buffer_;
+	size_t start_ = 0;
+	size_t end_ = 0;
+};
+
+#endif
@@ -0,0 +1,98 @@
+/*
+ * Copyright (C) 2017 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "buffered_reader.h"
+
+#include <gtest/gtest.h>
+
+#include <string>
+#include <thread>
+
+#include "adb_io.h"
+#include "sysdeps.h"
+
+class BufferedReaderTest : public ::testing::Test {
+protected:
+	void SetUp() override {
+		ASSERT_EQ(0, adb_socketpair(fds_));
+	}
+
+	void TearDown() override {
+		adb_close(fds_[0]);
+		adb_close(fds_[1]);
+	}
+
+	int fds_[2];
+};
+
+TEST_F(BufferedReaderTest, small_reads_are_batched) {
+	ASSERT_TRUE(WriteFdExactly(fds_[1], "headerpayloadheader2payload2"));
+
+	BufferedReader reader;
+	char buf[16] = {};
+	ASSERT_TRUE(reader.ReadExactly(fds_[0], buf, 6));
+	ASSERT_EQ("header", std::string(buf, 6));
+
+	// Everything else came in with the first read.
+	ASSERT_EQ(22u, reader.buffered());
+	ASSERT_TRUE(reader.ReadExactly(fds_[0], buf, 7));
+	ASSERT_EQ("payload", std::string(buf, 7));
+	ASSERT_TRUE(reader.ReadExactly(fds_[0], buf, 7));
+	ASSERT_EQ("header2", std::string(buf, 7));
+	ASSERT_TRUE(reader.ReadExactly(fds_[0], buf, 8));
+	ASSERT_EQ("payload2", std::string(buf, 8));
+	ASSERT_EQ(0u, reader.buffered());
+}
+
+TEST_F(BufferedReaderTest, read_spans_buffer_and_fd) {
+	BufferedReader reader(4);
+	ASSERT_TRUE(WriteFdExactly(fds_[1], "abcdef"));
+
+	char buf[16] = {};
+	ASSERT_TRUE(reader.ReadExactly(fds_[0], buf, 1));
+	ASSERT_EQ(4u, reader.buffered());
+
+	// Part comes from the buffer, and the rest from the fd.
+	ASSERT_TRUE(WriteFdExactly(fds_[1], "ghijkl"));
+	ASSERT_TRUE(reader.ReadExactly(fds_[0], buf, 8));
+	ASSERT_EQ("bcdefghi", std::string(buf, 8));
+	ASSERT_TRUE(reader.ReadExactly(fds_[0], buf, 3));
+	ASSERT_EQ("jkl", std::string(buf, 3));
+}
+
+TEST_F(BufferedReaderTest, large_read) {
+	std::string data(1024 * 1024, 'x');
+	for (size_t i = 0; i < data.size(); i += 4096) {
+		data[i] = 'y';
+	}
+	std::thread writer([this, &data]() { ASSERT_TRUE(WriteFdExactly(fds_[1], data)); });
+
+	BufferedReader reader;
+	std::string result(data.size(), '\0');
+	ASSERT_TRUE(reader.ReadExactly(fds_[0], &result[0], result.size()));
+	writer.join();
+	ASSERT_EQ(data, result);
+}
+
+TEST_F(BufferedReaderTest, eof) {
+	ASSERT_TRUE(WriteFdExactly(fds_[1], "abc"));
+	adb_shutdown(fds_[1]);
+
+	BufferedReader reader;
+	char buf[8];
+	ASSERT_FALSE(reader.ReadExactly(fds_[0], buf, sizeof(buf)));
+	ASSERT_EQ(0, errno);
+}
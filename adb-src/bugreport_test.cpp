@@ -43,7 +43,7 @@ using ::testing::internal::GetCapturedStdout;
 // Empty function so tests don't need to be linked against file_sync_service.cpp, which requires
 // SELinux and its transitive dependencies...
 bool do_sync_pull(const std::vector<const char*>& srcs, const char* dst, bool copy_attrs,
-	const char* name) {
+	const char* name, bool resume) {
 	ADD_FAILURE() << "do_sync_pull() should have been mocked";
 	return false;
 }
@@ -0,0 +1,89 @@
+/*
+ * Copyright (C) 2017 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "sysdeps.h"
+#include "byte_ring.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+
+#include <android-base/logging.h>
+
+void ByteRing::Grow(size_t min_capacity) {
+	size_t capacity = std::max(capacity_, kMinCapacity);
+	while (capacity < min_capacity) {
+		capacity *= 2;
+	}
+
+	// Unwrap the contents to the start of the new buffer.
+	char* data = static_cast<char*>(malloc(capacity));
+	CHECK(data != nullptr);
+	size_t first = std::min(size_, capacity_ - start_);
+	if (first > 0) {
+		memcpy(data, data_ + start_, first);
+		memcpy(data + first, data_, size_ - first);
+	}
+	free(data_);
+	data_ = data;
+	capacity_ = capacity;
+	start_ = 0;
+}
+
+void ByteRing::Append(const void* data, size_t len) {
+	if (size_ + len > capacity_) {
+		Grow(size_ + len);
+	}
+
+	const char* p = static_cast<const char*>(data);
+	size_t end = (start_ + size_) % capacity_;
+	size_t first = std::min(len, capacity_ - end);
+	memcpy(data_ + end, p, first);
+	memcpy(data_, p + first, len - first);
+	size_ += len;
+}
+
+int ByteRing::WriteTo(int fd) {
+	if (size_ == 0) {
+		return 0;
+	}
+
+	adb_iovec iov[2];
+	size_t first = std::min(size_, capacity_ - start_);
+	iov[0].iov_base = data_ + start_;
+	iov[0].iov_len = first;
+	iov[1].iov_base = data_;
+	iov[1].iov_len = size_ - first;
+
+	int r = adb_writev(fd, iov, iov[1].iov_len > 0 ? 2 : 1);
+	if (r > 0) {
+		start_ = (start_ + r) % capacity_;
+		size_ -= r;
+		if (size_ == 0) {
+			Clear();
+		}
+	}
+	return r;
+}
+
+void ByteRing::Clear() {
+	free(data_);
+	data_ = nullptr;
+	capacity_ = 0;
+	start_ = 0;
+	size_ = 0;
+}
@@ -0,0 +1,71 @@
+/*
+ * Copyright (C) 2017 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __BYTE_RING_H
+#define __BYTE_RING_H
+
+#include <stddef.h>
+
+// A growable ring of bytes waiting to be written to an fd. A local socket copies what its peer
+// sends into one of these when its fd can't take it straight away, so that a backlog of small
+// packets holds only their payload rather than an apacket each, and drains with one writev().
+//
+// All zeroes is a valid empty ring, so one can live in a calloc()ed asocket; in that case the
+// owner must Clear() it before freeing.
+class ByteRing {
+public:
+	static constexpr size_t kMinCapacity = 4096;
+
+	ByteRing() = default;
+	~ByteRing() {
+		Clear();
+	}
+
+	ByteRing(const ByteRing&) = delete;
+	ByteRing& operator=(const ByteRing&) = delete;
+
+	size_t size() const {
+		return size_;
+	}
+	bool empty() const {
+		return size_ == 0;
+	}
+	// Bytes allocated, which is what the ring costs whatever it holds.
+	size_t capacity() const {
+		return capacity_;
+	}
+
+	// Copies |len| bytes onto the end, growing the buffer (to a power of two) if they don't fit.
+	void Append(const void* data, size_t len);
+
+	// Writes as much as |fd| takes with a single adb_writev(), and drops what was written.
+	// Returns adb_writev()'s result, or 0 if there was nothing to write. Once the ring is empty
+	// its buffer is freed, so an idle socket doesn't hold on to the peak of its backlog.
+	int WriteTo(int fd);
+
+	// Drops everything and frees the buffer.
+	void Clear();
+
+private:
+	void Grow(size_t min_capacity);
+
+	char* data_ = nullptr;
+	size_t capacity_ = 0;
+	size_t start_ = 0;
+	size_t size_ = 0;
+};
+
+#endif
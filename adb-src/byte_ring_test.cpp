@@ -0,0 +1,112 @@
+/*
+ * Copyright (C) 2017 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "byte_ring.h"
+
+#include <gtest/gtest.h>
+
+#include <errno.h>
+
+#include <string>
+
+#include "adb_io.h"
+#include "adb_utils.h"
+#include "sysdeps.h"
+
+class ByteRingTest : public ::testing::Test {
+protected:
+	void SetUp() override {
+		ASSERT_EQ(0, adb_socketpair(fds_));
+	}
+
+	void TearDown() override {
+		adb_close(fds_[0]);
+		adb_close(fds_[1]);
+	}
+
+	// Reads whatever is waiting on the other end of the socketpair.
+	std::string ReadAvailable() {
+		std::string result;
+		char buf[4096];
+		int r;
+		while ((r = adb_read(fds_[1], buf, sizeof(buf))) > 0) {
+			result.append(buf, r);
+		}
+		return result;
+	}
+
+	int fds_[2];
+};
+
+TEST_F(ByteRingTest, write_frees_buffer) {
+	ByteRing ring;
+	ASSERT_TRUE(ring.empty());
+	ASSERT_EQ(0u, ring.capacity());
+	ASSERT_EQ(0, ring.WriteTo(fds_[0]));
+
+	ring.Append("hello, ", 7);
+	ring.Append("world", 5);
+	ASSERT_EQ(12u, ring.size());
+	ASSERT_EQ(ByteRing::kMinCapacity, ring.capacity());
+
+	ASSERT_EQ(12, ring.WriteTo(fds_[0]));
+	ASSERT_TRUE(ring.empty());
+	ASSERT_EQ(0u, ring.capacity());
+
+	char buf[12];
+	ASSERT_TRUE(ReadFdExactly(fds_[1], buf, sizeof(buf)));
+	ASSERT_EQ("hello, world", std::string(buf, sizeof(buf)));
+}
+
+TEST_F(ByteRingTest, grows_to_power_of_two) {
+	ByteRing ring;
+	std::string data(ByteRing::kMinCapacity * 3, 'x');
+	ring.Append(data.data(), data.size());
+	ASSERT_EQ(ByteRing::kMinCapacity * 4, ring.capacity());
+
+	ring.Clear();
+	ASSERT_TRUE(ring.empty());
+	ASSERT_EQ(0u, ring.capacity());
+}
+
+// Appending while a nonblocking fd takes partial writes wraps the ring and grows it from a
+// wrapped state; the bytes must still come out in order.
+TEST_F(ByteRingTest, partial_writes) {
+	ASSERT_TRUE(set_file_block_mode(fds_[0], false));
+	ASSERT_TRUE(set_file_block_mode(fds_[1], false));
+
+	ByteRing ring;
+	std::string sent;
+	std::string received;
+	for (size_t i = 0; i < 2000; ++i) {
+		std::string chunk((i * 37) % 3000 + 1, 'a' + i % 26);
+		ring.Append(chunk.data(), chunk.size());
+		sent += chunk;
+
+		int r = ring.WriteTo(fds_[0]);
+		ASSERT_TRUE(r > 0 || (r == -1 && errno == EAGAIN));
+		if (i % 3 == 0) {
+			received += ReadAvailable();
+		}
+	}
+	while (!ring.empty()) {
+		int r = ring.WriteTo(fds_[0]);
+		ASSERT_TRUE(r > 0 || (r == -1 && errno == EAGAIN));
+		received += ReadAvailable();
+	}
+	received += ReadAvailable();
+	ASSERT_EQ(sent, received);
+}
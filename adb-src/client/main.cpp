@@ -25,6 +25,7 @@
 #include "../adb_listeners.h"
 #include "../adb_utils.h"
 #include "../commandline.h"
+#include "../packet_trace.h"
 #include "../sysdeps/chrono.h"
 #include "../transport.h"
 #include "../sysdeps.h"
@@ -81,6 +82,7 @@ int adb_server_main(int is_daemon, const std::string& socket_spec, int ack_reply
 
 	//android::base::at_quick_exit(adb_server_cleanup);
 
+	packet_trace_init();
 	init_transport_registration();
 	init_mdns_transport_discovery();
 
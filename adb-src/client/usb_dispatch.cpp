@@ -16,9 +16,14 @@
 
 #include <android-base/logging.h>
 #include "usb.h"
+#include "client/usb_mock.h"
 
 void usb_init() {
-	if (should_use_libusb()) {
+	if (should_use_mock_usb()) {
+		LOG(DEBUG) << "using mock backend";
+		mock::usb_init();
+	}
+	else if (should_use_libusb()) {
 		LOG(DEBUG) << "using libusb backend";
 		libusb::usb_init();
 	}
@@ -29,7 +34,10 @@ void usb_init() {
 }
 
 void usb_cleanup() {
-	if (should_use_libusb()) {
+	if (should_use_mock_usb()) {
+		mock::usb_cleanup();
+	}
+	else if (should_use_libusb()) {
 		libusb::usb_cleanup();
 	}
 	else {
@@ -38,28 +46,44 @@ void usb_cleanup() {
 }
 
 int usb_write(usb_handle* h, const void* data, int len) {
+	if (should_use_mock_usb()) {
+		return mock::usb_write(reinterpret_cast<mock::usb_handle*>(h), data, len);
+	}
 	return should_use_libusb()
 		? libusb::usb_write(reinterpret_cast<libusb::usb_handle*>(h), data, len)
 		: native::usb_write(reinterpret_cast<native::usb_handle*>(h), data, len);
 }
 
 int usb_read(usb_handle* h, void* data, int len) {
+	if (should_use_mock_usb()) {
+		return mock::usb_read(reinterpret_cast<mock::usb_handle*>(h), data, len);
+	}
 	return should_use_libusb()
 		? libusb::usb_read(reinterpret_cast<libusb::usb_handle*>(h), data, len)
 		: native::usb_read(reinterpret_cast<native::usb_handle*>(h), data, len);
 }
 
 int usb_close(usb_handle* h) {
+	if (should_use_mock_usb()) {
+		return mock::usb_close(reinterpret_cast<mock::usb_handle*>(h));
+	}
 	return should_use_libusb() ? libusb::usb_close(reinterpret_cast<libusb::usb_handle*>(h))
 		: native::usb_close(reinterpret_cast<native::usb_handle*>(h));
 }
 
 void usb_kick(usb_handle* h) {
+	if (should_use_mock_usb()) {
+		mock::usb_kick(reinterpret_cast<mock::usb_handle*>(h));
+		return;
+	}
 	should_use_libusb() ? libusb::usb_kick(reinterpret_cast<libusb::usb_handle*>(h))
 		: native::usb_kick(reinterpret_cast<native::usb_handle*>(h));
 }
 
 size_t usb_get_max_packet_size(usb_handle* h) {
+	if (should_use_mock_usb()) {
+		return mock::usb_get_max_packet_size(reinterpret_cast<mock::usb_handle*>(h));
+	}
 	return should_use_libusb()
 		? libusb::usb_get_max_packet_size(reinterpret_cast<libusb::usb_handle*>(h))
 		: native::usb_get_max_packet_size(reinterpret_cast<native::usb_handle*>(h));
@@ -0,0 +1,218 @@
+/*
+ * Copyright (C) 2017 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define TRACE_TAG USB
+
+#include "sysdeps.h"
+#include "client/usb_mock.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+
+#include <android-base/logging.h>
+
+#include "adb.h"
+#include "transport.h"
+
+bool should_use_mock_usb() {
+	static bool enable = getenv("ADB_USB_MOCK") && strcmp(getenv("ADB_USB_MOCK"), "1") == 0;
+	return enable;
+}
+
+namespace mock {
+	// Packets in flight in one direction.
+	struct Endpoint {
+		std::deque<std::string> packets;
+	};
+
+	struct usb_handle : public ::usb_handle {
+		std::string serial;
+		MockUsbOptions options;
+
+		std::mutex mutex;
+		std::condition_variable cv;
+		Endpoint in;  // Device to host.
+		Endpoint out;  // Host to device.
+		uint64_t transfers = 0;
+		bool disconnected = false;
+		std::mt19937 random;
+
+		// Released by usb_close() on the host side, and device_release() on the other.
+		std::atomic<int> refs{ 2 };
+	};
+
+	static void release(usb_handle* h) {
+		if (--h->refs == 0) {
+			delete h;
+		}
+	}
+
+	// Called with |h->mutex| held at the start of every transfer.
+	static bool start_transfer(usb_handle* h) {
+		if (h->disconnected) {
+			errno = ENODEV;
+			return false;
+		}
+		if (h->options.disconnect_after_transfers != 0 &&
+			++h->transfers > h->options.disconnect_after_transfers) {
+			D("mock usb %s: disconnecting after %" PRIu64 " transfers", h->serial.c_str(),
+				h->options.disconnect_after_transfers);
+			h->disconnected = true;
+			h->cv.notify_all();
+			errno = ENODEV;
+			return false;
+		}
+		return true;
+	}
+
+	static void delay(usb_handle* h) {
+		if (h->options.latency.count() != 0) {
+			std::this_thread::sleep_for(h->options.latency);
+		}
+	}
+
+	static int write_endpoint(usb_handle* h, Endpoint* endpoint, const void* data, int len) {
+		delay(h);
+		std::lock_guard<std::mutex> lock(h->mutex);
+		if (!start_transfer(h)) return -1;
+
+		const char* p = static_cast<const char*>(data);
+		size_t packet_size = h->options.max_packet_size;
+		for (int offset = 0; offset < len; offset += packet_size) {
+			endpoint->packets.emplace_back(p + offset, std::min<size_t>(packet_size, len - offset));
+		}
+		h->cv.notify_all();
+		return 0;
+	}
+
+	static int read_endpoint(usb_handle* h, Endpoint* endpoint, void* data, int len,
+		bool allow_short_reads) {
+		delay(h);
+		std::unique_lock<std::mutex> lock(h->mutex);
+		if (!start_transfer(h)) return -1;
+
+		char* p = static_cast<char*>(data);
+		size_t packet_size = h->options.max_packet_size;
+		int result = 0;
+		while (result < len) {
+			h->cv.wait(lock, [h, endpoint]() {
+				return h->disconnected || !endpoint->packets.empty();
+			});
+			if (h->disconnected) {
+				errno = ENODEV;
+				return -1;
+			}
+
+			std::string& packet = endpoint->packets.front();
+			if (packet.size() > static_cast<size_t>(len - result)) {
+				// The rest of the packet is lost, as it would be on real hardware.
+				D("mock usb %s: %zu-byte packet overflows %d-byte read", h->serial.c_str(),
+					packet.size(), len - result);
+				endpoint->packets.pop_front();
+				errno = EOVERFLOW;
+				return -1;
+			}
+
+			if (allow_short_reads && packet.size() > 1 &&
+				std::uniform_real_distribution<double>(0, 100)(h->random) <
+				h->options.short_read_percent) {
+				size_t split = packet.size() / 2;
+				memcpy(p + result, packet.data(), split);
+				packet.erase(0, split);
+				return result + split;
+			}
+
+			memcpy(p + result, packet.data(), packet.size());
+			result += packet.size();
+			bool short_packet = packet.size() < packet_size;
+			endpoint->packets.pop_front();
+			if (short_packet) break;
+		}
+		return result;
+	}
+
+	usb_handle* create(const std::string& serial, const MockUsbOptions& options) {
+		usb_handle* h = new usb_handle();
+		h->serial = serial;
+		h->options = options;
+		h->random.seed(std::hash<std::string>()(serial));
+		return h;
+	}
+
+	usb_handle* attach(const std::string& serial, const MockUsbOptions& options) {
+		CHECK(should_use_mock_usb()) << "mock usb devices need ADB_USB_MOCK=1";
+		usb_handle* h = create(serial, options);
+		register_usb_transport(h, serial.c_str(), nullptr, 1);
+		return h;
+	}
+
+	int device_read(usb_handle* h, void* data, int len) {
+		return read_endpoint(h, &h->out, data, len, false);
+	}
+
+	int device_write(usb_handle* h, const void* data, int len) {
+		return write_endpoint(h, &h->in, data, len);
+	}
+
+	void disconnect(usb_handle* h) {
+		std::lock_guard<std::mutex> lock(h->mutex);
+		h->disconnected = true;
+		h->cv.notify_all();
+	}
+
+	void device_release(usb_handle* h) {
+		disconnect(h);
+		release(h);
+	}
+
+	void usb_init() {
+	}
+
+	void usb_cleanup() {
+	}
+
+	int usb_write(usb_handle* h, const void* data, int len) {
+		return write_endpoint(h, &h->out, data, len);
+	}
+
+	int usb_read(usb_handle* h, void* data, int len) {
+		return read_endpoint(h, &h->in, data, len, true);
+	}
+
+	int usb_close(usb_handle* h) {
+		release(h);
+		return 0;
+	}
+
+	void usb_kick(usb_handle* h) {
+		disconnect(h);
+	}
+
+	size_t usb_get_max_packet_size(usb_handle* h) {
+		return h->options.max_packet_size;
+	}
+}  // namespace mock
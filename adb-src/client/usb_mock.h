@@ -0,0 +1,71 @@
+/*
+ * Copyright (C) 2017 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <chrono>
+#include <string>
+
+#include "usb.h"
+
+// An in-memory USB backend, selected with ADB_USB_MOCK=1, for exercising the USB host path
+// (transport_usb.cpp) without hardware. Nothing is ever found by scanning; instead, whatever
+// plays the device calls mock::attach(), and then talks to the host through the device_*
+// functions.
+//
+// Each direction behaves like a bulk endpoint: a transfer is cut into max_packet_size packets,
+// with no zero-length packet after a transfer that's a multiple of the packet size. A read
+// completes when it gets a short packet or fills its buffer, and fails with EOVERFLOW if the
+// next packet doesn't fit, as it would with libusb.
+
+struct MockUsbOptions {
+	size_t max_packet_size = 512;
+
+	// Added to every transfer, in either direction.
+	std::chrono::microseconds latency{ 0 };
+
+	// Chance of a host read ending early, by splitting the packet it's on in two.
+	double short_read_percent = 0;
+
+	// Disconnect after this many transfers, in either direction (0 for never).
+	uint64_t disconnect_after_transfers = 0;
+};
+
+bool should_use_mock_usb();
+
+namespace mock {
+	// Makes a device without plugging it in, for testing the endpoints themselves.
+	usb_handle* create(const std::string& serial, const MockUsbOptions& options);
+
+	// Plugs in a device, which shows up as a usb transport with |serial|. The handle stays valid
+	// until the device side calls device_release(), however long the host keeps it. Only for use
+	// when should_use_mock_usb().
+	usb_handle* attach(const std::string& serial, const MockUsbOptions& options);
+
+	// The device's ends of the endpoints, with the same semantics as the host's: device_read()
+	// returns the number of bytes read, device_write() returns 0, and both return -1 with errno
+	// set once the device has been disconnected.
+	int device_read(usb_handle* h, void* data, int len);
+	int device_write(usb_handle* h, const void* data, int len);
+
+	// Unplugs the device: pending and later transfers fail on both sides.
+	void disconnect(usb_handle* h);
+
+	void device_release(usb_handle* h);
+}  // namespace mock
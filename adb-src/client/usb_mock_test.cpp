@@ -0,0 +1,116 @@
+/*
+ * Copyright (C) 2017 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "client/usb_mock.h"
+
+#include <gtest/gtest.h>
+
+#include <errno.h>
+
+#include <string>
+#include <thread>
+
+class MockUsbTest : public ::testing::Test {
+protected:
+	void Create(const MockUsbOptions& options = MockUsbOptions()) {
+		h_ = mock::create("mock", options);
+	}
+
+	void TearDown() override {
+		if (h_) {
+			mock::usb_close(h_);
+			mock::device_release(h_);
+		}
+	}
+
+	mock::usb_handle* h_ = nullptr;
+};
+
+TEST_F(MockUsbTest, short_packet_ends_transfer) {
+	Create();
+	std::string data(700, 'x');
+	ASSERT_EQ(0, mock::device_write(h_, data.data(), data.size()));
+	ASSERT_EQ(0, mock::device_write(h_, "y", 1));
+
+	char buf[2048];
+	ASSERT_EQ(700, mock::usb_read(h_, buf, sizeof(buf)));
+	ASSERT_EQ(1, mock::usb_read(h_, buf, sizeof(buf)));
+	ASSERT_EQ('y', buf[0]);
+}
+
+TEST_F(MockUsbTest, no_zero_length_packet) {
+	Create();
+	std::string data(512, 'x');
+	ASSERT_EQ(0, mock::device_write(h_, data.data(), data.size()));
+	ASSERT_EQ(0, mock::device_write(h_, "y", 1));
+
+	// A read that isn't rounded to what's expected runs into the next transfer.
+	char buf[2048];
+	ASSERT_EQ(513, mock::usb_read(h_, buf, sizeof(buf)));
+}
+
+TEST_F(MockUsbTest, overflow) {
+	Create();
+	std::string data(100, 'x');
+	ASSERT_EQ(0, mock::device_write(h_, data.data(), data.size()));
+
+	char buf[24];
+	errno = 0;
+	ASSERT_EQ(-1, mock::usb_read(h_, buf, sizeof(buf)));
+	ASSERT_EQ(EOVERFLOW, errno);
+}
+
+TEST_F(MockUsbTest, host_to_device) {
+	Create();
+	ASSERT_EQ(0, mock::usb_write(h_, "hello", 5));
+
+	char buf[512];
+	ASSERT_EQ(5, mock::device_read(h_, buf, sizeof(buf)));
+	ASSERT_EQ("hello", std::string(buf, 5));
+}
+
+TEST_F(MockUsbTest, short_reads) {
+	MockUsbOptions options;
+	options.short_read_percent = 100;
+	Create(options);
+	ASSERT_EQ(0, mock::device_write(h_, "abcd", 4));
+
+	char buf[512];
+	ASSERT_EQ(2, mock::usb_read(h_, buf, sizeof(buf)));
+	ASSERT_EQ(1, mock::usb_read(h_, buf, sizeof(buf)));
+	ASSERT_EQ('c', buf[0]);
+}
+
+TEST_F(MockUsbTest, disconnect_after_transfers) {
+	MockUsbOptions options;
+	options.disconnect_after_transfers = 1;
+	Create(options);
+	ASSERT_EQ(0, mock::usb_write(h_, "x", 1));
+
+	errno = 0;
+	ASSERT_EQ(-1, mock::usb_write(h_, "x", 1));
+	ASSERT_EQ(ENODEV, errno);
+}
+
+TEST_F(MockUsbTest, kick_wakes_reader) {
+	Create();
+	std::thread reader([this]() {
+		char buf[512];
+		ASSERT_EQ(-1, mock::usb_read(h_, buf, sizeof(buf)));
+	});
+	mock::usb_kick(h_);
+	reader.join();
+}
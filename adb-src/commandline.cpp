@@ -58,6 +58,7 @@
 #include "bugreport.h"
 #include "commandline.h"
 #include "file_sync_service.h"
+#include "packet_trace.h"
 #include "services.h"
 #include "shell_service.h"
 #include "sysdeps/chrono.h"
@@ -126,12 +127,14 @@ static void help() {
 		" reverse --remove-all     remove all reverse socket connections from device\n"
 		"\n"
 		"file transfer:\n"
-		" push [--sync] LOCAL... REMOTE\n"
+		" push [--sync] [--resume] LOCAL... REMOTE\n"
 		"     copy local files/directories to device\n"
 		"     --sync: only push files that are newer on the host than the device\n"
-		" pull [-a] REMOTE... LOCAL\n"
+		"     --resume: continue interrupted pushes of partially-copied files\n"
+		" pull [-a] [--resume] REMOTE... LOCAL\n"
 		"     copy files/dirs from device\n"
 		"     -a: preserve file timestamp and mode\n"
+		"     --resume: continue interrupted pulls of partially-copied files\n"
 		" sync [system|vendor|oem|data|all]\n"
 		"     sync a local build from $ANDROID_PRODUCT_OUT to the device (default all)\n"
 		"     -l: list but don't copy\n"
@@ -180,8 +183,8 @@ static void help() {
 		"     public key stored in FILE.pub (existing files overwritten)\n"
 		"\n"
 		"scripting:\n"
-		" wait-for[-TRANSPORT]-STATE\n"
-		"     wait for device to be in the given state\n"
+		" wait-for[-TRANSPORT]-STATE [--timeout SECONDS]\n"
+		"     wait for device to be in the given state, failing after SECONDS if given\n"
 		"     State: device, recovery, sideload, or bootloader\n"
 		"     Transport: usb, local, or any [default=any]\n"
 		" get-state                print offline | bootloader | device\n"
@@ -206,6 +209,15 @@ static void help() {
 		" reconnect                kick connection from host side to force reconnect\n"
 		" reconnect device         kick connection from device side to force reconnect\n"
 		" reconnect offline        reset offline/unauthorized devices to force reconnect\n"
+		" packet-trace [FILE]\n"
+		"     write the server's recent packets to FILE for adb_packet_trace\n"
+		"     [default=~/.android/adb_packet_trace.PID, with this adb's PID]\n"
+		" stats                    show the server's per-device and per-socket traffic counters\n"
+		" packet-memory            show how much memory the server's queued packets hold\n"
+		" service-pool             show the server's service threads and queue\n"
+		" fdevent-profile [start [MS]|stop]\n"
+		"     show the server's main loop profile, or start it (logging calls slower than\n"
+		"     MS [default=50]) or stop it\n"
 		"\n"
 		"environment variables:\n"
 		" $ADB_TRACE\n"
@@ -213,7 +225,15 @@ static void help() {
 		"     all,adb,sockets,packets,rwx,usb,sync,sysdeps,transport,jdwp\n"
 		" $ADB_VENDOR_KEYS         colon-separated list of keys (files or directories)\n"
 		" $ANDROID_SERIAL          serial number to connect to (see -s)\n"
-		" $ANDROID_LOG_TAGS        tags to be used by logcat (see logcat --help)\n");
+		" $ANDROID_LOG_TAGS        tags to be used by logcat (see logcat --help)\n"
+		" $ADB_PACKET_TRACE_PAYLOAD\n"
+		"     bytes of each packet's payload to keep for packet-trace (0-16) [default=0]\n"
+		" $ADB_FDEVENT_PROFILE     profile the server's main loop from startup, logging calls\n"
+		"     slower than this many milliseconds (see fdevent-profile)\n"
+		" $ADB_PACKET_MEMORY_MB    memory the server's queued packets may hold before it slows\n"
+		"     streams down, a quarter of it per device [default=1024]\n"
+		" $ADB_COALESCE_MS         how long the server holds small writes to forwarded ports\n"
+		"     and other bulk streams, to send them together (0 for never) [default=1]\n");
 	// clang-format on
 }
 
@@ -998,7 +1018,8 @@ static int ppp(int argc, const char** argv) {
 #endif /* !defined(_WIN32) */
 }
 
-static bool wait_for_device(const char* service, TransportType t, const char* serial) {
+static bool wait_for_device(const char* service, TransportType t, const char* serial,
+	int64_t timeout_seconds = -1) {
 	std::vector<std::string> components = android::base::Split(service, "-");
 	if (components.size() < 3 || components.size() > 4) {
 		fprintf(stderr, "adb: couldn't parse 'wait-for' command: %s\n", service);
@@ -1034,7 +1055,11 @@ static bool wait_for_device(const char* service, TransportType t, const char* se
 		return false;
 	}
 
-	std::string cmd = format_host_command(android::base::Join(components, "-").c_str(), t, serial);
+	std::string request = android::base::Join(components, "-");
+	if (timeout_seconds >= 0) {
+		request += android::base::StringPrintf(":%" PRId64, timeout_seconds * 1000);
+	}
+	std::string cmd = format_host_command(request.c_str(), t, serial);
 	return adb_command(cmd);
 }
 
@@ -1260,8 +1285,9 @@ static int restore(int argc, const char** argv) {
 }
 
 static void parse_push_pull_args(const char** arg, int narg, std::vector<const char*>* srcs,
-	const char** dst, bool* copy_attrs, bool* sync) {
+	const char** dst, bool* copy_attrs, bool* sync, bool* resume) {
 	*copy_attrs = false;
+	*resume = false;
 
 	srcs->clear();
 	bool ignore_flags = false;
@@ -1281,6 +1307,9 @@ static void parse_push_pull_args(const char** arg, int narg, std::vector<const c
 					*sync = true;
 				}
 			}
+			else if (!strcmp(*arg, "--resume")) {
+				*resume = true;
+			}
 			else if (!strcmp(*arg, "--")) {
 				ignore_flags = true;
 			}
@@ -1311,6 +1340,38 @@ static int adb_connect_command(const std::string& command) {
 	return 0;
 }
 
+// Fetches the server's packet trace, and writes it to |path|.
+static int adb_packet_trace(const std::string& path) {
+	std::string error;
+	unique_fd fd(adb_connect("host:packet-trace", &error));
+	if (fd < 0) {
+		fprintf(stderr, "error: %s\n", error.c_str());
+		return 1;
+	}
+
+	std::string contents;
+	char buf[BUFSIZ];
+	int rc;
+	while ((rc = adb_read(fd, buf, sizeof(buf))) > 0) {
+		contents.append(buf, rc);
+	}
+	PacketTraceHeader header;
+	if (rc < 0 || contents.size() < sizeof(header)) {
+		fprintf(stderr, "adb: failed to read packet trace: %s\n",
+			rc < 0 ? strerror(errno) : "connection closed");
+		return 1;
+	}
+	memcpy(&header, contents.data(), sizeof(header));
+
+	if (!android::base::WriteStringToFile(contents, path)) {
+		fprintf(stderr, "adb: couldn't write packet trace to '%s': %s\n", path.c_str(),
+			strerror(errno));
+		return 1;
+	}
+	printf("wrote %u packets to %s\n", header.record_count, path.c_str());
+	return 0;
+}
+
 static int adb_query_command(const std::string& command) {
 	std::string result;
 	std::string error;
@@ -1511,7 +1572,18 @@ int adb_commandline(int argc, const char** argv) {
 	if (!strncmp(argv[0], "wait-for-", strlen("wait-for-"))) {
 		const char* service = argv[0];
 
-		if (!wait_for_device(service, transport_type, serial)) {
+		// The server takes the timeout in milliseconds, and needs it to fit in nanoseconds too.
+		int64_t timeout_seconds = -1;
+		if (argc >= 2 && !strcmp(argv[1], "--timeout")) {
+			if (argc < 3 || !android::base::ParseInt(argv[2], &timeout_seconds, int64_t(0),
+								INT64_MAX / 1000000 / 1000)) {
+				return syntax_error("adb %s --timeout SECONDS", service);
+			}
+			argc -= 2;
+			argv += 2;
+		}
+
+		if (!wait_for_device(service, transport_type, serial, timeout_seconds)) {
 			return 1;
 		}
 
@@ -1716,21 +1788,23 @@ int adb_commandline(int argc, const char** argv) {
 	else if (!strcmp(argv[0], "push")) {
 		bool copy_attrs = false;
 		bool sync = false;
+		bool resume = false;
 		std::vector<const char*> srcs;
 		const char* dst = nullptr;
 
-		parse_push_pull_args(&argv[1], argc - 1, &srcs, &dst, &copy_attrs, &sync);
+		parse_push_pull_args(&argv[1], argc - 1, &srcs, &dst, &copy_attrs, &sync, &resume);
 		if (srcs.empty() || !dst) return syntax_error("push requires an argument");
-		return do_sync_push(srcs, dst, sync) ? 0 : 1;
+		return do_sync_push(srcs, dst, sync, resume) ? 0 : 1;
 	}
 	else if (!strcmp(argv[0], "pull")) {
 		bool copy_attrs = false;
+		bool resume = false;
 		std::vector<const char*> srcs;
 		const char* dst = ".";
 
-		parse_push_pull_args(&argv[1], argc - 1, &srcs, &dst, &copy_attrs, nullptr);
+		parse_push_pull_args(&argv[1], argc - 1, &srcs, &dst, &copy_attrs, nullptr, &resume);
 		if (srcs.empty()) return syntax_error("pull requires an argument");
-		return do_sync_pull(srcs, dst, copy_attrs) ? 0 : 1;
+		return do_sync_pull(srcs, dst, copy_attrs, nullptr, resume) ? 0 : 1;
 	}
 	else if (!strcmp(argv[0], "install")) {
 		if (argc < 2) return syntax_error("install requires an argument");
@@ -1892,6 +1966,37 @@ int adb_commandline(int argc, const char** argv) {
 			}
 		}
 	}
+	else if (!strcmp(argv[0], "packet-trace")) {
+		if (argc > 2) return syntax_error("adb packet-trace [FILE]");
+		return adb_packet_trace(argc == 2 ? argv[1] : packet_trace_default_path());
+	}
+	else if (!strcmp(argv[0], "fdevent-profile")) {
+		if (argc == 1) {
+			return adb_query_command("host:fdevent-profile");
+		}
+		else if (argc == 2 && !strcmp(argv[1], "start")) {
+			return adb_query_command("host:fdevent-profile:start");
+		}
+		else if (argc == 3 && !strcmp(argv[1], "start")) {
+			return adb_query_command(std::string("host:fdevent-profile:start:") + argv[2]);
+		}
+		else if (argc == 2 && !strcmp(argv[1], "stop")) {
+			return adb_query_command("host:fdevent-profile:stop");
+		}
+		return syntax_error("adb fdevent-profile [start [MS]|stop]");
+	}
+	else if (!strcmp(argv[0], "stats")) {
+		if (argc != 1) return syntax_error("adb stats");
+		return adb_query_command("host:stats");
+	}
+	else if (!strcmp(argv[0], "packet-memory")) {
+		if (argc != 1) return syntax_error("adb packet-memory");
+		return adb_query_command("host:packet-memory");
+	}
+	else if (!strcmp(argv[0], "service-pool")) {
+		if (argc != 1) return syntax_error("adb service-pool");
+		return adb_query_command("host:service-pool");
+	}
 
 	syntax_error("unknown command %s", argv[0]);
 	return 1;
@@ -43,6 +43,7 @@
 #include "adb_auth.h"
 #include "adb_listeners.h"
 #include "adb_utils.h"
+#include "packet_trace.h"
 #include "transport.h"
 
 #include "mdns.h"
@@ -156,6 +157,7 @@ int adbd_main(int server_port) {
 
 	signal(SIGPIPE, SIG_IGN);
 
+	packet_trace_init();
 	init_transport_registration();
 
 	// We need to call this even if auth isn't enabled because the file
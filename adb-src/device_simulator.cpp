@@ -0,0 +1,765 @@
+/*
+ * Copyright (C) 2017 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// adb_device_simulator: pretends to be any number of adbds, for scale testing the host server.
+// Each simulated device listens on its own port on 127.0.0.1, and speaks the adb protocol to
+// whatever connects to it, as the server does on `adb connect 127.0.0.1:PORT` (or when
+// --connect asks it to). A device offers:
+//
+//     shell:          echoes its input back; "shell:echo ARGS" prints ARGS
+//     sync:           STAT, LIST, SEND and RECV, on files under ROOT/PORT
+//
+// A link profile shapes everything the devices send: a fixed latency, a bandwidth limit, and
+// packet loss. There's no loss on a TCP connection, only retransmission, so a lost packet (and
+// everything queued behind it) is delayed by a retransmission timeout instead.
+//
+// Devices offer windowed streams (the stream_window feature) unless --no-stream-window makes
+// them behave like older adbds, which wait for a READY after every WRITE.
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <utime.h>
+
+#include <algorithm>
+#include <chrono>
+#include <deque>
+#include <map>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <android-base/parsedouble.h>
+#include <android-base/parseint.h>
+#include <android-base/stringprintf.h>
+#include <android-base/strings.h>
+
+#include "adb.h"
+#include "adb_auth.h"
+#include "file_sync_service.h"
+
+using Clock = std::chrono::steady_clock;
+
+// kFeatureStreamWindow, which lives in transport.cpp; the simulator only links libbase.
+static constexpr char kStreamWindowFeature[] = "stream_window";
+
+struct LinkProfile {
+	const char* name;
+	int latency_ms;
+	int bandwidth_kbps;  // 0 for unlimited.
+	double loss_percent;
+};
+
+static const LinkProfile kProfiles[] = {
+	{ "local", 0, 0, 0 },
+	{ "usb2", 1, 280000, 0 },
+	{ "wifi", 5, 40000, 0.1 },
+	{ "slow", 50, 8000, 1 },
+};
+
+// A lost packet costs about one minimum TCP retransmission timeout.
+static constexpr auto kRetransmitDelay = std::chrono::milliseconds(200);
+
+struct Options {
+	int devices = 1;
+	int base_port = 6000;
+	bool auth = false;
+	bool connect = false;
+	bool stream_window = true;
+	std::string root;
+	LinkProfile profile = kProfiles[0];
+};
+
+static Options options;
+
+static bool ReadFully(int fd, void* buf, size_t len) {
+	char* p = static_cast<char*>(buf);
+	while (len > 0) {
+		ssize_t rc = TEMP_FAILURE_RETRY(read(fd, p, len));
+		if (rc <= 0) return false;
+		p += rc;
+		len -= rc;
+	}
+	return true;
+}
+
+static bool WriteFully(int fd, const void* buf, size_t len) {
+	const char* p = static_cast<const char*>(buf);
+	while (len > 0) {
+		ssize_t rc = TEMP_FAILURE_RETRY(write(fd, p, len));
+		if (rc <= 0) return false;
+		p += rc;
+		len -= rc;
+	}
+	return true;
+}
+
+static bool MakeDirectories(const std::string& path) {
+	for (size_t i = 1; i <= path.size(); ++i) {
+		if (i == path.size() || path[i] == '/') {
+			std::string dir = path.substr(0, i);
+			if (mkdir(dir.c_str(), 0755) == -1 && errno != EEXIST) return false;
+		}
+	}
+	return true;
+}
+
+static void ShellService(int fd, std::string command) {
+	if (command.empty()) {
+		char buf[4096];
+		ssize_t rc;
+		while ((rc = TEMP_FAILURE_RETRY(read(fd, buf, sizeof(buf)))) > 0) {
+			if (!WriteFully(fd, buf, rc)) break;
+		}
+	}
+	else {
+		std::string output;
+		if (command == "echo" || android::base::StartsWith(command, "echo ")) {
+			output = command.substr(std::min<size_t>(5, command.size())) + "\n";
+		}
+		else {
+			output = "/system/bin/sh: " + command.substr(0, command.find(' ')) + ": not found\n";
+		}
+		WriteFully(fd, output.data(), output.size());
+	}
+	close(fd);
+}
+
+static bool SyncFail(int fd, const std::string& reason) {
+	syncmsg msg;
+	msg.status.id = ID_FAIL;
+	msg.status.msglen = reason.size();
+	return WriteFully(fd, &msg.status, sizeof(msg.status)) &&
+		WriteFully(fd, reason.data(), reason.size());
+}
+
+static bool SyncStat(int fd, const std::string& path) {
+	syncmsg msg = {};
+	msg.stat_v1.id = ID_LSTAT_V1;
+	struct stat st;
+	if (lstat(path.c_str(), &st) == 0) {
+		msg.stat_v1.mode = st.st_mode;
+		msg.stat_v1.size = st.st_size;
+		msg.stat_v1.time = st.st_mtime;
+	}
+	return WriteFully(fd, &msg.stat_v1, sizeof(msg.stat_v1));
+}
+
+static bool SyncList(int fd, const std::string& path) {
+	syncmsg msg = {};
+	msg.dent.id = ID_DENT;
+	DIR* dir = opendir(path.c_str());
+	if (dir) {
+		while (dirent* de = readdir(dir)) {
+			struct stat st;
+			std::string name = de->d_name;
+			if (lstat((path + "/" + name).c_str(), &st) != 0) continue;
+			msg.dent.mode = st.st_mode;
+			msg.dent.size = st.st_size;
+			msg.dent.time = st.st_mtime;
+			msg.dent.namelen = name.size();
+			if (!WriteFully(fd, &msg.dent, sizeof(msg.dent)) ||
+				!WriteFully(fd, name.data(), name.size())) {
+				closedir(dir);
+				return false;
+			}
+		}
+		closedir(dir);
+	}
+	msg = {};
+	msg.dent.id = ID_DONE;
+	return WriteFully(fd, &msg.dent, sizeof(msg.dent));
+}
+
+// |spec| is "<path>,<mode>". Like adbd, reads the whole data stream even if it can't be written.
+static bool SyncSend(int fd, const std::string& spec, std::vector<char>& buffer) {
+	size_t comma = spec.rfind(',');
+	std::string path = spec.substr(0, comma);
+	unsigned mode = 0644;
+	if (comma != std::string::npos) {
+		android::base::ParseUint(spec.substr(comma + 1), &mode);
+	}
+
+	std::string error;
+	size_t slash = path.rfind('/');
+	if (slash != std::string::npos && slash > 0 && !MakeDirectories(path.substr(0, slash))) {
+		error = android::base::StringPrintf("mkdir failed: %s", strerror(errno));
+	}
+	int file_fd = -1;
+	if (error.empty()) {
+		file_fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, mode & 0777);
+		if (file_fd == -1) error = android::base::StringPrintf("open failed: %s", strerror(errno));
+	}
+
+	while (true) {
+		syncmsg msg;
+		if (!ReadFully(fd, &msg.data, sizeof(msg.data))) {
+			if (file_fd != -1) close(file_fd);
+			return false;
+		}
+		if (msg.data.id == ID_DONE) {
+			if (file_fd != -1) {
+				close(file_fd);
+				struct utimbuf times = { static_cast<time_t>(msg.data.size),
+					static_cast<time_t>(msg.data.size) };
+				utime(path.c_str(), &times);
+			}
+			break;
+		}
+		if (msg.data.id != ID_DATA || msg.data.size > SYNC_DATA_MAX ||
+			!ReadFully(fd, buffer.data(), msg.data.size)) {
+			if (file_fd != -1) close(file_fd);
+			return false;
+		}
+		if (file_fd != -1 && error.empty() && !WriteFully(file_fd, buffer.data(), msg.data.size)) {
+			error = android::base::StringPrintf("write failed: %s", strerror(errno));
+		}
+	}
+
+	if (!error.empty()) return SyncFail(fd, error);
+	syncmsg msg;
+	msg.status.id = ID_OKAY;
+	msg.status.msglen = 0;
+	return WriteFully(fd, &msg.status, sizeof(msg.status));
+}
+
+static bool SyncRecv(int fd, const std::string& path, std::vector<char>& buffer) {
+	int file_fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+	if (file_fd == -1) {
+		return SyncFail(fd, android::base::StringPrintf("open failed: %s", strerror(errno)));
+	}
+
+	syncmsg msg;
+	msg.data.id = ID_DATA;
+	while (true) {
+		ssize_t rc = TEMP_FAILURE_RETRY(read(file_fd, buffer.data(), SYNC_DATA_MAX));
+		if (rc == 0) break;
+		if (rc == -1) {
+			close(file_fd);
+			return SyncFail(fd, android::base::StringPrintf("read failed: %s", strerror(errno)));
+		}
+		msg.data.size = rc;
+		if (!WriteFully(fd, &msg.data, sizeof(msg.data)) || !WriteFully(fd, buffer.data(), rc)) {
+			close(file_fd);
+			return false;
+		}
+	}
+	close(file_fd);
+
+	msg.data.id = ID_DONE;
+	msg.data.size = 0;
+	return WriteFully(fd, &msg.data, sizeof(msg.data));
+}
+
+static void SyncService(int fd, std::string root) {
+	std::vector<char> buffer(SYNC_DATA_MAX);
+	while (true) {
+		SyncRequest request;
+		char name[1025];
+		if (!ReadFully(fd, &request, sizeof(request)) || request.path_length > 1024 ||
+			!ReadFully(fd, name, request.path_length)) {
+			break;
+		}
+		name[request.path_length] = '\0';
+		std::string path = root + (name[0] == '/' ? "" : "/") + name;
+
+		bool ok;
+		switch (request.id) {
+		case ID_LSTAT_V1: ok = SyncStat(fd, path); break;
+		case ID_LIST: ok = SyncList(fd, path); break;
+		case ID_SEND: ok = SyncSend(fd, path, buffer); break;
+		case ID_RECV: ok = SyncRecv(fd, path, buffer); break;
+		case ID_QUIT: ok = false; break;
+		default:
+			SyncFail(fd, android::base::StringPrintf("unsupported command %08x", request.id));
+			ok = false;
+			break;
+		}
+		if (!ok) break;
+	}
+	close(fd);
+}
+
+// One simulated device's end of a connection from the server. Each open stream runs its service
+// on a thread of its own, behind a socketpair; this multiplexes them onto the connection.
+class Device {
+public:
+	Device(int fd, int port)
+		: fd_(fd), root_(android::base::StringPrintf("%s/%d", options.root.c_str(), port)),
+		random_(port) {}
+
+	void Run() {
+		while (Poll()) {
+		}
+		for (auto& it : streams_) {
+			close(it.second.fd);
+		}
+		close(fd_);
+	}
+
+private:
+	struct Stream {
+		uint32_t host_id;
+		int fd;
+		bool can_send = true;
+		std::string pending;  // Received from the host, not yet taken by the service.
+
+		// Windowed flow control; zero send_window for a legacy stream.
+		uint32_t send_window = 0;
+		size_t send_unacked = 0;
+		uint32_t recv_unacked = 0;
+	};
+
+	struct Outgoing {
+		Clock::time_point due;
+		std::string bytes;
+	};
+
+	// Queues a packet for sending once the link profile says it would have arrived.
+	void Send(uint32_t command, uint32_t arg0, uint32_t arg1, const void* data = nullptr,
+		size_t length = 0) {
+		amessage msg;
+		msg.command = command;
+		msg.arg0 = arg0;
+		msg.arg1 = arg1;
+		msg.data_length = length;
+		msg.data_check = 0;
+		for (size_t i = 0; i < length; ++i) {
+			msg.data_check += static_cast<const uint8_t*>(data)[i];
+		}
+		msg.magic = command ^ 0xffffffff;
+
+		Outgoing out;
+		out.bytes.assign(reinterpret_cast<const char*>(&msg), sizeof(msg));
+		out.bytes.append(static_cast<const char*>(data), length);
+
+		const LinkProfile& profile = options.profile;
+		Clock::time_point now = Clock::now();
+		link_free_ = std::max(link_free_, now);
+		if (profile.bandwidth_kbps != 0) {
+			link_free_ += std::chrono::microseconds(
+				out.bytes.size() * 8 * 1000 / profile.bandwidth_kbps);
+		}
+		out.due = link_free_ + std::chrono::milliseconds(profile.latency_ms);
+		if (profile.loss_percent > 0 &&
+			std::uniform_real_distribution<double>(0, 100)(random_) < profile.loss_percent) {
+			out.due += kRetransmitDelay;
+		}
+		// Nothing overtakes a retransmission on a TCP connection.
+		if (!outgoing_.empty()) out.due = std::max(out.due, outgoing_.back().due);
+		outgoing_.push_back(std::move(out));
+	}
+
+	bool FlushOutgoing() {
+		Clock::time_point now = Clock::now();
+		while (!outgoing_.empty() && outgoing_.front().due <= now) {
+			const std::string& bytes = outgoing_.front().bytes;
+			if (!WriteFully(fd_, bytes.data(), bytes.size())) return false;
+			outgoing_.pop_front();
+		}
+		return true;
+	}
+
+	void SendConnect() {
+		std::string banner =
+			"device::ro.product.name=simulator;ro.product.model=simulator;"
+			"ro.product.device=simulator;";
+		if (options.stream_window) banner += std::string("features=") + kStreamWindowFeature;
+		Send(A_CNXN, A_VERSION, MAX_PAYLOAD, banner.data(), banner.size());
+	}
+
+	// |window| is the one the host offered, or zero.
+	void Open(uint32_t host_id, uint32_t window, const std::string& name) {
+		int fds[2];
+		if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) == -1) {
+			Send(A_CLSE, 0, host_id);
+			return;
+		}
+		if (android::base::StartsWith(name, "shell:")) {
+			std::thread(ShellService, fds[1], name.substr(6)).detach();
+		}
+		else if (name == "sync:") {
+			std::thread(SyncService, fds[1], root_).detach();
+		}
+		else {
+			close(fds[0]);
+			close(fds[1]);
+			Send(A_CLSE, 0, host_id);
+			return;
+		}
+
+		fcntl(fds[0], F_SETFL, O_NONBLOCK);
+		uint32_t id = next_id_++;
+		Stream& stream = streams_[id];
+		stream.host_id = host_id;
+		stream.fd = fds[0];
+		if (options.stream_window && window != 0) {
+			stream.send_window = window;
+			Send(A_OKAY, id, host_id, &kStreamWindowBytes, sizeof(kStreamWindowBytes));
+		}
+		else {
+			Send(A_OKAY, id, host_id);
+		}
+	}
+
+	void Close(uint32_t id) {
+		auto it = streams_.find(id);
+		if (it == streams_.end()) return;
+		close(it->second.fd);
+		streams_.erase(it);
+	}
+
+	bool HandlePacket() {
+		amessage msg;
+		if (!ReadFully(fd_, &msg, sizeof(msg)) || msg.data_length > MAX_PAYLOAD) return false;
+		std::string data(msg.data_length, '\0');
+		if (!ReadFully(fd_, &data[0], data.size())) return false;
+
+		switch (msg.command) {
+		case A_CNXN:
+			max_payload_ = std::min<size_t>(msg.arg1, MAX_PAYLOAD);
+			if (options.auth && !authenticated_) {
+				char token[TOKEN_SIZE];
+				for (char& c : token) c = random_();
+				Send(A_AUTH, ADB_AUTH_TOKEN, 0, token, sizeof(token));
+			}
+			else {
+				SendConnect();
+			}
+			break;
+
+		case A_AUTH:
+			// Any signature or public key will do.
+			if (msg.arg0 == ADB_AUTH_SIGNATURE || msg.arg0 == ADB_AUTH_RSAPUBLICKEY) {
+				authenticated_ = true;
+				SendConnect();
+			}
+			break;
+
+		case A_OPEN:
+			Open(msg.arg0, msg.arg1, std::string(data.c_str()));
+			break;
+
+		case A_OKAY: {
+			auto it = streams_.find(msg.arg1);
+			if (it == streams_.end()) break;
+			Stream& stream = it->second;
+			if (stream.send_window == 0) {
+				stream.can_send = true;
+			}
+			else if (data.size() == sizeof(uint32_t)) {
+				uint32_t acked;
+				memcpy(&acked, data.data(), sizeof(acked));
+				stream.send_unacked -= std::min<size_t>(acked, stream.send_unacked);
+				stream.can_send = stream.send_unacked < stream.send_window;
+			}
+			break;
+		}
+
+		case A_WRTE: {
+			auto it = streams_.find(msg.arg1);
+			if (it == streams_.end()) break;
+			it->second.pending += data;
+			it->second.recv_unacked += data.size();
+			break;
+		}
+
+		case A_CLSE:
+			Close(msg.arg1);
+			break;
+		}
+		return true;
+	}
+
+	// Feeds the service what the host sent, and acknowledges it once it's all been taken.
+	void WriteToService(uint32_t id, Stream& stream) {
+		ssize_t rc = TEMP_FAILURE_RETRY(write(stream.fd, stream.pending.data(),
+			stream.pending.size()));
+		if (rc > 0) {
+			stream.pending.erase(0, rc);
+			if (!stream.pending.empty()) return;
+			if (stream.send_window == 0) {
+				Send(A_OKAY, id, stream.host_id);
+			}
+			else {
+				Send(A_OKAY, id, stream.host_id, &stream.recv_unacked, sizeof(stream.recv_unacked));
+			}
+			stream.recv_unacked = 0;
+		}
+	}
+
+	// Returns false if the service is done.
+	bool ReadFromService(uint32_t id, Stream& stream) {
+		std::string buf(max_payload_, '\0');
+		ssize_t rc = TEMP_FAILURE_RETRY(read(stream.fd, &buf[0], buf.size()));
+		if (rc == -1 && errno == EAGAIN) return true;
+		if (rc <= 0) {
+			Send(A_CLSE, id, stream.host_id);
+			return false;
+		}
+		Send(A_WRTE, id, stream.host_id, buf.data(), rc);
+		if (stream.send_window == 0) {
+			stream.can_send = false;
+		}
+		else {
+			stream.send_unacked += rc;
+			stream.can_send = stream.send_unacked < stream.send_window;
+		}
+		return true;
+	}
+
+	bool Poll() {
+		std::vector<pollfd> pfds;
+		std::vector<uint32_t> ids;
+		pfds.push_back({ fd_, POLLIN, 0 });
+		for (auto& it : streams_) {
+			short events = 0;
+			if (it.second.can_send) events |= POLLIN;
+			if (!it.second.pending.empty()) events |= POLLOUT;
+			if (events == 0) continue;
+			pfds.push_back({ it.second.fd, events, 0 });
+			ids.push_back(it.first);
+		}
+
+		int timeout = -1;
+		if (!outgoing_.empty()) {
+			auto wait = outgoing_.front().due - Clock::now();
+			timeout = std::max<int64_t>(
+				0, std::chrono::duration_cast<std::chrono::milliseconds>(wait).count() + 1);
+		}
+		if (TEMP_FAILURE_RETRY(poll(pfds.data(), pfds.size(), timeout)) == -1) return false;
+
+		if (pfds[0].revents != 0 && !HandlePacket()) return false;
+		for (size_t i = 1; i < pfds.size(); ++i) {
+			if (pfds[i].revents == 0) continue;
+			uint32_t id = ids[i - 1];
+			auto it = streams_.find(id);
+			// The host may have just closed it.
+			if (it == streams_.end()) continue;
+			if (pfds[i].revents & POLLOUT) WriteToService(id, it->second);
+			if ((pfds[i].revents & (POLLIN | POLLHUP | POLLERR)) && it->second.can_send &&
+				!ReadFromService(id, it->second)) {
+				Close(id);
+			}
+		}
+		return FlushOutgoing();
+	}
+
+	const int fd_;
+	const std::string root_;
+	std::mt19937 random_;
+	size_t max_payload_ = MAX_PAYLOAD_V1;
+	bool authenticated_ = false;
+	uint32_t next_id_ = 1;
+	std::map<uint32_t, Stream> streams_;
+	std::deque<Outgoing> outgoing_;
+	Clock::time_point link_free_;
+};
+
+static int Listen(int port) {
+	int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, IPPROTO_TCP);
+	if (fd == -1) return -1;
+	int on = 1;
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+	sockaddr_in addr = {};
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == -1 ||
+		listen(fd, 4) == -1) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+// Sends a host service request to the adb server, returning its reply, or an error.
+static bool AdbServerRequest(const std::string& service, std::string* reply) {
+	int port = DEFAULT_ADB_PORT;
+	const char* env = getenv("ANDROID_ADB_SERVER_PORT");
+	if (env) android::base::ParseInt(env, &port);
+
+	int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, IPPROTO_TCP);
+	sockaddr_in addr = {};
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (fd == -1 || connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == -1) {
+		*reply = android::base::StringPrintf("cannot connect to adb server on port %d: %s", port,
+			strerror(errno));
+		if (fd != -1) close(fd);
+		return false;
+	}
+
+	std::string request = android::base::StringPrintf("%04zx", service.size()) + service;
+	char status[4];
+	char length[5] = {};
+	unsigned reply_length = 0;
+	bool ok = WriteFully(fd, request.data(), request.size()) &&
+		ReadFully(fd, status, sizeof(status)) && ReadFully(fd, length, 4) &&
+		sscanf(length, "%04x", &reply_length) == 1;
+	if (ok) {
+		reply->resize(reply_length);
+		ok = ReadFully(fd, &(*reply)[0], reply_length);
+	}
+	close(fd);
+	if (!ok) {
+		*reply = "protocol fault talking to the adb server";
+		return false;
+	}
+	return memcmp(status, "OKAY", 4) == 0;
+}
+
+static void Usage() {
+	fprintf(stderr,
+		"usage: adb_device_simulator [OPTIONS]\n"
+		"  -n, --devices N          simulate N devices [default=1]\n"
+		"  -p, --port PORT          listen on PORT to PORT+N-1 [default=6000]\n"
+		"  -c, --connect            ask the adb server to connect to every device\n"
+		"  -a, --auth               require authentication (any key is accepted)\n"
+		"  -r, --root DIR           keep each device's files in DIR/PORT [default: a temp dir]\n"
+		"  -P, --profile NAME       link profile: local, usb2, wifi or slow [default=local]\n"
+		"      --latency-ms MS      override the profile's one-way latency\n"
+		"      --bandwidth-kbps N   override the profile's bandwidth (0 for unlimited)\n"
+		"      --loss PERCENT       override the profile's packet loss\n"
+		"      --no-stream-window   wait for a READY after every WRITE, like older adbds\n");
+}
+
+int main(int argc, char** argv) {
+	static const option long_options[] = {
+		{ "devices", required_argument, nullptr, 'n' },
+		{ "port", required_argument, nullptr, 'p' },
+		{ "connect", no_argument, nullptr, 'c' },
+		{ "auth", no_argument, nullptr, 'a' },
+		{ "root", required_argument, nullptr, 'r' },
+		{ "profile", required_argument, nullptr, 'P' },
+		{ "latency-ms", required_argument, nullptr, 'L' },
+		{ "bandwidth-kbps", required_argument, nullptr, 'B' },
+		{ "loss", required_argument, nullptr, 'l' },
+		{ "no-stream-window", no_argument, nullptr, 'W' },
+		{ nullptr, 0, nullptr, 0 },
+	};
+
+	int latency_ms = -1;
+	int bandwidth_kbps = -1;
+	double loss_percent = -1;
+	int opt;
+	while ((opt = getopt_long(argc, argv, "n:p:car:P:", long_options, nullptr)) != -1) {
+		bool ok = true;
+		switch (opt) {
+		case 'n': ok = android::base::ParseInt(optarg, &options.devices, 1); break;
+		case 'p': ok = android::base::ParseInt(optarg, &options.base_port, 1, 65535); break;
+		case 'c': options.connect = true; break;
+		case 'a': options.auth = true; break;
+		case 'r': options.root = optarg; break;
+		case 'P': {
+			auto it = std::find_if(std::begin(kProfiles), std::end(kProfiles),
+				[](const LinkProfile& profile) { return strcmp(profile.name, optarg) == 0; });
+			ok = it != std::end(kProfiles);
+			if (ok) options.profile = *it;
+			break;
+		}
+		case 'L': ok = android::base::ParseInt(optarg, &latency_ms, 0); break;
+		case 'B': ok = android::base::ParseInt(optarg, &bandwidth_kbps, 0); break;
+		case 'l': ok = android::base::ParseDouble(optarg, &loss_percent, 0.0, 100.0); break;
+		case 'W': options.stream_window = false; break;
+		default: ok = false; break;
+		}
+		if (!ok) {
+			Usage();
+			return 2;
+		}
+	}
+	if (optind != argc || options.base_port + options.devices - 1 > 65535) {
+		Usage();
+		return 2;
+	}
+	if (latency_ms != -1) options.profile.latency_ms = latency_ms;
+	if (bandwidth_kbps != -1) options.profile.bandwidth_kbps = bandwidth_kbps;
+	if (loss_percent != -1) options.profile.loss_percent = loss_percent;
+
+	if (options.root.empty()) {
+		char dir[] = "/tmp/adb_device_simulator.XXXXXX";
+		if (mkdtemp(dir) == nullptr) {
+			fprintf(stderr, "adb_device_simulator: mkdtemp failed: %s\n", strerror(errno));
+			return 1;
+		}
+		options.root = dir;
+	}
+	signal(SIGPIPE, SIG_IGN);
+
+	std::vector<pollfd> listeners;
+	for (int i = 0; i < options.devices; ++i) {
+		int port = options.base_port + i;
+		int fd = Listen(port);
+		if (fd == -1) {
+			fprintf(stderr, "adb_device_simulator: cannot listen on port %d: %s\n", port,
+				strerror(errno));
+			return 1;
+		}
+		listeners.push_back({ fd, POLLIN, 0 });
+	}
+	printf("simulating %d devices on 127.0.0.1:%d-%d, files in %s, profile %s"
+		" (latency %dms, bandwidth %dkbps, loss %g%%)\n",
+		options.devices, options.base_port, options.base_port + options.devices - 1,
+		options.root.c_str(), options.profile.name, options.profile.latency_ms,
+		options.profile.bandwidth_kbps, options.profile.loss_percent);
+	fflush(stdout);
+
+	if (options.connect) {
+		// The server connects from its own thread, which needs us to be accepting.
+		std::thread([]() {
+			for (int i = 0; i < options.devices; ++i) {
+				std::string reply;
+				std::string address =
+					android::base::StringPrintf("127.0.0.1:%d", options.base_port + i);
+				if (!AdbServerRequest("host:connect:" + address, &reply)) {
+					fprintf(stderr, "adb_device_simulator: connecting %s failed: %s\n",
+						address.c_str(), reply.c_str());
+				}
+			}
+		}).detach();
+	}
+
+	while (true) {
+		if (TEMP_FAILURE_RETRY(poll(listeners.data(), listeners.size(), -1)) == -1) {
+			perror("adb_device_simulator: poll");
+			return 1;
+		}
+		for (size_t i = 0; i < listeners.size(); ++i) {
+			if (!(listeners[i].revents & POLLIN)) continue;
+			int fd = TEMP_FAILURE_RETRY(accept4(listeners[i].fd, nullptr, nullptr, SOCK_CLOEXEC));
+			if (fd == -1) continue;
+			int on = 1;
+			setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+			int port = options.base_port + i;
+			std::thread([fd, port]() { Device(fd, port).Run(); }).detach();
+		}
+	}
+}
@@ -21,22 +21,33 @@
 #include "fdevent.h"
 
 #include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
+#include <algorithm>
 #include <atomic>
 #include <functional>
 #include <list>
+#include <map>
 #include <mutex>
+#include <set>
 #include <unordered_map>
 #include <vector>
 
+#if !defined(_WIN32)
+#include <dlfcn.h>
+#endif
+
 #include <android-base/logging.h>
+#include <android-base/parseint.h>
 #include <android-base/stringprintf.h>
 #include <android-base/thread_annotations.h>
 
 #include "adb_io.h"
+#include "adb_stats.h"
 #include "adb_trace.h"
 #include "adb_unique_fd.h"
 #include "adb_utils.h"
@@ -75,6 +86,7 @@ struct PollNode {
 // That's why we don't need a lock for fdevent.
 static auto& g_poll_node_map = *new std::unordered_map<int, PollNode>();
 static auto& g_pending_list = *new std::list<fdevent*>();
+static auto& g_timeouts = *new std::set<std::pair<uint64_t, fdevent*>>();
 static std::atomic<bool> terminate_loop(false);
 static bool main_thread_valid;
 static unsigned long main_thread_id;
@@ -83,6 +95,42 @@ static auto& run_queue_notify_fd = *new unique_fd();
 static auto& run_queue_mutex = *new std::mutex();
 static auto& run_queue GUARDED_BY(run_queue_mutex) = *new std::vector<std::function<void()>>();
 
+struct CallProfile {
+	uint64_t calls = 0;
+	uint64_t total_ns = 0;
+	uint64_t max_ns = 0;
+	uint64_t slow = 0;
+	int max_fd = -1;  // The fd of the longest call, for fd callbacks.
+
+	void Record(uint64_t ns, bool is_slow, int fd) {
+		++calls;
+		total_ns += ns;
+		if (ns > max_ns) {
+			max_ns = ns;
+			max_fd = fd;
+		}
+		if (is_slow) ++slow;
+	}
+};
+
+// Like everything else here, only used on the main thread.
+struct LoopProfile {
+	bool enabled = false;
+	uint64_t slow_threshold_ns = 0;
+	uint64_t start_ns = 0;
+
+	uint64_t iterations = 0;
+	uint64_t poll_wait_total_ns = 0;
+	uint64_t poll_wait_max_ns = 0;
+	uint64_t ready_fds_total = 0;
+	uint64_t ready_fds_max = 0;
+
+	std::map<fd_func, CallProfile> handlers;
+	CallProfile tasks;
+};
+
+static auto& g_profile = *new LoopProfile();
+
 void check_main_thread() {
 	if (main_thread_valid) {
 		CHECK_EQ(main_thread_id, adb_thread_id());
@@ -114,6 +162,9 @@ static std::string dump_fde(const fdevent* fde) {
 	if (fde->state & FDE_ERROR) {
 		state += "E";
 	}
+	if (fde->timeout_deadline_ns != 0) {
+		state += "T";
+	}
 	if (fde->state & FDE_DONT_CLOSE) {
 		state += "D";
 	}
@@ -166,6 +217,7 @@ void fdevent_remove(fdevent* fde) {
 		if (fde->state & FDE_PENDING) {
 			g_pending_list.remove(fde);
 		}
+		fdevent_set_timeout(fde, -1);
 		if (!(fde->state & FDE_DONT_CLOSE)) {
 			adb_close(fde->fd);
 			fde->fd = -1;
@@ -207,7 +259,7 @@ void fdevent_set(fdevent* fde, unsigned events) {
 
 	if (fde->state & FDE_PENDING) {
 		// If we are pending, make sure we don't signal an event that is no longer wanted.
-		fde->events &= events;
+		fde->events &= events | FDE_TIMEOUT;
 		if (fde->events == 0) {
 			g_pending_list.remove(fde);
 			fde->state &= ~FDE_PENDING;
@@ -225,6 +277,47 @@ void fdevent_del(fdevent* fde, unsigned events) {
 	fdevent_set(fde, (fde->state & FDE_EVENTMASK) & ~events);
 }
 
+void fdevent_set_timeout(fdevent* fde, int64_t timeout_ms) {
+	check_main_thread();
+	if (fde->timeout_deadline_ns != 0) {
+		g_timeouts.erase(std::make_pair(fde->timeout_deadline_ns, fde));
+		fde->timeout_deadline_ns = 0;
+	}
+	if (timeout_ms >= 0) {
+		CHECK(fde->state & FDE_ACTIVE);
+		fde->timeout_deadline_ns = stats_now_ns() + timeout_ms * 1000000;
+		g_timeouts.emplace(fde->timeout_deadline_ns, fde);
+	}
+}
+
+// How long poll() may wait before the next timeout is due.
+static int fdevent_poll_timeout_ms() {
+	if (g_timeouts.empty()) {
+		return -1;
+	}
+	uint64_t now = stats_now_ns();
+	uint64_t deadline = g_timeouts.begin()->first;
+	if (deadline <= now) {
+		return 0;
+	}
+	return static_cast<int>(std::min<uint64_t>((deadline - now + 999999) / 1000000, INT_MAX));
+}
+
+static void fdevent_expire_timeouts() {
+	uint64_t now = stats_now_ns();
+	while (!g_timeouts.empty() && g_timeouts.begin()->first <= now) {
+		fdevent* fde = g_timeouts.begin()->second;
+		g_timeouts.erase(g_timeouts.begin());
+		fde->timeout_deadline_ns = 0;
+		fde->events |= FDE_TIMEOUT;
+		D("%s timed out", dump_fde(fde).c_str());
+		if (!(fde->state & FDE_PENDING)) {
+			fde->state |= FDE_PENDING;
+			g_pending_list.push_back(fde);
+		}
+	}
+}
+
 static std::string dump_pollfds(const std::vector<adb_pollfd>& pollfds) {
 	std::string result;
 	for (const auto& pollfd : pollfds) {
@@ -240,6 +333,76 @@ static std::string dump_pollfds(const std::vector<adb_pollfd>& pollfds) {
 	return result;
 }
 
+static double ns_to_ms(uint64_t ns) {
+	return ns / 1e6;
+}
+
+// Names |func| if it's an exported symbol, and otherwise gives its address for addr2line.
+static std::string handler_name(fd_func func) {
+	void* address = reinterpret_cast<void*>(func);
+#if !defined(_WIN32)
+	Dl_info info;
+	if (dladdr(address, &info) && info.dli_sname && info.dli_saddr == address) {
+		return info.dli_sname;
+	}
+#endif
+	return android::base::StringPrintf("%p", address);
+}
+
+void fdevent_profile_start(int64_t slow_threshold_ms) {
+	check_main_thread();
+	g_profile = LoopProfile();
+	g_profile.enabled = true;
+	g_profile.slow_threshold_ns = std::max<int64_t>(slow_threshold_ms, 0) * 1000000;
+	g_profile.start_ns = stats_now_ns();
+}
+
+void fdevent_profile_stop() {
+	check_main_thread();
+	g_profile.enabled = false;
+}
+
+std::string fdevent_profile_summary() {
+	check_main_thread();
+	if (g_profile.start_ns == 0) {
+		return "fdevent profiling is off\n";
+	}
+
+	std::string result = android::base::StringPrintf(
+		"profiling %s, slow threshold %.0fms, %.3fs elapsed\n",
+		g_profile.enabled ? "on" : "stopped", ns_to_ms(g_profile.slow_threshold_ns),
+		ns_to_ms(stats_now_ns() - g_profile.start_ns) / 1000);
+	uint64_t iterations = std::max<uint64_t>(g_profile.iterations, 1);
+	android::base::StringAppendF(&result,
+		"loop iterations=%" PRIu64 " poll_wait_total=%.3fms poll_wait_max=%.3fms"
+		" ready_fds_avg=%.2f ready_fds_max=%" PRIu64 "\n",
+		g_profile.iterations, ns_to_ms(g_profile.poll_wait_total_ns),
+		ns_to_ms(g_profile.poll_wait_max_ns),
+		static_cast<double>(g_profile.ready_fds_total) / iterations, g_profile.ready_fds_max);
+
+	auto append = [&result](const std::string& name, const CallProfile& profile) {
+		android::base::StringAppendF(&result,
+			"%s calls=%" PRIu64 " total=%.3fms max=%.3fms slow=%" PRIu64, name.c_str(),
+			profile.calls, ns_to_ms(profile.total_ns), ns_to_ms(profile.max_ns), profile.slow);
+		if (profile.max_fd != -1) {
+			android::base::StringAppendF(&result, " max_fd=%d", profile.max_fd);
+		}
+		result += '\n';
+	};
+
+	// Worst offenders first.
+	std::vector<std::pair<fd_func, CallProfile>> handlers(g_profile.handlers.begin(),
+		g_profile.handlers.end());
+	std::sort(handlers.begin(), handlers.end(), [](const auto& a, const auto& b) {
+		return a.second.total_ns > b.second.total_ns;
+	});
+	for (const auto& handler : handlers) {
+		append("handler " + handler_name(handler.first), handler.second);
+	}
+	append("run_on_main_thread", g_profile.tasks);
+	return result;
+}
+
 static void fdevent_process() {
 	std::vector<adb_pollfd> pollfds;
 	for (const auto& pair : g_poll_node_map) {
@@ -247,11 +410,20 @@ static void fdevent_process() {
 	}
 	CHECK_GT(pollfds.size(), 0u);
 	D("poll(), pollfds = %s", dump_pollfds(pollfds).c_str());
-	int ret = adb_poll(&pollfds[0], pollfds.size(), -1);
+	uint64_t poll_start_ns = g_profile.enabled ? stats_now_ns() : 0;
+	int ret = adb_poll(&pollfds[0], pollfds.size(), fdevent_poll_timeout_ms());
 	if (ret == -1) {
 		PLOG(ERROR) << "poll(), ret = " << ret;
 		return;
 	}
+	if (g_profile.enabled) {
+		uint64_t wait_ns = stats_now_ns() - poll_start_ns;
+		++g_profile.iterations;
+		g_profile.poll_wait_total_ns += wait_ns;
+		g_profile.poll_wait_max_ns = std::max(g_profile.poll_wait_max_ns, wait_ns);
+		g_profile.ready_fds_total += ret;
+		g_profile.ready_fds_max = std::max<uint64_t>(g_profile.ready_fds_max, ret);
+	}
 	for (const auto& pollfd : pollfds) {
 		if (pollfd.revents != 0) {
 			D("for fd %d, revents = %x", pollfd.fd, pollfd.revents);
@@ -284,6 +456,7 @@ static void fdevent_process() {
 			g_pending_list.push_back(fde);
 		}
 	}
+	fdevent_expire_timeouts();
 }
 
 static void fdevent_call_fdfunc(fdevent* fde) {
@@ -292,7 +465,24 @@ static void fdevent_call_fdfunc(fdevent* fde) {
 	CHECK(fde->state & FDE_PENDING);
 	fde->state &= (~FDE_PENDING);
 	D("fdevent_call_fdfunc %s", dump_fde(fde).c_str());
-	fde->func(fde->fd, events, fde->arg);
+	if (!g_profile.enabled) {
+		fde->func(fde->fd, events, fde->arg);
+		return;
+	}
+
+	// The callback may well destroy |fde|.
+	fd_func func = fde->func;
+	int fd = fde->fd;
+	uint64_t start_ns = stats_now_ns();
+	func(fd, events, fde->arg);
+	uint64_t elapsed_ns = stats_now_ns() - start_ns;
+
+	bool slow = g_profile.slow_threshold_ns != 0 && elapsed_ns >= g_profile.slow_threshold_ns;
+	if (slow) {
+		LOG(WARNING) << "fdevent: handler " << handler_name(func) << " took "
+			<< ns_to_ms(elapsed_ns) << "ms on fd " << fd << " (events " << events << ")";
+	}
+	g_profile.handlers[func].Record(elapsed_ns, slow, fd);
 }
 
 #if !ADB_HOST
@@ -363,7 +553,19 @@ static void fdevent_subproc_setup() {
 
 static void fdevent_run_flush() REQUIRES(run_queue_mutex) {
 	for (auto& f : run_queue) {
+		if (!g_profile.enabled) {
+			f();
+			continue;
+		}
+
+		uint64_t start_ns = stats_now_ns();
 		f();
+		uint64_t elapsed_ns = stats_now_ns() - start_ns;
+		bool slow = g_profile.slow_threshold_ns != 0 && elapsed_ns >= g_profile.slow_threshold_ns;
+		if (slow) {
+			LOG(WARNING) << "fdevent: run_on_main_thread task took " << ns_to_ms(elapsed_ns) << "ms";
+		}
+		g_profile.tasks.Record(elapsed_ns, slow, -1);
 	}
 	run_queue.clear();
 }
@@ -419,6 +621,13 @@ void fdevent_loop() {
 #endif // !ADB_HOST
 	fdevent_run_setup();
 
+	const char* profile_threshold = getenv("ADB_FDEVENT_PROFILE");
+	int64_t slow_threshold_ms;
+	if (profile_threshold &&
+		android::base::ParseInt(profile_threshold, &slow_threshold_ms, int64_t(0))) {
+		fdevent_profile_start(slow_threshold_ms);
+	}
+
 	while (true) {
 		if (terminate_loop) {
 			return;
@@ -447,6 +656,7 @@ size_t fdevent_installed_count() {
 void fdevent_reset() {
 	g_poll_node_map.clear();
 	g_pending_list.clear();
+	g_timeouts.clear();
 
 	std::lock_guard<std::mutex> lock(run_queue_mutex);
 	run_queue_notify_fd.reset();
@@ -454,4 +664,5 @@ void fdevent_reset() {
 
 	main_thread_valid = false;
 	terminate_loop = false;
+	g_profile = LoopProfile();
 }
\ No newline at end of file
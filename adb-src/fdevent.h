@@ -21,11 +21,13 @@
 #include <stdint.h>  /* for int64_t */
 
 #include <functional>
+#include <string>
 
  /* events that may be observed */
 #define FDE_READ              0x0001
 #define FDE_WRITE             0x0002
 #define FDE_ERROR             0x0004
+#define FDE_TIMEOUT           0x0008  /* see fdevent_set_timeout() */
 
 /* features that may be set (via the events set/add/del interface) */
 #define FDE_DONT_CLOSE        0x0080
@@ -44,6 +46,9 @@ struct fdevent {
 
 	fd_func func;
 	void* arg;
+
+	// When the timeout set by fdevent_set_timeout() expires, or 0 if there isn't one.
+	uint64_t timeout_deadline_ns;
 };
 
 /* Allocate and initialize a new fdevent object
@@ -72,6 +77,10 @@ void fdevent_set(fdevent* fde, unsigned events);
 void fdevent_add(fdevent* fde, unsigned events);
 void fdevent_del(fdevent* fde, unsigned events);
 
+/* Arrange for a single FDE_TIMEOUT event in timeout_ms, whatever other
+** events are enabled, replacing any timeout already set. A negative
+** timeout_ms cancels it, as does fdevent_remove().
+*/
 void fdevent_set_timeout(fdevent* fde, int64_t  timeout_ms);
 
 /* loop forever, handling events.
@@ -83,6 +92,15 @@ void check_main_thread();
 // Queue an operation to run on the main thread.
 void fdevent_run_on_main_thread(std::function<void()> fn);
 
+// Profiling of the main loop, to find the handlers that stall every other fd: time spent in
+// each callback (by handler) and in run_on_main_thread tasks, time spent waiting in poll, and
+// the number of ready fds per iteration. Calls taking longer than |slow_threshold_ms| are also
+// logged. Profiling is off unless ADB_FDEVENT_PROFILE is set to a threshold when the loop
+// starts, or one of these is called; they must be called on the main thread once it's running.
+void fdevent_profile_start(int64_t slow_threshold_ms);
+void fdevent_profile_stop();
+std::string fdevent_profile_summary();
+
 // The following functions are used only for tests.
 void fdevent_terminate_loop();
 size_t fdevent_installed_count();
@@ -18,6 +18,7 @@
 
 #include <gtest/gtest.h>
 
+#include <chrono>
 #include <limits>
 #include <queue>
 #include <string>
@@ -193,4 +194,58 @@ TEST_F(FdeventTest, run_on_main_thread) {
 	for (int i = 0; i < 100; ++i) {
 		ASSERT_EQ(i, vec[i]);
 	}
-}
\ No newline at end of file
+}
+
+TEST_F(FdeventTest, profile) {
+	PrepareThread();
+	std::thread thread(fdevent_loop);
+
+	fdevent_run_on_main_thread([]() { fdevent_profile_start(1); });
+	fdevent_run_on_main_thread([]() { std::this_thread::sleep_for(std::chrono::milliseconds(5)); });
+
+	std::string summary;
+	fdevent_run_on_main_thread([&summary]() { summary = fdevent_profile_summary(); });
+
+	TerminateThread(thread);
+
+	ASSERT_NE(std::string::npos, summary.find("profiling on, slow threshold 1ms")) << summary;
+	ASSERT_NE(std::string::npos, summary.find("loop iterations=")) << summary;
+	ASSERT_NE(std::string::npos, summary.find("run_on_main_thread calls=")) << summary;
+	ASSERT_NE(std::string::npos, summary.find("slow=1")) << summary;
+}
+
+struct TimeoutArg {
+	fdevent fde;
+	std::vector<unsigned> events;
+};
+
+static void TimeoutCallback(int, unsigned events, void* userdata) {
+	reinterpret_cast<TimeoutArg*>(userdata)->events.push_back(events);
+}
+
+TEST_F(FdeventTest, timeout) {
+	int fds[2];
+	ASSERT_EQ(0, adb_socketpair(fds));
+
+	PrepareThread();
+	std::thread thread(fdevent_loop);
+
+	TimeoutArg fired;
+	TimeoutArg cancelled;
+	fdevent_run_on_main_thread([&]() {
+		fdevent_install(&fired.fde, fds[0], TimeoutCallback, &fired);
+		fdevent_set_timeout(&fired.fde, 10);
+		fdevent_install(&cancelled.fde, fds[1], TimeoutCallback, &cancelled);
+		fdevent_set_timeout(&cancelled.fde, 10);
+		fdevent_set_timeout(&cancelled.fde, -1);
+	});
+	std::this_thread::sleep_for(std::chrono::milliseconds(100));
+	fdevent_run_on_main_thread([&]() {
+		fdevent_remove(&fired.fde);
+		fdevent_remove(&cancelled.fde);
+	});
+	TerminateThread(thread);
+
+	ASSERT_EQ(std::vector<unsigned>{ FDE_TIMEOUT }, fired.events);
+	ASSERT_TRUE(cancelled.events.empty());
+}
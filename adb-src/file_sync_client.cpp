@@ -26,10 +26,11 @@
 #include <unistd.h>
 #include <utime.h>
 
+#include <algorithm>
 #include <chrono>
 #include <functional>
 #include <memory>
-#include <sstream>
+#include <mutex>
 #include <string>
 #include <vector>
 
@@ -41,6 +42,7 @@
 #include "adb_utils.h"
 #include "file_sync_service.h"
 #include "line_printer.h"
+#include "sync_progress.h"
 #include "sysdeps/errno.h"
 #include "sysdeps/stat.h"
 
@@ -93,114 +95,15 @@ struct copyinfo {
 	}
 };
 
-enum class TransferDirection {
-	push,
-	pull,
-};
-
-struct TransferLedger {
-	std::chrono::steady_clock::time_point start_time;
-	uint64_t files_transferred;
-	uint64_t files_skipped;
-	uint64_t bytes_transferred;
-	uint64_t bytes_expected;
-	bool expect_multiple_files;
-
-	TransferLedger() {
-		Reset();
-	}
-
-	bool operator==(const TransferLedger& other) const {
-		return files_transferred == other.files_transferred &&
-			files_skipped == other.files_skipped && bytes_transferred == other.bytes_transferred;
-	}
-
-	bool operator!=(const TransferLedger& other) const {
-		return !(*this == other);
-	}
-
-	void Reset() {
-		start_time = std::chrono::steady_clock::now();
-		files_transferred = 0;
-		files_skipped = 0;
-		bytes_transferred = 0;
-		bytes_expected = 0;
-	}
-
-	std::string TransferRate() {
-		if (bytes_transferred == 0) return "";
-
-		std::chrono::duration<double> duration;
-		duration = std::chrono::steady_clock::now() - start_time;
-
-		double s = duration.count();
-		if (s == 0) {
-			return "";
-		}
-		double rate = (static_cast<double>(bytes_transferred) / s) / (1024 * 1024);
-		return android::base::StringPrintf(" %.1f MB/s (%" PRIu64 " bytes in %.3fs)", rate,
-			bytes_transferred, s);
-	}
-
-	void ReportProgress(LinePrinter& lp, const std::string& file, uint64_t file_copied_bytes,
-		uint64_t file_total_bytes) {
-		char overall_percentage_str[5] = "?";
-		if (bytes_expected != 0 && bytes_transferred <= bytes_expected) {
-			int overall_percentage = static_cast<int>(bytes_transferred * 100 / bytes_expected);
-			// If we're pulling symbolic links, we'll pull the target of the link rather than
-			// just create a local link, and that will cause us to go over 100%.
-			if (overall_percentage <= 100) {
-				snprintf(overall_percentage_str, sizeof(overall_percentage_str), "%d%%",
-					overall_percentage);
-			}
-		}
-
-		std::string output;
-		if (file_copied_bytes > file_total_bytes || file_total_bytes == 0) {
-			// This case can happen if we're racing against something that wrote to the file
-			// between our stat and our read, or if we're reading a magic file that lies about
-			// its size. Just show how much we've copied.
-			output = android::base::StringPrintf("[%4s] %s: %" PRId64 "/?", overall_percentage_str,
-				file.c_str(), file_copied_bytes);
-		}
-		else {
-			// If we're transferring multiple files, we want to know how far through the current
-			// file we are, as well as the overall percentage.
-			if (expect_multiple_files) {
-				int file_percentage = static_cast<int>(file_copied_bytes * 100 / file_total_bytes);
-				output = android::base::StringPrintf("[%4s] %s: %d%%", overall_percentage_str,
-					file.c_str(), file_percentage);
-			}
-			else {
-				output =
-					android::base::StringPrintf("[%4s] %s", overall_percentage_str, file.c_str());
-			}
-		}
-		lp.Print(output, LinePrinter::LineType::INFO);
-	}
-
-	void ReportTransferRate(LinePrinter& lp, const std::string& name, TransferDirection direction) {
-		const char* direction_str = (direction == TransferDirection::push) ? "pushed" : "pulled";
-		std::stringstream ss;
-		if (!name.empty()) {
-			ss << name << ": ";
-		}
-		ss << files_transferred << " file" << ((files_transferred == 1) ? "" : "s") << " "
-			<< direction_str << ".";
-		if (files_skipped > 0) {
-			ss << " " << files_skipped << " file" << ((files_skipped == 1) ? "" : "s")
-				<< " skipped.";
-		}
-		ss << TransferRate();
-
-		lp.Print(ss.str(), LinePrinter::LineType::INFO);
-		lp.KeepInfoLine();
-	}
-};
-
 class SyncConnection {
 public:
-	SyncConnection() : expect_done_(false) {
+	SyncConnection()
+		: expect_done_(false),
+		  progress_([this](const std::string& file, uint64_t file_copied_bytes,
+			  uint64_t file_total_bytes) {
+			  current_ledger_.ReportProgress(line_printer_, file, file_copied_bytes,
+				  file_total_bytes);
+		  }, std::chrono::milliseconds(100)) {
 		max = SYNC_DATA_MAX; // TODO: decide at runtime.
 
 		std::string error;
@@ -211,6 +114,13 @@ public:
 		}
 		else {
 			have_stat_v2_ = CanUseFeature(features, kFeatureStat2);
+#if defined(SEEK_HOLE) && !defined(_WIN32)
+			have_sparse_ = CanUseFeature(features, kFeatureSparse);
+#else
+			have_sparse_ = false;
+#endif
+			have_resume_ = CanUseFeature(features, kFeatureResume);
+			have_send_batch_ = CanUseFeature(features, kFeatureSendBatch);
 			fd = adb_connect("sync:", &error);
 			if (fd < 0) {
 				Error("connect failed: %s", error.c_str());
@@ -219,6 +129,8 @@ public:
 	}
 
 	~SyncConnection() {
+		progress_.Stop();
+
 		if (!IsValid()) return;
 
 		if (SendQuit()) {
@@ -254,6 +166,13 @@ public:
 	void RecordBytesTransferred(size_t bytes) {
 		current_ledger_.bytes_transferred += bytes;
 		global_ledger_.bytes_transferred += bytes;
+		RecordLogicalBytes(bytes);
+	}
+
+	// Records file content covered by the transfer, including holes that weren't sent.
+	void RecordLogicalBytes(uint64_t bytes) {
+		current_ledger_.bytes_logical += bytes;
+		global_ledger_.bytes_logical += bytes;
 	}
 
 	void RecordFilesTransferred(size_t files) {
@@ -266,16 +185,22 @@ public:
 		global_ledger_.files_skipped += files;
 	}
 
+	// Only records where the transfer is; progress_ draws it ten times a second at most,
+	// so this is cheap enough to call for every chunk.
 	void ReportProgress(const std::string& file, uint64_t file_copied_bytes,
 		uint64_t file_total_bytes) {
-		current_ledger_.ReportProgress(line_printer_, file, file_copied_bytes, file_total_bytes);
+		progress_.Report(file, file_copied_bytes, file_total_bytes);
 	}
 
 	void ReportTransferRate(const std::string& file, TransferDirection direction) {
+		std::lock_guard<std::mutex> lock(progress_.mutex());
+		progress_.DiscardLocked();
 		current_ledger_.ReportTransferRate(line_printer_, file, direction);
 	}
 
 	void ReportOverallTransferRate(TransferDirection direction) {
+		std::lock_guard<std::mutex> lock(progress_.mutex());
+		progress_.DiscardLocked();
 		if (current_ledger_ != global_ledger_) {
 			global_ledger_.ReportTransferRate(line_printer_, "", direction);
 		}
@@ -291,14 +216,14 @@ public:
 
 		// Sending header and payload in a single write makes a noticeable
 		// difference to "adb sync" performance.
-		std::vector<char> buf(sizeof(SyncRequest) + path_length);
-		SyncRequest* req = reinterpret_cast<SyncRequest*>(&buf[0]);
-		req->id = id;
-		req->path_length = path_length;
-		char* data = reinterpret_cast<char*>(req + 1);
-		memcpy(data, path_and_mode, path_length);
-
-		return WriteFdExactly(fd, &buf[0], buf.size());
+		SyncRequest req;
+		req.id = id;
+		req.path_length = path_length;
+		adb_iovec iov[] = {
+			{ &req, sizeof(req) },
+			{ const_cast<char*>(path_and_mode), path_length },
+		};
+		return WriteFdExactlyV(fd, iov, 2);
 	}
 
 	bool SendStat(const char* path_and_mode) {
@@ -387,31 +312,26 @@ public:
 			return false;
 		}
 
-		std::vector<char> buf(sizeof(SyncRequest) + path_length +
-			sizeof(SyncRequest) + data_length +
-			sizeof(SyncRequest));
-		char* p = &buf[0];
-
-		SyncRequest* req_send = reinterpret_cast<SyncRequest*>(p);
-		req_send->id = ID_SEND;
-		req_send->path_length = path_length;
-		p += sizeof(SyncRequest);
-		memcpy(p, path_and_mode, path_length);
-		p += path_length;
+		SyncRequest req_send;
+		req_send.id = ID_SEND;
+		req_send.path_length = path_length;
 
-		SyncRequest* req_data = reinterpret_cast<SyncRequest*>(p);
-		req_data->id = ID_DATA;
-		req_data->path_length = data_length;
-		p += sizeof(SyncRequest);
-		memcpy(p, data, data_length);
-		p += data_length;
+		SyncRequest req_data;
+		req_data.id = ID_DATA;
+		req_data.path_length = data_length;
 
-		SyncRequest* req_done = reinterpret_cast<SyncRequest*>(p);
-		req_done->id = ID_DONE;
-		req_done->path_length = mtime;
-		p += sizeof(SyncRequest);
+		SyncRequest req_done;
+		req_done.id = ID_DONE;
+		req_done.path_length = mtime;
 
-		WriteOrDie(lpath, rpath, &buf[0], (p - &buf[0]));
+		adb_iovec iov[] = {
+			{ &req_send, sizeof(req_send) },
+			{ const_cast<char*>(path_and_mode), path_length },
+			{ &req_data, sizeof(req_data) },
+			{ const_cast<char*>(data), data_length },
+			{ &req_done, sizeof(req_done) },
+		};
+		WriteOrDie(lpath, rpath, iov, 5);
 		expect_done_ = true;
 
 		// RecordFilesTransferred gets called in CopyDone.
@@ -420,10 +340,20 @@ public:
 		return true;
 	}
 
+	// Sends |lpath| from |offset| onwards. A non-zero |offset| resumes an earlier transfer whose
+	// first |offset| bytes the caller has already checked with PrefixMatches.
 	bool SendLargeFile(const char* path_and_mode,
 		const char* lpath, const char* rpath,
-		unsigned mtime) {
-		if (!SendRequest(ID_SEND, path_and_mode)) {
+		unsigned mtime, uint64_t offset) {
+		if (offset > 0) {
+			std::string spec = android::base::StringPrintf("%s,%" PRIu64, path_and_mode, offset);
+			if (!SendRequest(ID_SEND_RESUME, spec.c_str())) {
+				Error("failed to send ID_SEND_RESUME message '%s': %s", spec.c_str(),
+					strerror(errno));
+				return false;
+			}
+		}
+		else if (!SendRequest(ID_SEND, path_and_mode)) {
 			Error("failed to send ID_SEND message '%s': %s", path_and_mode, strerror(errno));
 			return false;
 		}
@@ -435,18 +365,42 @@ public:
 		}
 
 		uint64_t total_size = st.st_size;
-		uint64_t bytes_copied = 0;
+		uint64_t bytes_copied = offset;
 
 		int lfd = adb_open(lpath, O_RDONLY);
 		if (lfd < 0) {
 			Error("opening '%s' locally failed: %s", lpath, strerror(errno));
 			return false;
 		}
+		if (offset > 0) {
+			if (adb_lseek64(lfd, offset, SEEK_SET) == -1) {
+				Error("seeking in '%s' locally failed: %s", lpath, strerror(errno));
+				adb_close(lfd);
+				return false;
+			}
+			RecordLogicalBytes(offset);
+		}
 
+		// End of the data extent we're currently sending. Dense transfers have a single extent.
+		int64_t data_end = have_sparse_ ? offset : INT64_MAX;
 		syncsendbuf sbuf;
 		sbuf.id = ID_DATA;
 		while (true) {
-			int bytes_read = adb_read(lfd, sbuf.data, max);
+			if (static_cast<int64_t>(bytes_copied) == data_end) {
+				int64_t data_start;
+				if (!find_data_extent(lfd, bytes_copied, &data_start, &data_end)) {
+					// This filesystem can't tell us where the holes are, so send the rest as data.
+					data_end = INT64_MAX;
+				}
+				else {
+					SendHole(lpath, rpath, data_start - bytes_copied);
+					bytes_copied = data_start;
+					if (data_start == data_end) break;
+				}
+			}
+
+			size_t count = std::min<int64_t>(max, data_end - bytes_copied);
+			int bytes_read = adb_read(lfd, sbuf.data, count);
 			if (bytes_read == -1) {
 				Error("reading '%s' locally failed: %s", lpath, strerror(errno));
 				adb_close(lfd);
@@ -525,7 +479,7 @@ public:
 		android::base::StringAppendV(&s, fmt, ap);
 		va_end(ap);
 
-		line_printer_.Print(s, LinePrinter::INFO);
+		Print(s, LinePrinter::INFO, false);
 	}
 
 	void Println(const char* fmt, ...) __attribute__((__format__(ADB_FORMAT_ARCHETYPE, 2, 3))) {
@@ -536,8 +490,7 @@ public:
 		android::base::StringAppendV(&s, fmt, ap);
 		va_end(ap);
 
-		line_printer_.Print(s, LinePrinter::INFO);
-		line_printer_.KeepInfoLine();
+		Print(s, LinePrinter::INFO, true);
 	}
 
 	void Error(const char* fmt, ...) __attribute__((__format__(ADB_FORMAT_ARCHETYPE, 2, 3))) {
@@ -548,7 +501,7 @@ public:
 		android::base::StringAppendV(&s, fmt, ap);
 		va_end(ap);
 
-		line_printer_.Print(s, LinePrinter::ERROR);
+		Print(s, LinePrinter::ERROR, false);
 	}
 
 	void Warning(const char* fmt, ...) __attribute__((__format__(ADB_FORMAT_ARCHETYPE, 2, 3))) {
@@ -559,7 +512,7 @@ public:
 		android::base::StringAppendV(&s, fmt, ap);
 		va_end(ap);
 
-		line_printer_.Print(s, LinePrinter::WARNING);
+		Print(s, LinePrinter::WARNING, false);
 	}
 
 	void ComputeExpectedTotalBytes(const std::vector<copyinfo>& file_list) {
@@ -577,6 +530,126 @@ public:
 		current_ledger_.expect_multiple_files = false;
 	}
 
+	bool HaveSparse() const { return have_sparse_; }
+	bool HaveResume() const { return have_resume_; }
+	bool HaveSendBatch() const { return have_send_batch_; }
+
+	// Starts an ID_SEND_BATCH. Follow with SendBatchFile for each file, then FinishBatch.
+	bool StartBatch() {
+		if (!SendRequest(ID_SEND_BATCH, "")) {
+			Error("failed to send ID_SEND_BATCH message: %s", strerror(errno));
+			return false;
+		}
+		return true;
+	}
+
+	// Sending header, path, and content in a single write keeps a batch of small
+	// files streaming without a round trip per file.
+	bool SendBatchFile(const char* lpath, const char* rpath, mode_t mode, unsigned mtime,
+		const char* data, size_t data_length) {
+		size_t path_length = strlen(rpath);
+		if (path_length > 1024) {
+			Error("SendBatchFile failed: path too long: %zu", path_length);
+			errno = ENAMETOOLONG;
+			return false;
+		}
+
+		syncmsg msg;
+		msg.batch.id = ID_FILE;
+		msg.batch.mode = mode;
+		msg.batch.mtime = mtime;
+		msg.batch.size = data_length;
+		msg.batch.path_length = path_length;
+
+		adb_iovec iov[] = {
+			{ &msg.batch, sizeof(msg.batch) },
+			{ const_cast<char*>(rpath), path_length },
+			{ const_cast<char*>(data), data_length },
+		};
+		WriteOrDie(lpath, rpath, iov, 3);
+
+		// RecordFilesTransferred gets called in FinishBatch.
+		RecordBytesTransferred(data_length);
+		ReportProgress(rpath, data_length, data_length);
+		return true;
+	}
+
+	// Ends a batch of |file_count| files and reports each file adbd couldn't write.
+	bool FinishBatch(const char* lpath, const char* rpath, size_t file_count) {
+		syncmsg msg;
+		memset(&msg.batch, 0, sizeof(msg.batch));
+		msg.batch.id = ID_DONE;
+		WriteOrDie(lpath, rpath, &msg.batch, sizeof(msg.batch));
+
+		if (!ReadFdExactly(fd, &msg.status, sizeof(msg.status))) {
+			Error("failed to copy '%s' to '%s': couldn't read from device", lpath, rpath);
+			return false;
+		}
+		if (msg.status.id == ID_OKAY) {
+			RecordFilesTransferred(file_count);
+			return true;
+		}
+		if (msg.status.id != ID_FAIL) {
+			Error("failed to copy '%s' to '%s': unknown reason %d", lpath, rpath, msg.status.id);
+			return false;
+		}
+
+		// adbd reports at most SYNC_BATCH_MAX_FAILURES paths, so this is never legitimately big.
+		if (msg.status.msglen > SYNC_DATA_MAX) {
+			Error("failed to copy '%s' to '%s': reason too long (%u bytes)", lpath, rpath,
+				msg.status.msglen);
+			return false;
+		}
+		std::string reasons(msg.status.msglen, '\0');
+		if (!ReadFdExactly(fd, &reasons[0], reasons.size())) {
+			Error("failed to copy '%s' to '%s'; failed to read reason (!): %s",
+				lpath, rpath, strerror(errno));
+			return false;
+		}
+		size_t failure_count = 0;
+		for (const std::string& failure : android::base::Split(reasons, "\n")) {
+			// Each line is "<remote path>: <reason>", except a last "+<count> more".
+			size_t more;
+			if (sscanf(failure.c_str(), "+%zu more", &more) == 1) {
+				Error("failed to copy %zu more files", more);
+				failure_count += more;
+				continue;
+			}
+			size_t colon = failure.find(": ");
+			Error("failed to copy to '%s': remote %s", failure.substr(0, colon).c_str(),
+				colon == std::string::npos ? "" : failure.c_str() + colon + 2);
+			++failure_count;
+		}
+		RecordFilesTransferred(file_count - std::min(file_count, failure_count));
+		return false;
+	}
+
+	// Returns true if the first |length| bytes of the local file |lpath| and the remote file
+	// |rpath| have the same SHA-256 digest, meaning a transfer between them can resume there.
+	bool PrefixMatches(const char* lpath, const char* rpath, uint64_t length) {
+		int lfd = adb_open(lpath, O_RDONLY);
+		if (lfd < 0) return false;
+		std::string local_digest;
+		uint64_t local_length;
+		bool hashed = hash_file_prefix(lfd, length, &local_digest, &local_length);
+		adb_close(lfd);
+		if (!hashed || local_length != length) return false;
+
+		std::string spec = android::base::StringPrintf("%s,%" PRIu64, rpath, length);
+		if (!SendRequest(ID_HASH, spec.c_str())) return false;
+
+		syncmsg msg;
+		if (!ReadFdExactly(fd, &msg.hash, sizeof(msg.hash))) {
+			fatal_errno("protocol fault: failed to read hash response");
+		}
+		if (msg.hash.id != ID_HASH) {
+			fatal_errno("protocol fault: hash response has wrong message id: %" PRIx32,
+				msg.hash.id);
+		}
+		return msg.hash.error == 0 && msg.hash.size == length &&
+			memcmp(msg.hash.digest, local_digest.data(), sizeof(msg.hash.digest)) == 0;
+	}
+
 	// TODO: add a char[max] buffer here, to replace syncsendbuf...
 	int fd;
 	size_t max;
@@ -584,17 +657,51 @@ public:
 private:
 	bool expect_done_;
 	bool have_stat_v2_;
+	bool have_sparse_;
+	bool have_resume_;
+	bool have_send_batch_;
 
 	TransferLedger global_ledger_;
 	TransferLedger current_ledger_;
+
+	// Guarded by progress_.mutex().
 	LinePrinter line_printer_;
+	ProgressRenderer progress_;
+
+	void Print(const std::string& s, LinePrinter::LineType type, bool keep) {
+		std::lock_guard<std::mutex> lock(progress_.mutex());
+		// Anything printed now is newer than progress that hasn't been drawn yet.
+		progress_.DiscardLocked();
+		line_printer_.Print(s, type);
+		if (keep) line_printer_.KeepInfoLine();
+	}
 
 	bool SendQuit() {
 		return SendRequest(ID_QUIT, ""); // TODO: add a SendResponse?
 	}
 
+	void SendHole(const char* from, const char* to, uint64_t length) {
+		syncmsg msg;
+		msg.data.id = ID_HOLE;
+		RecordLogicalBytes(length);
+		while (length > 0) {
+			msg.data.size = std::min<uint64_t>(length, UINT32_MAX);
+			WriteOrDie(from, to, &msg.data, sizeof(msg.data));
+			length -= msg.data.size;
+		}
+	}
+
 	bool WriteOrDie(const char* from, const char* to, const void* data, size_t data_length) {
-		if (!WriteFdExactly(fd, data, data_length)) {
+		adb_iovec iov = { const_cast<void*>(data), data_length };
+		return WriteOrDie(from, to, &iov, 1);
+	}
+
+	bool WriteOrDie(const char* from, const char* to, adb_iovec* iov, int iovcnt) {
+		size_t data_length = 0;
+		for (int i = 0; i < iovcnt; ++i) {
+			data_length += iov[i].iov_len;
+		}
+		if (!WriteFdExactlyV(fd, iov, iovcnt)) {
 			if (errno == ECONNRESET) {
 				// Assume adbd told us why it was closing the connection, and
 				// try to read failure reason from adbd.
@@ -685,7 +792,7 @@ static bool sync_stat_fallback(SyncConnection& sc, const char* path, struct stat
 }
 
 static bool sync_send(SyncConnection& sc, const char* lpath, const char* rpath, unsigned mtime,
-	mode_t mode, bool sync) {
+	mode_t mode, bool sync, bool resume) {
 	std::string path_and_mode = android::base::StringPrintf("%s,%d", rpath, mode);
 
 	if (sync) {
@@ -734,38 +841,105 @@ static bool sync_send(SyncConnection& sc, const char* lpath, const char* rpath,
 		}
 	}
 	else {
-		if (!sc.SendLargeFile(path_and_mode.c_str(), lpath, rpath, mtime)) {
+		// Pick up where an interrupted push left off if what's on the device so far matches.
+		uint64_t offset = 0;
+		struct stat remote_st;
+		if (resume && sc.HaveResume() && sync_lstat(sc, rpath, &remote_st) &&
+			S_ISREG(remote_st.st_mode) && remote_st.st_size > 0 &&
+			remote_st.st_size <= st.st_size &&
+			sc.PrefixMatches(lpath, rpath, remote_st.st_size)) {
+			offset = remote_st.st_size;
+		}
+
+		if (!sc.SendLargeFile(path_and_mode.c_str(), lpath, rpath, mtime, offset)) {
 			return false;
 		}
 	}
 	return sc.CopyDone(lpath, rpath);
 }
 
+// Opens the partial local file |lpath| to resume a pull at |offset|.
+static int open_for_resume(SyncConnection& sc, const char* lpath, uint64_t offset) {
+	int lfd = adb_open(lpath, O_WRONLY);
+	if (lfd < 0) {
+		sc.Error("cannot open '%s': %s", lpath, strerror(errno));
+		return -1;
+	}
+	if (adb_lseek64(lfd, offset, SEEK_SET) == -1) {
+		sc.Error("cannot seek in '%s': %s", lpath, strerror(errno));
+		adb_close(lfd);
+		return -1;
+	}
+	sc.RecordLogicalBytes(offset);
+	return lfd;
+}
+
 static bool sync_recv(SyncConnection& sc, const char* rpath, const char* lpath,
-	const char* name, uint64_t expected_size) {
-	if (!sc.SendRequest(ID_RECV, rpath)) return false;
+	const char* name, uint64_t expected_size, bool resume) {
+	// Pick up where an interrupted pull left off if what we have so far matches the device.
+	uint64_t offset = 0;
+	struct stat local_st;
+	if (resume && sc.HaveResume() && stat(lpath, &local_st) == 0 && S_ISREG(local_st.st_mode) &&
+		local_st.st_size > 0 && static_cast<uint64_t>(local_st.st_size) <= expected_size &&
+		sc.PrefixMatches(lpath, rpath, local_st.st_size)) {
+		offset = local_st.st_size;
+	}
+
+	int lfd;
+	if (offset > 0) {
+		lfd = open_for_resume(sc, lpath, offset);
+		if (lfd < 0) return false;
+
+		std::string spec = android::base::StringPrintf("%s,%" PRIu64 ",%d", rpath, offset,
+			sc.HaveSparse() ? kSyncFlagSparse : 0);
+		if (!sc.SendRequest(ID_RECV_RESUME, spec.c_str())) {
+			adb_close(lfd);
+			return false;
+		}
+	}
+	else {
+		if (!sc.SendRequest(sc.HaveSparse() ? ID_RECV_SPARSE : ID_RECV, rpath)) return false;
 
-	adb_unlink(lpath);
-	int lfd = adb_creat(lpath, 0644);
-	if (lfd < 0) {
-		sc.Error("cannot create '%s': %s", lpath, strerror(errno));
-		return false;
+		adb_unlink(lpath);
+		lfd = adb_creat(lpath, 0644);
+		if (lfd < 0) {
+			sc.Error("cannot create '%s': %s", lpath, strerror(errno));
+			return false;
+		}
 	}
 
-	uint64_t bytes_copied = 0;
+	// When resuming, keep whatever we manage to copy so that the next attempt can continue from it.
+	uint64_t bytes_copied = offset;
 	while (true) {
 		syncmsg msg;
 		if (!ReadFdExactly(sc.fd, &msg.data, sizeof(msg.data))) {
 			adb_close(lfd);
-			adb_unlink(lpath);
+			if (!resume) adb_unlink(lpath);
 			return false;
 		}
 
 		if (msg.data.id == ID_DONE) break;
 
+#if !defined(_WIN32)
+		// We only ask for holes where we can seek over them.
+		if (msg.data.id == ID_HOLE) {
+			if (adb_lseek64(lfd, msg.data.size, SEEK_CUR) == -1) {
+				sc.Error("cannot seek in '%s': %s", lpath, strerror(errno));
+				adb_close(lfd);
+				if (!resume) adb_unlink(lpath);
+				return false;
+			}
+			bytes_copied += msg.data.size;
+
+			sc.RecordLogicalBytes(msg.data.size);
+			sc.ReportProgress(name != nullptr ? name : rpath, bytes_copied, expected_size);
+			continue;
+		}
+#endif
+
 		if (msg.data.id != ID_DATA) {
 			adb_close(lfd);
-			adb_unlink(lpath);
+			if (!resume) adb_unlink(lpath);
 			sc.ReportCopyFailure(rpath, lpath, msg);
 			return false;
 		}
@@ -773,21 +947,21 @@ static bool sync_recv(SyncConnection& sc, const char* rpath, const char* lpath,
 		if (msg.data.size > sc.max) {
 			sc.Error("msg.data.size too large: %u (max %zu)", msg.data.size, sc.max);
 			adb_close(lfd);
-			adb_unlink(lpath);
+			if (!resume) adb_unlink(lpath);
 			return false;
 		}
 
 		char buffer[SYNC_DATA_MAX];
 		if (!ReadFdExactly(sc.fd, buffer, msg.data.size)) {
 			adb_close(lfd);
-			adb_unlink(lpath);
+			if (!resume) adb_unlink(lpath);
 			return false;
 		}
 
 		if (!WriteFdExactly(lfd, buffer, msg.data.size)) {
 			sc.Error("cannot write '%s': %s", lpath, strerror(errno));
 			adb_close(lfd);
-			adb_unlink(lpath);
+			if (!resume) adb_unlink(lpath);
 			return false;
 		}
 
@@ -797,6 +971,18 @@ static bool sync_recv(SyncConnection& sc, const char* rpath, const char* lpath,
 		sc.ReportProgress(name != nullptr ? name : rpath, bytes_copied, expected_size);
 	}
 
+#if !defined(_WIN32)
+	// A hole at the end of the file has only been seeked over so far.
+	struct stat st;
+	if (sc.HaveSparse() && fstat(lfd, &st) == 0 && S_ISREG(st.st_mode) &&
+		static_cast<uint64_t>(st.st_size) < bytes_copied && ftruncate(lfd, bytes_copied) == -1) {
+		sc.Error("cannot extend '%s': %s", lpath, strerror(errno));
+		adb_close(lfd);
+		if (!resume) adb_unlink(lpath);
+		return false;
+	}
+#endif
+
 	sc.RecordFilesTransferred(1);
 	adb_close(lfd);
 	return true;
@@ -883,7 +1069,7 @@ static bool local_build_list(SyncConnection& sc, std::vector<copyinfo>* file_lis
 
 static bool copy_local_dir_remote(SyncConnection& sc, std::string lpath,
 	std::string rpath, bool check_timestamps,
-	bool list_only) {
+	bool list_only, bool resume) {
 	sc.NewTransfer();
 
 	// Make sure that both directory paths end in a slash.
@@ -920,13 +1106,53 @@ static bool copy_local_dir_remote(SyncConnection& sc, std::string lpath,
 
 	sc.ComputeExpectedTotalBytes(file_list);
 
-	for (const copyinfo& ci : file_list) {
+	// Stream small regular files in a single batch rather than paying a round trip for each.
+	// Anything else (or a device without batch support) goes through sync_send below.
+	std::vector<bool> batched(file_list.size());
+	if (!list_only && sc.HaveSendBatch()) {
+		bool batch_started = false;
+		size_t batch_count = 0;
+		bool batch_ok = true;
+		for (size_t i = 0; i < file_list.size(); ++i) {
+			const copyinfo& ci = file_list[i];
+			if (ci.skip || !S_ISREG(ci.mode) || ci.size >= SYNC_DATA_MAX) continue;
+
+			if (!batch_started) {
+				if (!sc.StartBatch()) return false;
+				batch_started = true;
+			}
+			batched[i] = true;
+
+			std::string data;
+			if (!android::base::ReadFileToString(ci.lpath, &data, true) ||
+				data.size() > SYNC_DATA_MAX) {
+				sc.Error("failed to read all of '%s': %s", ci.lpath.c_str(), strerror(errno));
+				batch_ok = false;
+				continue;
+			}
+			if (!sc.SendBatchFile(ci.lpath.c_str(), ci.rpath.c_str(), ci.mode, ci.time,
+				data.data(), data.size())) {
+				batch_ok = false;
+				continue;
+			}
+			++batch_count;
+		}
+		if (batch_started && !sc.FinishBatch(lpath.c_str(), rpath.c_str(), batch_count)) {
+			batch_ok = false;
+		}
+		if (!batch_ok) return false;
+	}
+
+	for (size_t i = 0; i < file_list.size(); ++i) {
+		const copyinfo& ci = file_list[i];
+		if (batched[i]) continue;
 		if (!ci.skip) {
 			if (list_only) {
 				sc.Println("would push: %s -> %s", ci.lpath.c_str(), ci.rpath.c_str());
 			}
 			else {
-				if (!sync_send(sc, ci.lpath.c_str(), ci.rpath.c_str(), ci.time, ci.mode, false)) {
+				if (!sync_send(sc, ci.lpath.c_str(), ci.rpath.c_str(), ci.time, ci.mode, false,
+					resume)) {
 					return false;
 				}
 			}
@@ -941,7 +1167,7 @@ static bool copy_local_dir_remote(SyncConnection& sc, std::string lpath,
 	return true;
 }
 
-bool do_sync_push(const std::vector<const char*>& srcs, const char* dst, bool sync) {
+bool do_sync_push(const std::vector<const char*>& srcs, const char* dst, bool sync, bool resume) {
 	SyncConnection sc;
 	if (!sc.IsValid()) return false;
 
@@ -1009,7 +1235,7 @@ bool do_sync_push(const std::vector<const char*>& srcs, const char* dst, bool sy
 				dst_dir.append(android::base::Basename(src_path));
 			}
 
-			success &= copy_local_dir_remote(sc, src_path, dst_dir.c_str(), sync, false);
+			success &= copy_local_dir_remote(sc, src_path, dst_dir.c_str(), sync, false, resume);
 			continue;
 		}
 		else if (!should_push_file(st.st_mode)) {
@@ -1031,7 +1257,7 @@ bool do_sync_push(const std::vector<const char*>& srcs, const char* dst, bool sy
 
 		sc.NewTransfer();
 		sc.SetExpectedTotalBytes(st.st_size);
-		success &= sync_send(sc, src_path, dst_path, st.st_mtime, st.st_mode, sync);
+		success &= sync_send(sc, src_path, dst_path, st.st_mtime, st.st_mode, sync, resume);
 		sc.ReportTransferRate(src_path, TransferDirection::push);
 	}
 
@@ -1119,7 +1345,7 @@ static int set_time_and_mode(const std::string& lpath, time_t time,
 }
 
 static bool copy_remote_dir_local(SyncConnection& sc, std::string rpath,
-	std::string lpath, bool copy_attrs) {
+	std::string lpath, bool copy_attrs, bool resume) {
 	sc.NewTransfer();
 
 	// Make sure that both directory paths end in a slash.
@@ -1149,7 +1375,7 @@ static bool copy_remote_dir_local(SyncConnection& sc, std::string rpath,
 				continue;
 			}
 
-			if (!sync_recv(sc, ci.rpath.c_str(), ci.lpath.c_str(), nullptr, ci.size)) {
+			if (!sync_recv(sc, ci.rpath.c_str(), ci.lpath.c_str(), nullptr, ci.size, resume)) {
 				return false;
 			}
 
@@ -1168,7 +1394,7 @@ static bool copy_remote_dir_local(SyncConnection& sc, std::string rpath,
 }
 
 bool do_sync_pull(const std::vector<const char*>& srcs, const char* dst,
-	bool copy_attrs, const char* name) {
+	bool copy_attrs, const char* name, bool resume) {
 	SyncConnection sc;
 	if (!sc.IsValid()) return false;
 
@@ -1245,7 +1471,7 @@ bool do_sync_pull(const std::vector<const char*>& srcs, const char* dst,
 				dst_dir.append(android::base::Basename(src_path));
 			}
 
-			success &= copy_remote_dir_local(sc, src_path, dst_dir.c_str(), copy_attrs);
+			success &= copy_remote_dir_local(sc, src_path, dst_dir.c_str(), copy_attrs, resume);
 			continue;
 		}
 		else if (!should_pull_file(src_st.st_mode)) {
@@ -1265,7 +1491,7 @@ bool do_sync_pull(const std::vector<const char*>& srcs, const char* dst,
 
 		sc.NewTransfer();
 		sc.SetExpectedTotalBytes(src_st.st_size);
-		if (!sync_recv(sc, src_path, dst_path, name, src_st.st_size)) {
+		if (!sync_recv(sc, src_path, dst_path, name, src_st.st_size, resume)) {
 			success = false;
 			continue;
 		}
@@ -1285,7 +1511,7 @@ bool do_sync_sync(const std::string& lpath, const std::string& rpath, bool list_
 	SyncConnection sc;
 	if (!sc.IsValid()) return false;
 
-	bool success = copy_local_dir_remote(sc, lpath, rpath, true, list_only);
+	bool success = copy_local_dir_remote(sc, lpath, rpath, true, list_only, false);
 	if (!list_only) {
 		sc.ReportOverallTransferRate(TransferDirection::push);
 	}
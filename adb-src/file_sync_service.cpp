@@ -21,6 +21,8 @@
 
 #include <dirent.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <linux/falloc.h>
 #include <linux/xattr.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -31,7 +33,11 @@
 #include <unistd.h>
 #include <utime.h>
 
+#include <algorithm>
+#include <thread>
+
 #include <android-base/file.h>
+#include <android-base/parseint.h>
 #include <android-base/stringprintf.h>
 #include <android-base/strings.h>
 #include <private/android_filesystem_config.h>
@@ -70,13 +76,14 @@ static bool update_capabilities(const char* path, uint64_t capabilities) {
 	return setxattr(path, XATTR_NAME_CAPS, &cap_data, sizeof(cap_data), 0) != -1;
 }
 
-static bool secure_mkdirs(const std::string& path) {
-	uid_t uid = -1;
-	gid_t gid = -1;
-	unsigned int mode = 0775;
-	uint64_t capabilities = 0;
+using internal::DirectoryCache;
+using internal::DirectoryInfo;
+
+bool internal::secure_mkdirs(const std::string& path, DirectoryCache* dirs) {
+	DirectoryInfo info = { static_cast<uid_t>(-1), static_cast<gid_t>(-1), 0775, 0 };
 
 	if (path[0] != '/') return false;
+	if (dirs->count(path)) return true;
 
 	std::vector<std::string> path_components = android::base::Split(path, "/");
 	std::string partial_path;
@@ -84,26 +91,49 @@ static bool secure_mkdirs(const std::string& path) {
 		if (partial_path.back() != OS_PATH_SEPARATOR) partial_path += OS_PATH_SEPARATOR;
 		partial_path += path_component;
 
+		auto it = dirs->find(partial_path);
+		if (it != dirs->end()) {
+			info = it->second;
+			continue;
+		}
+
 		if (should_use_fs_config(partial_path)) {
-			fs_config(partial_path.c_str(), 1, nullptr, &uid, &gid, &mode, &capabilities);
+			fs_config(partial_path.c_str(), 1, nullptr, &info.uid, &info.gid, &info.mode,
+				&info.capabilities);
 		}
-		if (adb_mkdir(partial_path.c_str(), mode) == -1) {
+		if (adb_mkdir(partial_path.c_str(), info.mode) == -1) {
 			if (errno != EEXIST) {
+				dirs->clear();
 				return false;
 			}
 		}
 		else {
-			if (chown(partial_path.c_str(), uid, gid) == -1) return false;
+			if (chown(partial_path.c_str(), info.uid, info.gid) == -1) {
+				dirs->clear();
+				return false;
+			}
 
 			// Not all filesystems support setting SELinux labels. http://b/23530370.
 			selinux_android_restorecon(partial_path.c_str(), 0);
 
-			if (!update_capabilities(partial_path.c_str(), capabilities)) return false;
+			if (!update_capabilities(partial_path.c_str(), info.capabilities)) {
+				dirs->clear();
+				return false;
+			}
 		}
+		dirs->emplace(partial_path, info);
 	}
 	return true;
 }
 
+// Creates the parent directories of |path|, after creating |path| itself failed with ENOENT.
+static bool secure_mkdirs_for(const std::string& path, DirectoryCache* dirs) {
+	std::string dir = android::base::Dirname(path);
+	// If we thought the parent existed, it has been removed since; don't trust anything we cached.
+	if (dirs->count(dir)) dirs->clear();
+	return internal::secure_mkdirs(dir, dirs);
+}
+
 static bool do_lstat_v1(int s, const char* path) {
 	syncmsg msg = {};
 	msg.stat_v1.id = ID_LSTAT_V1;
@@ -169,8 +199,11 @@ static bool do_list(int s, const char* path) {
 			msg.dent.time = st.st_mtime;
 			msg.dent.namelen = d_name_length;
 
-			if (!WriteFdExactly(s, &msg.dent, sizeof(msg.dent)) ||
-				!WriteFdExactly(s, de->d_name, d_name_length)) {
+			adb_iovec iov[] = {
+				{ &msg.dent, sizeof(msg.dent) },
+				{ de->d_name, d_name_length },
+			};
+			if (!WriteFdExactlyV(s, iov, 2)) {
 				return false;
 			}
 		}
@@ -194,25 +227,127 @@ static bool SendSyncFail(int fd, const std::string& reason) {
 	syncmsg msg;
 	msg.data.id = ID_FAIL;
 	msg.data.size = reason.size();
-	return WriteFdExactly(fd, &msg.data, sizeof(msg.data)) && WriteFdExactly(fd, reason);
+	adb_iovec iov[] = {
+		{ &msg.data, sizeof(msg.data) },
+		{ const_cast<char*>(reason.data()), reason.size() },
+	};
+	return WriteFdExactlyV(fd, iov, 2);
 }
 
 static bool SendSyncFailErrno(int fd, const std::string& reason) {
 	return SendSyncFail(fd, StringPrintf("%s: %s", reason.c_str(), strerror(errno)));
 }
 
-static bool handle_send_file(int s, const char* path, uid_t uid, gid_t gid, uint64_t capabilities,
-	mode_t mode, std::vector<char>& buffer, bool do_unlink) {
+static bool SendSyncHole(int fd, uint64_t length) {
 	syncmsg msg;
-	unsigned int timestamp = 0;
+	msg.data.id = ID_HOLE;
+	while (length > 0) {
+		msg.data.size = std::min<uint64_t>(length, UINT32_MAX);
+		if (!WriteFdExactly(fd, &msg.data, sizeof(msg.data))) return false;
+		length -= msg.data.size;
+	}
+	return true;
+}
 
-	__android_log_security_bswrite(SEC_TAG_ADB_SEND_FILE, path);
+// Skips over |length| zero bytes in the file being written. For a regular file, seeking over the
+// range is enough to leave a hole behind (handle_send_file extends the file over a trailing one),
+// but anything already in the file there has to be punched out. Files that can't have holes, such
+// as block devices, just get the zeros written out.
+static bool write_hole(int fd, uint64_t length, std::vector<char>& buffer) {
+	struct stat st;
+	if (fstat(fd, &st) == -1) return false;
+	int64_t offset = adb_lseek64(fd, 0, SEEK_CUR);
+	if (offset == -1) return false;
+
+	if (S_ISREG(st.st_mode)) {
+		int64_t existing = std::min<int64_t>(length, std::max<int64_t>(st.st_size - offset, 0));
+		if (existing == 0 ||
+			fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, existing) == 0) {
+			return adb_lseek64(fd, length, SEEK_CUR) != -1;
+		}
+	}
+
+	memset(&buffer[0], 0, buffer.size());
+	while (length > 0) {
+		size_t count = std::min<uint64_t>(length, buffer.size());
+		if (!WriteFdExactly(fd, &buffer[0], count)) return false;
+		length -= count;
+	}
+	return true;
+}
+
+// Splits a trailing ",<number>" off |spec|.
+static bool split_trailing_number(std::string* spec, uint64_t* value) {
+	size_t comma = spec->find_last_of(',');
+	if (comma == std::string::npos ||
+		!android::base::ParseUint(spec->substr(comma + 1).c_str(), value)) {
+		return false;
+	}
+	spec->resize(comma);
+	return true;
+}
+
+// Opens |path| to continue a transfer that already wrote its first |offset| bytes, dropping
+// anything after them.
+static int open_for_resume(const char* path, mode_t mode, uint64_t offset) {
+	int fd = adb_open_mode(path, O_WRONLY | O_CLOEXEC, mode);
+	if (fd < 0) return -1;
+
+	struct stat st;
+	if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode) ||
+		static_cast<uint64_t>(st.st_size) < offset) {
+		if (errno == 0) errno = EINVAL;
+		adb_close(fd);
+		return -1;
+	}
+	if (ftruncate64(fd, offset) == -1 || adb_lseek64(fd, offset, SEEK_SET) == -1) {
+		adb_close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+// Works out the mode, owner and capabilities a pushed file at |path| should get, given the mode
+// the client asked for.
+static void get_send_attributes(const std::string& path, mode_t* mode, uid_t* uid, gid_t* gid,
+	uint64_t* capabilities) {
+	// Copy user permission bits to "group" and "other" permissions.
+	*mode &= 0777;
+	*mode |= ((*mode >> 3) & 0070);
+	*mode |= ((*mode >> 3) & 0007);
+
+	*uid = -1;
+	*gid = -1;
+	*capabilities = 0;
+	if (should_use_fs_config(path)) {
+		unsigned int broken_api_hack = *mode;
+		fs_config(path.c_str(), 0, nullptr, uid, gid, &broken_api_hack, capabilities);
+		*mode = broken_api_hack;
+	}
+}
 
-	int fd = adb_open_mode(path, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, mode);
+static std::string errno_reason(const char* reason) {
+	return StringPrintf("%s: %s", reason, strerror(errno));
+}
+
+int internal::create_send_file(const char* path, uid_t uid, gid_t gid, mode_t mode, uint64_t offset,
+	DirectoryCache* dirs, std::string* error) {
+	int fd;
+	if (offset > 0) {
+		errno = 0;
+		fd = open_for_resume(path, mode, offset);
+		if (fd < 0) {
+			*error = errno_reason("couldn't resume file");
+			return -1;
+		}
+	}
+	else {
+		fd = adb_open_mode(path, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, mode);
+	}
 	if (fd < 0 && errno == ENOENT) {
-		if (!secure_mkdirs(android::base::Dirname(path))) {
-			SendSyncFailErrno(s, "secure_mkdirs failed");
-			goto fail;
+		if (!secure_mkdirs_for(path, dirs)) {
+			*error = errno_reason("secure_mkdirs failed");
+			return -1;
 		}
 		fd = adb_open_mode(path, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, mode);
 	}
@@ -220,26 +355,58 @@ static bool handle_send_file(int s, const char* path, uid_t uid, gid_t gid, uint
 		fd = adb_open_mode(path, O_WRONLY | O_CLOEXEC, mode);
 	}
 	if (fd < 0) {
-		SendSyncFailErrno(s, "couldn't create file");
-		goto fail;
+		*error = errno_reason("couldn't create file");
+		dirs->clear();
+		return -1;
 	}
-	else {
-		if (fchown(fd, uid, gid) == -1) {
-			SendSyncFailErrno(s, "fchown failed");
-			goto fail;
-		}
 
-		// Not all filesystems support setting SELinux labels. http://b/23530370.
-		selinux_android_restorecon(path, 0);
+	// Only paths under fs_config have an owner to set; fchown(-1, -1) would change nothing.
+	if ((uid != static_cast<uid_t>(-1) || gid != static_cast<gid_t>(-1)) &&
+		fchown(fd, uid, gid) == -1) {
+		*error = errno_reason("fchown failed");
+		adb_close(fd);
+		return -1;
+	}
+
+	// Not all filesystems support setting SELinux labels. http://b/23530370.
+	// Labels come from file_contexts by path, so unlike the directory work above there's
+	// nothing a parent directory's entry could stand in for.
+	selinux_android_restorecon(path, 0);
+
+	// fchown clears the setuid bit - restore it if present.
+	// Ignore the result of calling fchmod. It's not supported
+	// by all filesystems, so we don't check for success. b/12441485
+	fchmod(fd, mode);
+	return fd;
+}
+
+static bool handle_send_file(int s, const char* path, uid_t uid, gid_t gid, uint64_t capabilities,
+	mode_t mode, std::vector<char>& buffer, DirectoryCache* dirs, bool do_unlink, uint64_t offset,
+	bool resume) {
+	syncmsg msg;
+	unsigned int timestamp = 0;
+	bool saw_hole = false;
+	std::string error;
+
+	__android_log_security_bswrite(SEC_TAG_ADB_SEND_FILE, path);
 
-		// fchown clears the setuid bit - restore it if present.
-		// Ignore the result of calling fchmod. It's not supported
-		// by all filesystems, so we don't check for success. b/12441485
-		fchmod(fd, mode);
+	int fd = internal::create_send_file(path, uid, gid, mode, offset, dirs, &error);
+	if (fd < 0) {
+		SendSyncFail(s, error);
+		goto fail;
 	}
 
 	while (true) {
-		if (!ReadFdExactly(s, &msg.data, sizeof(msg.data))) goto fail;
+		if (!ReadFdExactly(s, &msg.data, sizeof(msg.data))) goto disconnected;
+
+		if (msg.data.id == ID_HOLE) {
+			if (!write_hole(fd, msg.data.size, buffer)) {
+				SendSyncFailErrno(s, "write failed");
+				goto fail;
+			}
+			saw_hole = true;
+			continue;
+		}
 
 		if (msg.data.id != ID_DATA) {
 			if (msg.data.id == ID_DONE) {
@@ -255,7 +422,7 @@ static bool handle_send_file(int s, const char* path, uid_t uid, gid_t gid, uint
 			goto abort;
 		}
 
-		if (!ReadFdExactly(s, &buffer[0], msg.data.size)) goto abort;
+		if (!ReadFdExactly(s, &buffer[0], msg.data.size)) goto disconnected;
 
 		if (!WriteFdExactly(fd, &buffer[0], msg.data.size)) {
 			SendSyncFailErrno(s, "write failed");
@@ -263,6 +430,17 @@ static bool handle_send_file(int s, const char* path, uid_t uid, gid_t gid, uint
 		}
 	}
 
+	if (saw_hole) {
+		// A trailing hole has only been seeked over so far.
+		struct stat st;
+		int64_t end = adb_lseek64(fd, 0, SEEK_CUR);
+		if (end == -1 || fstat(fd, &st) == -1 ||
+			(S_ISREG(st.st_mode) && end > st.st_size && ftruncate64(fd, end) == -1)) {
+			SendSyncFailErrno(s, "ftruncate failed");
+			goto fail;
+		}
+	}
+
 	adb_close(fd);
 
 	if (!update_capabilities(path, capabilities)) {
@@ -287,11 +465,14 @@ fail:
 	// reading and throwing away ID_DATA packets until the other side notices
 	// that we've reported an error.
 	while (true) {
-		if (!ReadFdExactly(s, &msg.data, sizeof(msg.data))) goto fail;
+		if (!ReadFdExactly(s, &msg.data, sizeof(msg.data))) goto abort;
 
 		if (msg.data.id == ID_DONE) {
 			goto abort;
 		}
+		else if (msg.data.id == ID_HOLE) {
+			continue;
+		}
 		else if (msg.data.id != ID_DATA) {
 			char id[5];
 			memcpy(id, &msg.data.id, sizeof(msg.data.id));
@@ -313,12 +494,20 @@ abort:
 	if (fd >= 0) adb_close(fd);
 	if (do_unlink) adb_unlink(path);
 	return false;
+
+disconnected:
+	// The other side went away mid-transfer. A resumable push keeps what we've written so that
+	// the next push --resume can pick up from it; anything else mustn't leave a truncated file.
+	if (!resume) goto fail;
+	adb_close(fd);
+	return false;
 }
 
 #if defined(_WIN32)
-extern bool handle_send_link(int s, const std::string& path, std::vector<char>& buffer) __attribute__((error("no symlinks on Windows")));
+extern bool handle_send_link(int s, const std::string& path, std::vector<char>& buffer, DirectoryCache* dirs) __attribute__((error("no symlinks on Windows")));
 #else
-static bool handle_send_link(int s, const std::string& path, std::vector<char>& buffer) {
+static bool handle_send_link(int s, const std::string& path, std::vector<char>& buffer,
+	DirectoryCache* dirs) {
 	syncmsg msg;
 	unsigned int len;
 	int ret;
@@ -339,7 +528,7 @@ static bool handle_send_link(int s, const std::string& path, std::vector<char>&
 
 	ret = symlink(&buffer[0], path.c_str());
 	if (ret && errno == ENOENT) {
-		if (!secure_mkdirs(android::base::Dirname(path))) {
+		if (!secure_mkdirs_for(path, dirs)) {
 			SendSyncFailErrno(s, "secure_mkdirs failed");
 			return false;
 		}
@@ -366,7 +555,15 @@ static bool handle_send_link(int s, const std::string& path, std::vector<char>&
 }
 #endif
 
-static bool do_send(int s, const std::string& spec, std::vector<char>& buffer) {
+static bool do_send(int s, std::string spec, std::vector<char>& buffer, DirectoryCache* dirs,
+	bool resume) {
+	// A resumed send's 'spec' has the offset to resume from on the end.
+	uint64_t offset = 0;
+	if (resume && !split_trailing_number(&spec, &offset)) {
+		SendSyncFail(s, "bad offset in ID_SEND_RESUME");
+		return false;
+	}
+
 	// 'spec' is of the form "/some/path,0755". Break it up.
 	size_t comma = spec.find_last_of(',');
 	if (comma == std::string::npos) {
@@ -383,34 +580,29 @@ static bool do_send(int s, const std::string& spec, std::vector<char>& buffer) {
 		return false;
 	}
 
-	// Don't delete files before copying if they are not "regular" or symlinks.
+	// Don't delete files before copying if they are not "regular" or symlinks, or if we're
+	// going to resume writing them.
 	struct stat st;
-	bool do_unlink = (lstat(path.c_str(), &st) == -1) || S_ISREG(st.st_mode) || S_ISLNK(st.st_mode);
+	bool do_unlink = offset == 0 &&
+		((lstat(path.c_str(), &st) == -1) || S_ISREG(st.st_mode) || S_ISLNK(st.st_mode));
 	if (do_unlink) {
 		adb_unlink(path.c_str());
 	}
 
 	if (S_ISLNK(mode)) {
-		return handle_send_link(s, path.c_str(), buffer);
+		return handle_send_link(s, path.c_str(), buffer, dirs);
 	}
 
-	// Copy user permission bits to "group" and "other" permissions.
-	mode &= 0777;
-	mode |= ((mode >> 3) & 0070);
-	mode |= ((mode >> 3) & 0007);
-
-	uid_t uid = -1;
-	gid_t gid = -1;
-	uint64_t capabilities = 0;
-	if (should_use_fs_config(path)) {
-		unsigned int broken_api_hack = mode;
-		fs_config(path.c_str(), 0, nullptr, &uid, &gid, &broken_api_hack, &capabilities);
-		mode = broken_api_hack;
-	}
-	return handle_send_file(s, path.c_str(), uid, gid, capabilities, mode, buffer, do_unlink);
+	uid_t uid;
+	gid_t gid;
+	uint64_t capabilities;
+	get_send_attributes(path, &mode, &uid, &gid, &capabilities);
+	return handle_send_file(s, path.c_str(), uid, gid, capabilities, mode, buffer, dirs,
+		do_unlink, offset, resume);
 }
 
-static bool do_recv(int s, const char* path, std::vector<char>& buffer) {
+static bool do_recv(int s, const char* path, std::vector<char>& buffer, bool sparse,
+	int64_t offset) {
 	__android_log_security_bswrite(SEC_TAG_ADB_RECV_FILE, path);
 
 	int fd = adb_open(path, O_RDONLY | O_CLOEXEC);
@@ -418,22 +610,51 @@ static bool do_recv(int s, const char* path, std::vector<char>& buffer) {
 		SendSyncFailErrno(s, "open failed");
 		return false;
 	}
+	if (offset > 0 && adb_lseek64(fd, offset, SEEK_SET) == -1) {
+		SendSyncFailErrno(s, "seek failed");
+		adb_close(fd);
+		return false;
+	}
 
 	syncmsg msg;
-	msg.data.id = ID_DATA;
+	// End of the data extent we're currently sending. Dense transfers have a single extent.
+	int64_t data_end = sparse ? offset : INT64_MAX;
 	while (true) {
-		int r = adb_read(fd, &buffer[0], buffer.size());
+		if (offset == data_end) {
+			int64_t data_start;
+			if (!find_data_extent(fd, offset, &data_start, &data_end)) {
+				// This filesystem can't tell us where the holes are, so send the rest as data.
+				data_end = INT64_MAX;
+			}
+			else {
+				if (!SendSyncHole(s, data_start - offset)) {
+					adb_close(fd);
+					return false;
+				}
+				offset = data_start;
+				if (data_start == data_end) break;
+			}
+		}
+
+		size_t count = std::min<int64_t>(buffer.size(), data_end - offset);
+		int r = adb_read(fd, &buffer[0], count);
 		if (r <= 0) {
 			if (r == 0) break;
 			SendSyncFailErrno(s, "read failed");
 			adb_close(fd);
 			return false;
 		}
+		msg.data.id = ID_DATA;
 		msg.data.size = r;
-		if (!WriteFdExactly(s, &msg.data, sizeof(msg.data)) || !WriteFdExactly(s, &buffer[0], r)) {
+		adb_iovec iov[] = {
+			{ &msg.data, sizeof(msg.data) },
+			{ &buffer[0], static_cast<size_t>(r) },
+		};
+		if (!WriteFdExactlyV(s, iov, 2)) {
 			adb_close(fd);
 			return false;
 		}
+		offset += r;
 	}
 
 	adb_close(fd);
@@ -443,6 +664,150 @@ static bool do_recv(int s, const char* path, std::vector<char>& buffer) {
 	return WriteFdExactly(s, &msg.data, sizeof(msg.data));
 }
 
+static bool do_recv_resume(int s, std::string spec, std::vector<char>& buffer) {
+	// 'spec' is of the form "/some/path,<offset>,<flags>".
+	uint64_t flags;
+	uint64_t offset;
+	if (!split_trailing_number(&spec, &flags) || !split_trailing_number(&spec, &offset) ||
+		offset > INT64_MAX) {
+		SendSyncFail(s, "bad ID_RECV_RESUME");
+		return false;
+	}
+	return do_recv(s, spec.c_str(), buffer, (flags & kSyncFlagSparse) != 0, offset);
+}
+
+static bool do_hash(int s, std::string spec) {
+	// 'spec' is of the form "/some/path,<length>".
+	uint64_t length;
+	if (!split_trailing_number(&spec, &length)) {
+		SendSyncFail(s, "bad length in ID_HASH");
+		return false;
+	}
+
+	syncmsg msg = {};
+	msg.hash.id = ID_HASH;
+
+	std::string digest;
+	uint64_t hashed_length = 0;
+	int fd = adb_open(spec.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd < 0 || !hash_file_prefix(fd, length, &digest, &hashed_length)) {
+		msg.hash.error = errno_to_wire(errno);
+	}
+	else {
+		msg.hash.size = hashed_length;
+		memcpy(msg.hash.digest, digest.data(), sizeof(msg.hash.digest));
+	}
+	if (fd >= 0) adb_close(fd);
+
+	return WriteFdExactly(s, &msg.hash, sizeof(msg.hash));
+}
+
+// Writes out one file of an ID_SEND_BATCH, returning false with the reason in |error| if that
+// fails.
+static bool write_batch_file(const internal::BatchFile& file, DirectoryCache* dirs,
+	std::string* error) {
+	const char* path = file.path.c_str();
+	__android_log_security_bswrite(SEC_TAG_ADB_SEND_FILE, path);
+
+	// Don't delete files before copying if they are not "regular" or symlinks.
+	struct stat st;
+	bool do_unlink = (lstat(path, &st) == -1) || S_ISREG(st.st_mode) || S_ISLNK(st.st_mode);
+	if (do_unlink) {
+		adb_unlink(path);
+	}
+
+	mode_t mode = file.mode;
+	uid_t uid;
+	gid_t gid;
+	uint64_t capabilities;
+	get_send_attributes(file.path, &mode, &uid, &gid, &capabilities);
+
+	int fd = internal::create_send_file(path, uid, gid, mode, 0, dirs, error);
+	if (fd >= 0) {
+		if (!WriteFdExactly(fd, file.data.data(), file.data.size())) {
+			*error = errno_reason("write failed");
+		}
+		adb_close(fd);
+	}
+	if (error->empty() && !update_capabilities(path, capabilities)) {
+		*error = errno_reason("update_capabilities failed");
+	}
+	if (!error->empty()) {
+		if (fd >= 0 && do_unlink) adb_unlink(path);
+		return false;
+	}
+
+	utimbuf u;
+	u.actime = file.mtime;
+	u.modtime = file.mtime;
+	utime(path, &u);
+	return true;
+}
+
+static bool do_send_batch(int s, DirectoryCache* dirs) {
+	internal::BatchQueue queue;
+	std::string failures;
+	size_t failure_count = 0;
+	// Only the writer touches |dirs| until it has been joined.
+	std::thread writer([&queue, dirs, &failures, &failure_count]() {
+		adb_thread_setname("sync batch");
+		internal::BatchFile file;
+		while (queue.Pop(&file)) {
+			std::string error;
+			if (!write_batch_file(file, dirs, &error) &&
+				failure_count++ < SYNC_BATCH_MAX_FAILURES) {
+				failures += StringPrintf("%s: %s\n", file.path.c_str(), error.c_str());
+			}
+		}
+	});
+
+	syncmsg msg;
+	bool ok = true;
+	while (true) {
+		if (!ReadFdExactly(s, &msg.batch, sizeof(msg.batch))) {
+			ok = false;
+			break;
+		}
+		if (msg.batch.id == ID_DONE) break;
+
+		if (msg.batch.id != ID_FILE || msg.batch.path_length == 0 ||
+			msg.batch.path_length > 1024 || msg.batch.size > SYNC_DATA_MAX) {
+			SendSyncFail(s, "invalid batch message");
+			ok = false;
+			break;
+		}
+
+		internal::BatchFile file;
+		file.path.resize(msg.batch.path_length);
+		file.data.resize(msg.batch.size);
+		if (!ReadFdExactly(s, &file.path[0], file.path.size()) ||
+			!ReadFdExactly(s, file.data.data(), file.data.size())) {
+			ok = false;
+			break;
+		}
+		file.mode = msg.batch.mode;
+		file.mtime = msg.batch.mtime;
+		queue.Push(std::move(file));
+	}
+
+	queue.Finish();
+	writer.join();
+	if (!ok) return false;
+
+	if (failure_count > 0) {
+		// Individual failures don't end the sync session.
+		if (failure_count > SYNC_BATCH_MAX_FAILURES) {
+			failures += StringPrintf("+%zu more\n", failure_count - SYNC_BATCH_MAX_FAILURES);
+		}
+		failures.pop_back();
+		return SendSyncFail(s, failures);
+	}
+
+	msg.status.id = ID_OKAY;
+	msg.status.msglen = 0;
+	return WriteFdExactly(s, &msg.status, sizeof(msg.status));
+}
+
 static const char* sync_id_to_name(uint32_t id) {
 	switch (id) {
 	case ID_LSTAT_V1:
@@ -457,6 +822,16 @@ static const char* sync_id_to_name(uint32_t id) {
 		return "send";
 	case ID_RECV:
 		return "recv";
+	case ID_RECV_SPARSE:
+		return "recv_sparse";
+	case ID_HASH:
+		return "hash";
+	case ID_SEND_RESUME:
+		return "send_resume";
+	case ID_RECV_RESUME:
+		return "recv_resume";
+	case ID_SEND_BATCH:
+		return "send_batch";
 	case ID_QUIT:
 		return "quit";
 	default:
@@ -464,7 +839,7 @@ static const char* sync_id_to_name(uint32_t id) {
 	}
 }
 
-static bool handle_sync_command(int fd, std::vector<char>& buffer) {
+static bool handle_sync_command(int fd, std::vector<char>& buffer, DirectoryCache* dirs) {
 	D("sync: waiting for request");
 
 	ATRACE_CALL();
@@ -502,10 +877,21 @@ static bool handle_sync_command(int fd, std::vector<char>& buffer) {
 		if (!do_list(fd, name)) return false;
 		break;
 	case ID_SEND:
-		if (!do_send(fd, name, buffer)) return false;
+	case ID_SEND_RESUME:
+		if (!do_send(fd, name, buffer, dirs, request.id == ID_SEND_RESUME)) return false;
 		break;
 	case ID_RECV:
-		if (!do_recv(fd, name, buffer)) return false;
+	case ID_RECV_SPARSE:
+		if (!do_recv(fd, name, buffer, request.id == ID_RECV_SPARSE, 0)) return false;
+		break;
+	case ID_RECV_RESUME:
+		if (!do_recv_resume(fd, name, buffer)) return false;
+		break;
+	case ID_HASH:
+		if (!do_hash(fd, name)) return false;
+		break;
+	case ID_SEND_BATCH:
+		if (!do_send_batch(fd, dirs)) return false;
 		break;
 	case ID_QUIT:
 		return false;
@@ -519,8 +905,9 @@ static bool handle_sync_command(int fd, std::vector<char>& buffer) {
 
 void file_sync_service(int fd, void*) {
 	std::vector<char> buffer(SYNC_DATA_MAX);
+	DirectoryCache dirs;
 
-	while (handle_sync_command(fd, buffer)) {
+	while (handle_sync_command(fd, buffer, &dirs)) {
 	}
 
 	D("sync: done");
@@ -17,7 +17,14 @@
 #ifndef _FILE_SYNC_SERVICE_H_
 #define _FILE_SYNC_SERVICE_H_
 
+#include <stdint.h>
+#include <sys/types.h>
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
 #include <string>
+#include <unordered_map>
 #include <vector>
 
 #define MKID(a,b,c,d) ((a) | ((b) << 8) | ((c) << 16) | ((d) << 24))
@@ -35,6 +42,34 @@
 #define ID_FAIL MKID('F','A','I','L')
 #define ID_QUIT MKID('Q','U','I','T')
 
+// Sparse transfers (kFeatureSparse). ID_RECV_SPARSE is ID_RECV, but the reply may contain ID_HOLE
+// messages; an ID_SEND data stream may contain them whenever the device advertises the feature.
+// An ID_HOLE's 'size' is a run of zero bytes that isn't sent over the wire.
+#define ID_RECV_SPARSE MKID('R','C','V','S')
+#define ID_HOLE MKID('H','O','L','E')
+
+// Resumable transfers (kFeatureResume).
+//   ID_HASH "<path>,<length>" replies with a 'hash' message: the SHA-256 of the file's first
+//     <length> bytes (or of all of it, if it's shorter; 'size' says how much was hashed).
+//   ID_SEND_RESUME "<path>,<mode>,<offset>" is ID_SEND, but keeps the first <offset> bytes of the
+//     existing file and appends the data stream after them.
+//   ID_RECV_RESUME "<path>,<offset>,<flags>" is ID_RECV starting at <offset>. If <flags> has
+//     kSyncFlagSparse set, the reply may contain ID_HOLE messages as for ID_RECV_SPARSE.
+#define ID_HASH MKID('H','A','S','H')
+#define ID_SEND_RESUME MKID('S','N','D','R')
+#define ID_RECV_RESUME MKID('R','C','V','R')
+
+#define kSyncFlagSparse 0x1
+
+// Batched pushes of small regular files (kFeatureSendBatch). ID_SEND_BATCH (with an empty path)
+// is followed by any number of 'batch' messages with id ID_FILE, each followed by 'path_length'
+// bytes of path and 'size' (<= SYNC_DATA_MAX) bytes of file content, and then by a 'batch'
+// message with id ID_DONE. The device replies with a single 'status': ID_OKAY if every file was
+// written, or ID_FAIL with a "<path>: <reason>" line for each of the first
+// SYNC_BATCH_MAX_FAILURES files that weren't, then a "+<count> more" line if there were more.
+#define ID_SEND_BATCH MKID('S','N','D','B')
+#define ID_FILE MKID('F','I','L','E')
+
 struct SyncRequest {
 	uint32_t id;  // ID_STAT, et cetera.
 	uint32_t path_length;  // <= 1024
@@ -77,16 +112,107 @@ union syncmsg {
 		uint32_t id;
 		uint32_t msglen;
 	} status;
+	struct __attribute__((packed)) {
+		uint32_t id;
+		uint32_t error;
+		uint64_t size;
+		uint8_t digest[32];
+	} hash;
+	struct __attribute__((packed)) {
+		uint32_t id;
+		uint32_t mode;
+		uint32_t mtime;
+		uint32_t size;
+		uint32_t path_length;
+	} batch;
 };
 
 void file_sync_service(int fd, void* cookie);
 bool do_sync_ls(const char* path);
-bool do_sync_push(const std::vector<const char*>& srcs, const char* dst, bool sync);
+bool do_sync_push(const std::vector<const char*>& srcs, const char* dst, bool sync,
+	bool resume = false);
 bool do_sync_pull(const std::vector<const char*>& srcs, const char* dst,
-	bool copy_attrs, const char* name = nullptr);
+	bool copy_attrs, const char* name = nullptr, bool resume = false);
 
 bool do_sync_sync(const std::string& lpath, const std::string& rpath, bool list_only);
 
 #define SYNC_DATA_MAX (64*1024)
+#define SYNC_BATCH_MAX_FAILURES 16
+
+#if !ADB_HOST
+// Internal parts of the sync service that are only made available here for testing purposes.
+namespace internal {
+	// The ownership secure_mkdirs resolved for a directory, which its subdirectories inherit.
+	struct DirectoryInfo {
+		uid_t uid;
+		gid_t gid;
+		unsigned int mode;
+		uint64_t capabilities;
+	};
+
+	// Directories a sync session has created (or found already there), so that pushing a deep
+	// tree doesn't mkdir, chown and relabel every ancestor again for every file. Anything that
+	// fails clears it, since the device may have changed underneath us.
+	using DirectoryCache = std::unordered_map<std::string, DirectoryInfo>;
+
+	// Creates |path| and any missing ancestors, with their fs_config ownership and SELinux labels.
+	bool secure_mkdirs(const std::string& path, DirectoryCache* dirs);
+
+	// Opens |path| for writing a pushed file, creating it (and its parent directories) if
+	// necessary, and applies its owner, SELinux label and mode. A non-zero |offset| resumes an
+	// earlier push. On failure, returns -1 and sets |error|.
+	int create_send_file(const char* path, uid_t uid, gid_t gid, mode_t mode, uint64_t offset,
+		DirectoryCache* dirs, std::string* error);
+
+	struct BatchFile {
+		std::string path;
+		mode_t mode;
+		uint32_t mtime;
+		std::vector<char> data;
+	};
+
+	// Hands the files of an ID_SEND_BATCH from the thread reading them off the socket to the
+	// thread writing them out. At most kMaxQueuedBytes are held at once, so a slow filesystem
+	// pushes back on the client rather than letting the whole batch pile up in memory.
+	class BatchQueue {
+	public:
+		static constexpr size_t kMaxQueuedBytes = 4 * 1024 * 1024;
+
+		void Push(BatchFile file) {
+			std::unique_lock<std::mutex> lock(mutex_);
+			not_full_.wait(lock, [this]() { return queued_bytes_ < kMaxQueuedBytes; });
+			queued_bytes_ += file.data.size();
+			files_.push_back(std::move(file));
+			not_empty_.notify_one();
+		}
+
+		// Returns false once Finish has been called and every queued file has been popped.
+		bool Pop(BatchFile* file) {
+			std::unique_lock<std::mutex> lock(mutex_);
+			not_empty_.wait(lock, [this]() { return !files_.empty() || finished_; });
+			if (files_.empty()) return false;
+			*file = std::move(files_.front());
+			files_.pop_front();
+			queued_bytes_ -= file->data.size();
+			not_full_.notify_one();
+			return true;
+		}
+
+		void Finish() {
+			std::lock_guard<std::mutex> lock(mutex_);
+			finished_ = true;
+			not_empty_.notify_one();
+		}
+
+	private:
+		std::mutex mutex_;
+		std::condition_variable not_empty_;
+		std::condition_variable not_full_;
+		std::deque<BatchFile> files_;
+		size_t queued_bytes_ = 0;
+		bool finished_ = false;
+	};
+}  // namespace internal
+#endif
 
 #endif
@@ -0,0 +1,337 @@
+/*
+ * Copyright (C) 2017 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "file_sync_service.h"
+
+#include <gtest/gtest.h>
+
+#include <signal.h>
+#include <sys/stat.h>
+
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <android-base/file.h>
+#include <android-base/strings.h>
+#include <android-base/test_utils.h>
+
+#include "adb_io.h"
+#include "sysdeps.h"
+#include "sysdeps/chrono.h"
+
+// Runs the sync service on one end of a socketpair, and talks to it through the other.
+class FileSyncServiceTest : public ::testing::Test {
+protected:
+	virtual void SetUp() override {
+		saved_sigpipe_handler_ = signal(SIGPIPE, SIG_IGN);
+		int fds[2];
+		ASSERT_EQ(0, adb_socketpair(fds));
+		fd_ = fds[0];
+		service_ = std::thread(file_sync_service, fds[1], nullptr);
+	}
+
+	virtual void TearDown() override {
+		Disconnect();
+		signal(SIGPIPE, saved_sigpipe_handler_);
+	}
+
+	// Closes our end of the connection, and waits for the service to notice.
+	void Disconnect() {
+		if (fd_ != -1) {
+			adb_close(fd_);
+			fd_ = -1;
+		}
+		if (service_.joinable()) service_.join();
+	}
+
+	bool SendRequest(uint32_t id, const std::string& path) {
+		SyncRequest request;
+		request.id = id;
+		request.path_length = path.size();
+		return WriteFdExactly(fd_, &request, sizeof(request)) && WriteFdExactly(fd_, path);
+	}
+
+	bool SendData(const std::string& data) {
+		syncmsg msg;
+		msg.data.id = ID_DATA;
+		msg.data.size = data.size();
+		return WriteFdExactly(fd_, &msg.data, sizeof(msg.data)) && WriteFdExactly(fd_, data);
+	}
+
+	// Sends a 'batch' message, then |path_length| bytes of path and |size| bytes of content.
+	bool SendBatchMessage(uint32_t id, const std::string& path, const std::string& data,
+		uint32_t path_length, uint32_t size) {
+		syncmsg msg;
+		msg.batch.id = id;
+		msg.batch.mode = 0644;
+		msg.batch.mtime = 1234567890;
+		msg.batch.size = size;
+		msg.batch.path_length = path_length;
+		return WriteFdExactly(fd_, &msg.batch, sizeof(msg.batch)) && WriteFdExactly(fd_, path) &&
+			WriteFdExactly(fd_, data);
+	}
+
+	bool SendBatchFile(const std::string& path, const std::string& data) {
+		return SendBatchMessage(ID_FILE, path, data, path.size(), data.size());
+	}
+
+	bool SendBatchDone() {
+		return SendBatchMessage(ID_DONE, "", "", 0, 0);
+	}
+
+	// Sends a batch with a single malformed ID_FILE, and checks that it's refused.
+	void ExpectBatchRejected(uint32_t path_length, uint32_t size) {
+		ASSERT_TRUE(SendRequest(ID_SEND_BATCH, ""));
+		ASSERT_TRUE(SendBatchMessage(ID_FILE, "", "", path_length, size));
+		std::string error;
+		ASSERT_FALSE(ReadStatus(&error));
+		ASSERT_EQ("invalid batch message", error);
+	}
+
+	bool SendDone(uint32_t mtime) {
+		syncmsg msg;
+		msg.data.id = ID_DONE;
+		msg.data.size = mtime;
+		return WriteFdExactly(fd_, &msg.data, sizeof(msg.data));
+	}
+
+	// Reads an ID_OKAY or ID_FAIL, returning whether it was ID_OKAY, with the failure in |error|.
+	bool ReadStatus(std::string* error) {
+		syncmsg msg;
+		if (!ReadFdExactly(fd_, &msg.status, sizeof(msg.status))) {
+			*error = "connection closed";
+			return false;
+		}
+		if (msg.status.id == ID_OKAY) return true;
+		error->resize(msg.status.msglen);
+		if (msg.status.id != ID_FAIL || !ReadFdExactly(fd_, &(*error)[0], error->size())) {
+			*error = "bad status";
+		}
+		return false;
+	}
+
+	TemporaryDir dir_;
+	int fd_ = -1;
+
+private:
+	std::thread service_;
+	sighandler_t saved_sigpipe_handler_;
+};
+
+TEST_F(FileSyncServiceTest, send) {
+	std::string path = std::string(dir_.path) + "/file";
+	ASSERT_TRUE(SendRequest(ID_SEND, path + ",0644"));
+	ASSERT_TRUE(SendData("hello"));
+	ASSERT_TRUE(SendDone(0));
+	std::string error;
+	ASSERT_TRUE(ReadStatus(&error)) << error;
+
+	std::string contents;
+	ASSERT_TRUE(android::base::ReadFileToString(path, &contents));
+	ASSERT_EQ("hello", contents);
+}
+
+// An ordinary push that's cut off mustn't leave a truncated file behind.
+TEST_F(FileSyncServiceTest, interrupted_send_removes_file) {
+	std::string path = std::string(dir_.path) + "/file";
+	ASSERT_TRUE(SendRequest(ID_SEND, path + ",0644"));
+	ASSERT_TRUE(SendData("partial"));
+	Disconnect();
+
+	struct stat st;
+	ASSERT_EQ(-1, lstat(path.c_str(), &st));
+	ASSERT_EQ(ENOENT, errno);
+}
+
+// A resumable push that's cut off keeps what it wrote, for the next push --resume.
+TEST_F(FileSyncServiceTest, interrupted_send_resume_keeps_file) {
+	std::string path = std::string(dir_.path) + "/file";
+	ASSERT_TRUE(android::base::WriteStringToFile("abc", path));
+	ASSERT_TRUE(SendRequest(ID_SEND_RESUME, path + ",0644,3"));
+	ASSERT_TRUE(SendData("def"));
+	Disconnect();
+
+	std::string contents;
+	ASSERT_TRUE(android::base::ReadFileToString(path, &contents));
+	ASSERT_EQ("abcdef", contents);
+}
+
+TEST_F(FileSyncServiceTest, send_batch) {
+	std::string path1 = std::string(dir_.path) + "/one";
+	std::string path2 = std::string(dir_.path) + "/sub/two";
+	ASSERT_TRUE(SendRequest(ID_SEND_BATCH, ""));
+	ASSERT_TRUE(SendBatchFile(path1, "first"));
+	ASSERT_TRUE(SendBatchFile(path2, ""));
+	ASSERT_TRUE(SendBatchDone());
+	std::string error;
+	ASSERT_TRUE(ReadStatus(&error)) << error;
+
+	std::string contents;
+	ASSERT_TRUE(android::base::ReadFileToString(path1, &contents));
+	ASSERT_EQ("first", contents);
+	ASSERT_TRUE(android::base::ReadFileToString(path2, &contents));
+	ASSERT_EQ("", contents);
+	struct stat st;
+	ASSERT_EQ(0, stat(path1.c_str(), &st));
+	ASSERT_EQ(1234567890, st.st_mtime);
+
+	// The session carries on after a batch.
+	ASSERT_TRUE(SendRequest(ID_SEND_BATCH, ""));
+	ASSERT_TRUE(SendBatchDone());
+	ASSERT_TRUE(ReadStatus(&error)) << error;
+}
+
+TEST_F(FileSyncServiceTest, send_batch_empty_path) {
+	ExpectBatchRejected(0, 0);
+}
+
+TEST_F(FileSyncServiceTest, send_batch_long_path) {
+	ExpectBatchRejected(1025, 0);
+}
+
+TEST_F(FileSyncServiceTest, send_batch_oversize_file) {
+	ExpectBatchRejected(1, SYNC_DATA_MAX + 1);
+}
+
+TEST_F(FileSyncServiceTest, send_batch_unknown_message) {
+	ASSERT_TRUE(SendRequest(ID_SEND_BATCH, ""));
+	ASSERT_TRUE(SendBatchMessage(ID_DATA, "", "", 0, 0));
+	std::string error;
+	ASSERT_FALSE(ReadStatus(&error));
+	ASSERT_EQ("invalid batch message", error);
+}
+
+// A file that can't be written is reported, without stopping the rest of the batch.
+TEST_F(FileSyncServiceTest, send_batch_failure) {
+	std::string not_dir = std::string(dir_.path) + "/not_dir";
+	ASSERT_TRUE(android::base::WriteStringToFile("", not_dir));
+	std::string good = std::string(dir_.path) + "/good";
+
+	ASSERT_TRUE(SendRequest(ID_SEND_BATCH, ""));
+	ASSERT_TRUE(SendBatchFile(not_dir + "/bad", "x"));
+	ASSERT_TRUE(SendBatchFile(good, "y"));
+	ASSERT_TRUE(SendBatchDone());
+	std::string error;
+	ASSERT_FALSE(ReadStatus(&error));
+	ASSERT_EQ(not_dir + "/bad: couldn't create file: " + strerror(ENOTDIR), error);
+
+	std::string contents;
+	ASSERT_TRUE(android::base::ReadFileToString(good, &contents));
+	ASSERT_EQ("y", contents);
+}
+
+// Only the first SYNC_BATCH_MAX_FAILURES failures are listed, followed by a count of the rest.
+TEST_F(FileSyncServiceTest, send_batch_many_failures) {
+	std::string not_dir = std::string(dir_.path) + "/not_dir";
+	ASSERT_TRUE(android::base::WriteStringToFile("", not_dir));
+
+	const size_t kFailures = SYNC_BATCH_MAX_FAILURES + 5;
+	ASSERT_TRUE(SendRequest(ID_SEND_BATCH, ""));
+	for (size_t i = 0; i < kFailures; ++i) {
+		ASSERT_TRUE(SendBatchFile(not_dir + "/" + std::to_string(i), "x"));
+	}
+	ASSERT_TRUE(SendBatchDone());
+	std::string error;
+	ASSERT_FALSE(ReadStatus(&error));
+
+	std::vector<std::string> lines = android::base::Split(error, "\n");
+	ASSERT_EQ(SYNC_BATCH_MAX_FAILURES + 1u, lines.size());
+	ASSERT_EQ(not_dir + "/0: couldn't create file: " + strerror(ENOTDIR), lines[0]);
+	ASSERT_EQ("+5 more", lines.back());
+}
+
+TEST(DirectoryCache, remembers_created_directories) {
+	TemporaryDir dir;
+	std::string sub = std::string(dir.path) + "/a/b";
+	internal::DirectoryCache dirs;
+	ASSERT_TRUE(internal::secure_mkdirs(sub, &dirs));
+	ASSERT_EQ(1u, dirs.count(sub));
+	ASSERT_EQ(1u, dirs.count(std::string(dir.path) + "/a"));
+
+	// Once it's cached, the directory isn't looked at again.
+	ASSERT_EQ(0, rmdir(sub.c_str()));
+	ASSERT_TRUE(internal::secure_mkdirs(sub, &dirs));
+	struct stat st;
+	ASSERT_EQ(-1, stat(sub.c_str(), &st));
+	rmdir((std::string(dir.path) + "/a").c_str());
+}
+
+TEST(DirectoryCache, failed_mkdir_clears_cache) {
+	TemporaryDir dir;
+	std::string not_dir = std::string(dir.path) + "/not_dir";
+	ASSERT_TRUE(android::base::WriteStringToFile("", not_dir));
+	internal::DirectoryCache dirs;
+	ASSERT_TRUE(internal::secure_mkdirs(std::string(dir.path) + "/a", &dirs));
+	ASSERT_FALSE(dirs.empty());
+
+	ASSERT_FALSE(internal::secure_mkdirs(not_dir + "/sub", &dirs));
+	ASSERT_TRUE(dirs.empty());
+	adb_unlink(not_dir.c_str());
+	rmdir((std::string(dir.path) + "/a").c_str());
+}
+
+TEST(DirectoryCache, failed_create_clears_cache) {
+	TemporaryDir dir;
+	std::string not_dir = std::string(dir.path) + "/not_dir";
+	ASSERT_TRUE(android::base::WriteStringToFile("", not_dir));
+	internal::DirectoryCache dirs;
+	ASSERT_TRUE(internal::secure_mkdirs(std::string(dir.path) + "/a", &dirs));
+	ASSERT_FALSE(dirs.empty());
+
+	std::string error;
+	ASSERT_EQ(-1, internal::create_send_file((not_dir + "/file").c_str(), -1, -1, 0644, 0, &dirs,
+		&error));
+	ASSERT_EQ(std::string("couldn't create file: ") + strerror(ENOTDIR), error);
+	ASSERT_TRUE(dirs.empty());
+	adb_unlink(not_dir.c_str());
+	rmdir((std::string(dir.path) + "/a").c_str());
+}
+
+// The reader stops taking files off the socket once BatchQueue::kMaxQueuedBytes are waiting.
+TEST(BatchQueue, backpressure) {
+	internal::BatchQueue queue;
+	const size_t kFiles = internal::BatchQueue::kMaxQueuedBytes / SYNC_DATA_MAX;
+	std::atomic<size_t> pushed(0);
+	std::thread reader([&queue, &pushed, kFiles]() {
+		for (size_t i = 0; i < kFiles + 1; ++i) {
+			internal::BatchFile file;
+			file.path = std::to_string(i);
+			file.data.resize(SYNC_DATA_MAX);
+			queue.Push(std::move(file));
+			++pushed;
+		}
+		queue.Finish();
+	});
+
+	std::this_thread::sleep_for(100ms);
+	ASSERT_EQ(kFiles, pushed);
+
+	// Taking one file off lets the last one in.
+	internal::BatchFile file;
+	ASSERT_TRUE(queue.Pop(&file));
+	ASSERT_EQ("0", file.path);
+	reader.join();
+	ASSERT_EQ(kFiles + 1, pushed);
+
+	for (size_t i = 1; i < kFiles + 1; ++i) {
+		ASSERT_TRUE(queue.Pop(&file));
+		ASSERT_EQ(std::to_string(i), file.path);
+	}
+	ASSERT_FALSE(queue.Pop(&file));
+}
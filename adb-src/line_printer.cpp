@@ -19,12 +19,15 @@
 #ifdef _WIN32
 #include <windows.h>
 #else
+#include <signal.h>
 #include <unistd.h>
 #include <sys/ioctl.h>
 #include <termios.h>
 #include <sys/time.h>
 #endif
 
+#include <mutex>
+
 // Make sure printf is really adb_printf which works for UTF-8 on Windows.
 #include <sysdeps.h>
 
@@ -43,10 +46,45 @@ string ElideMiddle(const string& str, size_t width) {
 	return result;
 }
 
+#ifndef _WIN32
+// Asking the terminal for its size on every progress update is measurable, so the width is
+// cached and only looked up again after a SIGWINCH.
+static volatile sig_atomic_t terminal_resized = 1;
+static struct sigaction previous_sigwinch_action;
+
+static void HandleSigwinch(int sig) {
+	terminal_resized = 1;
+	if (!(previous_sigwinch_action.sa_flags & SA_SIGINFO) &&
+		previous_sigwinch_action.sa_handler != SIG_DFL &&
+		previous_sigwinch_action.sa_handler != SIG_IGN) {
+		previous_sigwinch_action.sa_handler(sig);
+	}
+}
+
+static size_t TerminalWidth() {
+	static size_t width = 0;
+	if (terminal_resized) {
+		terminal_resized = 0;
+		winsize size;
+		width = (ioctl(0, TIOCGWINSZ, &size) == 0) ? size.ws_col : 0;
+	}
+	return width;
+}
+#endif
+
 LinePrinter::LinePrinter() : have_blank_line_(true) {
 #ifndef _WIN32
 	const char* term = getenv("TERM");
 	smart_terminal_ = unix_isatty(1) && term && string(term) != "dumb";
+	if (smart_terminal_) {
+		static std::once_flag once;
+		std::call_once(once, []() {
+			struct sigaction sa = {};
+			sa.sa_handler = HandleSigwinch;
+			sa.sa_flags = SA_RESTART;
+			sigaction(SIGWINCH, &sa, &previous_sigwinch_action);
+		});
+	}
 #else
 	// Disable output buffer.  It'd be nice to use line buffering but
 	// MSDN says: "For some systems, [_IOLBF] provides line
@@ -105,9 +143,9 @@ void LinePrinter::Print(string to_print, LineType type) {
 #else
 		// Limit output to width of the terminal if provided so we don't cause
 		// line-wrapping.
-		winsize size;
-		if ((ioctl(0, TIOCGWINSZ, &size) == 0) && size.ws_col) {
-			to_print = ElideMiddle(to_print, size.ws_col);
+		size_t width = TerminalWidth();
+		if (width) {
+			to_print = ElideMiddle(to_print, width);
 		}
 		Out(to_print);
 		printf("\x1B[K");  // Clear to end of line.
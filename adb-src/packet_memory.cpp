@@ -0,0 +1,196 @@
+/*
+ * Copyright (C) 2017 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define TRACE_TAG TRANSPORT
+
+#include "sysdeps.h"
+#include "packet_memory.h"
+
+#include <inttypes.h>
+#include <stdlib.h>
+
+#include <algorithm>
+#include <atomic>
+#include <vector>
+
+#include <android-base/logging.h>
+#include <android-base/parseint.h>
+#include <android-base/stringprintf.h>
+
+#include "adb_trace.h"
+#include "fdevent.h"
+#include "socket.h"
+#include "transport.h"
+
+namespace {
+
+struct Budget {
+	std::atomic<size_t> process;
+	std::atomic<size_t> transport;
+	std::atomic<size_t> used{ 0 };
+};
+
+Budget& budget() {
+	static Budget* budget = []() {
+		size_t mb = 1024;
+		const char* value = getenv("ADB_PACKET_MEMORY_MB");
+		if (value && !android::base::ParseUint(value, &mb, SIZE_MAX >> 20)) {
+			LOG(WARNING) << "ignoring invalid $ADB_PACKET_MEMORY_MB '" << value << "'";
+			mb = 1024;
+		}
+		Budget* result = new Budget();
+		result->process = mb << 20;
+		result->transport = (mb << 20) / 4;
+		return result;
+	}();
+	return *budget;
+}
+
+// Sockets waiting for room, and whether a wakeup is on its way to the main thread. Waiters are
+// only touched on the main thread.
+auto& waiters = *new std::vector<asocket*>();
+std::atomic<bool> have_waiters{ false };
+std::atomic<bool> wakeup_pending{ false };
+
+// Under the low water mark: three quarters of the budget.
+bool has_room(const atransport* t) {
+	Budget& b = budget();
+	if (b.used.load(std::memory_order_relaxed) > b.process.load(std::memory_order_relaxed) / 4 * 3) {
+		return false;
+	}
+	return t == nullptr || t->queued_memory.load(std::memory_order_relaxed) <=
+		b.transport.load(std::memory_order_relaxed) / 4 * 3;
+}
+
+void wake_waiters() {
+	wakeup_pending = false;
+
+	// Resuming a socket can close others, so work from a copy and check each is still waiting.
+	std::vector<asocket*> ready;
+	for (asocket* s : waiters) {
+		if (has_room(s->transport)) ready.push_back(s);
+	}
+	for (asocket* s : ready) {
+		auto it = std::find(waiters.begin(), waiters.end(), s);
+		if (it == waiters.end()) continue;
+		waiters.erase(it);
+
+		D("RS(%d): packet memory available", s->id);
+		if (s->budget_deferred_ready) {
+			s->budget_deferred_ready = false;
+			s->ready(s);
+		}
+		if (s->budget_blocked_peer) {
+			s->budget_blocked_peer = false;
+			if (s->peer) s->peer->ready(s->peer);
+		}
+	}
+	have_waiters = !waiters.empty();
+}
+
+void schedule_wakeup() {
+	if (!wakeup_pending.exchange(true)) {
+		fdevent_run_on_main_thread(wake_waiters);
+	}
+}
+
+}  // namespace
+
+void packet_memory_get_budget(size_t* process_bytes, size_t* transport_bytes) {
+	*process_bytes = budget().process;
+	*transport_bytes = budget().transport;
+}
+
+void packet_memory_set_budget(size_t process_bytes, size_t transport_bytes) {
+	budget().process = process_bytes;
+	budget().transport = transport_bytes;
+}
+
+void packet_memory_charge(atransport* t, size_t bytes) {
+	budget().used.fetch_add(bytes, std::memory_order_relaxed);
+	if (t) t->queued_memory.fetch_add(bytes, std::memory_order_relaxed);
+}
+
+void packet_memory_release(atransport* t, size_t bytes) {
+	budget().used.fetch_sub(bytes, std::memory_order_relaxed);
+	if (t) t->queued_memory.fetch_sub(bytes, std::memory_order_relaxed);
+	if (have_waiters.load(std::memory_order_relaxed) && has_room(t)) {
+		schedule_wakeup();
+	}
+}
+
+void packet_memory_move(atransport* from, atransport* to, size_t bytes) {
+	if (to) to->queued_memory.fetch_add(bytes, std::memory_order_relaxed);
+	if (from) {
+		from->queued_memory.fetch_sub(bytes, std::memory_order_relaxed);
+		if (have_waiters.load(std::memory_order_relaxed) && has_room(from)) {
+			schedule_wakeup();
+		}
+	}
+}
+
+bool packet_memory_over_budget(const atransport* t) {
+	Budget& b = budget();
+	if (b.used.load(std::memory_order_relaxed) > b.process.load(std::memory_order_relaxed)) {
+		return true;
+	}
+	return t != nullptr &&
+		t->queued_memory.load(std::memory_order_relaxed) > b.transport.load(std::memory_order_relaxed);
+}
+
+void packet_memory_wait(asocket* s) {
+	if (std::find(waiters.begin(), waiters.end(), s) == waiters.end()) {
+		D("RS(%d): waiting for packet memory", s->id);
+		waiters.push_back(s);
+		have_waiters = true;
+	}
+	// The memory may have been released before we got on the list.
+	if (has_room(s->transport)) {
+		schedule_wakeup();
+	}
+}
+
+void packet_memory_cancel_wait(asocket* s) {
+	auto it = std::find(waiters.begin(), waiters.end(), s);
+	if (it != waiters.end()) {
+		waiters.erase(it);
+		have_waiters = !waiters.empty();
+	}
+}
+
+void packet_memory_forget_transport(atransport* t) {
+	size_t bytes = t->queued_memory.exchange(0);
+	if (bytes != 0) {
+		D("%s: forgetting %zu bytes of packet memory", t->serial, bytes);
+		packet_memory_release(nullptr, bytes);
+	}
+}
+
+std::string format_packet_memory() {
+	Budget& b = budget();
+	std::string result = android::base::StringPrintf(
+		"process used=%zu budget=%zu waiting_sockets=%zu\n",
+		b.used.load(std::memory_order_relaxed), b.process.load(std::memory_order_relaxed),
+		waiters.size());
+	iterate_transports([&result, &b](const atransport* t) {
+		android::base::StringAppendF(&result, "transport %s used=%zu budget=%zu\n",
+			(t->serial && *t->serial) ? t->serial : "-",
+			t->queued_memory.load(std::memory_order_relaxed),
+			b.transport.load(std::memory_order_relaxed));
+		return true;
+	});
+	return result;
+}
@@ -0,0 +1,71 @@
+/*
+ * Copyright (C) 2017 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __PACKET_MEMORY_H
+#define __PACKET_MEMORY_H
+
+#include <stddef.h>
+
+#include <string>
+
+#include "adb.h"
+
+// Accounts for the memory held by queued packets, against a budget for the whole process and
+// one for each transport. A packet queued between threads costs its whole apacket, however
+// little payload it carries; a local socket's backlog costs what its output ring has allocated.
+//
+// Charged to a transport: the packets in its queues between the main thread and its read and
+// write threads, and the backlogs of the local sockets it tracks (see track_local_socket()).
+// Charged only to the process: the backlogs of other local sockets.
+//
+// Over budget, remote sockets throttle through the usual backpressure: they stop their local
+// peer reading by returning 1 from enqueue(), and hold back READYs so the other side stops
+// sending. They resume, on the main thread, once usage is back under three quarters of the
+// budget.
+//
+// The process budget is $ADB_PACKET_MEMORY_MB (1024 by default); each transport may use a
+// quarter of it.
+
+constexpr size_t kQueuedPacketCost = sizeof(apacket);
+
+// Reads and overrides the budgets, for tests.
+void packet_memory_get_budget(size_t* process_bytes, size_t* transport_bytes);
+void packet_memory_set_budget(size_t process_bytes, size_t transport_bytes);
+
+// |t| may be null for packets charged only to the process.
+void packet_memory_charge(atransport* t, size_t bytes);
+void packet_memory_release(atransport* t, size_t bytes);
+
+// Moves a charge between transports (either of which may be null), leaving the process total.
+void packet_memory_move(atransport* from, atransport* to, size_t bytes);
+
+// Whether |t| (which may be null) or the process is over budget.
+bool packet_memory_over_budget(const atransport* t);
+
+// Remote socket |s| has stopped its peer reading (s->budget_blocked_peer), or held back a READY
+// (s->budget_deferred_ready), because of the budget. Both are undone once there's room again.
+void packet_memory_wait(asocket* s);
+
+// |s| is being closed.
+void packet_memory_cancel_wait(asocket* s);
+
+// Forgets whatever is still charged to |t|, which is about to be freed.
+void packet_memory_forget_transport(atransport* t);
+
+// The host:packet-memory report: a line for the process, then one per transport.
+std::string format_packet_memory();
+
+#endif
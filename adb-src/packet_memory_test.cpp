@@ -0,0 +1,235 @@
+/*
+ * Copyright (C) 2017 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "packet_memory.h"
+
+#include <gtest/gtest.h>
+
+#include <string.h>
+
+#include <functional>
+#include <future>
+#include <thread>
+
+#include "adb_io.h"
+#include "fdevent.h"
+#include "fdevent_test.h"
+#include "socket.h"
+#include "sysdeps.h"
+#include "transport.h"
+
+class PacketMemoryTest : public FdeventTest {
+protected:
+	void SetUp() override {
+		FdeventTest::SetUp();
+		packet_memory_get_budget(&saved_process_budget_, &saved_transport_budget_);
+		packet_memory_set_budget(8 * kQueuedPacketCost, 4 * kQueuedPacketCost);
+	}
+
+	void TearDown() override {
+		packet_memory_set_budget(saved_process_budget_, saved_transport_budget_);
+	}
+
+	size_t saved_process_budget_;
+	size_t saved_transport_budget_;
+};
+
+// A windowed stream whose remote socket sends on a transport that captures its packets, with
+// the fdevent loop running so that packet memory wakeups are delivered.
+class PacketMemoryStreamTest : public PacketMemoryTest {
+protected:
+	void SetUp() override {
+		PacketMemoryTest::SetUp();
+		ASSERT_EQ(0, adb_socketpair(transport_fds_));
+		ASSERT_EQ(0, adb_socketpair(local_fds_));
+		t_.transport_socket = transport_fds_[0];
+		t_.online = true;
+
+		PrepareThread();
+		thread_ = std::thread(fdevent_loop);
+		RunOnMainThread([this]() {
+			asocket* s = create_local_socket(local_fds_[1]);
+			rs_ = create_remote_socket(5, &t_);
+			rs_->send_window = kStreamWindowBytes;
+			rs_->peer = s;
+			s->peer = rs_;
+			track_local_socket(s, &t_);
+		});
+	}
+
+	void TearDown() override {
+		RunOnMainThread([this]() { close_all_sockets(&t_); });
+		TerminateThread(thread_);
+		while (apacket* p = ReadSent()) {
+			put_apacket(p);
+		}
+		packet_memory_forget_transport(&t_);
+		adb_close(transport_fds_[0]);
+		adb_close(transport_fds_[1]);
+		adb_close(local_fds_[0]);
+		PacketMemoryTest::TearDown();
+	}
+
+	// Runs |fn| on the fdevent thread, after anything already queued there.
+	void RunOnMainThread(std::function<void()> fn) {
+		std::promise<void> done;
+		fdevent_run_on_main_thread([&]() {
+			fn();
+			done.set_value();
+		});
+		done.get_future().wait();
+	}
+
+	// Returns the next packet sent on the transport, or nullptr if there isn't one.
+	apacket* ReadSent() {
+		adb_pollfd pfd = { transport_fds_[1], POLLIN, 0 };
+		if (adb_poll(&pfd, 1, 0) != 1) return nullptr;
+		apacket* p;
+		if (!ReadFdExactly(transport_fds_[1], &p, sizeof(p))) return nullptr;
+		return p;
+	}
+
+	// Sends a WRTE on the stream, returning what enqueue() did.
+	int Write() {
+		int result;
+		RunOnMainThread([this, &result]() {
+			apacket* p = get_apacket();
+			p->len = 4;
+			memset(p->data, 'x', p->len);
+			result = rs_->enqueue(rs_, p);
+		});
+		return result;
+	}
+
+	atransport t_;
+	asocket* rs_ = nullptr;
+	int transport_fds_[2];
+	int local_fds_[2];
+	std::thread thread_;
+};
+
+TEST_F(PacketMemoryTest, transport_budget) {
+	atransport t;
+	packet_memory_charge(&t, 4 * kQueuedPacketCost);
+	ASSERT_FALSE(packet_memory_over_budget(&t));
+	ASSERT_FALSE(packet_memory_over_budget(nullptr));
+
+	packet_memory_charge(&t, kQueuedPacketCost);
+	ASSERT_TRUE(packet_memory_over_budget(&t));
+	ASSERT_FALSE(packet_memory_over_budget(nullptr));
+
+	packet_memory_release(&t, 5 * kQueuedPacketCost);
+	ASSERT_EQ(0U, t.queued_memory.load());
+	ASSERT_FALSE(packet_memory_over_budget(&t));
+}
+
+TEST_F(PacketMemoryTest, process_budget) {
+	atransport t;
+	packet_memory_charge(nullptr, 8 * kQueuedPacketCost);
+	ASSERT_FALSE(packet_memory_over_budget(&t));
+
+	packet_memory_charge(nullptr, kQueuedPacketCost);
+	ASSERT_TRUE(packet_memory_over_budget(&t));
+	ASSERT_TRUE(packet_memory_over_budget(nullptr));
+	ASSERT_EQ(0U, t.queued_memory.load());
+
+	packet_memory_release(nullptr, 9 * kQueuedPacketCost);
+	ASSERT_FALSE(packet_memory_over_budget(nullptr));
+}
+
+TEST_F(PacketMemoryTest, move) {
+	atransport t;
+	packet_memory_charge(nullptr, 5 * kQueuedPacketCost);
+	packet_memory_move(nullptr, &t, 5 * kQueuedPacketCost);
+	ASSERT_TRUE(packet_memory_over_budget(&t));
+
+	packet_memory_move(&t, nullptr, 5 * kQueuedPacketCost);
+	ASSERT_FALSE(packet_memory_over_budget(&t));
+	ASSERT_FALSE(packet_memory_over_budget(nullptr));
+	packet_memory_release(nullptr, 5 * kQueuedPacketCost);
+}
+
+TEST_F(PacketMemoryTest, forget_transport) {
+	atransport t;
+	packet_memory_charge(&t, 6 * kQueuedPacketCost);
+	packet_memory_charge(nullptr, 3 * kQueuedPacketCost);
+	ASSERT_TRUE(packet_memory_over_budget(nullptr));
+
+	packet_memory_forget_transport(&t);
+	ASSERT_EQ(0U, t.queued_memory.load());
+	ASSERT_FALSE(packet_memory_over_budget(nullptr));
+	packet_memory_release(nullptr, 3 * kQueuedPacketCost);
+}
+
+TEST_F(PacketMemoryStreamTest, enqueue_over_budget) {
+	ASSERT_EQ(0, Write());
+	apacket* p = ReadSent();
+	ASSERT_NE(nullptr, p);
+	put_apacket(p);
+
+	// The window has room, but the transport's queue doesn't.
+	packet_memory_charge(&t_, 4 * kQueuedPacketCost);
+	ASSERT_EQ(1, Write());
+	ASSERT_TRUE(rs_->budget_blocked_peer);
+	ASSERT_FALSE(rs_->send_blocked);
+}
+
+TEST_F(PacketMemoryStreamTest, ready_held_back) {
+	packet_memory_charge(&t_, 5 * kQueuedPacketCost);
+	RunOnMainThread([this]() {
+		rs_->recv_unacked = 100;
+		rs_->ready(rs_);
+	});
+	ASSERT_EQ(nullptr, ReadSent());
+	ASSERT_TRUE(rs_->budget_deferred_ready);
+	ASSERT_EQ(100U, rs_->recv_unacked);
+}
+
+TEST_F(PacketMemoryStreamTest, wake_waiters) {
+	// Over budget with one queued WRTE and four packets' worth of other charges.
+	packet_memory_charge(&t_, 4 * kQueuedPacketCost);
+	ASSERT_EQ(1, Write());
+	RunOnMainThread([this]() {
+		rs_->recv_unacked = 100;
+		rs_->ready(rs_);
+	});
+	apacket* p = ReadSent();
+	ASSERT_NE(nullptr, p);
+	ASSERT_EQ(static_cast<uint32_t>(A_WRTE), p->msg.command);
+	put_apacket(p);
+	ASSERT_TRUE(rs_->budget_blocked_peer);
+	ASSERT_TRUE(rs_->budget_deferred_ready);
+
+	// Back under the budget, but not under three quarters of it: still waiting.
+	packet_memory_release(&t_, kQueuedPacketCost);
+	RunOnMainThread([]() {});
+	ASSERT_TRUE(rs_->budget_blocked_peer);
+	ASSERT_TRUE(rs_->budget_deferred_ready);
+	ASSERT_EQ(nullptr, ReadSent());
+
+	// Under three quarters: the READY goes out, and the peer may read again.
+	packet_memory_release(&t_, kQueuedPacketCost);
+	RunOnMainThread([]() {});
+	ASSERT_FALSE(rs_->budget_blocked_peer);
+	ASSERT_FALSE(rs_->budget_deferred_ready);
+	p = ReadSent();
+	ASSERT_NE(nullptr, p);
+	ASSERT_EQ(static_cast<uint32_t>(A_OKAY), p->msg.command);
+	uint32_t acked;
+	memcpy(&acked, p->data, sizeof(acked));
+	ASSERT_EQ(100U, acked);
+	put_apacket(p);
+}
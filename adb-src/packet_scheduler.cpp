@@ -0,0 +1,114 @@
+/*
+ * Copyright (C) 2017 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define TRACE_TAG TRANSPORT
+
+#include "sysdeps.h"
+#include "packet_scheduler.h"
+
+#include "adb_trace.h"
+
+PacketScheduler::~PacketScheduler() {
+	for (auto& queue : queues_) {
+		for (apacket* p : queue) {
+			put_apacket(p);
+		}
+	}
+}
+
+// The sender's local id, for the packets that belong to a stream. Other commands use arg0 for
+// something else (CNXN's version, AUTH's type), so they're never held to a stream's class.
+static uint32_t packet_stream(const apacket* p) {
+	switch (p->msg.command) {
+	case A_OPEN:
+	case A_OKAY:
+	case A_WRTE:
+	case A_CLSE:
+		return p->msg.arg0;
+	default:
+		return 0;
+	}
+}
+
+void PacketScheduler::Push(apacket* p) {
+	size_t priority = p->priority < kPacketPriorityCount ? p->priority : kPacketPriorityBulk;
+	uint32_t stream = packet_stream(p);
+	if (stream != 0) {
+		auto it = streams_.find(stream);
+		if (it != streams_.end()) {
+			priority = it->second.priority;
+			++it->second.packets;
+		}
+		else {
+			streams_.emplace(stream, StreamQueue{ priority, 1 });
+		}
+	}
+	queues_[priority].push_back(p);
+}
+
+bool PacketScheduler::empty() const {
+	for (const auto& queue : queues_) {
+		if (!queue.empty()) return false;
+	}
+	return true;
+}
+
+void PacketScheduler::NextClass() {
+	current_ = (current_ + 1) % kPacketPriorityCount;
+	turn_started_ = false;
+}
+
+size_t PacketScheduler::Next(apacket** packets, size_t max_packets, size_t max_bytes) {
+	size_t count = 0;
+	size_t bytes = 0;
+	while (count < max_packets && !empty()) {
+		std::deque<apacket*>& queue = queues_[current_];
+		if (queue.empty()) {
+			// An idle class doesn't save up credit.
+			deficits_[current_] = 0;
+			NextClass();
+			continue;
+		}
+		if (!turn_started_) {
+			deficits_[current_] += kQuantum;
+			turn_started_ = true;
+		}
+
+		apacket* p = queue.front();
+		size_t cost = sizeof(amessage) + p->msg.data_length;
+		if (cost > deficits_[current_]) {
+			NextClass();
+			continue;
+		}
+		if (count > 0 && bytes + p->msg.data_length > max_bytes) {
+			// The batch is full; this class's turn carries on with the next one.
+			break;
+		}
+
+		queue.pop_front();
+		uint32_t stream = packet_stream(p);
+		if (stream != 0) {
+			auto it = streams_.find(stream);
+			if (it != streams_.end() && --it->second.packets == 0) {
+				streams_.erase(it);
+			}
+		}
+		deficits_[current_] -= cost;
+		bytes += p->msg.data_length;
+		packets[count++] = p;
+	}
+	return count;
+}
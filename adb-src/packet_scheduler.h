@@ -0,0 +1,75 @@
+/*
+ * Copyright (C) 2017 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __PACKET_SCHEDULER_H
+#define __PACKET_SCHEDULER_H
+
+#include <stddef.h>
+
+#include <deque>
+#include <unordered_map>
+
+#include "adb.h"
+
+// Orders the packets waiting to be written to a transport. Each PacketPriority class has its own
+// queue, and batches are drawn from the queues by deficit round robin: on its turn a class may
+// send up to its deficit in bytes, which grows by a quantum per turn. A class with a backlog
+// therefore can't hold up the others for more than one quantum, while a class alone gets all
+// the bandwidth. Packets within a class keep their order, and so do each stream's: while a
+// stream has a packet queued, later ones for it join the same class whatever their own, so that
+// (say) a bulk WRITE can't overtake the interactive READY that opened its stream.
+//
+// Only the transport's write thread uses a PacketScheduler.
+class PacketScheduler {
+public:
+	// Bytes a class may send per turn; at least one full packet, so every turn makes progress.
+	static constexpr size_t kQuantum = MAX_PAYLOAD + sizeof(amessage);
+
+	PacketScheduler() = default;
+	~PacketScheduler();
+
+	void Push(apacket* p);
+
+	// Moves up to |max_packets| packets, with up to |max_bytes| of payload between them, into
+	// |packets| and returns how many. A packet larger than |max_bytes| is returned on its own.
+	size_t Next(apacket** packets, size_t max_packets, size_t max_bytes);
+
+	bool empty() const;
+
+	// Packets waiting in each class.
+	size_t queued(PacketPriority priority) const {
+		return queues_[priority].size();
+	}
+
+private:
+	void NextClass();
+
+	std::deque<apacket*> queues_[kPacketPriorityCount];
+	size_t deficits_[kPacketPriorityCount] = {};
+	size_t current_ = 0;
+	bool turn_started_ = false;
+
+	struct StreamQueue {
+		size_t priority;
+		size_t packets;
+	};
+	// The class and number of queued packets of each stream with any, by local id.
+	std::unordered_map<uint32_t, StreamQueue> streams_;
+
+	DISALLOW_COPY_AND_ASSIGN(PacketScheduler);
+};
+
+#endif
@@ -0,0 +1,151 @@
+/*
+ * Copyright (C) 2017 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "packet_scheduler.h"
+
+#include <gtest/gtest.h>
+
+#include <algorithm>
+#include <vector>
+
+#include "adb_auth.h"
+
+static apacket* MakePacket(PacketPriority priority, size_t length, uint32_t tag) {
+	apacket* p = get_apacket();
+	p->priority = priority;
+	p->msg.command = A_WRTE;
+	p->msg.arg0 = tag;
+	p->msg.data_length = length;
+	return p;
+}
+
+// Returns the tags of the next batch, and frees its packets.
+static std::vector<uint32_t> NextBatch(PacketScheduler* scheduler, size_t max_packets,
+	size_t max_bytes) {
+	std::vector<apacket*> packets(max_packets);
+	size_t count = scheduler->Next(packets.data(), max_packets, max_bytes);
+	std::vector<uint32_t> tags;
+	for (size_t i = 0; i < count; ++i) {
+		tags.push_back(packets[i]->msg.arg0);
+		put_apacket(packets[i]);
+	}
+	return tags;
+}
+
+TEST(PacketScheduler, empty) {
+	PacketScheduler scheduler;
+	ASSERT_TRUE(scheduler.empty());
+	ASSERT_EQ(std::vector<uint32_t>(), NextBatch(&scheduler, 8, MAX_PAYLOAD));
+}
+
+TEST(PacketScheduler, fifo_within_class) {
+	PacketScheduler scheduler;
+	for (uint32_t i = 0; i < 4; ++i) {
+		scheduler.Push(MakePacket(kPacketPriorityBulk, 100, i));
+	}
+	ASSERT_EQ(std::vector<uint32_t>({ 0, 1, 2, 3 }), NextBatch(&scheduler, 8, MAX_PAYLOAD));
+	ASSERT_TRUE(scheduler.empty());
+}
+
+TEST(PacketScheduler, interactive_cuts_in_line) {
+	PacketScheduler scheduler;
+	for (uint32_t i = 0; i < 16; ++i) {
+		scheduler.Push(MakePacket(kPacketPriorityBulk, MAX_PAYLOAD, i));
+	}
+	ASSERT_EQ(std::vector<uint32_t>({ 0 }), NextBatch(&scheduler, 1, MAX_PAYLOAD));
+
+	// A keystroke arriving behind the backlog goes out in the next batch.
+	scheduler.Push(MakePacket(kPacketPriorityInteractive, 1, 100));
+	std::vector<uint32_t> batch = NextBatch(&scheduler, 2, 2 * MAX_PAYLOAD);
+	ASSERT_NE(batch.end(), std::find(batch.begin(), batch.end(), 100u));
+}
+
+TEST(PacketScheduler, bulk_keeps_bandwidth) {
+	// With both classes backlogged, each gets about a quantum per turn.
+	PacketScheduler scheduler;
+	for (uint32_t i = 0; i < 8; ++i) {
+		scheduler.Push(MakePacket(kPacketPriorityBulk, MAX_PAYLOAD, i));
+		scheduler.Push(MakePacket(kPacketPriorityInteractive, MAX_PAYLOAD, 100 + i));
+	}
+	size_t bulk = 0;
+	for (size_t i = 0; i < 8; ++i) {
+		for (uint32_t tag : NextBatch(&scheduler, 1, MAX_PAYLOAD)) {
+			bulk += tag < 100;
+		}
+	}
+	ASSERT_EQ(4u, bulk);
+	ASSERT_EQ(4u, scheduler.queued(kPacketPriorityBulk));
+	ASSERT_EQ(4u, scheduler.queued(kPacketPriorityInteractive));
+}
+
+TEST(PacketScheduler, byte_budget) {
+	PacketScheduler scheduler;
+	for (uint32_t i = 0; i < 4; ++i) {
+		scheduler.Push(MakePacket(kPacketPriorityBulk, 1000, i));
+	}
+	ASSERT_EQ(std::vector<uint32_t>({ 0, 1 }), NextBatch(&scheduler, 8, 2500));
+
+	// A packet over the budget still goes out, on its own.
+	scheduler.Push(MakePacket(kPacketPriorityBulk, 4000, 4));
+	ASSERT_EQ(std::vector<uint32_t>({ 2, 3 }), NextBatch(&scheduler, 8, 2500));
+	ASSERT_EQ(std::vector<uint32_t>({ 4 }), NextBatch(&scheduler, 8, 2500));
+}
+
+TEST(PacketScheduler, stream_order_across_classes) {
+	PacketScheduler scheduler;
+	// Leave the bulk class mid-turn, with deficit to spare.
+	scheduler.Push(MakePacket(kPacketPriorityBulk, 100, 1));
+	scheduler.Push(MakePacket(kPacketPriorityBulk, 100, 2));
+	ASSERT_EQ(std::vector<uint32_t>({ 1 }), NextBatch(&scheduler, 1, MAX_PAYLOAD));
+
+	// The READY answering an OPEN, then the new stream's first WRITE.
+	apacket* ready = MakePacket(kPacketPriorityInteractive, 0, 7);
+	ready->msg.command = A_OKAY;
+	scheduler.Push(ready);
+	scheduler.Push(MakePacket(kPacketPriorityBulk, 100, 7));
+
+	std::vector<apacket*> packets(8);
+	size_t count = scheduler.Next(packets.data(), packets.size(), MAX_PAYLOAD);
+	std::vector<uint32_t> stream_commands;
+	for (size_t i = 0; i < count; ++i) {
+		if (packets[i]->msg.arg0 == 7) stream_commands.push_back(packets[i]->msg.command);
+		put_apacket(packets[i]);
+	}
+	ASSERT_EQ(std::vector<uint32_t>({ A_OKAY, A_WRTE }), stream_commands);
+	ASSERT_TRUE(scheduler.empty());
+}
+
+TEST(PacketScheduler, only_stream_packets_follow_streams) {
+	PacketScheduler scheduler;
+	for (uint32_t i = 0; i < 16; ++i) {
+		scheduler.Push(MakePacket(kPacketPriorityBulk, MAX_PAYLOAD, 1));
+	}
+	ASSERT_EQ(std::vector<uint32_t>({ 1 }), NextBatch(&scheduler, 1, MAX_PAYLOAD));
+
+	// An AUTH's arg0 is its type, not a stream: it mustn't wait behind stream 1's backlog.
+	apacket* auth = MakePacket(kPacketPriorityInteractive, 0, ADB_AUTH_TOKEN);
+	auth->msg.command = A_AUTH;
+	scheduler.Push(auth);
+
+	std::vector<apacket*> packets(2);
+	size_t count = scheduler.Next(packets.data(), packets.size(), 2 * MAX_PAYLOAD);
+	bool found = false;
+	for (size_t i = 0; i < count; ++i) {
+		found |= packets[i]->msg.command == A_AUTH;
+		put_apacket(packets[i]);
+	}
+	ASSERT_TRUE(found);
+}
@@ -0,0 +1,249 @@
+/*
+ * Copyright (C) 2017 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define TRACE_TAG TRANSPORT
+
+#include "sysdeps.h"
+#include "packet_trace.h"
+
+#include <errno.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <android-base/file.h>
+#include <android-base/parseint.h>
+#include <android-base/stringprintf.h>
+
+#include "adb.h"
+#include "adb_trace.h"
+#include "adb_utils.h"
+
+namespace {
+
+// A record, stored as words that a dump can read while the owning thread may be overwriting them.
+struct PacketTraceSlot {
+	static constexpr size_t kWords = (sizeof(PacketTraceRecord) + 7) / 8;
+
+	// A seqlock: 2 * n + 1 while the owner writes the nth record the ring has held, 2 * n + 2
+	// once it's done.
+	std::atomic<uint64_t> sequence{0};
+	std::atomic<uint64_t> words[kWords];
+};
+
+struct PacketTraceRing {
+	// Records ever written. Only the owning thread writes; dumps read it to find the records
+	// that are complete.
+	std::atomic<uint64_t> head{0};
+	// Cleared when the owning thread exits, so another thread can take the ring over.
+	std::atomic<bool> in_use{true};
+	uint32_t index;
+	PacketTraceSlot slots[kPacketTraceRingSize];
+};
+
+// Rings are never freed: a thread that has gone away may still have the interesting packets.
+auto& rings_mutex = *new std::mutex();
+auto& rings = *new std::vector<PacketTraceRing*>();
+
+std::atomic<size_t> payload_bytes{0};
+
+struct RingOwner {
+	PacketTraceRing* ring = nullptr;
+
+	~RingOwner() {
+		if (ring) ring->in_use = false;
+	}
+};
+
+thread_local RingOwner ring_owner;
+
+PacketTraceRing* acquire_ring() {
+	std::lock_guard<std::mutex> lock(rings_mutex);
+	for (PacketTraceRing* ring : rings) {
+		bool in_use = false;
+		if (ring->in_use.compare_exchange_strong(in_use, true)) {
+			return ring;
+		}
+	}
+	PacketTraceRing* ring = new PacketTraceRing();
+	ring->index = rings.size();
+	rings.push_back(ring);
+	return ring;
+}
+
+// Copies out the records of |ring| that weren't being overwritten while we looked.
+void copy_ring(PacketTraceRing* ring, std::vector<PacketTraceRecord>* out) {
+	uint64_t end = ring->head.load(std::memory_order_acquire);
+	uint64_t begin = end > kPacketTraceRingSize ? end - kPacketTraceRingSize : 0;
+	for (uint64_t i = begin; i < end; ++i) {
+		PacketTraceSlot& slot = ring->slots[i % kPacketTraceRingSize];
+		uint64_t sequence = slot.sequence.load(std::memory_order_acquire);
+		if (sequence != 2 * i + 2) continue;
+
+		uint64_t words[PacketTraceSlot::kWords];
+		for (size_t w = 0; w < PacketTraceSlot::kWords; ++w) {
+			words[w] = slot.words[w].load(std::memory_order_relaxed);
+		}
+		std::atomic_thread_fence(std::memory_order_acquire);
+		if (slot.sequence.load(std::memory_order_relaxed) != sequence) continue;
+
+		PacketTraceRecord record;
+		memcpy(&record, words, sizeof(record));
+		out->push_back(record);
+	}
+}
+
+#if !defined(_WIN32)
+int dump_request_fds[2] = { -1, -1 };
+
+void request_dump(int) {
+	int saved_errno = errno;
+	char c = 0;
+	unix_write(dump_request_fds[1], &c, 1);
+	errno = saved_errno;
+}
+
+void dump_thread() {
+	adb_thread_setname("packet trace");
+	while (true) {
+		char c;
+		int rc = unix_read(dump_request_fds[0], &c, 1);
+		if (rc == -1 && errno == EINTR) continue;
+		if (rc != 1) return;
+
+		std::string path = packet_trace_default_path();
+		int count = packet_trace_dump(path);
+		if (count == -1) {
+			LOG(ERROR) << "failed to write packet trace to " << path << ": " << strerror(errno);
+		}
+		else {
+			LOG(INFO) << "wrote " << count << " packets to " << path;
+		}
+	}
+}
+#endif
+
+}  // namespace
+
+void packet_trace_init() {
+	const char* payload = getenv("ADB_PACKET_TRACE_PAYLOAD");
+	size_t bytes;
+	if (payload && android::base::ParseUint(payload, &bytes, kPacketTracePayloadMax)) {
+		payload_bytes = bytes;
+	}
+
+#if !defined(_WIN32)
+	if (pipe(dump_request_fds) == -1) {
+		PLOG(ERROR) << "failed to create packet trace pipe";
+		return;
+	}
+	close_on_exec(dump_request_fds[0]);
+	close_on_exec(dump_request_fds[1]);
+	std::thread(dump_thread).detach();
+
+	struct sigaction sa = {};
+	sa.sa_handler = request_dump;
+	sa.sa_flags = SA_RESTART;
+	sigaction(SIGUSR2, &sa, nullptr);
+#endif
+}
+
+void packet_trace_record(PacketTraceDirection direction, const char* serial, const apacket* p) {
+	PacketTraceRing* ring = ring_owner.ring;
+	if (ring == nullptr) {
+		ring = ring_owner.ring = acquire_ring();
+	}
+
+	PacketTraceRecord record;
+	record.timestamp_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+		std::chrono::steady_clock::now().time_since_epoch()).count();
+	record.command = p->msg.command;
+	record.arg0 = p->msg.arg0;
+	record.arg1 = p->msg.arg1;
+	record.data_length = p->msg.data_length;
+	record.thread = ring->index;
+	record.direction = direction;
+	strncpy(record.serial, serial ? serial : "", sizeof(record.serial));
+	record.payload_length = std::min<size_t>(payload_bytes, p->msg.data_length);
+	memcpy(record.payload, p->data, record.payload_length);
+	memset(record.payload + record.payload_length, 0,
+		sizeof(record.payload) - record.payload_length);
+
+	uint64_t words[PacketTraceSlot::kWords] = {};
+	memcpy(words, &record, sizeof(record));
+
+	uint64_t head = ring->head.load(std::memory_order_relaxed);
+	PacketTraceSlot& slot = ring->slots[head % kPacketTraceRingSize];
+	slot.sequence.store(2 * head + 1, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+	for (size_t w = 0; w < PacketTraceSlot::kWords; ++w) {
+		slot.words[w].store(words[w], std::memory_order_relaxed);
+	}
+	slot.sequence.store(2 * head + 2, std::memory_order_release);
+	ring->head.store(head + 1, std::memory_order_release);
+}
+
+std::string packet_trace_snapshot(size_t* count) {
+	std::vector<PacketTraceRecord> records;
+	{
+		std::lock_guard<std::mutex> lock(rings_mutex);
+		for (PacketTraceRing* ring : rings) {
+			copy_ring(ring, &records);
+		}
+	}
+	std::stable_sort(records.begin(), records.end(),
+		[](const PacketTraceRecord& a, const PacketTraceRecord& b) {
+			return a.timestamp_ns < b.timestamp_ns;
+		});
+
+	PacketTraceHeader header;
+	memcpy(header.magic, PACKET_TRACE_MAGIC, sizeof(header.magic));
+	header.record_size = sizeof(PacketTraceRecord);
+	header.record_count = records.size();
+
+	std::string contents(reinterpret_cast<const char*>(&header), sizeof(header));
+	contents.append(reinterpret_cast<const char*>(records.data()),
+		records.size() * sizeof(PacketTraceRecord));
+	*count = records.size();
+	return contents;
+}
+
+int packet_trace_dump(const std::string& path) {
+	size_t count;
+	std::string contents = packet_trace_snapshot(&count);
+	if (!android::base::WriteStringToFile(contents, path)) {
+		return -1;
+	}
+	return count;
+}
+
+std::string packet_trace_default_path() {
+#if ADB_HOST
+	std::string dir = adb_get_android_dir_path();
+#else
+	std::string dir = "/data/local/tmp";
+#endif
+	return android::base::StringPrintf("%s%cadb_packet_trace.%d", dir.c_str(), OS_PATH_SEPARATOR,
+		getpid());
+}
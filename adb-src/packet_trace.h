@@ -0,0 +1,84 @@
+/*
+ * Copyright (C) 2017 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __PACKET_TRACE_H
+#define __PACKET_TRACE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <string>
+
+struct apacket;
+
+// A flight recorder for the packets crossing each transport, cheap enough to leave on all the
+// time. Every thread that records packets appends fixed-size binary records to a ring of its
+// own, so recording takes no locks and does no formatting. The rings are dumped on demand (sent
+// to the client by the host:packet-trace service, or written to packet_trace_default_path() on
+// SIGUSR2 where there are signals), and the adb_packet_trace tool renders a dump as a timeline.
+
+#define PACKET_TRACE_MAGIC "ADBPKTR1"
+
+constexpr size_t kPacketTraceSerialMax = 32;
+constexpr size_t kPacketTracePayloadMax = 16;
+
+// Records kept per recording thread: 176KiB each.
+constexpr size_t kPacketTraceRingSize = 2048;
+
+enum PacketTraceDirection : uint8_t {
+	kPacketTraceRecv = 0,  // Read from the device (or, in adbd, from the host).
+	kPacketTraceSend = 1,  // Written to it.
+};
+
+// A dump is a PacketTraceHeader followed by 'record_count' PacketTraceRecords, oldest first,
+// in the byte order of the machine that wrote it.
+struct PacketTraceHeader {
+	char magic[8];  // PACKET_TRACE_MAGIC, not NUL-terminated.
+	uint32_t record_size;
+	uint32_t record_count;
+} __attribute__((packed));
+
+struct PacketTraceRecord {
+	uint64_t timestamp_ns;  // Monotonic; only meaningful relative to other records.
+	uint32_t command;
+	uint32_t arg0;  // For OPEN, OKAY, WRTE and CLSE, the sender's socket id...
+	uint32_t arg1;  // ...and the receiver's.
+	uint32_t data_length;
+	uint32_t thread;  // Which thread's ring this came from.
+	uint8_t direction;
+	uint8_t payload_length;  // How much of 'payload' is valid.
+	char serial[kPacketTraceSerialMax];  // Truncated, NUL-padded.
+	uint8_t payload[kPacketTracePayloadMax];
+} __attribute__((packed));
+
+// Reads ADB_PACKET_TRACE_PAYLOAD (how many bytes of each payload to keep, 0 by default), and
+// on POSIX installs a SIGUSR2 handler that dumps to packet_trace_default_path(). Only for the
+// server and adbd: it starts a thread, and takes over SIGUSR2.
+void packet_trace_init();
+
+// Records |p| crossing the transport |serial| (which may be null).
+void packet_trace_record(PacketTraceDirection direction, const char* serial, const apacket* p);
+
+// Returns a dump of the rings of every thread, setting |*count| to the number of records in it.
+std::string packet_trace_snapshot(size_t* count);
+
+// Writes packet_trace_snapshot() to |path|. Returns the number of records written, or -1 with
+// errno set.
+int packet_trace_dump(const std::string& path);
+
+std::string packet_trace_default_path();
+
+#endif  // __PACKET_TRACE_H
@@ -0,0 +1,112 @@
+/*
+ * Copyright (C) 2017 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// adb_packet_trace: renders a dump written by `adb packet-trace` (or by sending adb or adbd
+// SIGUSR2) as a timeline, one packet per line:
+//
+//     +TIME_MS  THREAD  DIRECTION  SERIAL  COMMAND  arg0=A arg1=B len=N  [PAYLOAD]
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "packet_trace.h"
+
+static std::string command_name(uint32_t command) {
+	char name[9];
+	for (int i = 0; i < 4; ++i) {
+		int c = (command >> (i * 8)) & 0xff;
+		if (c < 32 || c >= 127) {
+			snprintf(name, sizeof(name), "%08x", command);
+			return name;
+		}
+		name[i] = c;
+	}
+	name[4] = '\0';
+	return name;
+}
+
+static std::string payload_string(const PacketTraceRecord& record) {
+	std::string result;
+	size_t length = std::min<size_t>(record.payload_length, kPacketTracePayloadMax);
+	for (size_t i = 0; i < length; ++i) {
+		char hex[4];
+		snprintf(hex, sizeof(hex), "%02x", record.payload[i]);
+		result += hex;
+	}
+	result += " ";
+	for (size_t i = 0; i < length; ++i) {
+		uint8_t c = record.payload[i];
+		result += (c >= 32 && c < 127) ? static_cast<char>(c) : '.';
+	}
+	return result;
+}
+
+static bool decode(FILE* fp, const char* path) {
+	PacketTraceHeader header;
+	if (fread(&header, sizeof(header), 1, fp) != 1 ||
+		memcmp(header.magic, PACKET_TRACE_MAGIC, sizeof(header.magic)) != 0) {
+		fprintf(stderr, "adb_packet_trace: %s isn't a packet trace\n", path);
+		return false;
+	}
+	if (header.record_size != sizeof(PacketTraceRecord)) {
+		fprintf(stderr, "adb_packet_trace: %s has %" PRIu32 "-byte records, expected %zu\n", path,
+			header.record_size, sizeof(PacketTraceRecord));
+		return false;
+	}
+
+	std::vector<PacketTraceRecord> records(header.record_count);
+	if (fread(records.data(), sizeof(PacketTraceRecord), records.size(), fp) != records.size()) {
+		fprintf(stderr, "adb_packet_trace: %s is truncated\n", path);
+		return false;
+	}
+
+	uint64_t start = records.empty() ? 0 : records[0].timestamp_ns;
+	for (const PacketTraceRecord& record : records) {
+		char serial[kPacketTraceSerialMax + 1] = {};
+		memcpy(serial, record.serial, kPacketTraceSerialMax);
+
+		printf("%+12.3f  t%-3" PRIu32 " %s  %-20s %-8s arg0=%-10" PRIu32 " arg1=%-10" PRIu32
+			" len=%-6" PRIu32 "%s%s\n",
+			(record.timestamp_ns - start) / 1e6, record.thread,
+			record.direction == kPacketTraceSend ? "send" : "recv", serial[0] ? serial : "-",
+			command_name(record.command).c_str(), record.arg0, record.arg1, record.data_length,
+			record.payload_length ? "  " : "",
+			record.payload_length ? payload_string(record).c_str() : "");
+	}
+	return true;
+}
+
+int main(int argc, char** argv) {
+	if (argc != 2) {
+		fprintf(stderr, "usage: adb_packet_trace FILE\n");
+		return 2;
+	}
+
+	FILE* fp = fopen(argv[1], "rb");
+	if (fp == nullptr) {
+		fprintf(stderr, "adb_packet_trace: couldn't open %s: %s\n", argv[1], strerror(errno));
+		return 1;
+	}
+	bool ok = decode(fp, argv[1]);
+	fclose(fp);
+	return ok ? 0 : 1;
+}
@@ -0,0 +1,124 @@
+/*
+ * Copyright (C) 2017 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "packet_trace.h"
+
+#include <gtest/gtest.h>
+
+#include <string.h>
+
+#include <atomic>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <android-base/file.h>
+#include <android-base/test_utils.h>
+
+#include "adb.h"
+
+static std::vector<PacketTraceRecord> DumpRecords(const char* serial) {
+	TemporaryFile tf;
+	EXPECT_NE(-1, packet_trace_dump(tf.path));
+
+	std::string contents;
+	EXPECT_TRUE(android::base::ReadFileToString(tf.path, &contents));
+	EXPECT_GE(contents.size(), sizeof(PacketTraceHeader));
+
+	PacketTraceHeader header;
+	memcpy(&header, contents.data(), sizeof(header));
+	EXPECT_EQ(0, memcmp(PACKET_TRACE_MAGIC, header.magic, sizeof(header.magic)));
+	EXPECT_EQ(sizeof(PacketTraceRecord), header.record_size);
+	EXPECT_EQ(sizeof(header) + header.record_count * sizeof(PacketTraceRecord), contents.size());
+
+	std::vector<PacketTraceRecord> result;
+	for (size_t i = 0; i < header.record_count; ++i) {
+		PacketTraceRecord record;
+		memcpy(&record, contents.data() + sizeof(header) + i * sizeof(record), sizeof(record));
+		if (strncmp(record.serial, serial, sizeof(record.serial)) == 0) {
+			result.push_back(record);
+		}
+	}
+	return result;
+}
+
+TEST(packet_trace, record_and_dump) {
+	std::unique_ptr<apacket> p(new apacket());
+	p->msg.command = A_WRTE;
+	p->msg.arg0 = 1;
+	p->msg.arg1 = 2;
+	p->msg.data_length = 4;
+	memcpy(p->data, "abcd", 4);
+	packet_trace_record(kPacketTraceSend, "packet_trace_test", p.get());
+	p->msg.command = A_OKAY;
+	p->msg.data_length = 0;
+	packet_trace_record(kPacketTraceRecv, "packet_trace_test", p.get());
+
+	std::vector<PacketTraceRecord> records = DumpRecords("packet_trace_test");
+	ASSERT_EQ(2U, records.size());
+	EXPECT_EQ(static_cast<uint32_t>(A_WRTE), records[0].command);
+	EXPECT_EQ(kPacketTraceSend, records[0].direction);
+	EXPECT_EQ(1U, records[0].arg0);
+	EXPECT_EQ(2U, records[0].arg1);
+	EXPECT_EQ(4U, records[0].data_length);
+	EXPECT_EQ(static_cast<uint32_t>(A_OKAY), records[1].command);
+	EXPECT_EQ(kPacketTraceRecv, records[1].direction);
+	EXPECT_LE(records[0].timestamp_ns, records[1].timestamp_ns);
+	EXPECT_EQ(records[0].thread, records[1].thread);
+}
+
+TEST(packet_trace, ring_keeps_newest) {
+	std::thread thread([]() {
+		std::unique_ptr<apacket> p(new apacket());
+		p->msg.command = A_WRTE;
+		for (size_t i = 0; i < kPacketTraceRingSize + 10; ++i) {
+			p->msg.arg0 = i;
+			packet_trace_record(kPacketTraceSend, "packet_trace_wrap", p.get());
+		}
+	});
+	thread.join();
+
+	std::vector<PacketTraceRecord> records = DumpRecords("packet_trace_wrap");
+	ASSERT_EQ(kPacketTraceRingSize, records.size());
+	for (size_t i = 0; i < records.size(); ++i) {
+		EXPECT_EQ(i + 10, records[i].arg0);
+	}
+}
+
+TEST(packet_trace, dump_while_recording) {
+	std::atomic<bool> done(false);
+	std::thread thread([&done]() {
+		std::unique_ptr<apacket> p(new apacket());
+		p->msg.command = A_WRTE;
+		for (uint32_t i = 0; !done; ++i) {
+			p->msg.arg0 = i;
+			p->msg.arg1 = ~i;
+			packet_trace_record(kPacketTraceSend, "packet_trace_race", p.get());
+		}
+	});
+
+	// Every record dumped must be one that was written whole, and they must still be in order.
+	for (int dump = 0; dump < 50; ++dump) {
+		std::vector<PacketTraceRecord> records = DumpRecords("packet_trace_race");
+		for (size_t i = 0; i < records.size(); ++i) {
+			ASSERT_EQ(~records[i].arg0, records[i].arg1);
+			if (i > 0) ASSERT_LT(records[i - 1].arg0, records[i].arg0);
+		}
+	}
+	done = true;
+	thread.join();
+}
@@ -0,0 +1,141 @@
+/*
+ * Copyright (C) 2017 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define TRACE_TAG SERVICES
+
+#include "sysdeps.h"
+#include "service_pool.h"
+
+#include <inttypes.h>
+
+#include <algorithm>
+#include <thread>
+
+#include <android-base/logging.h>
+#include <android-base/stringprintf.h>
+
+#include "adb_trace.h"
+
+constexpr size_t ServicePool::kDefaultMaxShort;
+constexpr std::chrono::milliseconds ServicePool::kDefaultIdleTimeout;
+
+ServicePool::ServicePool(size_t max_short, std::chrono::milliseconds idle_timeout)
+	: max_short_(max_short), idle_timeout_(idle_timeout) {
+	CHECK_GT(max_short_, 0U);
+}
+
+ServicePool::~ServicePool() {
+	std::unique_lock<std::mutex> lock(mutex_);
+	stopping_ = true;
+	cv_.notify_all();
+	cv_.wait(lock, [this]() { return stats_.threads == 0; });
+}
+
+void ServicePool::Run(std::function<void()> fn, ServiceDuration duration) {
+	Task task{ std::move(fn), duration, std::chrono::steady_clock::now() };
+
+	std::lock_guard<std::mutex> lock(mutex_);
+	if (duration == ServiceDuration::kShort) {
+		if (stats_.running_short >= max_short_) {
+			D("service pool: queueing, %zu short services running", stats_.running_short);
+			queue_.push_back(std::move(task));
+			++stats_.tasks_queued;
+			return;
+		}
+		++stats_.running_short;
+	}
+	else {
+		++stats_.running_long;
+	}
+	StartLocked(std::move(task));
+}
+
+void ServicePool::StartLocked(Task task) {
+	if (stats_.idle > handoff_.size()) {
+		handoff_.push_back(std::move(task));
+		cv_.notify_one();
+		return;
+	}
+
+	++stats_.threads;
+	++stats_.threads_created;
+	std::thread(&ServicePool::Worker, this, std::move(task)).detach();
+}
+
+void ServicePool::DrainQueueLocked() {
+	while (!queue_.empty() && stats_.running_short < max_short_) {
+		Task task = std::move(queue_.front());
+		queue_.pop_front();
+		++stats_.running_short;
+		uint64_t waited_us = std::chrono::duration_cast<std::chrono::microseconds>(
+			std::chrono::steady_clock::now() - task.queued).count();
+		stats_.max_queue_wait_us = std::max(stats_.max_queue_wait_us, waited_us);
+		StartLocked(std::move(task));
+	}
+}
+
+void ServicePool::Worker(Task task) {
+	adb_thread_setname("service pool");
+	std::unique_lock<std::mutex> lock(mutex_);
+	while (true) {
+		lock.unlock();
+		task.fn();
+		task.fn = nullptr;
+		lock.lock();
+
+		++stats_.tasks_run;
+		++stats_.idle;
+		if (task.duration == ServiceDuration::kShort) {
+			--stats_.running_short;
+			// Counted as idle, this worker may be handed the next one itself.
+			DrainQueueLocked();
+		}
+		else {
+			--stats_.running_long;
+		}
+
+		cv_.wait_for(lock, idle_timeout_, [this]() { return !handoff_.empty() || stopping_; });
+		--stats_.idle;
+		if (handoff_.empty()) break;
+		task = std::move(handoff_.front());
+		handoff_.pop_front();
+	}
+
+	--stats_.threads;
+	cv_.notify_all();
+}
+
+ServicePoolStats ServicePool::GetStats() {
+	std::lock_guard<std::mutex> lock(mutex_);
+	ServicePoolStats result = stats_;
+	result.queued = queue_.size();
+	return result;
+}
+
+ServicePool& service_pool() {
+	static ServicePool& pool = *new ServicePool();
+	return pool;
+}
+
+std::string format_service_pool() {
+	ServicePoolStats stats = service_pool().GetStats();
+	return android::base::StringPrintf(
+		"threads=%zu idle=%zu running_short=%zu running_long=%zu queued=%zu\n"
+		"threads_created=%" PRIu64 " tasks_run=%" PRIu64 " tasks_queued=%" PRIu64
+		" max_queue_wait_us=%" PRIu64 "\n",
+		stats.threads, stats.idle, stats.running_short, stats.running_long, stats.queued,
+		stats.threads_created, stats.tasks_run, stats.tasks_queued, stats.max_queue_wait_us);
+}
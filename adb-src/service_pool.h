@@ -0,0 +1,107 @@
+/*
+ * Copyright (C) 2017 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __SERVICE_POOL_H
+#define __SERVICE_POOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+
+// How long a service may keep the thread it runs on.
+enum class ServiceDuration {
+	// Done in seconds at most, whatever the client does: root, remount, usb, tcpip and the
+	// like. These are limited, and queue once the limit is reached.
+	kShort,
+	// For as long as the client wants (sync, shell, framebuffer), or for as long as something
+	// outside adb takes: reboot, which never returns once it's started, and the host's connect,
+	// which waits on the network. These never queue, since there's no telling when a slot would
+	// free up, and don't count against the limit.
+	kLongLived,
+};
+
+struct ServicePoolStats {
+	size_t threads = 0;
+	size_t idle = 0;
+	size_t running_short = 0;
+	size_t running_long = 0;
+	size_t queued = 0;
+
+	uint64_t threads_created = 0;
+	uint64_t tasks_run = 0;
+	uint64_t tasks_queued = 0;
+	uint64_t max_queue_wait_us = 0;
+};
+
+// Runs services on reused threads, instead of a thread of their own that's created and torn
+// down for every request. A finished worker waits for the next service for a while before
+// exiting, so a burst of requests (say, a script running thousands of short syncs) only pays for
+// thread creation once.
+class ServicePool {
+public:
+	static constexpr size_t kDefaultMaxShort = 8;
+	static constexpr std::chrono::milliseconds kDefaultIdleTimeout{ 30000 };
+
+	ServicePool(size_t max_short = kDefaultMaxShort,
+		std::chrono::milliseconds idle_timeout = kDefaultIdleTimeout);
+
+	// Waits for the running services to finish, and the workers to exit.
+	~ServicePool();
+
+	void Run(std::function<void()> fn, ServiceDuration duration);
+
+	ServicePoolStats GetStats();
+
+private:
+	struct Task {
+		std::function<void()> fn;
+		ServiceDuration duration;
+		std::chrono::steady_clock::time_point queued;
+	};
+
+	// Starts |task|, which has been counted as running, on an idle worker or a new one.
+	void StartLocked(Task task);
+	// Starts as many queued tasks as the limit allows.
+	void DrainQueueLocked();
+	void Worker(Task task);
+
+	const size_t max_short_;
+	const std::chrono::milliseconds idle_timeout_;
+
+	std::mutex mutex_;
+	std::condition_variable cv_;
+	// Started tasks waiting for an idle worker to pick them up; never more than there are idle
+	// workers.
+	std::deque<Task> handoff_;
+	// Short tasks waiting for one of the others to finish.
+	std::deque<Task> queue_;
+	bool stopping_ = false;
+	ServicePoolStats stats_;
+};
+
+// The process's pool.
+ServicePool& service_pool();
+
+// The host:service-pool report.
+std::string format_service_pool();
+
+#endif
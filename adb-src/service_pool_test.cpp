@@ -0,0 +1,103 @@
+/*
+ * Copyright (C) 2017 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "service_pool.h"
+
+#include <gtest/gtest.h>
+
+#include <atomic>
+#include <chrono>
+#include <future>
+#include <thread>
+
+using namespace std::chrono_literals;
+
+// Waits for |pool| to have no services running or queued.
+static void WaitForIdle(ServicePool* pool) {
+	while (true) {
+		ServicePoolStats stats = pool->GetStats();
+		if (stats.running_short == 0 && stats.running_long == 0 && stats.queued == 0) return;
+		std::this_thread::sleep_for(1ms);
+	}
+}
+
+TEST(ServicePoolTest, reuses_threads) {
+	ServicePool pool(4, 10s);
+	for (int i = 0; i < 100; ++i) {
+		std::promise<void> done;
+		pool.Run([&done]() { done.set_value(); },
+			i % 2 ? ServiceDuration::kShort : ServiceDuration::kLongLived);
+		done.get_future().wait();
+		WaitForIdle(&pool);
+	}
+
+	ServicePoolStats stats = pool.GetStats();
+	ASSERT_EQ(1U, stats.threads_created);
+	ASSERT_EQ(100U, stats.tasks_run);
+	ASSERT_EQ(1U, stats.idle);
+}
+
+TEST(ServicePoolTest, queues_short_services) {
+	ServicePool pool(2, 10s);
+	std::promise<void> release;
+	std::shared_future<void> released = release.get_future().share();
+	std::atomic<int> finished{ 0 };
+	auto blocked = [released, &finished]() {
+		released.wait();
+		++finished;
+	};
+
+	for (int i = 0; i < 3; ++i) {
+		pool.Run(blocked, ServiceDuration::kShort);
+	}
+	ServicePoolStats stats = pool.GetStats();
+	ASSERT_EQ(2U, stats.running_short);
+	ASSERT_EQ(1U, stats.queued);
+
+	// Long-lived services don't wait for the limit.
+	std::promise<void> ran;
+	pool.Run([&ran]() { ran.set_value(); }, ServiceDuration::kLongLived);
+	ASSERT_EQ(std::future_status::ready, ran.get_future().wait_for(10s));
+
+	release.set_value();
+	WaitForIdle(&pool);
+	ASSERT_EQ(3, finished);
+	stats = pool.GetStats();
+	ASSERT_EQ(1U, stats.tasks_queued);
+	ASSERT_EQ(3U, stats.threads_created);
+}
+
+TEST(ServicePoolTest, idle_workers_exit) {
+	ServicePool pool(1, 10ms);
+	pool.Run([]() {}, ServiceDuration::kShort);
+	auto deadline = std::chrono::steady_clock::now() + 10s;
+	while (pool.GetStats().threads != 0) {
+		ASSERT_LT(std::chrono::steady_clock::now(), deadline);
+		std::this_thread::sleep_for(1ms);
+	}
+}
+
+TEST(ServicePoolTest, destructor_waits) {
+	std::atomic<bool> finished{ false };
+	{
+		ServicePool pool;
+		pool.Run([&finished]() {
+			std::this_thread::sleep_for(50ms);
+			finished = true;
+		}, ServiceDuration::kLongLived);
+	}
+	ASSERT_TRUE(finished);
+}
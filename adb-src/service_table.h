@@ -0,0 +1,104 @@
+/*
+ * Copyright (C) 2017 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __SERVICE_TABLE_H
+#define __SERVICE_TABLE_H
+
+#include <string.h>
+
+#include <algorithm>
+#include <initializer_list>
+#include <vector>
+
+#include <android-base/logging.h>
+
+// What may follow a service's name in a request.
+enum class ServiceArgument {
+	kNone,      // Nothing: "name".
+	kRequired,  // "name:<argument>", where the argument may be empty.
+	kOptional,  // Either of the above.
+	kRaw,       // Anything, passed on as it is (for "shell,v2,raw:<command>" and the like).
+};
+
+// Finds the handler for a service request with a binary search on its name, which is everything
+// up to the first ':' or ',', rather than with a chain of comparisons that every request has to
+// walk until it gets to its own. Entries may be given in any order; they're sorted once, up
+// front.
+template <typename Handler>
+class ServiceTable {
+public:
+	struct Entry {
+		const char* name;
+		ServiceArgument argument;
+		Handler handler;
+	};
+
+	explicit ServiceTable(std::initializer_list<Entry> entries) : entries_(entries) {
+		std::sort(entries_.begin(), entries_.end(), [](const Entry& a, const Entry& b) {
+			return strcmp(a.name, b.name) < 0;
+		});
+		for (size_t i = 1; i < entries_.size(); ++i) {
+			CHECK_NE(0, strcmp(entries_[i - 1].name, entries_[i].name))
+				<< "duplicate service " << entries_[i].name;
+		}
+	}
+
+	// Returns the entry for |request|, or nullptr if there's none, or if it has an argument that
+	// the service doesn't take or lacks one it needs. |*argument| is set to the argument (nullptr
+	// if an optional one is absent), or for kRaw, to whatever follows the name.
+	const Entry* Find(const char* request, const char** argument) const {
+		size_t length = strcspn(request, ":,");
+		auto it = std::lower_bound(entries_.begin(), entries_.end(), request,
+			[length](const Entry& entry, const char* name) {
+				return Compare(entry.name, name, length) < 0;
+			});
+		if (it == entries_.end() || Compare(it->name, request, length) != 0) {
+			return nullptr;
+		}
+
+		const char* rest = request + length;
+		switch (it->argument) {
+		case ServiceArgument::kNone:
+			if (*rest != '\0') return nullptr;
+			*argument = nullptr;
+			break;
+		case ServiceArgument::kRequired:
+			if (*rest != ':') return nullptr;
+			*argument = rest + 1;
+			break;
+		case ServiceArgument::kOptional:
+			if (*rest != '\0' && *rest != ':') return nullptr;
+			*argument = *rest == ':' ? rest + 1 : nullptr;
+			break;
+		case ServiceArgument::kRaw:
+			*argument = rest;
+			break;
+		}
+		return &*it;
+	}
+
+private:
+	// strcmp() of |a| against the first |length| bytes of |b|.
+	static int Compare(const char* a, const char* b, size_t length) {
+		int result = strncmp(a, b, length);
+		if (result != 0) return result;
+		return a[length] == '\0' ? 0 : 1;
+	}
+
+	std::vector<Entry> entries_;
+};
+
+#endif
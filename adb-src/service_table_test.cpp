@@ -0,0 +1,89 @@
+/*
+ * Copyright (C) 2017 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include "service_table.h"
+
+#include <gtest/gtest.h>
+
+static const ServiceTable<int>& Table() {
+	// Out of order, to check that they're sorted.
+	static const auto& table = *new ServiceTable<int>({
+		{ "sync", ServiceArgument::kRequired, 1 },
+		{ "reconnect", ServiceArgument::kNone, 2 },
+		{ "shell", ServiceArgument::kRaw, 3 },
+		{ "fdevent-profile", ServiceArgument::kOptional, 4 },
+		{ "s", ServiceArgument::kRequired, 5 },
+		{ "devices", ServiceArgument::kNone, 6 },
+		{ "devices-l", ServiceArgument::kNone, 7 },
+	});
+	return table;
+}
+
+static int Find(const char* request, const char** argument) {
+	*argument = "unset";
+	const auto* entry = Table().Find(request, argument);
+	return entry == nullptr ? -1 : entry->handler;
+}
+
+TEST(ServiceTableTest, unknown) {
+	const char* argument;
+	ASSERT_EQ(-1, Find("", &argument));
+	ASSERT_EQ(-1, Find("a", &argument));
+	ASSERT_EQ(-1, Find("zzz", &argument));
+	ASSERT_EQ(-1, Find("syn:", &argument));
+	ASSERT_EQ(-1, Find("syncs:", &argument));
+	ASSERT_EQ(-1, Find("devices-", &argument));
+}
+
+TEST(ServiceTableTest, none) {
+	const char* argument;
+	ASSERT_EQ(2, Find("reconnect", &argument));
+	ASSERT_EQ(nullptr, argument);
+	ASSERT_EQ(6, Find("devices", &argument));
+	ASSERT_EQ(7, Find("devices-l", &argument));
+	ASSERT_EQ(-1, Find("reconnect:", &argument));
+	ASSERT_EQ(-1, Find("reconnect,x", &argument));
+}
+
+TEST(ServiceTableTest, required) {
+	const char* argument;
+	ASSERT_EQ(1, Find("sync:", &argument));
+	ASSERT_STREQ("", argument);
+	ASSERT_EQ(5, Find("s:a:b", &argument));
+	ASSERT_STREQ("a:b", argument);
+	ASSERT_EQ(-1, Find("sync", &argument));
+	ASSERT_EQ(-1, Find("sync,v2:", &argument));
+}
+
+TEST(ServiceTableTest, optional) {
+	const char* argument;
+	ASSERT_EQ(4, Find("fdevent-profile", &argument));
+	ASSERT_EQ(nullptr, argument);
+	ASSERT_EQ(4, Find("fdevent-profile:start:5", &argument));
+	ASSERT_STREQ("start:5", argument);
+	ASSERT_EQ(-1, Find("fdevent-profile,start", &argument));
+}
+
+TEST(ServiceTableTest, raw) {
+	const char* argument;
+	ASSERT_EQ(3, Find("shell", &argument));
+	ASSERT_STREQ("", argument);
+	ASSERT_EQ(3, Find("shell:ls", &argument));
+	ASSERT_STREQ(":ls", argument);
+	ASSERT_EQ(3, Find("shell,v2,raw:ls", &argument));
+	ASSERT_STREQ(",v2,raw:ls", argument);
+}
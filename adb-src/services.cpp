@@ -31,9 +31,8 @@
 #include <unistd.h>
 #endif
 
-#include <thread>
-
 #include <android-base/file.h>
+#include <android-base/parseint.h>
 #include <android-base/parsenetaddress.h>
 #include <android-base/stringprintf.h>
 #include <android-base/strings.h>
@@ -50,26 +49,16 @@
 #include "adb_io.h"
 #include "adb_utils.h"
 #include "file_sync_service.h"
+#include "packet_trace.h"
 #include "remount_service.h"
+#include "service_pool.h"
+#include "service_table.h"
 #include "services.h"
 #include "shell_service.h"
 #include "socket_spec.h"
 #include "sysdeps.h"
 #include "transport.h"
 
-struct stinfo {
-	void (*func)(int fd, void* cookie);
-	int fd;
-	void* cookie;
-};
-
-static void service_bootstrap_func(void* x) {
-	stinfo* sti = reinterpret_cast<stinfo*>(x);
-	adb_thread_setname(android::base::StringPrintf("service %d", sti->fd));
-	sti->func(sti->fd, sti->cookie);
-	free(sti);
-}
-
 #if !ADB_HOST
 
 void restart_root_service(int fd, void* cookie) {
@@ -241,7 +230,10 @@ static int ShellService(const std::string& args, const atransport* transport) {
 
 #endif  // !ADB_HOST
 
-static int create_service_thread(void (*func)(int, void*), void* cookie)
+// Runs |func| on the service pool (see service_pool.h), with one end of a new socketpair; returns
+// the other.
+static int create_service_thread(void (*func)(int, void*), void* cookie,
+	ServiceDuration duration)
 {
 	int s[2];
 	if (adb_socketpair(s)) {
@@ -259,20 +251,111 @@ static int create_service_thread(void (*func)(int, void*), void* cookie)
 	}
 #endif // !ADB_HOST
 
-	stinfo* sti = reinterpret_cast<stinfo*>(malloc(sizeof(stinfo)));
-	if (sti == nullptr) {
-		fatal("cannot allocate stinfo");
-	}
-	sti->func = func;
-	sti->cookie = cookie;
-	sti->fd = s[1];
-
-	std::thread(service_bootstrap_func, sti).detach();
+	int fd = s[1];
+	service_pool().Run([func, fd, cookie]() {
+		adb_thread_setname(android::base::StringPrintf("service %d", fd));
+		func(fd, cookie);
+	}, duration);
 
 	D("service thread started, %d:%d", s[0], s[1]);
 	return s[0];
 }
 
+#if !ADB_HOST
+typedef int (*ServiceHandler)(const char* argument, const atransport* transport);
+
+static const auto& device_services = *new ServiceTable<ServiceHandler>({
+	{ "backup", ServiceArgument::kRequired,
+		[](const char* argument, const atransport*) {
+			return StartSubprocess(android::base::StringPrintf("/system/bin/bu backup %s",
+				argument).c_str(),
+				nullptr, SubprocessType::kRaw, SubprocessProtocol::kNone);
+		} },
+	{ "dev", ServiceArgument::kRequired,
+		[](const char* argument, const atransport*) {
+			return unix_open(argument, O_RDWR | O_CLOEXEC);
+		} },
+	{ "disable-verity", ServiceArgument::kRequired,
+		[](const char*, const atransport*) {
+			return create_service_thread(set_verity_enabled_state_service, (void*)0,
+				ServiceDuration::kShort);
+		} },
+	{ "enable-verity", ServiceArgument::kRequired,
+		[](const char*, const atransport*) {
+			return create_service_thread(set_verity_enabled_state_service, (void*)1,
+				ServiceDuration::kShort);
+		} },
+	{ "exec", ServiceArgument::kRequired,
+		[](const char* argument, const atransport*) {
+			return StartSubprocess(argument, nullptr, SubprocessType::kRaw,
+				SubprocessProtocol::kNone);
+		} },
+	{ "framebuffer", ServiceArgument::kRequired,
+		[](const char*, const atransport*) {
+			return create_service_thread(framebuffer_service, 0, ServiceDuration::kLongLived);
+		} },
+	{ "jdwp", ServiceArgument::kRequired,
+		[](const char* argument, const atransport*) {
+			return create_jdwp_connection_fd(atoi(argument));
+		} },
+	{ "reboot", ServiceArgument::kRequired,
+		[](const char* argument, const atransport*) {
+			void* arg = strdup(argument);
+			if (arg == NULL) return -1;
+			// Once the reboot is under way, reboot_service never returns.
+			return create_service_thread(reboot_service, arg, ServiceDuration::kLongLived);
+		} },
+	{ "reconnect", ServiceArgument::kNone,
+		[](const char*, const atransport* transport) {
+			return create_service_thread(reconnect_service, const_cast<atransport*>(transport),
+				ServiceDuration::kShort);
+		} },
+	{ "remount", ServiceArgument::kRequired,
+		[](const char*, const atransport*) {
+			return create_service_thread(remount_service, NULL, ServiceDuration::kShort);
+		} },
+	{ "restore", ServiceArgument::kRequired,
+		[](const char*, const atransport*) {
+			return StartSubprocess("/system/bin/bu restore", nullptr, SubprocessType::kRaw,
+				SubprocessProtocol::kNone);
+		} },
+	{ "reverse", ServiceArgument::kRequired,
+		[](const char* argument, const atransport*) {
+			return reverse_service(argument);
+		} },
+	{ "root", ServiceArgument::kRequired,
+		[](const char*, const atransport*) {
+			return create_service_thread(restart_root_service, NULL, ServiceDuration::kShort);
+		} },
+	// "shell[,<options>]:<command>": ShellService() takes everything after "shell".
+	{ "shell", ServiceArgument::kRaw,
+		[](const char* argument, const atransport* transport) {
+			return ShellService(argument, transport);
+		} },
+	{ "sync", ServiceArgument::kRequired,
+		[](const char*, const atransport*) {
+			return create_service_thread(file_sync_service, NULL, ServiceDuration::kLongLived);
+		} },
+	{ "tcpip", ServiceArgument::kRequired,
+		[](const char* argument, const atransport*) {
+			int port;
+			if (sscanf(argument, "%d", &port) != 1) {
+				return -1;
+			}
+			return create_service_thread(restart_tcp_service, (void*)(uintptr_t)port,
+				ServiceDuration::kShort);
+		} },
+	{ "unroot", ServiceArgument::kRequired,
+		[](const char*, const atransport*) {
+			return create_service_thread(restart_unroot_service, NULL, ServiceDuration::kShort);
+		} },
+	{ "usb", ServiceArgument::kRequired,
+		[](const char*, const atransport*) {
+			return create_service_thread(restart_usb_service, NULL, ServiceDuration::kShort);
+		} },
+});
+#endif  // !ADB_HOST
+
 int service_to_fd(const char* name, const atransport* transport) {
 	int ret = -1;
 
@@ -282,72 +365,16 @@ int service_to_fd(const char* name, const atransport* transport) {
 		if (ret < 0) {
 			LOG(ERROR) << "failed to connect to socket '" << name << "': " << error;
 		}
-#if !ADB_HOST
-	}
-	else if (!strncmp("dev:", name, 4)) {
-		ret = unix_open(name + 4, O_RDWR | O_CLOEXEC);
-	}
-	else if (!strncmp(name, "framebuffer:", 12)) {
-		ret = create_service_thread(framebuffer_service, 0);
-	}
-	else if (!strncmp(name, "jdwp:", 5)) {
-		ret = create_jdwp_connection_fd(atoi(name + 5));
 	}
-	else if (!strncmp(name, "shell", 5)) {
-		ret = ShellService(name + 5, transport);
-	}
-	else if (!strncmp(name, "exec:", 5)) {
-		ret = StartSubprocess(name + 5, nullptr, SubprocessType::kRaw, SubprocessProtocol::kNone);
-	}
-	else if (!strncmp(name, "sync:", 5)) {
-		ret = create_service_thread(file_sync_service, NULL);
-	}
-	else if (!strncmp(name, "remount:", 8)) {
-		ret = create_service_thread(remount_service, NULL);
-	}
-	else if (!strncmp(name, "reboot:", 7)) {
-		void* arg = strdup(name + 7);
-		if (arg == NULL) return -1;
-		ret = create_service_thread(reboot_service, arg);
-	}
-	else if (!strncmp(name, "root:", 5)) {
-		ret = create_service_thread(restart_root_service, NULL);
-	}
-	else if (!strncmp(name, "unroot:", 7)) {
-		ret = create_service_thread(restart_unroot_service, NULL);
-	}
-	else if (!strncmp(name, "backup:", 7)) {
-		ret = StartSubprocess(android::base::StringPrintf("/system/bin/bu backup %s",
-			(name + 7)).c_str(),
-			nullptr, SubprocessType::kRaw, SubprocessProtocol::kNone);
-	}
-	else if (!strncmp(name, "restore:", 8)) {
-		ret = StartSubprocess("/system/bin/bu restore", nullptr, SubprocessType::kRaw,
-			SubprocessProtocol::kNone);
-	}
-	else if (!strncmp(name, "tcpip:", 6)) {
-		int port;
-		if (sscanf(name + 6, "%d", &port) != 1) {
-			return -1;
+#if !ADB_HOST
+	else {
+		const char* argument;
+		const auto* entry = device_services.Find(name, &argument);
+		if (entry != nullptr) {
+			ret = entry->handler(argument, transport);
 		}
-		ret = create_service_thread(restart_tcp_service, (void*)(uintptr_t)port);
-	}
-	else if (!strncmp(name, "usb:", 4)) {
-		ret = create_service_thread(restart_usb_service, NULL);
-	}
-	else if (!strncmp(name, "reverse:", 8)) {
-		ret = reverse_service(name + 8);
 	}
-	else if (!strncmp(name, "disable-verity:", 15)) {
-		ret = create_service_thread(set_verity_enabled_state_service, (void*)0);
-	}
-	else if (!strncmp(name, "enable-verity:", 15)) {
-		ret = create_service_thread(set_verity_enabled_state_service, (void*)1);
-	}
-	else if (!strcmp(name, "reconnect")) {
-		ret = create_service_thread(reconnect_service, const_cast<atransport*>(transport));
 #endif
-	}
 	if (ret >= 0) {
 		close_on_exec(ret);
 	}
@@ -355,51 +382,6 @@ int service_to_fd(const char* name, const atransport* transport) {
 }
 
 #if ADB_HOST
-struct state_info {
-	TransportType transport_type;
-	std::string serial;
-	ConnectionState state;
-};
-
-static void wait_for_state(int fd, void* data) {
-	std::unique_ptr<state_info> sinfo(reinterpret_cast<state_info*>(data));
-
-	D("wait_for_state %d", sinfo->state);
-
-	while (true) {
-		bool is_ambiguous = false;
-		std::string error = "unknown error";
-		const char* serial = sinfo->serial.length() ? sinfo->serial.c_str() : NULL;
-		atransport* t = acquire_one_transport(sinfo->transport_type, serial, &is_ambiguous, &error);
-		if (t != nullptr && (sinfo->state == kCsAny || sinfo->state == t->GetConnectionState())) {
-			SendOkay(fd);
-			break;
-		}
-		else if (!is_ambiguous) {
-			adb_pollfd pfd = { .fd = fd, .events = POLLIN };
-			int rc = adb_poll(&pfd, 1, 1000);
-			if (rc < 0) {
-				SendFail(fd, error);
-				break;
-			}
-			else if (rc > 0 && (pfd.revents & POLLHUP) != 0) {
-				// The other end of the socket is closed, probably because the other side was
-				// terminated, bail out.
-				break;
-			}
-
-			// Try again...
-		}
-		else {
-			SendFail(fd, error);
-			break;
-		}
-	}
-
-	adb_close(fd);
-	D("wait_for_state is done");
-}
-
 void connect_emulator(const std::string& port_spec, std::string* response) {
 	std::vector<std::string> pieces = android::base::Split(port_spec, ",");
 	if (pieces.size() != 2) {
@@ -448,6 +430,15 @@ void connect_emulator(const std::string& port_spec, std::string* response) {
 	}
 }
 
+// Sends a packet trace dump, for the client to write wherever it likes; the server doesn't
+// write files at paths its clients choose.
+static void packet_trace_service(int fd, void*) {
+	size_t count;
+	std::string contents = packet_trace_snapshot(&count);
+	WriteFdExactly(fd, contents);
+	adb_close(fd);
+}
+
 static void connect_service(int fd, void* data) {
 	char* host = reinterpret_cast<char*>(data);
 	std::string response;
@@ -470,58 +461,66 @@ asocket* host_service_to_socket(const char* name, const char* serial) {
 	if (!strcmp(name, "track-devices")) {
 		return create_device_tracker();
 	}
-	else if (android::base::StartsWith(name, "wait-for-")) {
+	else if (!strncmp(name, "wait-for-", 9)) {
+		// wait-for-<transport>-<state>[:<timeout ms>]
 		name += strlen("wait-for-");
 
-		std::unique_ptr<state_info> sinfo(new state_info);
-		if (sinfo == nullptr) {
-			fprintf(stderr, "couldn't allocate state_info: %s", strerror(errno));
-			return nullptr;
-		}
-
-		if (serial) sinfo->serial = serial;
-
-		if (android::base::StartsWith(name, "local")) {
+		TransportType transport_type;
+		if (!strncmp(name, "local", 5)) {
 			name += strlen("local");
-			sinfo->transport_type = kTransportLocal;
+			transport_type = kTransportLocal;
 		}
-		else if (android::base::StartsWith(name, "usb")) {
+		else if (!strncmp(name, "usb", 3)) {
 			name += strlen("usb");
-			sinfo->transport_type = kTransportUsb;
+			transport_type = kTransportUsb;
 		}
-		else if (android::base::StartsWith(name, "any")) {
+		else if (!strncmp(name, "any", 3)) {
 			name += strlen("any");
-			sinfo->transport_type = kTransportAny;
+			transport_type = kTransportAny;
 		}
 		else {
 			return nullptr;
 		}
 
-		if (!strcmp(name, "-device")) {
-			sinfo->state = kCsDevice;
+		int64_t timeout_ms = -1;
+		const char* timeout = strchr(name, ':');
+		if (timeout != nullptr &&
+			!android::base::ParseInt(timeout + 1, &timeout_ms, int64_t(0),
+				kStateWaiterMaxTimeoutMs)) {
+			return nullptr;
+		}
+		std::string state_name(name, timeout ? timeout - name : strlen(name));
+
+		ConnectionState state;
+		if (state_name == "-device") {
+			state = kCsDevice;
 		}
-		else if (!strcmp(name, "-recovery")) {
-			sinfo->state = kCsRecovery;
+		else if (state_name == "-recovery") {
+			state = kCsRecovery;
 		}
-		else if (!strcmp(name, "-sideload")) {
-			sinfo->state = kCsSideload;
+		else if (state_name == "-sideload") {
+			state = kCsSideload;
 		}
-		else if (!strcmp(name, "-bootloader")) {
-			sinfo->state = kCsBootloader;
+		else if (state_name == "-bootloader") {
+			state = kCsBootloader;
 		}
-		else if (!strcmp(name, "-any")) {
-			sinfo->state = kCsAny;
+		else if (state_name == "-any") {
+			state = kCsAny;
 		}
 		else {
 			return nullptr;
 		}
 
-		int fd = create_service_thread(wait_for_state, sinfo.release());
+		return create_state_waiter(transport_type, serial, state, timeout_ms);
+	}
+	else if (!strcmp(name, "packet-trace")) {
+		int fd = create_service_thread(packet_trace_service, nullptr, ServiceDuration::kLongLived);
 		return create_local_socket(fd);
 	}
 	else if (!strncmp(name, "connect:", 8)) {
 		char* host = strdup(name + 8);
-		int fd = create_service_thread(connect_service, host);
+		// Blocks in a TCP connect, for as long as the network takes to answer.
+		int fd = create_service_thread(connect_service, host, ServiceDuration::kLongLived);
 		return create_local_socket(fd);
 	}
 	return NULL;
@@ -90,7 +90,6 @@
 
 #include <memory>
 #include <string>
-#include <thread>
 #include <unordered_map>
 #include <vector>
 
@@ -104,6 +103,7 @@
 #include "adb_unique_fd.h"
 #include "adb_utils.h"
 #include "security_log_tags.h"
+#include "service_pool.h"
 
 namespace {
 	// Reads from |fd| until close or failure.
@@ -396,7 +396,7 @@ namespace {
 
 	bool Subprocess::StartThread(std::unique_ptr<Subprocess> subprocess, std::string* error) {
 		Subprocess* raw = subprocess.release();
-		std::thread(ThreadHandler, raw).detach();
+		service_pool().Run([raw]() { ThreadHandler(raw); }, ServiceDuration::kLongLived);
 
 		return true;
 	}
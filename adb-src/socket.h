@@ -18,12 +18,26 @@
 #define __ADB_SOCKET_H
 
 #include <stddef.h>
+#include <stdint.h>
 
+#include <functional>
+
+#include "adb_stats.h"
+#include "byte_ring.h"
 #include "fdevent.h"
 
 struct apacket;
 class atransport;
 
+// The classes a transport's write thread schedules packets by (see packet_scheduler.h), so that
+// interactive traffic isn't stuck behind a bulk transfer. A stream's WRITEs and CLOSE are in the
+// class of its service (see service_priority()); everything else is interactive.
+enum PacketPriority : uint8_t {
+	kPacketPriorityInteractive = 0,
+	kPacketPriorityBulk,
+	kPacketPriorityCount,
+};
+
 /* An asocket represents one half of a connection between a local and
 ** remote entity.  A local asocket is bound to a file descriptor.  A
 ** remote asocket is bound to the protocol engine.
@@ -65,7 +79,7 @@ struct asocket {
 	fdevent fde;
 	int fd;
 
-	/* queue of apackets waiting to be written
+	/* for the smart socket, the request received so far
 	*/
 	apacket* pkt_first;
 	apacket* pkt_last;
@@ -98,19 +112,76 @@ struct asocket {
 	/* A socket is bound to atransport */
 	atransport* transport;
 
+	// The transport whose close_all_sockets() closes this local socket, if any.
+	atransport* tracking_transport;
+
+	// For a local socket, the class of the stream's traffic; see service_priority().
+	PacketPriority priority;
+
+	// Windowed flow control, used by remote sockets on streams that negotiated it. Zero
+	// send_window means the legacy protocol: one WRITE, then wait for READY. Otherwise this
+	// side may keep sending until send_unacked reaches send_window, and READYs carry the
+	// number of bytes they acknowledge.
+	size_t send_window;
+	size_t send_unacked;
+	bool send_blocked;
+	// Bytes delivered to our peer that haven't been acknowledged yet.
+	size_t recv_unacked;
+
+	// For a local bulk socket, the packet being filled by small reads before it's sent (see
+	// should_coalesce()), whether anything was added to it since it was first held back, and how
+	// many packets to send without holding them back.
+	apacket* read_pending;
+	bool read_pending_grew;
+	uint8_t coalesce_skip;
+
+	// For a local socket, the bytes its peer sent that didn't fit into its fd yet, how many
+	// packets they came in, and when the oldest of those arrived.
+	ByteRing output;
+	size_t output_packets;
+	uint64_t output_timestamp_ns;
+
+	// Queued packet memory (see packet_memory.h). A local socket's output buffer, charged to its
+	// tracking_transport; and what a remote socket is waiting on to resume.
+	size_t queued_memory;
+	bool budget_blocked_peer;
+	bool budget_deferred_ready;
+
+	TrafficStats stats;
+
 	size_t get_max_payload() const;
 };
 
 asocket* find_local_socket(unsigned local_id, unsigned remote_id);
 void install_local_socket(asocket* s);
 void remove_socket(asocket* s);
+
+// Makes close_all_sockets(t) close local socket |s|, unless it's already tracked by a transport.
+// Done for sockets that connect to a remote on |t|, or are connected to by one.
+void track_local_socket(asocket* s, atransport* t);
 void close_all_sockets(atransport* t);
 
+// Calls |fn| for each local socket, including those still flushing after being closed.
+void iterate_local_sockets(std::function<void(const asocket*)> fn);
+
 asocket* create_local_socket(int fd);
 asocket* create_local_service_socket(const char* destination,
 	const atransport* transport);
 
 asocket* create_remote_socket(unsigned id, atransport* t);
+
+// The class of a stream to |destination|: bulk for file transfer and forwarded connections,
+// interactive for everything else (shells, JDWP, host services).
+PacketPriority service_priority(const char* destination);
+
+// The receive window this side offers to new streams on |t|: the OPEN argument, or the READY
+// payload answering an OPEN. Zero if |t| doesn't support kFeatureStreamWindow.
+constexpr uint32_t kStreamWindowBytes = 2 * 1024 * 1024;
+uint32_t stream_window(atransport* t);
+
+// Applies a READY from the other side to remote socket |s|. Returns true if it unblocks |s|, and
+// so its peer can be told it's ready.
+bool remote_socket_acked(asocket* s, const apacket* p);
 void connect_to_remote(asocket* s, const char* destination);
 void connect_to_smartsocket(asocket* s);
 
@@ -119,6 +190,26 @@ namespace internal {
 #if ADB_HOST
 	char* skip_host_serial(char* service);
 #endif
+
+	// A smart socket request, parsed in place.
+	struct SmartSocketRequest {
+		// The service, NUL-terminated, without any host prefix.
+		char* service;
+
+		// Who it's for: the device, or the host, as "host:", "host-usb:", "host-local:" or
+		// "host-serial:<serial>:". Host prefixes are only recognized by the host.
+		enum Target { kDevice, kHostAny, kHostUsb, kHostLocal, kHostSerial } target;
+		// For kHostSerial, or nullptr if it couldn't be found.
+		char* serial;
+	};
+
+	// Parses the request at the start of |data|, of which |len| bytes have arrived so far, in
+	// one pass and without copying or allocating. A request is four hex digits giving the
+	// length of the service that follows; that must leave room in |capacity| for the service's
+	// terminator. Returns 1 once the request is complete, 0 if more is needed, or -1 if it's
+	// malformed.
+	int parse_smart_socket_request(char* data, size_t len, size_t capacity,
+		SmartSocketRequest* request);
 }  // namespace internal
 
 #endif  // __ADB_SOCKET_H
@@ -27,12 +27,17 @@
 
 #include <unistd.h>
 
+#include <android-base/stringprintf.h>
+
 #include "adb.h"
 #include "adb_io.h"
 #include "fdevent_test.h"
+#include "packet_memory.h"
 #include "socket.h"
+#include "socket_spec.h"
 #include "sysdeps.h"
 #include "sysdeps/chrono.h"
+#include "transport.h"
 
 struct ThreadArg {
 	int first_read_fd;
@@ -213,6 +218,336 @@ TEST_F(LocalSocketTest, write_error_when_having_packets) {
 	TerminateThread(thread);
 }
 
+struct QueuedBytesArg {
+	int socket_fd;
+	int peer_fd;
+	asocket* s;
+	size_t bytes_written;
+	uint64_t queued_bytes;
+};
+
+static void QueuedBytesThreadFunc(QueuedBytesArg* arg) {
+	asocket* s = create_local_socket(arg->socket_fd);
+	ASSERT_TRUE(s != nullptr);
+	asocket* peer = create_local_socket(arg->peer_fd);
+	ASSERT_TRUE(peer != nullptr);
+	s->peer = peer;
+	peer->peer = s;
+
+	// Fill the socket until a packet is only partly written, then queue one more behind it.
+	arg->bytes_written = 0;
+	for (int queued = 0; queued < 2;) {
+		apacket* p = get_apacket();
+		p->len = sizeof(p->data);
+		arg->bytes_written += p->len;
+		if (s->enqueue(s, p) == 1) ++queued;
+	}
+	arg->s = s;
+	arg->queued_bytes = s->stats.queued_bytes;
+
+	fdevent_loop();
+}
+
+// This test checks that the bytes a socket counts as queued are the ones left over from a partial
+// write, and that draining them brings the count back to zero.
+TEST_F(LocalSocketTest, queued_bytes_after_partial_write) {
+	int socket_fd[2];
+	ASSERT_EQ(0, adb_socketpair(socket_fd));
+	int peer_fd[2];
+	ASSERT_EQ(0, adb_socketpair(peer_fd));
+	QueuedBytesArg arg;
+	arg.socket_fd = socket_fd[1];
+	arg.peer_fd = peer_fd[1];
+
+	PrepareThread();
+	std::thread thread(QueuedBytesThreadFunc, &arg);
+	// Wait until the fdevent_loop() starts.
+	std::this_thread::sleep_for(SLEEP_FOR_FDEVENT);
+	ASSERT_NE(0u, arg.queued_bytes);
+	ASSERT_LT(arg.queued_bytes, arg.bytes_written);
+
+	std::vector<char> buf(arg.bytes_written);
+	ASSERT_TRUE(ReadFdExactly(socket_fd[0], buf.data(), buf.size()));
+	std::this_thread::sleep_for(SLEEP_FOR_FDEVENT);
+	EXPECT_EQ(0u, arg.s->stats.queued_bytes);
+	EXPECT_EQ(0u, arg.s->stats.queued_packets);
+
+	ASSERT_EQ(0, adb_close(socket_fd[0]));
+	ASSERT_EQ(0, adb_close(peer_fd[0]));
+	std::this_thread::sleep_for(SLEEP_FOR_FDEVENT);
+	ASSERT_EQ(GetAdditionalLocalSocketCount(), fdevent_installed_count());
+	TerminateThread(thread);
+}
+
+TEST_F(LocalSocketTest, find_local_socket) {
+	atransport t;
+	int fds[2];
+	ASSERT_EQ(0, adb_socketpair(fds));
+	asocket* s = create_local_socket(fds[1]);
+	ASSERT_NE(nullptr, s);
+	track_local_socket(s, &t);
+	unsigned id = s->id;
+	ASSERT_NE(0u, id);
+
+	ASSERT_EQ(s, find_local_socket(id, 0));
+	ASSERT_EQ(nullptr, find_local_socket(id, 1));
+	ASSERT_EQ(nullptr, find_local_socket(id + 1, 0));
+
+	close_all_sockets(&t);
+	ASSERT_EQ(nullptr, find_local_socket(id, 0));
+
+	// A new socket doesn't answer to the old one's id.
+	int fds2[2];
+	ASSERT_EQ(0, adb_socketpair(fds2));
+	asocket* s2 = create_local_socket(fds2[1]);
+	track_local_socket(s2, &t);
+	ASSERT_NE(id, s2->id);
+	ASSERT_EQ(nullptr, find_local_socket(id, 0));
+	ASSERT_EQ(s2, find_local_socket(s2->id, 0));
+
+	close_all_sockets(&t);
+	ASSERT_EQ(0, adb_close(fds[0]));
+	ASSERT_EQ(0, adb_close(fds2[0]));
+}
+
+TEST_F(LocalSocketTest, close_all_sockets) {
+	atransport t1;
+	int fds1[2];
+	ASSERT_EQ(0, adb_socketpair(fds1));
+	asocket* s1 = create_local_socket(fds1[1]);
+	track_local_socket(s1, &t1);
+	unsigned id1 = s1->id;
+
+	atransport t2;
+	int fds2[2];
+	ASSERT_EQ(0, adb_socketpair(fds2));
+	asocket* s2 = create_local_socket(fds2[1]);
+	track_local_socket(s2, &t2);
+
+	// Only the first transport's socket is closed.
+	close_all_sockets(&t1);
+	ASSERT_EQ(nullptr, find_local_socket(id1, 0));
+	ASSERT_EQ(s2, find_local_socket(s2->id, 0));
+	ASSERT_EQ(1u, fdevent_installed_count());
+
+	close_all_sockets(&t2);
+	ASSERT_EQ(0u, fdevent_installed_count());
+	ASSERT_EQ(0, adb_close(fds1[0]));
+	ASSERT_EQ(0, adb_close(fds2[0]));
+}
+
+// Streams on a transport whose packets are captured rather than written anywhere.
+class StreamWindowTest : public FdeventTest {
+protected:
+	void SetUp() override {
+		FdeventTest::SetUp();
+		ASSERT_EQ(0, adb_socketpair(transport_fds_));
+		t_.transport_socket = transport_fds_[0];
+		t_.online = true;
+		t_.SetFeatures(FeatureSetToString(FeatureSet{ kFeatureStreamWindow }));
+		ASSERT_EQ(0, adb_socketpair(local_fds_));
+	}
+
+	void TearDown() override {
+		close_all_sockets(&t_);
+		while (apacket* p = ReadSent()) {
+			put_apacket(p);
+		}
+		packet_memory_forget_transport(&t_);
+		adb_close(transport_fds_[0]);
+		adb_close(transport_fds_[1]);
+		adb_close(local_fds_[0]);
+	}
+
+	// Returns the next packet sent on the transport, or nullptr if there isn't one.
+	apacket* ReadSent() {
+		adb_pollfd pfd = { transport_fds_[1], POLLIN, 0 };
+		if (adb_poll(&pfd, 1, 0) != 1) return nullptr;
+		apacket* p;
+		if (!ReadFdExactly(transport_fds_[1], &p, sizeof(p))) return nullptr;
+		return p;
+	}
+
+	// Delivers a packet from the other side of the transport.
+	void Receive(unsigned command, unsigned arg0, unsigned arg1, const void* data = nullptr,
+		size_t length = 0) {
+		apacket* p = get_apacket();
+		p->msg.command = command;
+		p->msg.arg0 = arg0;
+		p->msg.arg1 = arg1;
+		p->msg.data_length = length;
+		if (length != 0) memcpy(p->data, data, length);
+		handle_packet(p, &t_);
+	}
+
+	// A local socket whose stream to remote socket |remote_id| has the given windows.
+	asocket* ConnectedSocket(unsigned remote_id, size_t send_window) {
+		asocket* s = create_local_socket(local_fds_[1]);
+		s->peer = create_remote_socket(remote_id, &t_);
+		s->peer->peer = s;
+		s->peer->send_window = send_window;
+		track_local_socket(s, &t_);
+		return s;
+	}
+
+	static apacket* Write(size_t length) {
+		apacket* p = get_apacket();
+		p->len = length;
+		memset(p->data, 'x', length);
+		return p;
+	}
+
+	atransport t_;
+	int transport_fds_[2];
+	int local_fds_[2];
+};
+
+TEST_F(StreamWindowTest, remote_socket_acked) {
+	asocket* rs = create_remote_socket(1, &t_);
+	rs->send_window = 100;
+	rs->send_unacked = 100;
+	rs->send_blocked = true;
+
+	apacket* p = get_apacket();
+	p->msg.command = A_OKAY;
+	uint32_t acked = 60;
+	memcpy(p->data, &acked, sizeof(acked));
+	p->msg.data_length = sizeof(acked);
+	ASSERT_TRUE(remote_socket_acked(rs, p));
+	ASSERT_EQ(40U, rs->send_unacked);
+	ASSERT_FALSE(rs->send_blocked);
+
+	// A payload that isn't a 4-byte count acknowledges nothing.
+	p->msg.data_length = 3;
+	ASSERT_FALSE(remote_socket_acked(rs, p));
+	ASSERT_EQ(40U, rs->send_unacked);
+
+	// Nor can the other side acknowledge more than was sent.
+	acked = 1000;
+	memcpy(p->data, &acked, sizeof(acked));
+	p->msg.data_length = sizeof(acked);
+	ASSERT_FALSE(remote_socket_acked(rs, p));
+	ASSERT_EQ(0U, rs->send_unacked);
+
+	// Without a window, every READY unblocks.
+	rs->send_window = 0;
+	p->msg.data_length = 0;
+	ASSERT_TRUE(remote_socket_acked(rs, p));
+
+	put_apacket(p);
+	free(rs);
+}
+
+TEST_F(StreamWindowTest, ack_at_half_window) {
+	asocket* s = ConnectedSocket(5, kStreamWindowBytes);
+	s->peer->recv_unacked = kStreamWindowBytes / 2 - 8;
+
+	char data[4] = {};
+	Receive(A_WRTE, 5, s->id, data, sizeof(data));
+	ASSERT_EQ(nullptr, ReadSent());
+
+	Receive(A_WRTE, 5, s->id, data, sizeof(data));
+	apacket* p = ReadSent();
+	ASSERT_NE(nullptr, p);
+	ASSERT_EQ(static_cast<uint32_t>(A_OKAY), p->msg.command);
+	ASSERT_EQ(s->id, p->msg.arg0);
+	ASSERT_EQ(5U, p->msg.arg1);
+	ASSERT_EQ(sizeof(uint32_t), p->msg.data_length);
+	uint32_t acked;
+	memcpy(&acked, p->data, sizeof(acked));
+	ASSERT_EQ(kStreamWindowBytes / 2, acked);
+	ASSERT_EQ(0U, s->peer->recv_unacked);
+	put_apacket(p);
+}
+
+TEST_F(StreamWindowTest, send_blocked_when_window_full) {
+	asocket* s = ConnectedSocket(5, 8);
+	asocket* rs = s->peer;
+
+	ASSERT_EQ(0, rs->enqueue(rs, Write(4)));
+	ASSERT_FALSE(rs->send_blocked);
+	ASSERT_EQ(1, rs->enqueue(rs, Write(4)));
+	ASSERT_TRUE(rs->send_blocked);
+	for (int i = 0; i < 2; ++i) {
+		apacket* p = ReadSent();
+		ASSERT_NE(nullptr, p);
+		ASSERT_EQ(static_cast<uint32_t>(A_WRTE), p->msg.command);
+		put_apacket(p);
+	}
+
+	uint32_t acked = 8;
+	Receive(A_OKAY, 5, s->id, &acked, sizeof(acked));
+	ASSERT_FALSE(rs->send_blocked);
+	ASSERT_EQ(0U, rs->send_unacked);
+}
+
+TEST_F(StreamWindowTest, legacy_ready) {
+	// Our OPEN offered a window, but the READY answering it has no payload: the stream is
+	// legacy, one WRITE at a time.
+	asocket* s = create_local_socket(local_fds_[1]);
+	Receive(A_OKAY, 9, s->id);
+	ASSERT_NE(nullptr, s->peer);
+	ASSERT_EQ(0U, s->peer->send_window);
+
+	asocket* rs = s->peer;
+	ASSERT_EQ(1, rs->enqueue(rs, Write(4)));
+	apacket* p = ReadSent();
+	ASSERT_NE(nullptr, p);
+	put_apacket(p);
+
+	// And a READY without a payload unblocks it, acknowledging nothing.
+	Receive(A_OKAY, 9, s->id);
+	ASSERT_EQ(0U, rs->send_unacked);
+	ASSERT_EQ(nullptr, ReadSent());
+}
+
+TEST_F(StreamWindowTest, open_with_and_without_window) {
+	std::string error;
+	int port;
+	int listener = socket_spec_listen("tcp:0", &error, &port);
+	ASSERT_NE(-1, listener) << error;
+	std::string service = android::base::StringPrintf("tcp:%d", port);
+
+	// An OPEN without a window is answered without one, whatever the transport supports.
+	Receive(A_OPEN, 7, 0, service.c_str(), service.size() + 1);
+	apacket* p = ReadSent();
+	ASSERT_NE(nullptr, p);
+	ASSERT_EQ(static_cast<uint32_t>(A_OKAY), p->msg.command);
+	ASSERT_EQ(7U, p->msg.arg1);
+	ASSERT_EQ(0U, p->msg.data_length);
+	asocket* s = find_local_socket(p->msg.arg0, 7);
+	ASSERT_NE(nullptr, s);
+	ASSERT_EQ(0U, s->peer->send_window);
+	put_apacket(p);
+
+	// One with a window is answered with ours.
+	Receive(A_OPEN, 8, 4096, service.c_str(), service.size() + 1);
+	p = ReadSent();
+	ASSERT_NE(nullptr, p);
+	ASSERT_EQ(static_cast<uint32_t>(A_OKAY), p->msg.command);
+	ASSERT_EQ(8U, p->msg.arg1);
+	ASSERT_EQ(sizeof(uint32_t), p->msg.data_length);
+	uint32_t window;
+	memcpy(&window, p->data, sizeof(window));
+	ASSERT_EQ(kStreamWindowBytes, window);
+	s = find_local_socket(p->msg.arg0, 8);
+	ASSERT_NE(nullptr, s);
+	ASSERT_EQ(4096U, s->peer->send_window);
+	put_apacket(p);
+
+	// And refused on a transport that didn't advertise windows.
+	t_.SetFeatures("");
+	Receive(A_OPEN, 9, 4096, service.c_str(), service.size() + 1);
+	p = ReadSent();
+	ASSERT_NE(nullptr, p);
+	ASSERT_EQ(static_cast<uint32_t>(A_CLSE), p->msg.command);
+	ASSERT_EQ(0U, p->msg.arg0);
+	ASSERT_EQ(9U, p->msg.arg1);
+	put_apacket(p);
+
+	adb_close(listener);
+}
+
 #if defined(__linux__)
 
 static void ClientThreadFunc() {
@@ -264,8 +599,74 @@ TEST_F(LocalSocketTest, close_socket_in_CLOSE_WAIT_state) {
 
 #endif  // defined(__linux__)
 
+// Parses |request| as it would arrive from a client, in a buffer of |capacity| bytes.
+static int ParseRequest(const std::string& request, internal::SmartSocketRequest* result,
+	std::vector<char>* buffer, size_t capacity = MAX_PAYLOAD) {
+	buffer->assign(request.begin(), request.end());
+	buffer->resize(capacity);
+	return internal::parse_smart_socket_request(buffer->data(), request.size(), capacity, result);
+}
+
+TEST(socket_test, parse_smart_socket_request) {
+	internal::SmartSocketRequest request;
+	std::vector<char> buffer;
+
+	ASSERT_EQ(0, ParseRequest("", &request, &buffer));
+	ASSERT_EQ(0, ParseRequest("000", &request, &buffer));
+	ASSERT_EQ(0, ParseRequest("000cshell:ls", &request, &buffer));
+
+	ASSERT_EQ(1, ParseRequest("0008shell:ls", &request, &buffer));
+	ASSERT_STREQ("shell:ls", request.service);
+	ASSERT_EQ(internal::SmartSocketRequest::kDevice, request.target);
+	ASSERT_EQ(nullptr, request.serial);
+
+	// Anything after the request is left alone.
+	ASSERT_EQ(1, ParseRequest("0004sync....", &request, &buffer));
+	ASSERT_STREQ("sync", request.service);
+}
+
+TEST(socket_test, parse_smart_socket_request_invalid) {
+	internal::SmartSocketRequest request;
+	std::vector<char> buffer;
+
+	ASSERT_EQ(-1, ParseRequest("0000", &request, &buffer));
+	ASSERT_EQ(-1, ParseRequest("00g4sync", &request, &buffer));
+	ASSERT_EQ(-1, ParseRequest(" 004sync", &request, &buffer));
+
+	// The request and its terminator have to fit in the buffer.
+	ASSERT_EQ(-1, ParseRequest("000csync", &request, &buffer, 16));
+	ASSERT_EQ(0, ParseRequest("000bsync", &request, &buffer, 16));
+}
+
 #if ADB_HOST
 
+TEST(socket_test, parse_smart_socket_request_host) {
+	internal::SmartSocketRequest request;
+	std::vector<char> buffer;
+
+	ASSERT_EQ(1, ParseRequest("000chost:version", &request, &buffer));
+	ASSERT_STREQ("version", request.service);
+	ASSERT_EQ(internal::SmartSocketRequest::kHostAny, request.target);
+
+	ASSERT_EQ(1, ParseRequest("0010host-usb:devices", &request, &buffer));
+	ASSERT_STREQ("devices", request.service);
+	ASSERT_EQ(internal::SmartSocketRequest::kHostUsb, request.target);
+
+	ASSERT_EQ(1, ParseRequest("0012host-local:devices", &request, &buffer));
+	ASSERT_STREQ("devices", request.service);
+	ASSERT_EQ(internal::SmartSocketRequest::kHostLocal, request.target);
+
+	ASSERT_EQ(1, ParseRequest("0028host-serial:tcp:127.0.0.1:5555:get-state", &request, &buffer));
+	ASSERT_STREQ("tcp:127.0.0.1:5555", request.serial);
+	ASSERT_STREQ("get-state", request.service);
+	ASSERT_EQ(internal::SmartSocketRequest::kHostSerial, request.target);
+
+	// Only "host" followed by one of the prefixes is for the host.
+	ASSERT_EQ(1, ParseRequest("000ahostname:x", &request, &buffer));
+	ASSERT_STREQ("hostname:x", request.service);
+	ASSERT_EQ(internal::SmartSocketRequest::kDevice, request.target);
+}
+
 // Checks that skip_host_serial(serial) returns a pointer to the part of |serial| which matches
 // |expected|, otherwise logs the failure to gtest.
 void VerifySkipHostSerial(std::string serial, const char* expected) {
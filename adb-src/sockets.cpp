@@ -26,10 +26,17 @@
 #include <unistd.h>
 
 #include <algorithm>
+#include <atomic>
+#include <deque>
 #include <mutex>
 #include <string>
+#include <unordered_map>
+#include <unordered_set>
 #include <vector>
 
+#include <android-base/logging.h>
+#include <android-base/parseint.h>
+
 #if !ADB_HOST
 #include <android-base/properties.h>
 #include <log/log_properties.h>
@@ -37,10 +44,10 @@
 
 #include "adb.h"
 #include "adb_io.h"
+#include "packet_memory.h"
 #include "transport.h"
 
 static std::recursive_mutex& local_socket_list_lock = *new std::recursive_mutex();
-static unsigned local_socket_next_id = 1;
 
 static asocket local_socket_list = {
 	.next = &local_socket_list, .prev = &local_socket_list,
@@ -54,25 +61,54 @@ static asocket local_socket_closing_list = {
 	.next = &local_socket_closing_list, .prev = &local_socket_closing_list,
 };
 
-// Parse the global list of sockets to find one with id |local_id|.
-// If |peer_id| is not 0, also check that it is connected to a peer
-// with id |peer_id|. Returns an asocket handle on success, NULL on failure.
-asocket* find_local_socket(unsigned local_id, unsigned peer_id) {
-	asocket* s;
-	asocket* result = NULL;
+// Every OKAY, WRITE and CLOSE looks up a local socket by id, so as well as being on
+// local_socket_list, live sockets are indexed by id. The low bits of an id pick a slot, and the
+// high bits are the slot's generation, which tells a stale id from the slot's current socket.
+// Slots live in chunks that are never freed, so lookups can skip local_socket_list_lock; like
+// the rest of the packet path, they're only made on the main thread, which is also the only one
+// that closes sockets.
+static constexpr unsigned kSocketSlotBits = 18;
+static constexpr unsigned kSocketSlotMask = (1u << kSocketSlotBits) - 1;
+static constexpr unsigned kSocketSlotsPerChunk = 1024;
+static constexpr unsigned kSocketChunkCount = (1u << kSocketSlotBits) / kSocketSlotsPerChunk;
+
+struct SocketSlot {
+	std::atomic<asocket*> socket;
+	unsigned generation;
+};
 
-	std::lock_guard<std::recursive_mutex> lock(local_socket_list_lock);
-	for (s = local_socket_list.next; s != &local_socket_list; s = s->next) {
-		if (s->id != local_id) {
-			continue;
-		}
-		if (peer_id == 0 || (s->peer && s->peer->id == peer_id)) {
-			result = s;
-		}
-		break;
-	}
+static std::atomic<SocketSlot*> local_socket_chunks[kSocketChunkCount];
+
+// Slot 0 is never used, so that no id is 0.
+static unsigned local_socket_slot_count = 1;
 
-	return result;
+// Freed slots are reused oldest first, and only once there are plenty of them, so that an id
+// takes as long as possible to come around again.
+static std::deque<unsigned>& local_socket_free_slots = *new std::deque<unsigned>();
+
+// The local sockets to close when each transport goes away (see track_local_socket).
+static auto& transport_sockets = *new std::unordered_map<atransport*, std::unordered_set<asocket*>>();
+
+static SocketSlot* get_socket_slot(unsigned slot) {
+	SocketSlot* chunk = local_socket_chunks[slot / kSocketSlotsPerChunk].load(std::memory_order_acquire);
+	return chunk ? &chunk[slot % kSocketSlotsPerChunk] : nullptr;
+}
+
+// Returns the socket with id |local_id|. If |peer_id| is not 0, also check that it is connected
+// to a peer with id |peer_id|. Returns an asocket handle on success, NULL on failure.
+asocket* find_local_socket(unsigned local_id, unsigned peer_id) {
+	SocketSlot* slot = get_socket_slot(local_id & kSocketSlotMask);
+	if (slot == nullptr) {
+		return nullptr;
+	}
+	asocket* s = slot->socket.load(std::memory_order_acquire);
+	if (s == nullptr || s->id != local_id) {
+		return nullptr;
+	}
+	if (peer_id != 0 && (s->peer == nullptr || s->peer->id != peer_id)) {
+		return nullptr;
+	}
+	return s;
 }
 
 static void insert_local_socket(asocket* s, asocket* list) {
@@ -82,17 +118,60 @@ static void insert_local_socket(asocket* s, asocket* list) {
 	s->next->prev = s;
 }
 
+static unsigned allocate_socket_slot() {
+	if (local_socket_free_slots.size() >= kSocketSlotsPerChunk ||
+		(local_socket_slot_count == (1u << kSocketSlotBits) && !local_socket_free_slots.empty())) {
+		unsigned slot = local_socket_free_slots.front();
+		local_socket_free_slots.pop_front();
+		return slot;
+	}
+	if (local_socket_slot_count == (1u << kSocketSlotBits)) {
+		fatal("too many local sockets");
+	}
+
+	unsigned slot = local_socket_slot_count++;
+	std::atomic<SocketSlot*>& chunk = local_socket_chunks[slot / kSocketSlotsPerChunk];
+	if (chunk.load(std::memory_order_relaxed) == nullptr) {
+		chunk.store(new SocketSlot[kSocketSlotsPerChunk](), std::memory_order_release);
+	}
+	return slot;
+}
+
 void install_local_socket(asocket* s) {
 	std::lock_guard<std::recursive_mutex> lock(local_socket_list_lock);
 
-	s->id = local_socket_next_id++;
+	unsigned slot_index = allocate_socket_slot();
+	SocketSlot* slot = get_socket_slot(slot_index);
+	slot->generation = (slot->generation + 1) & (~0u >> kSocketSlotBits);
+	s->id = (slot->generation << kSocketSlotBits) | slot_index;
+	slot->socket.store(s, std::memory_order_release);
 
-	// Socket ids should never be 0.
-	if (local_socket_next_id == 0) {
-		fatal("local socket id overflow");
+	insert_local_socket(s, &local_socket_list);
+}
+
+void track_local_socket(asocket* s, atransport* t) {
+	std::lock_guard<std::recursive_mutex> lock(local_socket_list_lock);
+	if (s->tracking_transport == nullptr && t != nullptr) {
+		s->tracking_transport = t;
+		transport_sockets[t].insert(s);
+		packet_memory_move(nullptr, t, s->queued_memory);
 	}
+}
 
-	insert_local_socket(s, &local_socket_list);
+static void untrack_local_socket(asocket* s) {
+	atransport* t = s->tracking_transport;
+	if (t == nullptr) {
+		return;
+	}
+	s->tracking_transport = nullptr;
+	packet_memory_move(t, nullptr, s->queued_memory);
+	auto it = transport_sockets.find(t);
+	if (it != transport_sockets.end()) {
+		it->second.erase(s);
+		if (it->second.empty()) {
+			transport_sockets.erase(it);
+		}
+	}
 }
 
 void remove_socket(asocket* s) {
@@ -102,36 +181,69 @@ void remove_socket(asocket* s) {
 		s->next->prev = s->prev;
 		s->next = 0;
 		s->prev = 0;
+	}
+	if (s->id != 0) {
+		unsigned slot_index = s->id & kSocketSlotMask;
+		SocketSlot* slot = get_socket_slot(slot_index);
+		if (slot != nullptr && slot->socket.load(std::memory_order_relaxed) == s) {
+			slot->socket.store(nullptr, std::memory_order_release);
+			local_socket_free_slots.push_back(slot_index);
+		}
 		s->id = 0;
 	}
+	untrack_local_socket(s);
 }
 
 void close_all_sockets(atransport* t) {
-	asocket* s;
-
-	/* this is a little gross, but since s->close() *will* modify
-	** the list out from under you, your options are limited.
-	*/
+	// s->close() can close other sockets too, so look the set up again after each one.
 	std::lock_guard<std::recursive_mutex> lock(local_socket_list_lock);
-restart:
-	for (s = local_socket_list.next; s != &local_socket_list; s = s->next) {
-		if (s->transport == t || (s->peer && s->peer->transport == t)) {
-			s->close(s);
-			goto restart;
+	while (true) {
+		auto it = transport_sockets.find(t);
+		if (it == transport_sockets.end()) {
+			break;
 		}
+		asocket* s = *it->second.begin();
+		untrack_local_socket(s);
+		s->close(s);
+	}
+}
+
+void iterate_local_sockets(std::function<void(const asocket*)> fn) {
+	std::lock_guard<std::recursive_mutex> lock(local_socket_list_lock);
+	for (asocket* s = local_socket_list.next; s != &local_socket_list; s = s->next) {
+		fn(s);
+	}
+	for (asocket* s = local_socket_closing_list.next; s != &local_socket_closing_list;
+		s = s->next) {
+		fn(s);
+	}
+}
+
+// Charges (or releases) the difference between what the output ring has allocated and what
+// was last charged for it.
+static void update_output_memory(asocket* s) {
+	size_t capacity = s->output.capacity();
+	if (capacity > s->queued_memory) {
+		packet_memory_charge(s->tracking_transport, capacity - s->queued_memory);
 	}
+	else if (capacity < s->queued_memory) {
+		packet_memory_release(s->tracking_transport, s->queued_memory - capacity);
+	}
+	s->queued_memory = capacity;
 }
 
 static int local_socket_enqueue(asocket* s, apacket* p) {
 	D("LS(%d): enqueue %zu", s->id, p->len);
 
 	p->ptr = p->data;
+	p->timestamp_ns = stats_now_ns();
+	s->stats.RecordIn(p->len);
 
 	/* if there is already data queue'd, we will receive
 	** events when it's time to write.  just add this to
 	** the tail
 	*/
-	if (s->pkt_first) {
+	if (!s->output.empty()) {
 		goto enqueue;
 	}
 
@@ -158,19 +270,21 @@ static int local_socket_enqueue(asocket* s, apacket* p) {
 	}
 
 	if (p->len == 0) {
+		s->stats.write_latency.Record(p->timestamp_ns, stats_now_ns());
 		put_apacket(p);
 		return 0; /* ready for more data */
 	}
 
 enqueue:
-	p->next = 0;
-	if (s->pkt_first) {
-		s->pkt_last->next = p;
+	s->stats.RecordQueued(p->len);
+	s->stats.RecordBackpressure();
+	if (s->output.empty()) {
+		s->output_timestamp_ns = p->timestamp_ns;
 	}
-	else {
-		s->pkt_first = p;
-	}
-	s->pkt_last = p;
+	s->output.Append(p->ptr, p->len);
+	s->output_packets++;
+	update_output_memory(s);
+	put_apacket(p);
 
 	/* make sure we are notified when we can drain the queue */
 	fdevent_add(&s->fde, FDE_WRITE);
@@ -186,7 +300,6 @@ static void local_socket_ready(asocket* s) {
 
 // be sure to hold the socket list lock when calling this
 static void local_socket_destroy(asocket* s) {
-	apacket* p, * n;
 	int exit_on_close = s->exit_on_close;
 
 	D("LS(%d): destroying fde.fd=%d", s->id, s->fde.fd);
@@ -197,11 +310,15 @@ static void local_socket_destroy(asocket* s) {
 	fdevent_remove(&s->fde);
 
 	/* dispose of any unwritten data */
-	for (p = s->pkt_first; p; p = n) {
-		D("LS(%d): discarding %zu bytes", s->id, p->len);
-		n = p->next;
-		put_apacket(p);
+	if (s->read_pending) {
+		put_apacket(s->read_pending);
+		s->read_pending = nullptr;
+	}
+	if (!s->output.empty()) {
+		D("LS(%d): discarding %zu bytes", s->id, s->output.size());
 	}
+	s->output.Clear();
+	update_output_memory(s);
 	remove_socket(s);
 	free(s);
 
@@ -231,7 +348,7 @@ static void local_socket_close(asocket* s) {
 	/* If we are already closing, or if there are no
 	** pending packets, destroy immediately
 	*/
-	if (s->closing || s->has_write_error || s->pkt_first == NULL) {
+	if (s->closing || s->has_write_error || s->output.empty()) {
 		int id = s->id;
 		local_socket_destroy(s);
 		D("LS(%d): closed", id);
@@ -249,6 +366,41 @@ static void local_socket_close(asocket* s) {
 	CHECK_EQ(FDE_WRITE, s->fde.state & FDE_WRITE);
 }
 
+// Small reads on bulk streams are held back for up to $ADB_COALESCE_MS (1 by default, 0 to
+// turn it off) to see whether more follows, so that a client trickling out small writes doesn't
+// cost a packet, and often a round trip, for each. A packet goes out as soon as it has
+// kCoalesceMinFill bytes, or half its payload if that's smaller; interactive streams are never
+// held. A stream that's still quiet when its hold times out is answering back and forth, so
+// the next kCoalesceBackoffPackets go out straight away.
+static constexpr size_t kCoalesceMinFill = 16 * 1024;
+static constexpr uint8_t kCoalesceBackoffPackets = 16;
+
+static int64_t coalesce_hold_ms() {
+	static int64_t hold_ms = []() {
+		int64_t result = 1;
+		const char* value = getenv("ADB_COALESCE_MS");
+		if (value && !android::base::ParseInt(value, &result, int64_t(0), int64_t(1000))) {
+			LOG(WARNING) << "ignoring invalid $ADB_COALESCE_MS '" << value << "'";
+			result = 1;
+		}
+		return result;
+	}();
+	return hold_ms;
+}
+
+// Whether to hold back a packet of |len| bytes; |held| if it already has been.
+static bool should_coalesce(asocket* s, size_t len, size_t max_payload, bool held) {
+	if (s->priority != kPacketPriorityBulk || coalesce_hold_ms() == 0 ||
+		len >= std::min(kCoalesceMinFill, max_payload / 2)) {
+		return false;
+	}
+	if (!held && s->coalesce_skip > 0) {
+		--s->coalesce_skip;
+		return false;
+	}
+	return true;
+}
+
 static void local_socket_event_func(int fd, unsigned ev, void* _s) {
 	asocket* s = reinterpret_cast<asocket*>(_s);
 	D("LS(%d): event_func(fd=%d(==%d), ev=%04x)", s->id, s->fd, fd, ev);
@@ -257,36 +409,31 @@ static void local_socket_event_func(int fd, unsigned ev, void* _s) {
 	** in order to simplify the code.
 	*/
 	if (ev & FDE_WRITE) {
-		apacket* p;
-		while ((p = s->pkt_first) != nullptr) {
-			while (p->len > 0) {
-				int r = adb_write(fd, p->ptr, p->len);
-				if (r == -1) {
-					/* returning here is ok because FDE_READ will
-					** be processed in the next iteration loop
-					*/
-					if (errno == EAGAIN) {
-						return;
-					}
-				}
-				else if (r > 0) {
-					p->ptr += r;
-					p->len -= r;
-					continue;
-				}
-
+		// The whole backlog goes in one writev(); whatever doesn't fit waits for the next event.
+		if (!s->output.empty()) {
+			int r = s->output.WriteTo(fd);
+			if (r == -1 && errno == EAGAIN) {
+				/* returning here is ok because FDE_READ will
+				** be processed in the next iteration loop
+				*/
+				return;
+			}
+			if (r <= 0) {
 				D(" closing after write because r=%d and errno is %d", r, errno);
 				s->has_write_error = true;
 				s->close(s);
 				return;
 			}
 
-			if (p->len == 0) {
-				s->pkt_first = p->next;
-				if (s->pkt_first == 0) {
-					s->pkt_last = 0;
-				}
-				put_apacket(p);
+			bool drained = s->output.empty();
+			s->stats.RecordDequeued(r, drained ? s->output_packets : 0);
+			if (drained) {
+				s->stats.write_latency.Record(s->output_timestamp_ns, stats_now_ns());
+				s->output_packets = 0;
+			}
+			update_output_memory(s);
+			if (!drained) {
+				return;
 			}
 		}
 
@@ -307,15 +454,23 @@ static void local_socket_event_func(int fd, unsigned ev, void* _s) {
 		s->peer->ready(s->peer);
 	}
 
-	if (ev & FDE_READ) {
-		apacket* p = get_apacket();
-		char* x = p->data;
+	if (ev & (FDE_READ | FDE_TIMEOUT)) {
+		// Carry on filling the packet held back by an earlier read, if there is one. A timeout
+		// means it has been held long enough, and goes out with whatever it has.
+		apacket* p = s->read_pending;
+		bool held = p != nullptr;
+		s->read_pending = nullptr;
+		if (!held) {
+			p = get_apacket();
+		}
+		const size_t held_len = p->len;
 		const size_t max_payload = s->get_max_payload();
-		size_t avail = max_payload;
+		char* x = p->data + p->len;
+		size_t avail = max_payload - p->len;
 		int r = 0;
 		int is_eof = 0;
 
-		while (avail > 0) {
+		while ((ev & FDE_READ) && avail > 0) {
 			r = adb_read(fd, x, avail);
 			D("LS(%d): post adb_read(fd=%d,...) r=%d (errno=%d) avail=%zu", s->id, s->fd, r,
 				r < 0 ? errno : 0, avail);
@@ -336,16 +491,36 @@ static void local_socket_event_func(int fd, unsigned ev, void* _s) {
 		}
 		D("LS(%d): fd=%d post avail loop. r=%d is_eof=%d forced_eof=%d", s->id, s->fd, r, is_eof,
 			s->fde.force_eof);
-		if ((avail == max_payload) || (s->peer == 0)) {
+		p->len = max_payload - avail;
+		if (held && p->len > held_len) {
+			s->read_pending_grew = true;
+		}
+		if (p->len > 0 && s->peer && !is_eof && !s->fde.force_eof && !(ev & FDE_TIMEOUT) &&
+			should_coalesce(s, p->len, max_payload, held)) {
+			D("LS(%d): holding %zu bytes back for more", s->id, p->len);
+			s->read_pending = p;
+			if (!held) {
+				s->read_pending_grew = false;
+				fdevent_set_timeout(&s->fde, coalesce_hold_ms());
+			}
+			return;
+		}
+		if (held && (ev & FDE_TIMEOUT) && !s->read_pending_grew) {
+			// Nothing more came while it was held: the client is probably waiting for an answer,
+			// so don't keep it waiting again for a while.
+			s->coalesce_skip = kCoalesceBackoffPackets;
+		}
+		fdevent_set_timeout(&s->fde, -1);
+
+		if ((p->len == 0) || (s->peer == 0)) {
 			put_apacket(p);
 		}
 		else {
-			p->len = max_payload - avail;
-
 			// s->peer->enqueue() may call s->close() and free s,
 			// so save variables for debug printing below.
 			unsigned saved_id = s->id;
 			int saved_fd = s->fd;
+			s->stats.RecordOut(p->len, max_payload);
 			r = s->peer->enqueue(s->peer, p);
 			D("LS(%u): fd=%d post peer->enqueue(). r=%d", saved_id, saved_fd, r);
 
@@ -419,6 +594,7 @@ asocket* create_local_service_socket(const char* name, const atransport* transpo
 	}
 
 	asocket* s = create_local_socket(fd);
+	s->priority = service_priority(name);
 	D("LS(%d): bound to '%s' via %d", s->id, name, fd);
 
 #if !ADB_HOST
@@ -451,23 +627,82 @@ static asocket* create_host_service_socket(const char* name, const char* serial)
 
 static int remote_socket_enqueue(asocket* s, apacket* p) {
 	D("entered remote_socket_enqueue RS(%d) WRITE fd=%d peer.fd=%d", s->id, s->fd, s->peer->fd);
+	size_t len = p->len;
+	p->priority = s->peer->priority;
 	p->msg.command = A_WRTE;
 	p->msg.arg0 = s->peer->id;
 	p->msg.arg1 = s->id;
-	p->msg.data_length = p->len;
+	p->msg.data_length = len;
 	send_packet(p, s->transport);
+
+	if (s->send_window != 0) {
+		s->send_unacked += len;
+		if (s->send_unacked >= s->send_window) {
+			D("RS(%d): window full with %zu bytes unacknowledged", s->id, s->send_unacked);
+			s->send_blocked = true;
+			return 1;
+		}
+		if (packet_memory_over_budget(s->transport)) {
+			// The window has room, but the write thread is too far behind: hold off the peer
+			// until enough queued packets have drained.
+			D("RS(%d): over packet memory budget", s->id);
+			s->budget_blocked_peer = true;
+			packet_memory_wait(s);
+			return 1;
+		}
+		return 0;
+	}
 	return 1;
 }
 
+// On a windowed stream, this acknowledges everything delivered so far, if there's anything.
+// Over the packet memory budget, the acknowledgement waits until there's room again.
 static void remote_socket_ready(asocket* s) {
 	D("entered remote_socket_ready RS(%d) OKAY fd=%d peer.fd=%d", s->id, s->fd, s->peer->fd);
+	if (s->send_window != 0 && s->recv_unacked == 0) {
+		return;
+	}
+	if (packet_memory_over_budget(s->transport)) {
+		D("RS(%d): holding back READY, over packet memory budget", s->id);
+		s->budget_deferred_ready = true;
+		packet_memory_wait(s);
+		return;
+	}
+
 	apacket* p = get_apacket();
 	p->msg.command = A_OKAY;
 	p->msg.arg0 = s->peer->id;
 	p->msg.arg1 = s->id;
+	if (s->send_window != 0) {
+		uint32_t acked = s->recv_unacked;
+		memcpy(p->data, &acked, sizeof(acked));
+		p->msg.data_length = sizeof(acked);
+		s->recv_unacked = 0;
+	}
 	send_packet(p, s->transport);
 }
 
+uint32_t stream_window(atransport* t) {
+	return CanUseFeature(t->features(), kFeatureStreamWindow) ? kStreamWindowBytes : 0;
+}
+
+bool remote_socket_acked(asocket* s, const apacket* p) {
+	if (s->send_window == 0) {
+		return true;
+	}
+
+	uint32_t acked = 0;
+	if (p->msg.data_length == sizeof(acked)) {
+		memcpy(&acked, p->data, sizeof(acked));
+	}
+	s->send_unacked -= std::min<size_t>(acked, s->send_unacked);
+	if (s->send_blocked && s->send_unacked < s->send_window) {
+		s->send_blocked = false;
+		return true;
+	}
+	return false;
+}
+
 static void remote_socket_shutdown(asocket* s) {
 	D("entered remote_socket_shutdown RS(%d) CLOSE fd=%d peer->fd=%d", s->id, s->fd,
 		s->peer ? s->peer->fd : -1);
@@ -475,12 +710,15 @@ static void remote_socket_shutdown(asocket* s) {
 	p->msg.command = A_CLSE;
 	if (s->peer) {
 		p->msg.arg0 = s->peer->id;
+		// Behind the stream's last WRITEs, not ahead of them.
+		p->priority = s->peer->priority;
 	}
 	p->msg.arg1 = s->id;
 	send_packet(p, s->transport);
 }
 
 static void remote_socket_close(asocket* s) {
+	packet_memory_cancel_wait(s);
 	if (s->peer) {
 		s->peer->peer = 0;
 		D("RS(%d) peer->close()ing peer->id=%d peer->fd=%d", s->id, s->peer->id, s->peer->fd);
@@ -492,6 +730,21 @@ static void remote_socket_close(asocket* s) {
 	free(s);
 }
 
+// Streams that move data in bulk, by service prefix; every other stream is interactive.
+PacketPriority service_priority(const char* destination) {
+	static const char* const kBulkServices[] = {
+		"backup:", "dev:", "exec:", "framebuffer:", "local:", "localabstract:",
+		"localfilesystem:", "localreserved:", "restore:", "sideload:", "sideload-host:", "sync:",
+		"tcp:",
+	};
+	for (const char* prefix : kBulkServices) {
+		if (!strncmp(destination, prefix, strlen(prefix))) {
+			return kPacketPriorityBulk;
+		}
+	}
+	return kPacketPriorityInteractive;
+}
+
 // Create a remote socket to exchange packets with a remote service through transport
 // |t|. Where |id| is the socket id of the corresponding service on the other
 //  side of the transport (it is allocated by the remote side and _cannot_ be 0).
@@ -518,6 +771,8 @@ asocket* create_remote_socket(unsigned id, atransport* t) {
 
 void connect_to_remote(asocket* s, const char* destination) {
 	D("Connect_to_remote call RS(%d) fd=%d", s->id, s->fd);
+	track_local_socket(s, s->transport);
+	s->priority = service_priority(destination);
 	apacket* p = get_apacket();
 	size_t len = strlen(destination) + 1;
 
@@ -528,6 +783,7 @@ void connect_to_remote(asocket* s, const char* destination) {
 	D("LS(%d): connect('%s')", s->id, destination);
 	p->msg.command = A_OPEN;
 	p->msg.arg0 = s->id;
+	p->msg.arg1 = stream_window(s->transport);
 	p->msg.data_length = len;
 	strcpy((char*)p->data, destination);
 	send_packet(p, s->transport);
@@ -554,47 +810,11 @@ static void local_socket_close_notify(asocket* s) {
 	s->close(s);
 }
 
-static unsigned unhex(char* s, int len) {
-	unsigned n = 0, c;
-
-	while (len-- > 0) {
-		switch ((c = *s++)) {
-		case '0':
-		case '1':
-		case '2':
-		case '3':
-		case '4':
-		case '5':
-		case '6':
-		case '7':
-		case '8':
-		case '9':
-			c -= '0';
-			break;
-		case 'a':
-		case 'b':
-		case 'c':
-		case 'd':
-		case 'e':
-		case 'f':
-			c = c - 'a' + 10;
-			break;
-		case 'A':
-		case 'B':
-		case 'C':
-		case 'D':
-		case 'E':
-		case 'F':
-			c = c - 'A' + 10;
-			break;
-		default:
-			return 0xffffffff;
-		}
-
-		n = (n << 4) | c;
-	}
-
-	return n;
+static int hex_digit(char c) {
+	if (c >= '0' && c <= '9') return c - '0';
+	if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+	if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+	return -1;
 }
 
 #if ADB_HOST
@@ -608,12 +828,12 @@ namespace internal {
 	//
 	// The returned pointer will point to the ':' just before <command>, or nullptr if not found.
 	char* skip_host_serial(char* service) {
-		static const std::vector<std::string>& prefixes =
-			*(new std::vector<std::string>{ "usb:", "product:", "model:", "device:" });
+		static const char* const prefixes[] = { "usb:", "product:", "model:", "device:" };
 
-		for (const std::string& prefix : prefixes) {
-			if (!strncmp(service, prefix.c_str(), prefix.length())) {
-				return strchr(service + prefix.length(), ':');
+		for (const char* prefix : prefixes) {
+			size_t length = strlen(prefix);
+			if (!strncmp(service, prefix, length)) {
+				return strchr(service + length, ':');
 			}
 		}
 
@@ -656,13 +876,74 @@ namespace internal {
 
 #endif  // ADB_HOST
 
-static int smart_socket_enqueue(asocket* s, apacket* p) {
-	unsigned len;
+namespace internal {
+	int parse_smart_socket_request(char* data, size_t len, size_t capacity,
+		SmartSocketRequest* request) {
+		/* don't bother if we can't decode the length */
+		if (len < 4) {
+			return 0;
+		}
+
+		size_t length = 0;
+		for (size_t i = 0; i < 4; ++i) {
+			int digit = hex_digit(data[i]);
+			if (digit == -1) {
+				return -1;
+			}
+			length = (length << 4) | digit;
+		}
+		if (length < 1 || length + 4 >= capacity) {
+			return -1;
+		}
+
+		/* can't do anything until we have the full header */
+		if (length + 4 > len) {
+			return 0;
+		}
+
+		char* service = data + 4;
+		service[length] = '\0';
+		request->service = service;
+		request->target = SmartSocketRequest::kDevice;
+		request->serial = nullptr;
+
 #if ADB_HOST
-	char* service = nullptr;
-	char* serial = nullptr;
-	TransportType type = kTransportAny;
+		if (strncmp(service, "host", 4) != 0) {
+			return 1;
+		}
+		char* rest = service + 4;
+		if (*rest == ':') {
+			request->target = SmartSocketRequest::kHostAny;
+			request->service = rest + 1;
+		}
+		else if (!strncmp(rest, "-usb:", 5)) {
+			request->target = SmartSocketRequest::kHostUsb;
+			request->service = rest + 5;
+		}
+		else if (!strncmp(rest, "-local:", 7)) {
+			request->target = SmartSocketRequest::kHostLocal;
+			request->service = rest + 7;
+		}
+		else if (!strncmp(rest, "-serial:", 8)) {
+			request->target = SmartSocketRequest::kHostSerial;
+			request->service = rest + 8;
+
+			// serial number should follow "host:" and could be a host:port string.
+			char* serial_end = skip_host_serial(request->service);
+			if (serial_end) {
+				*serial_end = 0;  // terminate string
+				request->serial = request->service;
+				request->service = serial_end + 1;
+			}
+		}
 #endif
+		return 1;
+	}
+}  // namespace internal
+
+static int smart_socket_enqueue(asocket* s, apacket* p) {
+	internal::SmartSocketRequest request;
+	int rc;
 
 	D("SS(%d): enqueue %zu", s->id, p->len);
 
@@ -684,59 +965,29 @@ static int smart_socket_enqueue(asocket* s, apacket* p) {
 		p = s->pkt_first;
 	}
 
-	/* don't bother if we can't decode the length */
-	if (p->len < 4) {
-		return 0;
-	}
-
-	len = unhex(p->data, 4);
-	if ((len < 1) || (len > MAX_PAYLOAD)) {
-		D("SS(%d): bad size (%d)", s->id, len);
+	rc = internal::parse_smart_socket_request(p->data, p->len, sizeof(p->data), &request);
+	if (rc == -1) {
+		D("SS(%d): bad request", s->id);
 		goto fail;
 	}
-
-	D("SS(%d): len is %d", s->id, len);
-	/* can't do anything until we have the full header */
-	if ((len + 4) > p->len) {
-		D("SS(%d): waiting for %zu more bytes", s->id, len + 4 - p->len);
+	if (rc == 0) {
+		D("SS(%d): waiting for more of the request", s->id);
 		return 0;
 	}
 
-	p->data[len + 4] = 0;
-
-	D("SS(%d): '%s'", s->id, (char*)(p->data + 4));
+	D("SS(%d): '%s'", s->id, p->data + 4);
 
 #if ADB_HOST
-	service = (char*)p->data + 4;
-	if (!strncmp(service, "host-serial:", strlen("host-serial:"))) {
-		char* serial_end;
-		service += strlen("host-serial:");
-
-		// serial number should follow "host:" and could be a host:port string.
-		serial_end = internal::skip_host_serial(service);
-		if (serial_end) {
-			*serial_end = 0;  // terminate string
-			serial = service;
-			service = serial_end + 1;
+	if (request.target != internal::SmartSocketRequest::kDevice) {
+		const char* service = request.service;
+		const char* serial = request.serial;
+		TransportType type = kTransportAny;
+		if (request.target == internal::SmartSocketRequest::kHostUsb) {
+			type = kTransportUsb;
+		}
+		else if (request.target == internal::SmartSocketRequest::kHostLocal) {
+			type = kTransportLocal;
 		}
-	}
-	else if (!strncmp(service, "host-usb:", strlen("host-usb:"))) {
-		type = kTransportUsb;
-		service += strlen("host-usb:");
-	}
-	else if (!strncmp(service, "host-local:", strlen("host-local:"))) {
-		type = kTransportLocal;
-		service += strlen("host-local:");
-	}
-	else if (!strncmp(service, "host:", strlen("host:"))) {
-		type = kTransportAny;
-		service += strlen("host:");
-	}
-	else {
-		service = nullptr;
-	}
-
-	if (service) {
 		asocket* s2;
 
 		/* some requests are handled immediately -- in that
@@ -823,7 +1074,7 @@ static int smart_socket_enqueue(asocket* s, apacket* p) {
 	/* give him our transport and upref it */
 	s->peer->transport = s->transport;
 
-	connect_to_remote(s->peer, (char*)(p->data + 4));
+	connect_to_remote(s->peer, request.service);
 	s->peer = 0;
 	s->close(s);
 	return 1;
@@ -0,0 +1,148 @@
+/*
+ * Copyright (C) 2017 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "sync_progress.h"
+
+#include <inttypes.h>
+#include <stdio.h>
+
+#include <sstream>
+
+#include <android-base/stringprintf.h>
+
+#include "sysdeps.h"
+
+void TransferLedger::Reset() {
+	start_time = std::chrono::steady_clock::now();
+	files_transferred = 0;
+	files_skipped = 0;
+	bytes_transferred = 0;
+	bytes_logical = 0;
+	bytes_expected = 0;
+}
+
+std::string TransferLedger::TransferRate() {
+	uint64_t bytes_transferred = this->bytes_transferred;
+	uint64_t bytes_logical = this->bytes_logical;
+	if (bytes_transferred == 0) return "";
+
+	std::chrono::duration<double> duration;
+	duration = std::chrono::steady_clock::now() - start_time;
+
+	double s = duration.count();
+	if (s == 0) {
+		return "";
+	}
+	double rate = (static_cast<double>(bytes_transferred) / s) / (1024 * 1024);
+	if (bytes_logical != bytes_transferred) {
+		return android::base::StringPrintf(
+			" %.1f MB/s (%" PRIu64 " bytes in %.3fs, %" PRIu64 " bytes logical)", rate,
+			bytes_transferred, s, bytes_logical);
+	}
+	return android::base::StringPrintf(" %.1f MB/s (%" PRIu64 " bytes in %.3fs)", rate,
+		bytes_transferred, s);
+}
+
+std::string TransferLedger::FormatProgress(const std::string& file, uint64_t file_copied_bytes,
+	uint64_t file_total_bytes) {
+	uint64_t bytes_logical = this->bytes_logical;
+	uint64_t bytes_expected = this->bytes_expected;
+	char overall_percentage_str[5] = "?";
+	if (bytes_expected != 0 && bytes_logical <= bytes_expected) {
+		int overall_percentage = static_cast<int>(bytes_logical * 100 / bytes_expected);
+		// If we're pulling symbolic links, we'll pull the target of the link rather than
+		// just create a local link, and that will cause us to go over 100%.
+		if (overall_percentage <= 100) {
+			snprintf(overall_percentage_str, sizeof(overall_percentage_str), "%d%%",
+				overall_percentage);
+		}
+	}
+
+	if (file_copied_bytes > file_total_bytes || file_total_bytes == 0) {
+		// This case can happen if we're racing against something that wrote to the file
+		// between our stat and our read, or if we're reading a magic file that lies about
+		// its size. Just show how much we've copied.
+		return android::base::StringPrintf("[%4s] %s: %" PRIu64 "/?", overall_percentage_str,
+			file.c_str(), file_copied_bytes);
+	}
+
+	// If we're transferring multiple files, we want to know how far through the current
+	// file we are, as well as the overall percentage.
+	if (expect_multiple_files) {
+		int file_percentage = static_cast<int>(file_copied_bytes * 100 / file_total_bytes);
+		return android::base::StringPrintf("[%4s] %s: %d%%", overall_percentage_str,
+			file.c_str(), file_percentage);
+	}
+	return android::base::StringPrintf("[%4s] %s", overall_percentage_str, file.c_str());
+}
+
+void TransferLedger::ReportTransferRate(LinePrinter& lp, const std::string& name,
+	TransferDirection direction) {
+	const char* direction_str = (direction == TransferDirection::push) ? "pushed" : "pulled";
+	std::stringstream ss;
+	if (!name.empty()) {
+		ss << name << ": ";
+	}
+	uint64_t files_transferred = this->files_transferred;
+	uint64_t files_skipped = this->files_skipped;
+	ss << files_transferred << " file" << ((files_transferred == 1) ? "" : "s") << " "
+		<< direction_str << ".";
+	if (files_skipped > 0) {
+		ss << " " << files_skipped << " file" << ((files_skipped == 1) ? "" : "s")
+			<< " skipped.";
+	}
+	ss << TransferRate();
+
+	lp.Print(ss.str(), LinePrinter::LineType::INFO);
+	lp.KeepInfoLine();
+}
+
+void ProgressRenderer::Report(const std::string& file, uint64_t file_copied_bytes,
+	uint64_t file_total_bytes) {
+	// Only this thread writes file_, so it can compare without the lock.
+	if (file != file_) {
+		std::lock_guard<std::mutex> lock(mutex_);
+		file_ = file;
+	}
+	file_copied_bytes_ = file_copied_bytes;
+	file_total_bytes_ = file_total_bytes;
+	pending_ = true;
+
+	if (!thread_.joinable()) {
+		thread_ = std::thread([this]() { Run(); });
+	}
+}
+
+void ProgressRenderer::Stop() {
+	if (!thread_.joinable()) return;
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		stop_ = true;
+	}
+	cv_.notify_one();
+	thread_.join();
+}
+
+void ProgressRenderer::Run() {
+	adb_thread_setname("sync progress");
+	std::unique_lock<std::mutex> lock(mutex_);
+	while (!stop_) {
+		cv_.wait_for(lock, interval_);
+		if (!stop_ && pending_.exchange(false)) {
+			render_(file_, file_copied_bytes_, file_total_bytes_);
+		}
+	}
+}
@@ -0,0 +1,136 @@
+/*
+ * Copyright (C) 2017 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __SYNC_PROGRESS_H
+#define __SYNC_PROGRESS_H
+
+#include <stdint.h>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include "line_printer.h"
+
+enum class TransferDirection {
+	push,
+	pull,
+};
+
+// The counters are updated on the transfer path and read by the progress renderer thread.
+struct TransferLedger {
+	std::chrono::steady_clock::time_point start_time;
+	std::atomic<uint64_t> files_transferred;
+	std::atomic<uint64_t> files_skipped;
+	// Bytes that went over the wire, and bytes of file content they represent. These differ
+	// when holes in sparse files are sent as ID_HOLE rather than as zeros.
+	std::atomic<uint64_t> bytes_transferred;
+	std::atomic<uint64_t> bytes_logical;
+	std::atomic<uint64_t> bytes_expected;
+	std::atomic<bool> expect_multiple_files;
+
+	TransferLedger() {
+		Reset();
+	}
+
+	bool operator==(const TransferLedger& other) const {
+		return files_transferred == other.files_transferred &&
+			files_skipped == other.files_skipped && bytes_transferred == other.bytes_transferred &&
+			bytes_logical == other.bytes_logical;
+	}
+
+	bool operator!=(const TransferLedger& other) const {
+		return !(*this == other);
+	}
+
+	void Reset();
+
+	std::string TransferRate();
+
+	// The progress line for |file|, of which |file_copied_bytes| of |file_total_bytes| are done.
+	std::string FormatProgress(const std::string& file, uint64_t file_copied_bytes,
+		uint64_t file_total_bytes);
+
+	void ReportProgress(LinePrinter& lp, const std::string& file, uint64_t file_copied_bytes,
+		uint64_t file_total_bytes) {
+		lp.Print(FormatProgress(file, file_copied_bytes, file_total_bytes),
+			LinePrinter::LineType::INFO);
+	}
+
+	void ReportTransferRate(LinePrinter& lp, const std::string& name, TransferDirection direction);
+};
+
+// Draws transfer progress from its own thread, at most once per interval, so that the transfer
+// itself only has to store where it's got to. The thread isn't started until there's progress to
+// draw, so connections that never transfer anything don't pay for it.
+class ProgressRenderer {
+public:
+	// Called on the renderer's thread, with mutex() held.
+	typedef std::function<void(const std::string& file, uint64_t file_copied_bytes,
+		uint64_t file_total_bytes)> RenderFunction;
+
+	ProgressRenderer(RenderFunction render, std::chrono::milliseconds interval)
+		: render_(render), interval_(interval) {
+	}
+
+	~ProgressRenderer() {
+		Stop();
+	}
+
+	// Records progress for the next tick to draw. Only one thread may report progress.
+	void Report(const std::string& file, uint64_t file_copied_bytes, uint64_t file_total_bytes);
+
+	// Drops progress that hasn't been drawn yet, because newer output is about to be printed.
+	// The caller must hold mutex().
+	void DiscardLocked() {
+		pending_ = false;
+	}
+
+	// Stops the thread, without drawing anything still pending.
+	void Stop();
+
+	bool started() const {
+		return thread_.joinable();
+	}
+
+	// Guards whatever the render function draws on, and orders progress against other output.
+	std::mutex& mutex() {
+		return mutex_;
+	}
+
+private:
+	void Run();
+
+	RenderFunction render_;
+	std::chrono::milliseconds interval_;
+
+	std::mutex mutex_;
+	std::condition_variable cv_;
+	std::thread thread_;
+	bool stop_ = false;
+
+	// Guarded by mutex_, but only the reporting thread writes it.
+	std::string file_;
+	std::atomic<uint64_t> file_copied_bytes_{0};
+	std::atomic<uint64_t> file_total_bytes_{0};
+	std::atomic<bool> pending_{false};
+};
+
+#endif  // __SYNC_PROGRESS_H
@@ -0,0 +1,151 @@
+/*
+ * Copyright (C) 2017 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "sync_progress.h"
+
+#include <gtest/gtest.h>
+
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+TEST(TransferLedger, counters) {
+	TransferLedger ledger;
+	EXPECT_EQ(0U, ledger.files_transferred);
+	EXPECT_EQ(0U, ledger.bytes_transferred);
+
+	TransferLedger other;
+	EXPECT_TRUE(ledger == other);
+
+	ledger.files_transferred += 1;
+	ledger.bytes_transferred += 4096;
+	ledger.bytes_logical += 8192;
+	EXPECT_TRUE(ledger != other);
+
+	other.files_transferred += 1;
+	other.bytes_transferred += 4096;
+	other.bytes_logical += 8192;
+	EXPECT_TRUE(ledger == other);
+
+	ledger.Reset();
+	EXPECT_EQ(0U, ledger.files_transferred);
+	EXPECT_EQ(0U, ledger.bytes_logical);
+	EXPECT_EQ("", ledger.TransferRate());
+}
+
+TEST(TransferLedger, concurrent_updates) {
+	TransferLedger ledger;
+	std::vector<std::thread> threads;
+	for (int i = 0; i < 4; ++i) {
+		threads.emplace_back([&ledger]() {
+			for (int j = 0; j < 10000; ++j) {
+				ledger.bytes_transferred += 1;
+			}
+		});
+	}
+	for (auto& thread : threads) {
+		thread.join();
+	}
+	EXPECT_EQ(40000U, ledger.bytes_transferred);
+}
+
+TEST(TransferLedger, format_progress) {
+	TransferLedger ledger;
+	ledger.expect_multiple_files = false;
+	EXPECT_EQ("[   ?] /sdcard/a", ledger.FormatProgress("/sdcard/a", 10, 100));
+
+	ledger.bytes_expected = 200;
+	ledger.bytes_logical = 50;
+	EXPECT_EQ("[ 25%] /sdcard/a", ledger.FormatProgress("/sdcard/a", 10, 100));
+
+	ledger.expect_multiple_files = true;
+	EXPECT_EQ("[ 25%] /sdcard/a: 10%", ledger.FormatProgress("/sdcard/a", 10, 100));
+
+	// A file that grew under us only shows how much has been copied.
+	EXPECT_EQ("[ 25%] /sdcard/a: 150/?", ledger.FormatProgress("/sdcard/a", 150, 100));
+
+	// Following symlinks can take us past what we expected.
+	ledger.bytes_logical = 300;
+	EXPECT_EQ("[   ?] /sdcard/a: 10%", ledger.FormatProgress("/sdcard/a", 10, 100));
+}
+
+// Collects what a ProgressRenderer draws.
+class ProgressRendererTest : public ::testing::Test {
+protected:
+	ProgressRendererTest()
+		: renderer_([this](const std::string& file, uint64_t copied, uint64_t total) {
+			  rendered_.push_back(file + ":" + std::to_string(copied) + "/" +
+				  std::to_string(total));
+			  cv_.notify_all();
+		  }, std::chrono::milliseconds(10)) {
+	}
+
+	// Waits for at least |count| renders, and returns whether they arrived.
+	bool WaitForRenders(size_t count) {
+		std::unique_lock<std::mutex> lock(renderer_.mutex());
+		return cv_.wait_for(lock, std::chrono::seconds(5),
+			[this, count]() { return rendered_.size() >= count; });
+	}
+
+	std::vector<std::string> rendered_;
+	std::condition_variable cv_;
+	ProgressRenderer renderer_;
+};
+
+TEST_F(ProgressRendererTest, starts_on_first_report) {
+	EXPECT_FALSE(renderer_.started());
+	renderer_.Stop();
+	EXPECT_FALSE(renderer_.started());
+
+	renderer_.Report("a", 1, 2);
+	EXPECT_TRUE(renderer_.started());
+	ASSERT_TRUE(WaitForRenders(1));
+	renderer_.Stop();
+	EXPECT_FALSE(renderer_.started());
+	EXPECT_EQ("a:1/2", rendered_[0]);
+}
+
+TEST_F(ProgressRendererTest, renders_latest) {
+	renderer_.Report("a", 0, 3);
+	ASSERT_TRUE(WaitForRenders(1));
+	{
+		// Keep the renderer from drawing until every report is in. Report only takes the lock
+		// when the file changes, so these stay on the same file.
+		std::lock_guard<std::mutex> lock(renderer_.mutex());
+		renderer_.Report("a", 1, 3);
+		renderer_.Report("a", 2, 3);
+	}
+	ASSERT_TRUE(WaitForRenders(2));
+	renderer_.Stop();
+	ASSERT_EQ(2U, rendered_.size());
+	EXPECT_EQ("a:2/3", rendered_[1]);
+}
+
+TEST_F(ProgressRendererTest, discard) {
+	renderer_.Report("a", 1, 2);
+	ASSERT_TRUE(WaitForRenders(1));
+	{
+		std::lock_guard<std::mutex> lock(renderer_.mutex());
+		renderer_.Report("a", 2, 2);
+		renderer_.DiscardLocked();
+	}
+	std::this_thread::sleep_for(std::chrono::milliseconds(50));
+	renderer_.Stop();
+	EXPECT_EQ(1U, rendered_.size());
+}
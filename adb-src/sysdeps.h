@@ -27,6 +27,7 @@
 #include <string>
 #include <vector>
 #include "sysdeps/errno.h"
+#include "sysdeps/format.h"
 #include "sysdeps/network.h"
 #include "sysdeps/stat.h"
 
@@ -45,19 +46,6 @@
     _rc; })
 #endif
 
-// Some printf-like functions are implemented in terms of
-// android::base::StringAppendV, so they should use the same attribute for
-// compile-time format string checking. On Windows, if the mingw version of
-// vsnprintf is used in StringAppendV, use `gnu_printf' which allows z in %zd
-// and PRIu64 (and related) to be recognized by the compile-time checking.
-#define ADB_FORMAT_ARCHETYPE __printf__
-#ifdef __USE_MINGW_ANSI_STDIO
-#if __USE_MINGW_ANSI_STDIO
-#undef ADB_FORMAT_ARCHETYPE
-#define ADB_FORMAT_ARCHETYPE gnu_printf
-#endif
-#endif
-
 #ifdef _WIN32
 
 // Clang-only nullability specifiers
@@ -122,10 +110,30 @@ extern int  adb_creat(const char* path, int  mode);
 extern int  adb_read(int  fd, void* buf, int len);
 extern int  adb_write(int  fd, const void* buf, int  len);
 extern int  adb_lseek(int  fd, int  pos, int  where);
+
+// See the comments for the !defined(_WIN32) versions of adb_readv() and adb_writev().
+struct adb_iovec {
+	void* iov_base;
+	size_t iov_len;
+};
+extern int  adb_readv(int  fd, const adb_iovec* iov, int  iovcnt);
+extern int  adb_writev(int  fd, const adb_iovec* iov, int  iovcnt);
+
 extern int  adb_shutdown(int  fd);
 extern int  adb_close(int  fd);
 extern int  adb_register_socket(SOCKET s);
 
+// See the comments for the !defined(_WIN32) version. adb_lseek() is limited to int offsets, so
+// larger ones fail with EINVAL.
+static inline int64_t adb_lseek64(int fd, int64_t pos, int where)
+{
+	if (pos > INT_MAX || pos < INT_MIN) {
+		errno = EINVAL;
+		return -1;
+	}
+	return adb_lseek(fd, static_cast<int>(pos), where);
+}
+
 // See the comments for the !defined(_WIN32) version of unix_close().
 static inline int  unix_close(int fd)
 {
@@ -343,6 +351,7 @@ namespace internal {
 #include <poll.h>
 #include <signal.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 #include <sys/wait.h>
 
 #include <pthread.h>
@@ -469,10 +478,39 @@ static inline  int  adb_write(int  fd, const void* buf, size_t  len)
 #undef   write
 #define  write  ___xxx_write
 
+// Scatter/gather versions of adb_read() and adb_write(), so that a header and its payload can be
+// transferred with a single system call. Like their scalar versions, they can transfer fewer
+// bytes than asked for.
+typedef struct iovec adb_iovec;
+
+static inline int adb_readv(int fd, const adb_iovec* iov, int iovcnt)
+{
+	return TEMP_FAILURE_RETRY(readv(fd, iov, iovcnt));
+}
+
+static inline int adb_writev(int fd, const adb_iovec* iov, int iovcnt)
+{
+	return TEMP_FAILURE_RETRY(writev(fd, iov, iovcnt));
+}
+#undef   readv
+#define  readv  ___xxx_readv
+#undef   writev
+#define  writev  ___xxx_writev
+
 static inline int   adb_lseek(int  fd, int  pos, int  where)
 {
 	return lseek(fd, pos, where);
 }
+
+// Like adb_lseek(), but with a 64-bit offset so that it can address all of a large file.
+static inline int64_t adb_lseek64(int fd, int64_t pos, int where)
+{
+#if defined(__APPLE__)
+	return lseek(fd, pos, where);
+#else
+	return lseek64(fd, pos, where);
+#endif
+}
 #undef   lseek
 #define  lseek   ___xxx_lseek
 
@@ -57,6 +57,8 @@ typedef struct FHClassRec_ {
 	int (*_fh_lseek)(FH, int, int);
 	int (*_fh_read)(FH, void*, int);
 	int (*_fh_write)(FH, const void*, int);
+	int (*_fh_readv)(FH, const adb_iovec*, int);
+	int (*_fh_writev)(FH, const adb_iovec*, int);
 } FHClassRec;
 
 static void _fh_file_init(FH);
@@ -64,6 +66,8 @@ static int _fh_file_close(FH);
 static int _fh_file_lseek(FH, int, int);
 static int _fh_file_read(FH, void*, int);
 static int _fh_file_write(FH, const void*, int);
+static int _fh_file_readv(FH, const adb_iovec*, int);
+static int _fh_file_writev(FH, const adb_iovec*, int);
 
 static const FHClassRec _fh_file_class = {
 	_fh_file_init,
@@ -71,6 +75,8 @@ static const FHClassRec _fh_file_class = {
 	_fh_file_lseek,
 	_fh_file_read,
 	_fh_file_write,
+	_fh_file_readv,
+	_fh_file_writev,
 };
 
 static void _fh_socket_init(FH);
@@ -78,6 +84,8 @@ static int _fh_socket_close(FH);
 static int _fh_socket_lseek(FH, int, int);
 static int _fh_socket_read(FH, void*, int);
 static int _fh_socket_write(FH, const void*, int);
+static int _fh_socket_readv(FH, const adb_iovec*, int);
+static int _fh_socket_writev(FH, const adb_iovec*, int);
 
 static const FHClassRec _fh_socket_class = {
 	_fh_socket_init,
@@ -85,6 +93,8 @@ static const FHClassRec _fh_socket_class = {
 	_fh_socket_lseek,
 	_fh_socket_read,
 	_fh_socket_write,
+	_fh_socket_readv,
+	_fh_socket_writev,
 };
 
 #define assert(cond)                                                                       \
@@ -284,6 +294,36 @@ static int _fh_file_write(FH  f, const void* buf, int   len) {
 	return  (int)wrote_bytes;
 }
 
+// Files have no scatter/gather I/O, so these just go through the buffers in turn, stopping early
+// the same way a single read or write would.
+static int _fh_file_readv(FH f, const adb_iovec* iov, int iovcnt) {
+	int total = 0;
+	for (int i = 0; i < iovcnt; ++i) {
+		int len = (int)iov[i].iov_len;
+		int result = _fh_file_read(f, iov[i].iov_base, len);
+		if (result == -1) {
+			return total > 0 ? total : -1;
+		}
+		total += result;
+		if (result < len) break;
+	}
+	return total;
+}
+
+static int _fh_file_writev(FH f, const adb_iovec* iov, int iovcnt) {
+	int total = 0;
+	for (int i = 0; i < iovcnt; ++i) {
+		int len = (int)iov[i].iov_len;
+		int result = _fh_file_write(f, iov[i].iov_base, len);
+		if (result == -1) {
+			return total > 0 ? total : -1;
+		}
+		total += result;
+		if (result < len) break;
+	}
+	return total;
+}
+
 static int _fh_file_lseek(FH  f, int  pos, int  origin) {
 	DWORD  method;
 	DWORD  result;
@@ -446,6 +486,28 @@ int  adb_write(int  fd, const void* buf, int  len)
 	return f->clazz->_fh_write(f, buf, len);
 }
 
+int  adb_readv(int  fd, const adb_iovec* iov, int  iovcnt)
+{
+	FH     f = _fh_from_int(fd, __func__);
+
+	if (f == NULL) {
+		return -1;
+	}
+
+	return f->clazz->_fh_readv(f, iov, iovcnt);
+}
+
+int  adb_writev(int  fd, const adb_iovec* iov, int  iovcnt)
+{
+	FH     f = _fh_from_int(fd, __func__);
+
+	if (f == NULL) {
+		return -1;
+	}
+
+	return f->clazz->_fh_writev(f, iov, iovcnt);
+}
+
 int  adb_lseek(int  fd, int  pos, int  where)
 {
 	FH     f = _fh_from_int(fd, __func__);
@@ -638,6 +700,47 @@ static int _fh_socket_write(FH f, const void* buf, int len) {
 	return result;
 }
 
+static std::vector<WSABUF> _iovec_to_wsabuf(const adb_iovec* iov, int iovcnt) {
+	std::vector<WSABUF> bufs(iovcnt);
+	for (int i = 0; i < iovcnt; ++i) {
+		bufs[i].buf = reinterpret_cast<char*>(iov[i].iov_base);
+		bufs[i].len = static_cast<ULONG>(iov[i].iov_len);
+	}
+	return bufs;
+}
+
+static int _fh_socket_readv(FH f, const adb_iovec* iov, int iovcnt) {
+	std::vector<WSABUF> bufs = _iovec_to_wsabuf(iov, iovcnt);
+	DWORD received = 0;
+	DWORD flags = 0;
+	if (WSARecv(f->fh_socket, bufs.data(), iovcnt, &received, &flags, NULL, NULL) ==
+		SOCKET_ERROR) {
+		const DWORD err = WSAGetLastError();
+		if (err != WSAEWOULDBLOCK) {
+			D("WSARecv fd %d failed: %s", _fh_to_int(f),
+				android::base::SystemErrorCodeToString(err).c_str());
+		}
+		_socket_set_errno(err);
+		return -1;
+	}
+	return static_cast<int>(received);
+}
+
+static int _fh_socket_writev(FH f, const adb_iovec* iov, int iovcnt) {
+	std::vector<WSABUF> bufs = _iovec_to_wsabuf(iov, iovcnt);
+	DWORD sent = 0;
+	if (WSASend(f->fh_socket, bufs.data(), iovcnt, &sent, 0, NULL, NULL) == SOCKET_ERROR) {
+		const DWORD err = WSAGetLastError();
+		if (err != WSAEWOULDBLOCK) {
+			D("WSASend fd %d failed: %s", _fh_to_int(f),
+				android::base::SystemErrorCodeToString(err).c_str());
+		}
+		_socket_set_errno(err);
+		return -1;
+	}
+	return static_cast<int>(sent);
+}
+
 /**************************************************************************/
 /**************************************************************************/
 /*****                                                                *****/
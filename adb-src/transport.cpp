@@ -28,28 +28,94 @@
 
 #include <algorithm>
 #include <list>
+#include <memory>
 #include <mutex>
 #include <thread>
+#include <unordered_map>
+#include <vector>
 
 #include "adb.h"
 #include "adb_auth.h"
+#include "adb_io.h"
 #include "adb_trace.h"
 #include "adb_utils.h"
 #include "diagnose_usb.h"
 #include "fdevent.h"
+#include "packet_memory.h"
+#include "packet_scheduler.h"
+#include "packet_trace.h"
 
 static void transport_unref(atransport* t);
 
+// transport_lock serializes changes to the transport lists. Everything else reads the current
+// TransportRegistry, a snapshot that's replaced, never modified, on each change.
 static auto& transport_list = *new std::list<atransport*>();
 static auto& pending_list = *new std::list<atransport*>();
 
 static std::mutex& transport_lock = *new std::mutex();
 
+// Registered transports are freed when the last registry that lists them goes away, so anything
+// found in a registry stays valid for as long as the registry is held.
+static auto& transport_owners = *new std::unordered_map<atransport*, std::shared_ptr<atransport>>();
+
+struct TransportRegistry {
+	std::vector<std::shared_ptr<atransport>> owners;
+	std::vector<atransport*> transports;  // transport_list, in order.
+	std::vector<atransport*> pending;
+	TransportIndex index;  // Of |transports|.
+	bool has_no_perm = false;
+};
+
+static std::shared_ptr<const TransportRegistry>& current_registry =
+	*new std::shared_ptr<const TransportRegistry>(std::make_shared<TransportRegistry>());
+
+static std::shared_ptr<const TransportRegistry> transport_registry() {
+	return std::atomic_load(&current_registry);
+}
+
+static void free_transport(atransport* t) {
+	// Packets that were still in the socketpair when it was closed.
+	packet_memory_forget_transport(t);
+
+	if (t->product) free(t->product);
+	if (t->serial) free(t->serial);
+	if (t->model) free(t->model);
+	if (t->device) free(t->device);
+	if (t->devpath) free(t->devpath);
+
+	delete t;
+}
+
+// Takes ownership of |t|, which is about to go on pending_list.
+static void own_transport(atransport* t) {
+	transport_owners.emplace(t, std::shared_ptr<atransport>(t, free_transport));
+}
+
+// Called with transport_lock held after any change to the lists, or to what's indexed.
+static void publish_transports() {
+	auto registry = std::make_shared<TransportRegistry>();
+	for (atransport* t : transport_list) {
+		registry->owners.push_back(transport_owners.at(t));
+		registry->transports.push_back(t);
+		registry->index.Add(t);
+		registry->has_no_perm |= t->GetConnectionState() == kCsNoPerm;
+	}
+	for (atransport* t : pending_list) {
+		registry->owners.push_back(transport_owners.at(t));
+		registry->pending.push_back(t);
+	}
+	std::atomic_store(&current_registry, std::shared_ptr<const TransportRegistry>(registry));
+}
+
 const char* const kFeatureShell2 = "shell_v2";
 const char* const kFeatureCmd = "cmd";
 const char* const kFeatureStat2 = "stat_v2";
 const char* const kFeatureLibusb = "libusb";
 const char* const kFeaturePushSync = "push_sync";
+const char* const kFeatureSparse = "sync_sparse";
+const char* const kFeatureResume = "sync_resume";
+const char* const kFeatureSendBatch = "sync_send_batch";
+const char* const kFeatureStreamWindow = "stream_window";
 
 static std::string dump_packet(const char* name, const char* func, apacket* p) {
 	unsigned command = p->msg.command;
@@ -146,6 +212,7 @@ static void transport_socket_events(int fd, unsigned events, void* _t) {
 			D("%s: failed to read packet from transport socket on fd %d", t->serial, fd);
 		}
 		else {
+			packet_memory_release(t, kQueuedPacketCost);
 			handle_packet(p, (atransport*)_t);
 		}
 	}
@@ -161,11 +228,79 @@ void send_packet(apacket* p, atransport* t) {
 		fatal("Transport is null");
 	}
 
+	p->timestamp_ns = stats_now_ns();
+	t->stats.RecordQueued(p->msg.data_length);
+	packet_memory_charge(t, kQueuedPacketCost);
 	if (write_packet(t->transport_socket, t->serial, &p)) {
 		fatal_errno("cannot enqueue packet on transport socket");
 	}
 }
 
+// The most payload bytes the write thread hands to the transport in one write. The write thread
+// also takes at most kWriteBatchPackets packets off the transport socket at once.
+static constexpr size_t kWriteBatchBytes = 256 * 1024;
+
+// Adds up to |max| packets that are already queued on |fd| to |packets|, without waiting for
+// more, and returns how many were added.
+static size_t read_queued_packets(int fd, const char* name, apacket** packets, size_t max) {
+	adb_pollfd pfd = { fd, POLLIN, 0 };
+	if (max == 0 || adb_poll(&pfd, 1, 0) != 1 || !(pfd.revents & POLLIN)) {
+		return 0;
+	}
+
+	char* p = reinterpret_cast<char*>(packets);
+	int r = adb_read(fd, p, max * sizeof(apacket*));
+	if (r <= 0) {
+		// Leave it for the next read_packet() to report.
+		return 0;
+	}
+
+	// Packet addresses are written whole, so the rest of a partial one is on its way.
+	size_t count = r / sizeof(apacket*);
+	size_t partial = r % sizeof(apacket*);
+	if (partial != 0) {
+		if (ReadFdExactly(fd, p + r, sizeof(apacket*) - partial)) {
+			++count;
+		}
+		else {
+			D("%s: read_queued_packets (fd=%d) failed: %s", name, fd, strerror(errno));
+		}
+	}
+
+	for (size_t i = 0; i < count; ++i) {
+		VLOG(TRANSPORT) << dump_packet(name, "from remote", packets[i]);
+	}
+	return count;
+}
+
+// Writes a run of data packets to the transport and frees them.
+static bool write_packets(atransport* t, apacket** packets, size_t count) {
+	for (size_t i = 0; i < count; ++i) {
+		packet_trace_record(kPacketTraceSend, t->serial, packets[i]);
+	}
+
+	D("%s: transport got %zu packets, sending to remote", t->serial, count);
+	bool result;
+	{
+		ATRACE_NAME("write_transport write_remote");
+		result = t->Write(packets, count) == 0;
+	}
+	if (!result) {
+		D("%s: remote write failed for transport", t->serial);
+	}
+
+	uint64_t now = stats_now_ns();
+	for (size_t i = 0; i < count; ++i) {
+		if (result) {
+			t->stats.RecordOut(packets[i]->msg.data_length);
+			t->stats.write_latency.Record(packets[i]->timestamp_ns, now);
+		}
+		put_apacket(packets[i]);
+	}
+	packet_memory_release(t, count * kQueuedPacketCost);
+	return result;
+}
+
 // The transport is opened by transport_register_func before
 // the read_transport and write_transport threads are started.
 //
@@ -192,8 +327,10 @@ static void read_transport_thread(void* _t) {
 	p->msg.arg0 = 1;
 	p->msg.arg1 = ++(t->sync_token);
 	p->msg.magic = A_SYNC ^ 0xffffffff;
+	packet_memory_charge(t, kQueuedPacketCost);
 	if (write_packet(t->fd, t->serial, &p)) {
 		put_apacket(p);
+		packet_memory_release(t, kQueuedPacketCost);
 		D("%s: failed to write SYNC packet", t->serial);
 		goto oops;
 	}
@@ -216,10 +353,15 @@ static void read_transport_thread(void* _t) {
 			}
 #endif
 		}
+		packet_trace_record(kPacketTraceRecv, t->serial, p);
+		t->stats.RecordIn(p->msg.data_length);
+		p->timestamp_ns = stats_now_ns();
 
 		D("%s: received remote packet, sending to transport", t->serial);
+		packet_memory_charge(t, kQueuedPacketCost);
 		if (write_packet(t->fd, t->serial, &p)) {
 			put_apacket(p);
+			packet_memory_release(t, kQueuedPacketCost);
 			D("%s: failed to write apacket to transport", t->serial);
 			goto oops;
 		}
@@ -231,8 +373,10 @@ static void read_transport_thread(void* _t) {
 	p->msg.arg0 = 0;
 	p->msg.arg1 = 0;
 	p->msg.magic = A_SYNC ^ 0xffffffff;
+	packet_memory_charge(t, kQueuedPacketCost);
 	if (write_packet(t->fd, t->serial, &p)) {
 		put_apacket(p);
+		packet_memory_release(t, kQueuedPacketCost);
 		D("%s: failed to write SYNC apacket to transport", t->serial);
 	}
 
@@ -242,56 +386,104 @@ oops:
 	transport_unref(t);
 }
 
+// Hands a packet from the main thread to the scheduler, or acts on it if it's a SYNC. Returns
+// false once the transport is going offline.
+static bool schedule_packet(atransport* t, apacket* p, PacketScheduler* scheduler, int* active) {
+	if (p->timestamp_ns != 0) {
+		// Only packets from send_packet() were counted as queued.
+		t->stats.RecordDequeued(p->msg.data_length);
+	}
+
+	if (p->msg.command == A_SYNC) {
+		bool online = p->msg.arg0 != 0;
+		if (!online) {
+			D("%s: transport SYNC offline", t->serial);
+		}
+		else if (p->msg.arg1 == t->sync_token) {
+			D("%s: transport SYNC online", t->serial);
+			*active = 1;
+		}
+		else {
+			D("%s: transport ignoring SYNC %d != %d", t->serial, p->msg.arg1, t->sync_token);
+		}
+		put_apacket(p);
+		packet_memory_release(t, kQueuedPacketCost);
+		return online;
+	}
+
+	if (!*active) {
+		D("%s: transport ignoring packet while offline", t->serial);
+		put_apacket(p);
+		packet_memory_release(t, kQueuedPacketCost);
+		return true;
+	}
+
+	scheduler->Push(p);
+	return true;
+}
+
 // write_transport thread gets packets sent by the main thread (through send_packet()),
 // and writes to a transport (representing a usb/tcp connection).
+//
+// Everything the main thread has queued is taken before each write, and the PacketScheduler
+// picks what goes next, so that a keystroke doesn't wait behind the whole of a push.
 static void write_transport_thread(void* _t) {
 	atransport* t = reinterpret_cast<atransport*>(_t);
-	apacket* p;
+	apacket* packets[kWriteBatchPackets];
+	PacketScheduler scheduler;
 	int active = 0;
 
 	adb_thread_setname(
 		android::base::StringPrintf("->%s", (t->serial != nullptr ? t->serial : "transport")));
 	D("%s: starting write_transport thread, reading from fd %d", t->serial, t->fd);
 
-	for (;;) {
+	bool running = true;
+	while (running) {
 		ATRACE_NAME("write_transport loop");
-		if (read_packet(t->fd, t->serial, &p)) {
-			D("%s: failed to read apacket from transport on fd %d", t->serial, t->fd);
-			break;
-		}
 
-		if (p->msg.command == A_SYNC) {
-			if (p->msg.arg0 == 0) {
-				D("%s: transport SYNC offline", t->serial);
-				put_apacket(p);
+		// Only wait for the main thread when there's nothing left to send.
+		size_t count = 0;
+		if (scheduler.empty()) {
+			if (read_packet(t->fd, t->serial, &packets[0])) {
+				D("%s: failed to read apacket from transport on fd %d", t->serial, t->fd);
 				break;
 			}
-			else {
-				if (p->msg.arg1 == t->sync_token) {
-					D("%s: transport SYNC online", t->serial);
-					active = 1;
+			count = 1;
+		}
+
+		bool drained = false;
+		while (!drained) {
+			count += read_queued_packets(t->fd, t->serial, &packets[count],
+				kWriteBatchPackets - count);
+			drained = count < kWriteBatchPackets;
+			for (size_t i = 0; i < count; ++i) {
+				if (running) {
+					running = schedule_packet(t, packets[i], &scheduler, &active);
 				}
 				else {
-					D("%s: transport ignoring SYNC %d != %d", t->serial, p->msg.arg1, t->sync_token);
+					// Whatever follows SYNC(0) is dropped.
+					put_apacket(packets[i]);
+					packet_memory_release(t, kQueuedPacketCost);
 				}
 			}
+			count = 0;
 		}
-		else {
-			if (active) {
-				D("%s: transport got packet, sending to remote", t->serial);
-				ATRACE_NAME("write_transport write_remote");
-				if (t->Write(p) != 0) {
-					D("%s: remote write failed for transport", t->serial);
-					put_apacket(p);
-					break;
-				}
-			}
-			else {
-				D("%s: transport ignoring packet while offline", t->serial);
+
+		if (running) {
+			count = scheduler.Next(packets, kWriteBatchPackets, kWriteBatchBytes);
+			if (count != 0) {
+				running = write_packets(t, packets, count);
 			}
 		}
+	}
 
-		put_apacket(p);
+	// Free whatever is left while |t| is still ours to release the memory against.
+	size_t count;
+	while ((count = scheduler.Next(packets, kWriteBatchPackets, SIZE_MAX)) != 0) {
+		for (size_t i = 0; i < count; ++i) {
+			put_apacket(packets[i]);
+		}
+		packet_memory_release(t, count * kQueuedPacketCost);
 	}
 
 	D("%s: write_transport thread is exiting, fd %d", t->serial, t->fd);
@@ -300,10 +492,11 @@ static void write_transport_thread(void* _t) {
 }
 
 void kick_transport(atransport* t) {
-	std::lock_guard<std::mutex> lock(transport_lock);
 	// As kick_transport() can be called from threads without guarantee that t is valid,
 	// check if the transport is in transport_list first.
-	if (std::find(transport_list.begin(), transport_list.end(), t) != transport_list.end()) {
+	auto registry = transport_registry();
+	const auto& transports = registry->transports;
+	if (std::find(transports.begin(), transports.end(), t) != transports.end()) {
 		t->Kick();
 	}
 }
@@ -403,15 +596,153 @@ asocket* create_device_tracker(void) {
 	return &tracker->socket;
 }
 
+/* this adds support required by the 'wait-for-*' services. rather
+ * than a thread polling for the transport, waiters sit on this list
+ * and are checked on the main thread whenever the transport list or
+ * a transport's connection state changes.
+ */
+struct state_waiter {
+	asocket socket;
+	TransportType transport_type;
+	std::string serial;
+	ConnectionState state;
+	uint64_t deadline_ns;  // 0 for no timeout.
+};
+
+static auto& state_waiters = *new std::list<state_waiter*>();
+static bool state_waiters_check_pending = false;
+
+static void arm_state_waiter_timeout() {
+	uint64_t deadline_ns = 0;
+	for (state_waiter* waiter : state_waiters) {
+		if (waiter->deadline_ns != 0 &&
+			(deadline_ns == 0 || waiter->deadline_ns < deadline_ns)) {
+			deadline_ns = waiter->deadline_ns;
+		}
+	}
+	if (deadline_ns == 0) {
+		fdevent_set_timeout(&transport_registration_fde, -1);
+		return;
+	}
+	uint64_t now = stats_now_ns();
+	int64_t timeout_ms = deadline_ns > now ? (deadline_ns - now + 999999) / 1000000 : 0;
+	fdevent_set_timeout(&transport_registration_fde, timeout_ms);
+}
+
+static void state_waiter_close(asocket* socket) {
+	state_waiter* waiter = reinterpret_cast<state_waiter*>(socket);
+	asocket* peer = socket->peer;
+
+	D("state waiter %p removed", waiter);
+	if (peer) {
+		peer->peer = NULL;
+		peer->close(peer);
+	}
+	state_waiters.remove(waiter);
+	delete waiter;
+	arm_state_waiter_timeout();
+}
+
+static int state_waiter_enqueue(asocket* socket, apacket* p) {
+	/* you can't write to a state waiter, close immediately */
+	put_apacket(p);
+	state_waiter_close(socket);
+	return -1;
+}
+
+// Replies and closes |waiter| if its transport is in the state it wants, or if it can't ever be
+// told apart from another. Returns whether it did.
+static bool state_waiter_check(state_waiter* waiter) {
+	bool is_ambiguous = false;
+	std::string error = "unknown error";
+	const char* serial = waiter->serial.empty() ? nullptr : waiter->serial.c_str();
+	atransport* t = acquire_one_transport(waiter->transport_type, serial, &is_ambiguous, &error);
+	if (t != nullptr && (waiter->state == kCsAny || waiter->state == t->GetConnectionState())) {
+		SendOkay(waiter->socket.peer->fd);
+	}
+	else if (is_ambiguous) {
+		SendFail(waiter->socket.peer->fd, error);
+	}
+	else {
+		return false;
+	}
+	state_waiter_close(&waiter->socket);
+	return true;
+}
+
+static void state_waiter_ready(asocket* socket) {
+	state_waiter* waiter = reinterpret_cast<state_waiter*>(socket);
+	if (std::find(state_waiters.begin(), state_waiters.end(), waiter) != state_waiters.end()) {
+		return;
+	}
+
+	D("state waiter %p waiting for state %d", waiter, waiter->state);
+	state_waiters.push_back(waiter);
+	if (!state_waiter_check(waiter)) {
+		arm_state_waiter_timeout();
+	}
+}
+
+static void check_state_waiters() {
+	state_waiters_check_pending = false;
+	auto waiters = state_waiters;
+	for (state_waiter* waiter : waiters) {
+		state_waiter_check(waiter);
+	}
+}
+
+// Called on the main thread when a transport's state may have changed. The check is deferred, so
+// that whatever changed it has finished updating the transport (and the registry) by then.
+static void notify_state_waiters() {
+	if (state_waiters.empty() || state_waiters_check_pending) {
+		return;
+	}
+	state_waiters_check_pending = true;
+	fdevent_run_on_main_thread(check_state_waiters);
+}
+
+static void expire_state_waiters() {
+	uint64_t now = stats_now_ns();
+	auto waiters = state_waiters;
+	for (state_waiter* waiter : waiters) {
+		if (waiter->deadline_ns != 0 && waiter->deadline_ns <= now) {
+			D("state waiter %p timed out", waiter);
+			SendFail(waiter->socket.peer->fd, "timeout expired while waiting for device");
+			state_waiter_close(&waiter->socket);
+		}
+	}
+	arm_state_waiter_timeout();
+}
+
+asocket* create_state_waiter(TransportType transport_type, const char* serial,
+	ConnectionState state, int64_t timeout_ms) {
+	state_waiter* waiter = new state_waiter();
+
+	D("state waiter %p created", waiter);
+
+	waiter->socket.enqueue = state_waiter_enqueue;
+	waiter->socket.ready = state_waiter_ready;
+	waiter->socket.close = state_waiter_close;
+	waiter->transport_type = transport_type;
+	if (serial) waiter->serial = serial;
+	waiter->state = state;
+	if (timeout_ms >= 0) {
+		timeout_ms = std::min(timeout_ms, kStateWaiterMaxTimeoutMs);
+		waiter->deadline_ns = std::max<uint64_t>(1, stats_now_ns() + timeout_ms * 1000000);
+	}
+
+	return &waiter->socket;
+}
+
 // Check if all of the USB transports are connected.
 bool iterate_transports(std::function<bool(const atransport*)> fn) {
-	std::lock_guard<std::mutex> lock(transport_lock);
-	for (const auto& t : transport_list) {
+	auto registry = transport_registry();
+	for (const auto& t : registry->transports) {
 		if (!fn(t)) {
 			return false;
 		}
 	}
-	for (const auto& t : pending_list) {
+	for (const auto& t : registry->pending) {
 		if (!fn(t)) {
 			return false;
 		}
@@ -421,6 +752,11 @@ bool iterate_transports(std::function<bool(const atransport*)> fn) {
 
 // Call this function each time the transport list has changed.
 void update_transports() {
+	// The banner may have changed what the transports are indexed by.
+	{
+		std::lock_guard<std::mutex> lock(transport_lock);
+		publish_transports();
+	}
 	update_transport_status();
 
 	// Notify `adb track-devices` clients.
@@ -433,12 +769,16 @@ void update_transports() {
 		device_tracker_send(tracker, transports);
 		tracker = next;
 	}
+
+	notify_state_waiters();
 }
 
 #else
 
 void update_transports() {
-	// Nothing to do on the device side.
+	// The banner may have changed what the transports are indexed by.
+	std::lock_guard<std::mutex> lock(transport_lock);
+	publish_transports();
 }
 
 #endif  // ADB_HOST
@@ -491,6 +831,13 @@ static void transport_registration_func(int _fd, unsigned ev, void* data) {
 	int s[2];
 	atransport* t;
 
+#if ADB_HOST
+	// The registration fd also carries the wait-for-* timeouts.
+	if (ev & FDE_TIMEOUT) {
+		expire_state_waiters();
+	}
+#endif
+
 	if (!(ev & FDE_READ)) {
 		return;
 	}
@@ -510,18 +857,16 @@ static void transport_registration_func(int _fd, unsigned ev, void* data) {
 		fdevent_remove(&(t->transport_fde));
 		adb_close(t->fd);
 
+		// |t| is freed once nothing's using a registry that lists it.
+		std::shared_ptr<atransport> owner;
 		{
 			std::lock_guard<std::mutex> lock(transport_lock);
 			transport_list.remove(t);
+			owner = std::move(transport_owners.at(t));
+			transport_owners.erase(t);
+			publish_transports();
 		}
-
-		if (t->product) free(t->product);
-		if (t->serial) free(t->serial);
-		if (t->model) free(t->model);
-		if (t->device) free(t->device);
-		if (t->devpath) free(t->devpath);
-
-		delete t;
+		owner.reset();
 
 		update_transports();
 		return;
@@ -553,6 +898,7 @@ static void transport_registration_func(int _fd, unsigned ev, void* data) {
 		std::lock_guard<std::mutex> lock(transport_lock);
 		pending_list.remove(t);
 		transport_list.push_front(t);
+		publish_transports();
 	}
 
 	update_transports();
@@ -577,8 +923,8 @@ void init_transport_registration(void) {
 
 void kick_all_transports() {
 	// To avoid only writing part of a packet to a transport after exit, kick all transports.
-	std::lock_guard<std::mutex> lock(transport_lock);
-	for (auto t : transport_list) {
+	auto registry = transport_registry();
+	for (auto t : registry->transports) {
 		t->Kick();
 	}
 }
@@ -660,12 +1006,20 @@ atransport* acquire_one_transport(TransportType type, const char* serial, bool*
 		*error_out = "no devices found";
 	}
 
-	std::unique_lock<std::mutex> lock(transport_lock);
-	for (const auto& t : transport_list) {
-		if (t->GetConnectionState() == kCsNoPerm) {
+	auto registry = transport_registry();
 #if ADB_HOST
-			* error_out = UsbNoPermissionsLongHelpText();
+	if (registry->has_no_perm) {
+		*error_out = UsbNoPermissionsLongHelpText();
+	}
 #endif
+
+	// With a serial, only the transports the index turns up need checking.
+	std::vector<atransport*> candidates;
+	if (serial) {
+		candidates = registry->index.Candidates(serial);
+	}
+	for (const auto& t : serial ? candidates : registry->transports) {
+		if (t->GetConnectionState() == kCsNoPerm) {
 			continue;
 		}
 
@@ -711,7 +1065,6 @@ atransport* acquire_one_transport(TransportType type, const char* serial, bool*
 			}
 		}
 	}
-	lock.unlock();
 
 	// Don't return unauthorized devices; the caller can't do anything with them.
 	if (result && result->GetConnectionState() == kCsUnauthorized && !accept_any_state) {
@@ -745,9 +1098,24 @@ int atransport::Write(apacket* p) {
 	return write_func_(p, this);
 }
 
+int atransport::Write(apacket** packets, size_t count) {
+#if ADB_HOST
+	std::lock_guard<std::mutex> lock(write_msg_lock_);
+#endif
+	if (write_batch_func_ != nullptr) {
+		return write_batch_func_(packets, count, this);
+	}
+	for (size_t i = 0; i < count; ++i) {
+		int rc = write_func_(packets[i], this);
+		if (rc != 0) return rc;
+	}
+	return 0;
+}
+
 void atransport::Kick() {
-	if (!kicked_) {
-		kicked_ = true;
+	// Transports are kicked from registry snapshots without transport_lock, so two threads can
+	// get here at once: only the first one to claim kicked_ calls kick_func_.
+	if (!kicked_.exchange(true)) {
 		CHECK(kick_func_ != nullptr);
 #if ADB_HOST
 		// On host, adb server should avoid writing part of a packet, so don't
@@ -765,6 +1133,9 @@ ConnectionState atransport::GetConnectionState() const {
 void atransport::SetConnectionState(ConnectionState state) {
 	check_main_thread();
 	connection_state_ = state;
+#if ADB_HOST
+	notify_state_waiters();
+#endif
 }
 
 const std::string atransport::connection_state_name() const {
@@ -811,7 +1182,8 @@ namespace {
 const FeatureSet& supported_features() {
 	// Local static allocation to avoid global non-POD variables.
 	static const FeatureSet* features = new FeatureSet{
-		kFeatureShell2, kFeatureCmd, kFeatureStat2,
+		kFeatureShell2, kFeatureCmd, kFeatureStat2, kFeatureSparse, kFeatureResume,
+		kFeatureSendBatch, kFeatureStreamWindow,
 		// Increment ADB_SERVER_VERSION whenever the feature list changes to
 		// make sure that the adb client and server features stay in sync
 		// (http://b/24370690).
@@ -897,6 +1269,89 @@ bool atransport::MatchesTarget(const std::string& target) const {
 		qual_match(target.c_str(), "device:", device, false);
 }
 
+// Strips the protocol prefix MatchesTarget() ignores, and returns the hostname, if there is one.
+static bool ParseTargetHost(const std::string& target, std::string* host) {
+	const char* address = target.c_str();
+	if (android::base::StartsWith(target, "tcp:") || android::base::StartsWith(target, "udp:")) {
+		address += 4;
+	}
+	int port = -1;
+	std::string error;
+	return android::base::ParseNetAddress(address, host, &port, nullptr, &error);
+}
+
+void TransportIndex::Add(atransport* t) {
+	all_.push_back(t);
+	if (t->serial) {
+		serials_[t->serial].push_back(t);
+		std::string host;
+		if (t->type == kTransportLocal && ParseTargetHost(t->serial, &host)) {
+			hosts_[host].push_back(t);
+		}
+	}
+	if (t->devpath) devpaths_[t->devpath].push_back(t);
+	if (t->product) products_[t->product].push_back(t);
+	if (t->model) {
+		std::string model = t->model;
+		std::replace_if(model.begin(), model.end(), [](char ch) { return !isalnum(ch); }, '_');
+		models_[model].push_back(t);
+	}
+	if (t->device) devices_[t->device].push_back(t);
+}
+
+std::vector<atransport*> TransportIndex::Candidates(const std::string& target) const {
+	// An empty target can match any transport missing a product, model or device.
+	if (target.empty()) {
+		return all_;
+	}
+
+	std::vector<atransport*> result;
+	auto add = [&result](const Map& map, const std::string& key) {
+		auto it = map.find(key);
+		if (it == map.end()) {
+			return;
+		}
+		for (atransport* t : it->second) {
+			if (std::find(result.begin(), result.end(), t) == result.end()) {
+				result.push_back(t);
+			}
+		}
+	};
+
+	add(serials_, target);
+	add(devpaths_, target);
+	if (android::base::StartsWith(target, "product:")) {
+		add(products_, target.substr(strlen("product:")));
+	}
+	if (android::base::StartsWith(target, "model:")) {
+		add(models_, target.substr(strlen("model:")));
+	}
+	if (android::base::StartsWith(target, "device:")) {
+		add(devices_, target.substr(strlen("device:")));
+	}
+	std::string host;
+	if (ParseTargetHost(target, &host)) {
+		add(hosts_, host);
+	}
+
+	// Keep the order the transports were added in.
+	if (result.size() > 1) {
+		std::vector<atransport*> ordered;
+		for (atransport* t : all_) {
+			if (std::find(result.begin(), result.end(), t) != result.end()) {
+				ordered.push_back(t);
+			}
+		}
+		result.swap(ordered);
+	}
+	return result;
+}
+
+atransport* TransportIndex::FindSerial(const std::string& serial) const {
+	auto it = serials_.find(serial);
+	return it == serials_.end() ? nullptr : it->second.front();
+}
+
 #if ADB_HOST
 
 static void append_transport_info(std::string* result, const char* key, const char* value,
@@ -938,16 +1393,16 @@ static void append_transport(const atransport* t, std::string* result, bool long
 std::string list_transports(bool long_listing) {
 	std::string result;
 
-	std::lock_guard<std::mutex> lock(transport_lock);
-	for (const auto& t : transport_list) {
+	auto registry = transport_registry();
+	for (const auto& t : registry->transports) {
 		append_transport(t, &result, long_listing);
 	}
 	return result;
 }
 
 void close_usb_devices(std::function<bool(const atransport*)> predicate) {
-	std::lock_guard<std::mutex> lock(transport_lock);
-	for (auto& t : transport_list) {
+	auto registry = transport_registry();
+	for (auto& t : registry->transports) {
 		if (predicate(t)) {
 			t->Kick();
 		}
@@ -994,8 +1449,10 @@ int register_socket_transport(int s, const char* serial, int port, int local) {
 		}
 	}
 
-	pending_list.push_front(t);
 	t->serial = strdup(serial);
+	own_transport(t);
+	pending_list.push_front(t);
+	publish_transports();
 
 	lock.unlock();
 
@@ -1005,22 +1462,12 @@ int register_socket_transport(int s, const char* serial, int port, int local) {
 
 #if ADB_HOST
 atransport* find_transport(const char* serial) {
-	atransport* result = nullptr;
-
-	std::lock_guard<std::mutex> lock(transport_lock);
-	for (auto& t : transport_list) {
-		if (t->serial && strcmp(serial, t->serial) == 0) {
-			result = t;
-			break;
-		}
-	}
-
-	return result;
+	return transport_registry()->index.FindSerial(serial);
 }
 
 void kick_all_tcp_devices() {
-	std::lock_guard<std::mutex> lock(transport_lock);
-	for (auto& t : transport_list) {
+	auto registry = transport_registry();
+	for (auto& t : registry->transports) {
 		if (t->IsTcpDevice()) {
 			// Kicking breaks the read_transport thread of this transport out of any read, then
 			// the read_transport thread will notify the main thread to make this transport
@@ -1049,7 +1496,9 @@ void register_usb_transport(usb_handle* usb, const char* serial, const char* dev
 
 	{
 		std::lock_guard<std::mutex> lock(transport_lock);
+		own_transport(t);
 		pending_list.push_front(t);
+		publish_transports();
 	}
 
 	register_transport(t);
@@ -1057,9 +1506,17 @@ void register_usb_transport(usb_handle* usb, const char* serial, const char* dev
 
 // This should only be used for transports with connection_state == kCsNoPerm.
 void unregister_usb_transport(usb_handle* usb) {
+	std::vector<std::shared_ptr<atransport>> owners;
 	std::lock_guard<std::mutex> lock(transport_lock);
-	transport_list.remove_if(
-		[usb](atransport* t) { return t->usb == usb && t->GetConnectionState() == kCsNoPerm; });
+	transport_list.remove_if([usb, &owners](atransport* t) {
+		if (t->usb != usb || t->GetConnectionState() != kCsNoPerm) {
+			return false;
+		}
+		owners.push_back(std::move(transport_owners.at(t)));
+		transport_owners.erase(t);
+		return true;
+	});
+	publish_transports();
 }
 
 bool check_header(apacket* p, atransport* t) {
@@ -26,9 +26,13 @@
 #include <memory>
 #include <mutex>
 #include <string>
+#include <unordered_map>
 #include <unordered_set>
+#include <vector>
 
 #include "adb.h"
+#include "adb_stats.h"
+#include "buffered_reader.h"
 
 #include <openssl/rsa.h>
 
@@ -53,6 +57,17 @@ extern const char* const kFeatureStat2;
 extern const char* const kFeatureLibusb;
 // The server supports `push --sync`.
 extern const char* const kFeaturePushSync;
+// The sync service understands ID_HOLE and ID_RECV_SPARSE.
+extern const char* const kFeatureSparse;
+// The sync service understands ID_HASH, ID_SEND_RESUME and ID_RECV_RESUME.
+extern const char* const kFeatureResume;
+// The sync service understands ID_SEND_BATCH.
+extern const char* const kFeatureSendBatch;
+// Streams can have several WRITEs in flight, up to a window (see socket.h).
+extern const char* const kFeatureStreamWindow;
+
+// The most packets the write thread hands to a transport's write batch function at once.
+constexpr size_t kWriteBatchPackets = 64;
 
 class atransport {
 public:
@@ -72,6 +87,10 @@ public:
 	void (*close)(atransport* t) = nullptr;
 
 	void SetWriteFunction(int (*write_func)(apacket*, atransport*)) { write_func_ = write_func; }
+	// Optional: lets the write thread send a run of packets with a single system call.
+	void SetWriteBatchFunction(int (*write_batch_func)(apacket**, size_t, atransport*)) {
+		write_batch_func_ = write_batch_func;
+	}
 	void SetKickFunction(void (*kick_func)(atransport*)) {
 		kick_func_ = kick_func;
 	}
@@ -79,6 +98,8 @@ public:
 		return kicked_;
 	}
 	int Write(apacket* p);
+	// Writes |count| packets in order, a batch at a time if the transport can.
+	int Write(apacket** packets, size_t count);
 	void Kick();
 
 	// ConnectionState can be read by all threads, but can only be written in the main thread.
@@ -96,6 +117,8 @@ public:
 	// USB handle or socket fd as needed.
 	usb_handle* usb = nullptr;
 	int sfd = -1;
+	// Packets read from sfd ahead of when they're needed.
+	std::unique_ptr<BufferedReader> sfd_reader;
 
 	// Used to identify transports for clients.
 	char* serial = nullptr;
@@ -128,6 +151,11 @@ public:
 	char token[TOKEN_SIZE] = {};
 	size_t failed_auth_attempts = 0;
 
+	TrafficStats stats{};
+
+	// Memory held by packets charged to this transport; see packet_memory.h.
+	std::atomic<size_t> queued_memory{ 0 };
+
 	const std::string serial_name() const { return serial ? serial : "<unknown>"; }
 	const std::string connection_state_name() const;
 
@@ -165,9 +193,10 @@ public:
 
 private:
 	int local_port_for_emulator_ = -1;
-	bool kicked_ = false;
+	std::atomic<bool> kicked_{false};
 	void (*kick_func_)(atransport*) = nullptr;
 	int (*write_func_)(apacket*, atransport*) = nullptr;
+	int (*write_batch_func_)(apacket**, size_t, atransport*) = nullptr;
 
 	// A set of features transmitted in the banner with the initial connection.
 	// This is stored in the banner as 'features=feature0,feature1,etc'.
@@ -188,6 +217,33 @@ private:
 	DISALLOW_COPY_AND_ASSIGN(atransport);
 };
 
+// Indexes transports by everything MatchesTarget() looks at, so that finding the transports a
+// target names doesn't mean checking every one of them.
+class TransportIndex {
+public:
+	// Indexes |t| as it is now; a change to its serial, devpath, product, model or device needs a
+	// new index.
+	void Add(atransport* t);
+
+	// Returns the transports that might match |target|, in the order they were added. Callers
+	// still need to check MatchesTarget().
+	std::vector<atransport*> Candidates(const std::string& target) const;
+
+	// Returns the first transport with exactly |serial|, or nullptr.
+	atransport* FindSerial(const std::string& serial) const;
+
+private:
+	using Map = std::unordered_map<std::string, std::vector<atransport*>>;
+
+	std::vector<atransport*> all_;
+	Map serials_;
+	Map devpaths_;
+	Map products_;
+	Map models_;  // Sanitized, as "model:" targets are.
+	Map devices_;
+	Map hosts_;  // Of local transports.
+};
+
 /*
  * Obtain a transport from the available transports.
  * If serial is non-null then only the device with that serial will be chosen.
@@ -233,4 +289,12 @@ void send_packet(apacket* p, atransport* t);
 
 asocket* create_device_tracker(void);
 
+// A socket that replies OKAY once the transport matching |transport_type| and |serial| (which may
+// be null) is in |state|, or FAIL if more than one transport matches, or after |timeout_ms| (if
+// it's not negative, and at most kStateWaiterMaxTimeoutMs). It's woken by changes to the
+// transports, rather than polling for them.
+constexpr int64_t kStateWaiterMaxTimeoutMs = INT64_MAX / 1000000;
+asocket* create_state_waiter(TransportType transport_type, const char* serial,
+	ConnectionState state, int64_t timeout_ms);
+
 #endif   /* __TRANSPORT_H */
@@ -62,7 +62,7 @@ static atransport* local_transports[ADB_LOCAL_TRANSPORT_MAX];
 
 static int remote_read(apacket* p, atransport* t)
 {
-	if (!ReadFdExactly(t->sfd, &p->msg, sizeof(amessage))) {
+	if (!t->sfd_reader->ReadExactly(t->sfd, &p->msg, sizeof(amessage))) {
 		D("remote local: read terminated (message)");
 		return -1;
 	}
@@ -72,7 +72,7 @@ static int remote_read(apacket* p, atransport* t)
 		return -1;
 	}
 
-	if (!ReadFdExactly(t->sfd, p->data, p->msg.data_length)) {
+	if (!t->sfd_reader->ReadExactly(t->sfd, p->data, p->msg.data_length)) {
 		D("remote local: terminated (data)");
 		return -1;
 	}
@@ -97,6 +97,25 @@ static int remote_write(apacket* p, atransport* t)
 	return 0;
 }
 
+// Sends a run of packets with one writev(), so that many small packets from busy sockets go
+// out in as few TCP segments as they can.
+static int remote_write_batch(apacket** packets, size_t count, atransport* t)
+{
+	CHECK_LE(count, kWriteBatchPackets);
+	adb_iovec iov[kWriteBatchPackets];
+	for (size_t i = 0; i < count; ++i) {
+		iov[i].iov_base = &packets[i]->msg;
+		iov[i].iov_len = sizeof(amessage) + packets[i]->msg.data_length;
+	}
+
+	if (!WriteFdExactlyV(t->sfd, iov, count)) {
+		D("remote local: batch write terminated");
+		return -1;
+	}
+
+	return 0;
+}
+
 bool local_connect(int port) {
 	std::string dummy;
 	return local_connect_arbitrary_ports(port - 1, port, &dummy) == 0;
@@ -530,9 +549,11 @@ int init_socket_transport(atransport* t, int s, int adb_port, int local)
 
 	t->SetKickFunction(remote_kick);
 	t->SetWriteFunction(remote_write);
+	t->SetWriteBatchFunction(remote_write_batch);
 	t->close = remote_close;
 	t->read_from_remote = remote_read;
 	t->sfd = s;
+	t->sfd_reader.reset(new BufferedReader());
 	t->sync_token = 1;
 	t->type = kTransportLocal;
 
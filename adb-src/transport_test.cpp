@@ -18,7 +18,13 @@
 
 #include <gtest/gtest.h>
 
+#include <atomic>
+#include <thread>
+#include <vector>
+
 #include "adb.h"
+#include "adb_io.h"
+#include "fdevent_test.h"
 
 TEST(transport, kick_transport) {
 	atransport t;
@@ -36,6 +42,53 @@ TEST(transport, kick_transport) {
 	ASSERT_EQ(1u, kick_count);
 }
 
+TEST(transport, kick_transport_concurrently) {
+	atransport t;
+	static std::atomic<size_t> kick_count;
+	kick_count = 0;
+	t.SetKickFunction([](atransport*) { kick_count++; });
+
+	std::vector<std::thread> threads;
+	for (int i = 0; i < 8; ++i) {
+		threads.emplace_back([&t]() { t.Kick(); });
+	}
+	for (auto& thread : threads) {
+		thread.join();
+	}
+	ASSERT_TRUE(t.IsKicked());
+	ASSERT_EQ(1u, kick_count);
+}
+
+TEST(transport, write_batch) {
+	atransport t;
+	static std::vector<uint32_t> written;
+	written.clear();
+	apacket* batch[3];
+	for (size_t i = 0; i < 3; ++i) {
+		batch[i] = get_apacket();
+		batch[i]->msg.arg0 = i;
+	}
+
+	// Without a batch function, packets are written one at a time, in order.
+	t.SetWriteFunction([](apacket* p, atransport*) {
+		written.push_back(p->msg.arg0);
+		return p->msg.arg0 == 1 ? -1 : 0;
+	});
+	ASSERT_EQ(-1, t.Write(batch, 3));
+	ASSERT_EQ(std::vector<uint32_t>({ 0, 1 }), written);
+
+	t.SetWriteBatchFunction([](apacket** packets, size_t count, atransport*) {
+		written.push_back(count);
+		return 0;
+	});
+	ASSERT_EQ(0, t.Write(batch, 3));
+	ASSERT_EQ(std::vector<uint32_t>({ 0, 1, 3 }), written);
+
+	for (apacket* p : batch) {
+		put_apacket(p);
+	}
+}
+
 static void DisconnectFunc(void* arg, atransport*) {
 	int* count = reinterpret_cast<int*>(arg);
 	++* count;
@@ -197,4 +250,112 @@ TEST(transport, test_matches_target_local) {
 		EXPECT_FALSE(t.MatchesTarget("100.100.100.100:5554"));
 		EXPECT_FALSE(t.MatchesTarget("abc:100.100.100.100"));
 	}
-}
\ No newline at end of file
+}
+
+TEST(transport, TransportIndex) {
+	std::string serial = "foo";
+	std::string devpath = "/path/to/bar";
+	std::string product = "test_product";
+	std::string model = "test model";
+	std::string device = "test_device";
+	std::string local_serial = "100.100.100.100:5555";
+
+	atransport usb;
+	usb.serial = &serial[0];
+	usb.devpath = &devpath[0];
+	usb.product = &product[0];
+	usb.model = &model[0];
+	usb.device = &device[0];
+
+	atransport local;
+	local.type = kTransportLocal;
+	local.serial = &local_serial[0];
+
+	TransportIndex index;
+	index.Add(&usb);
+	index.Add(&local);
+
+	using Candidates = std::vector<atransport*>;
+	EXPECT_EQ(Candidates{ &usb }, index.Candidates(serial));
+	EXPECT_EQ(Candidates{ &usb }, index.Candidates(devpath));
+	EXPECT_EQ(Candidates{ &usb }, index.Candidates("product:" + product));
+	EXPECT_EQ(Candidates{ &usb }, index.Candidates("model:test_model"));
+	EXPECT_EQ(Candidates{ &usb }, index.Candidates("device:" + device));
+	EXPECT_EQ(Candidates{}, index.Candidates(product));
+
+	EXPECT_EQ(Candidates{ &local }, index.Candidates(local_serial));
+	EXPECT_EQ(Candidates{ &local }, index.Candidates("100.100.100.100"));
+	EXPECT_EQ(Candidates{ &local }, index.Candidates("tcp:100.100.100.100:5555"));
+	EXPECT_EQ(Candidates{}, index.Candidates("100.100.100.101"));
+
+	// Every candidate the index turns up really matches.
+	for (const std::string& target : { serial, devpath, local_serial, std::string("udp:100.100.100.100") }) {
+		for (atransport* t : index.Candidates(target)) {
+			EXPECT_TRUE(t->MatchesTarget(target)) << target;
+		}
+	}
+
+	EXPECT_EQ(&usb, index.FindSerial(serial));
+	EXPECT_EQ(nullptr, index.FindSerial("100.100.100.100"));
+
+	usb.serial = nullptr;
+	usb.devpath = nullptr;
+	usb.product = nullptr;
+	usb.model = nullptr;
+	usb.device = nullptr;
+	local.serial = nullptr;
+}
+
+#if ADB_HOST
+
+class StateWaiterTest : public FdeventTest {};
+
+TEST_F(StateWaiterTest, timeout) {
+	init_transport_registration();
+	int fds[2];
+	ASSERT_EQ(0, adb_socketpair(fds));
+	asocket* s = create_local_socket(fds[1]);
+	asocket* waiter = create_state_waiter(kTransportAny, "no-such-device", kCsDevice, 10);
+	s->peer = waiter;
+	waiter->peer = s;
+	waiter->ready(waiter);
+
+	PrepareThread();
+	std::thread thread(fdevent_loop);
+
+	char status[4];
+	ASSERT_TRUE(ReadFdExactly(fds[0], status, sizeof(status)));
+	ASSERT_EQ("FAIL", std::string(status, sizeof(status)));
+	std::string reply;
+	std::string error;
+	ASSERT_TRUE(ReadProtocolString(fds[0], &reply, &error));
+	ASSERT_EQ("timeout expired while waiting for device", reply);
+
+	// The waiter closes the client's connection once it has replied.
+	ASSERT_EQ(0, adb_read(fds[0], status, sizeof(status)));
+	ASSERT_EQ(0, adb_close(fds[0]));
+	TerminateThread(thread);
+}
+
+TEST_F(StateWaiterTest, huge_timeout) {
+	init_transport_registration();
+	int fds[2];
+	ASSERT_EQ(0, adb_socketpair(fds));
+	asocket* s = create_local_socket(fds[1]);
+	// Without clamping, the deadline would overflow into the past and expire at once.
+	asocket* waiter = create_state_waiter(kTransportAny, "no-such-device", kCsDevice, INT64_MAX);
+	s->peer = waiter;
+	waiter->peer = s;
+	waiter->ready(waiter);
+
+	PrepareThread();
+	std::thread thread(fdevent_loop);
+
+	adb_pollfd pfd = {.fd = fds[0], .events = POLLIN};
+	ASSERT_EQ(0, adb_poll(&pfd, 1, 100));
+
+	ASSERT_EQ(0, adb_close(fds[0]));
+	TerminateThread(thread);
+}
+
+#endif  // ADB_HOST
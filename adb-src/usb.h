@@ -36,7 +36,8 @@ struct usb_handle;
 ADB_USB_INTERFACE(usb_handle*);
 
 #else // linux host || darwin
-// Linux and Darwin clients have native and libusb implementations.
+// Linux and Darwin clients have native and libusb implementations, and an in-memory one for
+// testing (see client/usb_mock.h).
 
 namespace libusb {
 	struct usb_handle;
@@ -48,7 +49,12 @@ namespace native {
 	ADB_USB_INTERFACE(native::usb_handle*);
 }
 
-// Empty base that both implementations' opaque handles inherit from.
+namespace mock {
+	struct usb_handle;
+	ADB_USB_INTERFACE(mock::usb_handle*);
+}
+
+// Empty base that each implementation's opaque handle inherits from.
 struct usb_handle {
 };
 